@@ -1,684 +1,471 @@
 #include <pthread.h>
 #include <time.h>
 #include "errors.h"
-#include <semaphore.h>
+#include "alarm_engine.h"
+#include "alarm_clock.h"
+#include "command.h"
+#include "command_server.h"
+#include "trace.h"
+#include <sys/epoll.h>
+#include <sys/timerfd.h>
 #include <stdio.h>
 #include <stdlib.h>
 
-// Structure for alarms
-typedef struct alarm
-{
-  int id;                      // Unique identifier for the alarm
-  int group_id;                // Group ID to categorize alarms
-  int seconds;                 // Duration in seconds after which the alarm should expire
-  time_t time;                 // Timestamp when the alarm was set
-  char message[128];           // A message associated with the alarm
-  pthread_t display_thread_id; // ID of the thread responsible for displaying this alarm
-  struct alarm *next;          // Pointer to the next alarm in a linked list
-} alarm_t;
-
-// Structure for change requests
-typedef struct change_request
-{
-  int alarm_id;                // ID of the alarm to be changed
-  int new_group_id;            // group ID for the alarm
-  int new_seconds;             // duration in seconds for the alarm
-  time_t new_time;             // New timestamp when the alarm is set
-  char new_message[128];       // New message for the alarm
-  struct change_request *next; // Pointer to the next change request in a linked list
-} change_request_t;
-
-// Strucutre for alarm nodes in display alarm thread queue
-typedef struct alarm_queue_node
-{
-  alarm_t *alarm;                // Pointer to the alarm
-  int reassigned;                // Indicates if the alarm has been reassigned to a different group
-  int message_changed;           // Indicates if the alarm's message has been changed
-  struct alarm_queue_node *next; // Pointer to the next node in the queue
-} alarm_queue_node_t;
-
-// Structure for dsipaly alarm thread nodes
-typedef struct thread_node
-{
-  pthread_t thread_id;             // ID of the thread
-  int group_id;                    // Group ID that this thread is responsible for
-  int alarm_count;                 // Count of alarms this thread is managing
-  alarm_queue_node_t *alarm_queue; // Queue of alarms that this thread is responsible for
-  pthread_mutex_t queue_mutex;     // Mutex for synchronizing access to the alarm queue
-  pthread_cond_t queue_cond;       // Condition variable for signaling changes in the alarm queue
-  struct thread_node *next;        // Pointer to the next thread node in the list
-} thread_node_t;
-
-// Global variables
-alarm_t *alarm_list = NULL;                      // Head of the linked list of alarms
-change_request_t *change_request_list = NULL;    // Head of the linked list of change requests
-thread_node_t *display_alarm_thread_list = NULL; // Head of the linked list of display alarm threads
-
-// Mutexes and condition variables for synchronization
-pthread_mutex_t alarm_list_mutex = PTHREAD_MUTEX_INITIALIZER; // Mutex for synchronizing access to the alarm list
-pthread_cond_t alarm_cond = PTHREAD_COND_INITIALIZER;         // Condition variable for the alarm list
-
-pthread_mutex_t change_request_list_mutex = PTHREAD_MUTEX_INITIALIZER; // Mutex for synchronizing access to the change request list
-pthread_cond_t change_request_cond = PTHREAD_COND_INITIALIZER;         // Condition variable for the change request list
-
-pthread_mutex_t display_alarm_thread_list_mutex = PTHREAD_MUTEX_INITIALIZER; // Mutex for synchronizing access to the display alarm thread list
-
-// Function prototype declaration for the display alarm thread function
-void *display_alarm_thread_function(void *arg);
-
-// Function to add a thread node to the linked list of display alarm threads
-thread_node_t *add_thread_node(thread_node_t **head, pthread_t tid, int group_id)
-{
+/*
+ * The alarm program: a client of the alarm engine (alarm_engine.h)
+ * that reads commands from the standard input, from the command server
+ * or from a recorded trace, hands them to the engine, and lets the
+ * engine print what it does. Everything is configured from the
+ * environment; see the README.
+ */
 
-  // Allocate memory for a new thread node
-  thread_node_t *new_node = (thread_node_t *)malloc(sizeof(thread_node_t));
+int command_server_fd = -1; // Readable when the command server has work, when ALARM_SOCKET names a socket
 
-  if (new_node == NULL)
-  {
-    perror("Failed to allocate memory for thread node");
-    exit(1); // Exit if memory allocation fails
-  }
+int trace_recording = 0; // Set when ALARM_TRACE_RECORD names a trace every command is recorded to
 
-  // Initialize the new node with provided thread ID and group ID
-  new_node->thread_id = tid;
-  new_node->group_id = group_id;
-  new_node->alarm_count = 0;                        // Initialize alarm count as zero
-  new_node->alarm_queue = NULL;                     // Initialize the alarm queue as empty
-  pthread_mutex_init(&new_node->queue_mutex, NULL); // Initialize the mutex for the alarm queue
-  pthread_cond_init(&new_node->queue_cond, NULL);   // Initialize the condition variable for the alarm queue
-  new_node->next = *head;                           // Link the new node to the current head of the list
-  *head = new_node;                                 // Update the head of the list to point to the new node
-
-  return new_node; // Return the newly created node
+// Function to print one line of the periodic statistics dump to stderr
+void print_stats_line(const char *line)
+{
+  fprintf(stderr, "%s\n", line);
 }
 
-// Function to signal a specific display thread
-void signal_display_thread(pthread_t thread_id, int alarm_id, int reassigned, int message_changed)
+/*
+ * The statistics dump thread's start routine. It prints the Stats
+ * report to stderr every interval seconds, given by arg.
+ */
+void *stats_dump_thread_function(void *arg)
 {
-  // Iterate through the list of display alarm threads
-  for (thread_node_t *current = display_alarm_thread_list; current != NULL; current = current->next)
+  int interval = *(int *)arg;
+  struct timespec next_dump;
+  clock_gettime(CLOCK_MONOTONIC, &next_dump); // Real time, even in a replay
+
+  while (1)
   {
-    // Check if the current thread's ID matches the provided thread ID
-    if (pthread_equal(current->thread_id, thread_id))
+    next_dump.tv_sec += interval;
+    while (clock_nanosleep(CLOCK_MONOTONIC, TIMER_ABSTIME, &next_dump, NULL) == EINTR)
     {
-
-      pthread_mutex_lock(&current->queue_mutex); // Lock the mutex before accessing the queue
-      // Iterate through the alarm queue of the thread
-      for (alarm_queue_node_t *queue_node = current->alarm_queue; queue_node != NULL; queue_node = queue_node->next)
-      {
-        // Check if the current alarm in the queue matches the provided alarm ID
-        if (queue_node->alarm->id == alarm_id)
-        {
-          queue_node->reassigned = reassigned;           // Set the reassignment flag
-          queue_node->message_changed = message_changed; // Set the message changed flag
-          break;                                         // Break the loop once the alarm is found and updated
-        }
-      }
-      pthread_mutex_unlock(&current->queue_mutex); // Unlock the mutex
-      pthread_cond_signal(&current->queue_cond);   // broadcast the condition variable to notify the thread of changes
-
-      break; // Break the loop once the target thread is found and signaled
     }
+    alarm_engine_report_stats(print_stats_line);
   }
+  return NULL;
 }
 
-// Function to find or create a display thread for a specific group ID
-pthread_t find_or_create_thread_for_group(int group_id)
+/*
+ * Function to carry out one command, recording it first when a trace
+ * is being recorded. The answers to a query go to answer, with arg,
+ * when it is not NULL, and are printed otherwise.
+ */
+command_status_t run_command(const command_t *command, command_answer_fn answer, void *arg)
 {
-  pthread_t thread_id = 0; // Initialize thread ID as zero (invalid thread ID)
-
-  // Lock the mutex to access the global display alarm thread list safely
-  pthread_mutex_lock(&display_alarm_thread_list_mutex);
-
-  // Iterate through existing display alarm threads
-  for (thread_node_t *current = display_alarm_thread_list; current != NULL; current = current->next)
+  if (trace_recording && command->type != COMMAND_SUBSCRIBE)
   {
-    // Check if a thread already exists for the specified group ID
-    if (current->group_id == group_id && current->alarm_count < 2)
-    {
-      thread_id = current->thread_id; // Assign the found thread ID
-      break;                          // Exit loop as the thread has been found
-    }
+    trace_record(command);
   }
-
-  // If no thread exists for the given group ID, create a new thread
-  if (thread_id == 0)
+  switch (command->type)
   {
-
-    // Allocate memory for a new thread node
-    thread_node_t *new_thread_info = malloc(sizeof(thread_node_t));
-    if (new_thread_info == NULL)
-    {
-      errno_abort("Allocate thread"); // Handle allocation error}
-
-      // Initialize the new thread node
-      new_thread_info->group_id = group_id; // Set the group ID
-      new_thread_info->alarm_count = 0;
-      new_thread_info->alarm_queue = NULL;
-      pthread_mutex_init(&new_thread_info->queue_mutex, NULL);
-      pthread_cond_init(&new_thread_info->queue_cond, NULL);
-
-      // Create a new display alarm thread
-      if (pthread_create(&thread_id, NULL, display_alarm_thread_function, new_thread_info) != 0)
-      {
-        perror("Failed to create a new display alarm thread");
-        exit(1); // Exit if thread creation fails
-      }
-
-      new_thread_info->thread_id = thread_id; // Set the group ID
-
-      // Add the new thread to the global display alarm thread list
-      add_thread_node(&display_alarm_thread_list, thread_id, group_id);
-    }
-
-    // Unlock the mutex after processing
-    pthread_mutex_unlock(&display_alarm_thread_list_mutex);
-
-    return thread_id; // Return the found or newly created thread ID
+  case COMMAND_QUERY_ALARM:
+  case COMMAND_LIST_GROUP:
+  case COMMAND_COUNT:
+    return alarm_engine_answer(command, answer, arg);
+  default:
+    return alarm_engine_execute(command);
   }
 }
 
-// Function to insert a new alarm into the global alarm list in sorted order
-void alarm_insert(alarm_t *alarm)
+// Function to parse and carry out one command line from the standard input, given without its newline
+void process_command(const char *line, size_t length)
 {
-  int status;
-  alarm_t **last, *next;
+  command_t command;
+  command_error_t error;
 
-  // Initialize pointers to start at the head of the list
-  last = &alarm_list;
-  next = *last;
-
-  while (next != NULL)
+  if (!command_parse(line, length, &command, &error))
   {
-    // If the next alarm ID is greater or equal, insert the new alarm here
-    if (next->id >= alarm->id)
-    {
-      alarm->next = next;
-      *last = alarm;
-      break;
-    }
-
-    // Move to the next node in the list
-    last = &next->next;
-    next = next->next;
+    fprintf(stderr, "Invalid command format or bad command: %s at column %zu.\n", command_error_text(error.code),
+            error.column + 1);
   }
-
-  // If at the end of the list, append the new alarm
-  if (next == NULL)
+  else if (run_command(&command, NULL, NULL) == COMMAND_INVALID)
   {
-    *last = alarm;
-    alarm->next = NULL;
+    fprintf(stderr, "Invalid command format or bad command.\n");
   }
+}
 
-  // Signal the condition variable to indicate a new alarm has been inserted
-  status = pthread_cond_signal(&alarm_cond);
-  if (status != 0)
+// The command server thread's start routine, for the threaded engine
+void *command_server_thread_function(void *arg)
+{
+  while (1)
   {
-    err_abort(status, "Signal cond");
+    command_server_poll(-1);
   }
+  return NULL;
 }
 
-void insert_change_request(change_request_t *new_request)
+/*
+ * Function to carry out every command of a replayed trace that is due
+ * by now, as if read from the standard input. Returns 0 once the end
+ * of the trace's input is due.
+ */
+int replay_trace(trace_reader_t *trace)
 {
-  int status;
+  uint64_t now = clock_now_usec();
 
-  // Initialize pointers to start at the head of the global list
-  change_request_t **last = &change_request_list;
-  change_request_t *next = *last;
-
-  // Find the correct position to insert (sorted by alarm_id)
-  while (next != NULL)
+  while (trace->time <= now)
   {
-    if (next->alarm_id >= new_request->alarm_id)
+    if (trace->ended)
     {
-      // Insert the new request before the next one
-      new_request->next = next;
-      *last = new_request;
-      break;
+      return 0;
     }
-    // Move to the next node in the list
-    last = &next->next;
-    next = next->next;
+    process_command(trace->line, trace->length);
+    log_event(LOG_PROMPT, 0, 0, 0, 0, NULL);
+    trace_reader_next(trace);
   }
+  return 1;
+}
 
-  // If at the end of the list, append the new request
-  if (next == NULL)
+#define EVENT_LOOP_READ_SIZE 4096 // Input read per pass; small, so due alarms are not held up by a long backlog
+
+/*
+ * Function to read what is available on the input and process every
+ * complete line. Returns 0 once the input has ended.
+ */
+int event_loop_read_input(command_input_t *input)
+{
+  const char *line;
+  size_t length;
+
+  int open = command_input_fill(input, EVENT_LOOP_READ_SIZE);
+  while ((line = command_input_line(input, &length)) != NULL)
   {
-    *last = new_request;
-    new_request->next = NULL;
+    if (length > 0)
+    {
+      process_command(line, length);
+    }
+    log_event(LOG_PROMPT, 0, 0, 0, 0, NULL);
   }
+  return open;
+}
 
-  // Signal the condition variable to indicate a new change request has been inserted
-  status = pthread_cond_signal(&change_request_cond);
-  if (status != 0)
+/*
+ * Function to arm a timerfd for an absolute clock tick (0 disarms it),
+ * only when the tick differs from the one it is armed for.
+ */
+void event_loop_arm_timer(int timer_fd, uint64_t deadline, uint64_t *armed_deadline)
+{
+  if (deadline != *armed_deadline)
   {
-    err_abort(status, "Signal cond");
+    struct itimerspec timer = {{0, 0}, {0, 0}};
+    if (deadline != 0)
+    {
+      timer.it_value = clock_real_time(deadline);
+    }
+    if (timerfd_settime(timer_fd, TFD_TIMER_ABSTIME, &timer, NULL) < 0)
+    {
+      errno_abort("Arm timer");
+    }
+    *armed_deadline = deadline;
   }
 }
 
-// Function for the alarm monitor thread
-void *alarm_monitor_thread_function(void *arg)
+/*
+ * Function to run the program on the engine's event-loop mode, all on
+ * the calling thread. One epoll loop multiplexes the input, the
+ * command server and the engine's timer, and every pass ends with
+ * alarm_engine_dispatch, so no other thread is needed besides the
+ * event log writer. The output is the same as on the threaded engine.
+ * When trace is not NULL, its commands replace the input, each carried
+ * out when a timerfd of its own says it is due.
+ */
+void event_loop_run(trace_reader_t *trace)
 {
+  static command_input_t input; // Standard input not yet processed
+  struct epoll_event event;
+  uint64_t armed_trace = 0;     // Clock tick trace_timer is armed for (0 when disarmed)
 
-  // Retrieve the thread ID of the alarm monitor thread
-  pthread_t monitor_thread_id = pthread_self();
-
-  // Infinite loop to continuously monitor alarms
-  while (1)
+  int epoll_fd = epoll_create1(0);
+  int trace_timer = timerfd_create(CLOCK_MONOTONIC, TFD_NONBLOCK);
+  if (epoll_fd < 0 || trace_timer < 0)
   {
+    errno_abort("Create event loop");
+  }
 
-    int status;
-    struct timespec cond_time;
-    int expired = 0;
-
-    time_t now;
-    time(&now); // Get the current time
-
-    // Convert the current time to struct tm
-    struct tm *timeinfo = localtime(&now);
+  event.events = EPOLLIN;
+  event.data.fd = alarm_engine_fd();
+  epoll_ctl(epoll_fd, EPOLL_CTL_ADD, alarm_engine_fd(), &event);
+  event.data.fd = trace_timer;
+  epoll_ctl(epoll_fd, EPOLL_CTL_ADD, trace_timer, &event);
 
-    // Lock the mutex to access the alarm list
-    pthread_mutex_lock(&alarm_list_mutex);
-    alarm_t **prev = &alarm_list;
-    alarm_t *current = alarm_list;
+  // A regular file cannot be polled; it is always readable, so read it on every pass
+  int input_always_ready = 0;
+  event.data.fd = STDIN_FILENO;
+  if (trace == NULL && epoll_ctl(epoll_fd, EPOLL_CTL_ADD, STDIN_FILENO, &event) < 0)
+  {
+    if (errno != EPERM)
+    {
+      errno_abort("Poll input");
+    }
+    input_always_ready = 1;
+  }
+  if (command_server_fd >= 0)
+  {
+    event.data.fd = command_server_fd;
+    epoll_ctl(epoll_fd, EPOLL_CTL_ADD, command_server_fd, &event);
+  }
 
-    while (current != NULL)
+  command_input_init(&input, STDIN_FILENO);
+  log_event(LOG_PROMPT, 0, 0, 0, 0, NULL);
+  if (trace != NULL)
+  {
+    trace_reader_start(trace);
+    event_loop_arm_timer(trace_timer, trace->time, &armed_trace);
+  }
+  while (1)
+  {
+    struct epoll_event events[4];
+    int count = epoll_wait(epoll_fd, events, 4, input_always_ready ? 0 : -1);
+    if (count < 0)
     {
-      if (current->time <= now)
-      { // Check if the alarm has expired
-        // Handle the expired alarm
-        *prev = current->next; // Remove from list
-
-        pthread_mutex_lock(&display_alarm_thread_list_mutex);
-        // Signal the display thread to stop displaying this alarm
-        signal_display_thread(current->display_thread_id, current->id, -1, 0);
-        pthread_mutex_unlock(&display_alarm_thread_list_mutex);
-
-        char formatted_current_time[80];
-        strftime(formatted_current_time, sizeof(formatted_current_time), "%H:%M:%S", localtime(&now));
-        printf("Alarm Monitor Thread %lu Has Removed Alarm(%d) at %s: Group(%d) %s\n",
-               (unsigned long)monitor_thread_id, current->id, formatted_current_time,
-               current->group_id, current->message);
-
-        free(current);
-        current = *prev; // Continue from the next alarm
-      }
-      else
+      if (errno == EINTR)
       {
-        prev = &current->next;
-        current = current->next;
+        continue;
       }
+      errno_abort("Wait for events");
     }
-    pthread_mutex_unlock(&alarm_list_mutex);
-
-    // Wait for a new change request to be made
-    pthread_mutex_lock(&change_request_list_mutex);
-    pthread_cond_wait(&change_request_cond, &change_request_list_mutex);
 
-    // Process each change request in the list
-    change_request_t *prev_request = NULL;
-    change_request_t *current_request = change_request_list;
-    while (current_request != NULL)
+    int input_ready = input_always_ready;
+    for (int i = 0; i < count; i++)
     {
-      // Lock the mutex to access the alarm list
-      pthread_mutex_lock(&alarm_list_mutex);
-
-      // Search for the alarm corresponding to the change request
-      alarm_t *alarm = alarm_list;
-      while (alarm != NULL)
+      if (events[i].data.fd == STDIN_FILENO)
       {
-        if (alarm->id == current_request->alarm_id)
-        {
-          // Store the original group ID for comparison
-          int old_group_id = alarm->group_id;
-
-          // Check if the message of the alarm has changed
-          int message_changed = strncmp(alarm->message, current_request->new_message, sizeof(alarm->message)) != 0;
-
-          // Update the alarm with the details from the change request
-          alarm->group_id = current_request->new_group_id;
-          alarm->time = current_request->new_time;
-          strncpy(alarm->message, current_request->new_message, sizeof(alarm->message));
-
-          // If the group ID of the alarm has changed, handle reassignment
-          if (old_group_id != alarm->group_id)
-          {
-            // Signal the old display thread to stop printing this alarm
-            signal_display_thread(alarm->display_thread_id, alarm->id, -1, 0);
-
-            // Find or create a new thread for the updated group ID and update the alarm's display_thread_id
-            pthread_t new_thread_id = find_or_create_thread_for_group(alarm->group_id);
-            alarm->display_thread_id = new_thread_id;
-
-            // Signal the new display thread to start displaying this alarm
-            signal_display_thread(new_thread_id, alarm->id, 1, 0);
-          }
-
-          // If the message of the alarm has changed, signal the display thread
-          if (message_changed)
-          {
-            signal_display_thread(alarm->display_thread_id, alarm->id, 0, message_changed);
-          }
-
-          // Print a message indicating that the alarm has been changed
-          printf("Alarm Monitor Thread %lu Has Changed Alarm(%d) at %s: Group(%d) %s\n",
-                 (unsigned long)monitor_thread_id, alarm->id, alarm->time, alarm->group_id, alarm->message);
-
-          break; // Exit the loop as the relevant alarm has been updated
-        }
-        alarm = alarm->next; // Move to the next alarm
+        input_ready = 1;
       }
-
-      // If the alarm corresponding to the change request is not found, print an invalid change request message
-      if (alarm == NULL)
+      else if (events[i].data.fd == command_server_fd)
       {
-        printf("Invalid Change Alarm Request(%d) at %s: Group(%d) %s\n",
-               current_request->alarm_id, current_request->new_time, current_request->new_group_id, current_request->new_message);
+        command_server_poll(0);
       }
-
-      // Unlock the mutex for the alarm list
-      pthread_mutex_unlock(&alarm_list_mutex);
-
-      // Remove the processed change request from the list
-      change_request_t *temp = current_request;
-      if (prev_request == NULL)
+      else if (events[i].data.fd == trace_timer)
       {
-        change_request_list = current_request->next;
+        // Due commands are carried out below on every pass
+        uint64_t expirations;
+        read(trace_timer, &expirations, sizeof(expirations));
       }
-      else
+    }
+
+    if (input_ready && !event_loop_read_input(&input))
+    {
+      if (command_server_fd < 0)
       {
-        prev_request->next = current_request->next;
+        exit(0); // Exit at the end of the input
       }
-      current_request = current_request->next;
-
-      // Free the memory allocated for the processed change request
-      free(temp);
+      // Keep serving clients once the input has ended
+      epoll_ctl(epoll_fd, EPOLL_CTL_DEL, STDIN_FILENO, NULL);
+      input_always_ready = 0;
+    }
+    if (trace != NULL && !replay_trace(trace))
+    {
+      exit(0); // Exit where the recorded input ended
     }
 
-    // Unlock the mutex for the change request list
-    pthread_mutex_unlock(&change_request_list_mutex);
-
-    // Sleep for a short duration before checking again
-    sleep(1); // Prevents thread staying continuously awake
+    // The engine's timer is re-armed here, which also clears it
+    alarm_engine_dispatch();
+    if (trace != NULL)
+    {
+      event_loop_arm_timer(trace_timer, trace->time, &armed_trace);
+    }
   }
-  return NULL;
 }
 
-// Function for the display alarm thread
-void *display_alarm_thread_function(void *arg)
+/*
+ * Function to replay a trace on a virtual clock, as fast as the engine
+ * goes. It makes the same passes as event_loop_run, but instead of
+ * waiting for the engine's next deadline or the next trace command,
+ * it moves the clock straight to whichever comes first. Everything
+ * runs on this thread and nothing else moves the clock, so a replay
+ * prints the same lines every time.
+ */
+void event_loop_simulate(trace_reader_t *trace)
 {
-
-  // Extract thread information from the argument
-  thread_node_t *thread_info = (thread_node_t *)arg;
-
-  // Retrieve the thread ID of the display alarm thread
-  pthread_t display_thread_id = pthread_self();
-  time_t now;
-
-  int status;
-
-  // Continuous loop to handle alarm display
+  log_event(LOG_PROMPT, 0, 0, 0, 0, NULL);
+  trace_reader_start(trace);
   while (1)
   {
-    // Lock the mutex to safely access the alarm queue of this thread
-    status = pthread_mutex_lock(&thread_info->queue_mutex);
-    if (status != 0)
+    if (!replay_trace(trace))
     {
-      err_abort(status, "Lock mutex"); // Abort if mutex lock fails.
+      exit(0); // Exit where the recorded input ended
     }
 
-    // Wait for a signal to process alarms (either new or updated)
-    pthread_cond_wait(&thread_info->queue_cond, &thread_info->queue_mutex);
+    // The trace always has a next entry, if only its end
+    uint64_t next = alarm_engine_dispatch();
+    if (next == 0 || trace->time < next)
+    {
+      next = trace->time;
+    }
+    clock_advance_usec(next > clock_now_usec() ? next : clock_now_usec() + 1);
+  }
+}
 
-    // Iterate through the alarm queue of this thread
-    alarm_queue_node_t *queue_node = thread_info->alarm_queue;
-    alarm_queue_node_t *prev_node = NULL;
-    while (queue_node != NULL)
+int main(int argc, char *argv[])
+{
+  static command_input_t input; // Standard input not yet processed
+  static trace_reader_t trace;  // Trace replayed instead of the standard input
+  alarm_engine_options_t options = ALARM_ENGINE_OPTIONS_INITIALIZER;
+  const char *line;
+  size_t length;
+
+  /*
+   * ALARM_TRACE_REPLAY=<file> takes the commands from a recorded trace
+   * instead of the standard input, ALARM_REPLAY_SPEED times as fast as
+   * they were recorded; "max" puts the engine on a virtual clock that
+   * jumps from one event to the next. The clock changes before any
+   * other thread reads it.
+   */
+  const char *replay_path = getenv("ALARM_TRACE_REPLAY");
+  if (replay_path != NULL)
+  {
+    double speed = 1;
+    const char *speed_text = getenv("ALARM_REPLAY_SPEED");
+    if (speed_text != NULL && strcmp(speed_text, "max") == 0)
     {
+      speed = 0;
+    }
+    else if (speed_text != NULL && (speed = atof(speed_text)) <= 0)
+    {
+      fprintf(stderr, "ALARM_REPLAY_SPEED must be a positive factor or \"max\"\n");
+      exit(1);
+    }
+    clock_set_speed(speed, trace_reader_open(&trace, replay_path));
+  }
 
-      // Get the current alarm from the queue node
-      alarm_t *alarm = queue_node->alarm;
+  if (getenv("ALARM_POOL_STATS") != NULL)
+  {
+    atexit(alarm_engine_report_pools); // Lets a soak run check for a zero-allocation steady state
+  }
 
-      // Handle different scenarios based on alarm status flags
-      if (queue_node->reassigned == 1)
-      {
-        // Handle the case where this thread has taken over a reassigned alarm
-        time(&now);
-        char formatted_time[80];
-        strftime(formatted_time, 80, "%H:%M:%S", localtime(&now));
-        printf("Display Thread %lu Has Taken Over Printing Message of Alarm(%d) at %s: Changed Group(%d) %s\n",
-               (unsigned long)display_thread_id, alarm->id, formatted_time, alarm->group_id, alarm->message);
-        queue_node->reassigned = 0; // Reset the flag
-      }
-      else if (queue_node->reassigned == -1)
-      {
-        // Handle the case where this thread stops printing an alarm
-        time(&now);
-        char formatted_time[80];
-        strftime(formatted_time, 80, "%H:%M:%S", localtime(&now));
-        printf("Display Thread %lu Has Stopped Printing Message of Alarm(%d) at %s: Changed Group(%d) %s\n",
-               (unsigned long)display_thread_id, alarm->id, formatted_time, alarm->group_id, alarm->message);
-
-        // Remove the alarm from this thread's queue
-        if (prev_node == NULL)
-        {
-          thread_info->alarm_queue = queue_node->next;
-          free(queue_node);
-          queue_node = thread_info->alarm_queue;
-        }
-        else
-        {
-          prev_node->next = queue_node->next;
-          free(queue_node);
-          queue_node = prev_node->next;
-        }
-        continue; // Skip to the next iteration
-      }
-      else if (queue_node->message_changed)
-      {
-        // Handle the case where the alarm message has been changed
-        time(&now);
-        char formatted_time[80];
-        strftime(formatted_time, 80, "%H:%M:%S", localtime(&now));
-        printf("Display Thread %lu Starts to Print Changed Message Alarm(%d) at %s: Group(%d) %s\n",
-               (unsigned long)display_thread_id, alarm->id, formatted_time, alarm->group_id, alarm->message);
-        queue_node->message_changed = 0; // Reset the flag
-      }
-      else
-      {
-        // Regular printing of the alarm information
-        time(&now);
-        char formatted_time[80];
-        strftime(formatted_time, 80, "%H:%M:%S", localtime(&now));
-        printf("Alarm (%d) Printed by Alarm Display Thread %lu at %s: Group(%d) %s\n",
-               alarm->id, (unsigned long)display_thread_id, formatted_time, alarm->group_id, alarm->message);
-      }
+  // ALARM_STATS_INTERVAL=<seconds> dumps the Stats report to stderr periodically
+  static int stats_interval;
+  const char *interval = getenv("ALARM_STATS_INTERVAL");
+  if (interval != NULL && (stats_interval = atoi(interval)) > 0)
+  {
+    pthread_t stats_dump_thread;
+    pthread_create(&stats_dump_thread, NULL, stats_dump_thread_function, &stats_interval);
+  }
 
-      // Move to the next queue node
-      prev_node = queue_node;
-      queue_node = queue_node->next;
+  // ALARM_SHARDS=<n> splits the alarm state into n shards by group (1 to ALARM_SHARDS_MAX)
+  const char *shards = getenv("ALARM_SHARDS");
+  if (shards != NULL)
+  {
+    options.shards = atoi(shards);
+    if (options.shards < 1 || options.shards > ALARM_SHARDS_MAX)
+    {
+      fprintf(stderr, "ALARM_SHARDS must be between 1 and %d\n", ALARM_SHARDS_MAX);
+      exit(1);
     }
+  }
 
-    // Check if there are no more alarms to display for this thread
-    if (thread_info->alarm_queue == NULL)
+  // ALARM_MONITOR_THREADS=<n> expires alarms on n threads, each over its own shards (1 to the shard count)
+  const char *monitor_threads = getenv("ALARM_MONITOR_THREADS");
+  if (monitor_threads != NULL)
+  {
+    options.monitor_threads = atoi(monitor_threads);
+    if (options.monitor_threads < 1 || options.monitor_threads > options.shards)
     {
-
-      // Print an exit message and break the loop to terminate the thread
-      time(&now);
-      char formatted_time[80];
-      strftime(formatted_time, 80, "%H:%M:%S", localtime(&now));
-      printf("No More Alarms in Group(%d): Display Thread %lu exiting at %s\n",
-             thread_info->group_id, (unsigned long)display_thread_id, formatted_time);
-      pthread_mutex_unlock(&thread_info->queue_mutex);
-      break; // Exit the while loop and end the thread
+      fprintf(stderr, "ALARM_MONITOR_THREADS must be between 1 and the number of shards (%d)\n", options.shards);
+      exit(1);
     }
+  }
 
-    // Unlock the mutex
-    pthread_mutex_unlock(&thread_info->queue_mutex);
-    sleep(5); // Sleep for 5 seconds as specified in the requirements
+  // ALARM_CADENCE_SLACK_MS=<ms> sets how far apart periodic prints may be and still share a wakeup
+  const char *slack = getenv("ALARM_CADENCE_SLACK_MS");
+  if (slack != NULL && atoi(slack) >= 0)
+  {
+    options.cadence_slack_usec = (uint64_t)atoi(slack) * 1000;
   }
 
-  return NULL;
-}
+  /*
+   * ALARM_STORE_DIR=<directory> keeps the alarms in a crash-safe store:
+   * recover what it holds, then log every change to it. The group
+   * commit interval (ALARM_WAL_SYNC_MS) and the snapshot interval
+   * (ALARM_SNAPSHOT_INTERVAL, in seconds) can be tuned.
+   */
+  options.store_directory = getenv("ALARM_STORE_DIR");
+  const char *sync_msec = getenv("ALARM_WAL_SYNC_MS");
+  if (sync_msec != NULL)
+  {
+    options.wal_sync_msec = atoi(sync_msec);
+  }
+  const char *snapshot_interval = getenv("ALARM_SNAPSHOT_INTERVAL");
+  if (snapshot_interval != NULL && atoi(snapshot_interval) > 0)
+  {
+    options.snapshot_interval = atoi(snapshot_interval);
+  }
 
-int main(int argc, char *argv[])
-{
-  char line[128];
+  // ALARM_ENGINE=epoll runs everything on this thread instead of the engine's own threads
+  const char *engine = getenv("ALARM_ENGINE");
+  options.event_loop = (engine != NULL && strcmp(engine, "epoll") == 0) || clock_is_virtual();
+  alarm_engine_start(&options);
 
-  // Store the thread ID of the main thread for future reference
-  pthread_t main_thread_id = pthread_self();
+  // ALARM_TRACE_RECORD=<file> records every command carried out, for ALARM_TRACE_REPLAY
+  const char *record_path = getenv("ALARM_TRACE_RECORD");
+  if (record_path != NULL)
+  {
+    trace_record_open(record_path);
+    trace_recording = 1;
+    atexit(trace_record_close);
+  }
 
-  // Create the alarm monitor thread
-  pthread_t alarm_monitor_thread;
-  pthread_create(&alarm_monitor_thread, NULL, alarm_monitor_thread_function, NULL);
+  // A virtual clock only moves between the event loop's passes, so it takes no clients
+  if (clock_is_virtual())
+  {
+    event_loop_simulate(&trace);
+  }
 
-  // Main loop for processing user input
-  while (1)
+  // ALARM_SOCKET=<path> also takes commands from local clients of a Unix domain socket
+  const char *socket_path = getenv("ALARM_SOCKET");
+  if (socket_path != NULL)
   {
-    printf("Alarm> ");
-    if (fgets(line, sizeof(line), stdin) == NULL)
-      exit(0); // Exit if input fails
-    if (strlen(line) <= 1)
-      continue; // Ignore empty lines
+    command_server_fd = command_server_open(socket_path, run_command);
+  }
 
-    int alarm_id, group_id, seconds;
-    char message[128];
+  if (options.event_loop)
+  {
+    event_loop_run(replay_path != NULL ? &trace : NULL);
+  }
 
-    // Process the Start_Alarm command
-    if (sscanf(line, "Start_Alarm(%d): Group(%d) %d %128[^\n]", &alarm_id, &group_id, &seconds, message) == 4)
+  if (command_server_fd >= 0)
+  {
+    pthread_t command_server_thread;
+    pthread_create(&command_server_thread, NULL, command_server_thread_function, NULL);
+  }
+
+  // Replay a trace's commands as each falls due, then exit where its input ended
+  log_event(LOG_PROMPT, 0, 0, 0, 0, NULL);
+  if (replay_path != NULL)
+  {
+    trace_reader_start(&trace);
+    while (replay_trace(&trace))
     {
-      int duplicate = 0;
-      // Check if alarm with this ID already exists
-      pthread_mutex_lock(&alarm_list_mutex);
-      for (alarm_t *current = alarm_list; current != NULL; current = current->next)
+      struct timespec due = clock_real_time(trace.time);
+      while (clock_nanosleep(CLOCK_MONOTONIC, TIMER_ABSTIME, &due, NULL) == EINTR)
       {
-        if (current->id == alarm_id)
-        {
-          duplicate = 1;
-        }
-      }
-      if(duplicate){
-        printf("Alarm with ID %d already exists. Ignoring command.\n", alarm_id);
-        pthread_mutex_unlock(&alarm_list_mutex);
-      }
-      else{
-        pthread_mutex_unlock(&alarm_list_mutex);
-
-        // Create and initialize a new alarm structure
-        alarm_t *new_alarm = (alarm_t *)malloc(sizeof(alarm_t));
-        if (new_alarm == NULL)
-        {
-          errno_abort("Allocate alarm"); // Handle allocation error
-        }
-
-        new_alarm->id = alarm_id;
-        new_alarm->group_id = group_id;
-        new_alarm->seconds = seconds;
-        new_alarm->time = time(NULL) + seconds; // Set the alarm to expire 'seconds' from now
-        strncpy(new_alarm->message, message, sizeof(new_alarm->message));
-
-        // Insert the new alarm into the global alarm list
-        pthread_mutex_lock(&alarm_list_mutex);
-        alarm_insert(new_alarm);
-        pthread_mutex_unlock(&alarm_list_mutex);
-
-        // Check if a new display alarm thread needs to be created
-        int *group_arg = malloc(sizeof(int));
-        *group_arg = group_id;
-        pthread_t new_thread;
-        int thread_created = 0;
-
-        pthread_mutex_lock(&display_alarm_thread_list_mutex);
-        for (thread_node_t *current = display_alarm_thread_list; current != NULL; current = current->next)
-        {
-          if (current->group_id == group_id && current->alarm_count < 2)
-          {
-
-            // Add the alarm to an existing thread's queue
-            pthread_mutex_lock(&current->queue_mutex);
-            alarm_queue_node_t *new_queue_node = (alarm_queue_node_t *)malloc(sizeof(alarm_queue_node_t));
-            new_queue_node->alarm = new_alarm;
-            new_queue_node->next = current->alarm_queue;
-            current->alarm_queue = new_queue_node;
-            pthread_mutex_unlock(&current->queue_mutex);
-
-            current->alarm_count++;
-            thread_created = 1;
-            new_alarm->display_thread_id = current->thread_id; // Update thread ID in alarm
-
-            printf("Main Thread %lu Assigned to Display Alarm(%d) at %s: Group(%d) %s\n",
-                   (unsigned long)main_thread_id, new_alarm->id, new_alarm->time, new_alarm->group_id, new_alarm->message);
-
-            break;
-          }
-        }
-        pthread_mutex_unlock(&display_alarm_thread_list_mutex);
-
-        if (!thread_created)
-        {
-          // Allocate memory for a new thread node
-          thread_node_t *new_thread_info = malloc(sizeof(thread_node_t));
-          if (new_thread_info == NULL)
-          {
-            errno_abort("Allocate thread"); // Handle allocation error
-          }
-
-          // Initialize the new thread node
-          new_thread_info->group_id = group_id; // Set the group ID
-          new_thread_info->alarm_count = 0;
-          new_thread_info->alarm_queue = NULL;
-          pthread_mutex_init(&new_thread_info->queue_mutex, NULL);
-          pthread_cond_init(&new_thread_info->queue_cond, NULL);
-
-          // Create a new display alarm thread
-          pthread_create(&new_thread, NULL, display_alarm_thread_function, new_thread_info);
-          new_thread_info->thread_id = new_thread;
-
-          pthread_mutex_lock(&display_alarm_thread_list_mutex);
-          add_thread_node(&display_alarm_thread_list, new_thread, group_id);
-          pthread_mutex_unlock(&display_alarm_thread_list_mutex);
-
-          new_alarm->display_thread_id = new_thread; // Update thread ID in alarm
-
-          char time_str[30]; // Ensure this buffer is large enough
-          strftime(time_str, sizeof(time_str), "%H:%M:%S", localtime(&(new_alarm->time)));
-
-          printf("Main Thread Created New Display Alarm Thread %lu For Alarm(%d) at %s: Group(%d) %s\n\n",
-                 (unsigned long)new_thread, new_alarm->id, time_str, new_alarm->group_id, new_alarm->message);
-        }
-
-        char time_str[30]; // Buffer to hold the formatted time string
-        strftime(time_str, sizeof(time_str), "%H:%M:%S", localtime(&(new_alarm->time)));
-
-        printf("Alarm(%d) Inserted by Main Thread %ld Into Alarm List at %s: Group(%d) %s\n\n",
-               new_alarm->id, (unsigned long)main_thread_id, time_str, new_alarm->group_id, new_alarm->message);
       }
     }
-    else if (sscanf(line, "Change_Alarm(%d): Group(%d) %d %128[^\n]", &alarm_id, &group_id, &seconds, message) == 4)
+    exit(0);
+  }
+
+  // Main loop for processing user input, a buffer of lines at a time
+  command_input_init(&input, STDIN_FILENO);
+  while (1)
+  {
+    int open = command_input_fill(&input, sizeof(input.buffer));
+    while ((line = command_input_line(&input, &length)) != NULL)
     {
-      // Process the Change_Alarm command
-      change_request_t *new_request = (change_request_t *)malloc(sizeof(change_request_t));
-      if (new_request == NULL)
-      {
-        errno_abort("Allocate alarm"); // Handle allocation error
-      }
-      new_request->alarm_id = alarm_id;
-      new_request->new_group_id = group_id;
-      new_request->new_seconds = seconds; // Duration from now until the alarm should expire
-      // Set the new expiry time as the current time plus the specified duration
-      new_request->new_time = time(NULL) + seconds;
-      strncpy(new_request->new_message, message, sizeof(new_request->new_message));
-
-      pthread_mutex_lock(&change_request_list_mutex);
-      insert_change_request(new_request);
-      pthread_mutex_unlock(&change_request_list_mutex);
-
-      printf("Change Alarm Request(%d) Inserted by Main Thread %ld Into Alarm List at %s: Group(%d) %s\n",
-             new_request->alarm_id, (unsigned long)main_thread_id, new_request->new_time, new_request->new_group_id, new_request->new_message);
+      if (length > 0) // Ignore empty lines
+        process_command(line, length);
+      log_event(LOG_PROMPT, 0, 0, 0, 0, NULL);
     }
-    else
+    if (!open)
     {
-      fprintf(stderr, "Invalid command format or bad command.\n");
+      if (command_server_fd >= 0)
+        pthread_exit(NULL); // Keep serving clients once the input has ended
+      exit(0); // Exit if input fails
     }
   }
 
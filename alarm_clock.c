@@ -0,0 +1,274 @@
+#include <ctype.h>
+#include "errors.h"
+#include "alarm_clock.h"
+
+/*
+ * How the clock runs. clock_speed is 1 on the real clock; a replay may
+ * run it faster, or make it virtual (clock_speed 0), where it only
+ * moves when clock_advance_usec is called. A replay's clock starts at
+ * the monotonic time clock_origin_nsec, which for a faster clock is
+ * the real time the replay began, and shows the wall-clock time
+ * clock_wall_origin_nsec there. These are set once, before any
+ * other thread reads the clock.
+ */
+static int clock_replay = 0;
+static double clock_speed = 1.0;
+static int64_t clock_origin_nsec;
+static int64_t clock_wall_origin_nsec;
+static uint64_t clock_virtual_nsec; // Current time of a virtual clock
+
+#define CLOCK_VIRTUAL_START_NSEC (86400ll * 1000000000ll) // Where a virtual clock starts, a day after boot
+
+// Return the real monotonic clock in nanoseconds
+static int64_t clock_real_nsec(void)
+{
+  struct timespec now;
+  clock_gettime(CLOCK_MONOTONIC, &now);
+  return (int64_t)now.tv_sec * 1000000000ll + now.tv_nsec;
+}
+
+/*
+ * Run the clock "speed" times faster than real time from now on, or,
+ * with a speed of 0, make it virtual. Either way, the current time
+ * shows as the wall-clock time wall_nsec. Call it before starting any
+ * thread that reads the clock.
+ */
+void clock_set_speed(double speed, int64_t wall_nsec)
+{
+  clock_replay = 1;
+  clock_speed = speed;
+  clock_origin_nsec = clock_real_nsec();
+
+  // A virtual clock starts at the same time in every run, so the wheels' slots line up the same way
+  if (speed == 0)
+  {
+    clock_origin_nsec = CLOCK_VIRTUAL_START_NSEC;
+  }
+  clock_wall_origin_nsec = wall_nsec;
+  clock_virtual_nsec = (uint64_t)clock_origin_nsec;
+}
+
+// Return 1 when the clock only moves through clock_advance_usec
+int clock_is_virtual(void)
+{
+  return clock_replay && clock_speed == 0;
+}
+
+// Move a virtual clock forward to "usec"; it never moves back
+void clock_advance_usec(uint64_t usec)
+{
+  if (usec * 1000 > clock_virtual_nsec)
+  {
+    __atomic_store_n(&clock_virtual_nsec, usec * 1000, __ATOMIC_RELEASE);
+  }
+}
+
+// Return the clock in nanoseconds
+uint64_t clock_now_nsec(void)
+{
+  if (!clock_replay)
+  {
+    return (uint64_t)clock_real_nsec();
+  }
+  if (clock_speed == 0)
+  {
+    return __atomic_load_n(&clock_virtual_nsec, __ATOMIC_ACQUIRE);
+  }
+  return (uint64_t)(clock_origin_nsec + (int64_t)((clock_real_nsec() - clock_origin_nsec) * clock_speed));
+}
+
+// Return the clock as a timespec
+struct timespec clock_now(void)
+{
+  uint64_t nsec = clock_now_nsec();
+  struct timespec now;
+  now.tv_sec = (time_t)(nsec / 1000000000ull);
+  now.tv_nsec = (long)(nsec % 1000000000ull);
+  return now;
+}
+
+// Return the clock in microseconds
+uint64_t clock_now_usec(void)
+{
+  return clock_now_nsec() / 1000;
+}
+
+// Move a time "usec" microseconds later, exactly
+void clock_add_usec(struct timespec *time, uint64_t usec)
+{
+  uint64_t nsec = (uint64_t)time->tv_nsec + (usec % USEC_PER_SEC) * 1000;
+
+  time->tv_sec += (time_t)(usec / USEC_PER_SEC + nsec / 1000000000ull);
+  time->tv_nsec = (long)(nsec % 1000000000ull);
+}
+
+// Return the monotonic time "usec" microseconds from now
+struct timespec clock_after_usec(uint64_t usec)
+{
+  struct timespec time = clock_now();
+  clock_add_usec(&time, usec);
+  return time;
+}
+
+// Convert a monotonic time to wheel ticks, rounding up so nothing fires early
+uint64_t clock_timespec_to_usec(const struct timespec *time)
+{
+  return (uint64_t)time->tv_sec * USEC_PER_SEC + ((uint64_t)time->tv_nsec + 999) / 1000;
+}
+
+// Convert wheel ticks back to a monotonic timespec
+struct timespec clock_usec_to_timespec(uint64_t usec)
+{
+  struct timespec time;
+  time.tv_sec = (time_t)(usec / USEC_PER_SEC);
+  time.tv_nsec = (long)(usec % USEC_PER_SEC) * 1000;
+  return time;
+}
+
+/*
+ * Return the real CLOCK_MONOTONIC time at which the clock reaches
+ * "usec", for timed waits and timers, rounding up so they do not wake
+ * early. Nothing waits on a virtual clock, which only moves when told
+ * to; its times map to the present.
+ */
+struct timespec clock_real_time(uint64_t usec)
+{
+  if (!clock_replay)
+  {
+    return clock_usec_to_timespec(usec);
+  }
+
+  int64_t real_nsec = clock_real_nsec();
+  int64_t offset = (int64_t)(usec * 1000) - clock_origin_nsec;
+  if (clock_speed != 0 && offset > 0)
+  {
+    real_nsec = clock_origin_nsec + (int64_t)(offset / clock_speed) + 1; // The extra nanosecond rounds up
+  }
+
+  struct timespec time;
+  time.tv_sec = (time_t)(real_nsec / 1000000000ll);
+  time.tv_nsec = (long)(real_nsec % 1000000000ll);
+  return time;
+}
+
+// Return the wall-clock second at which a monotonic time falls
+time_t clock_to_wall(const struct timespec *time)
+{
+  int64_t wall_nsec = clock_to_wall_nsec(time);
+
+  // Floor division, so times just before a second boundary print as that second
+  time_t seconds = (time_t)(wall_nsec / 1000000000ll);
+  if (wall_nsec % 1000000000ll < 0)
+  {
+    seconds--;
+  }
+  return seconds;
+}
+
+// Return the wall-clock time, in nanoseconds since the epoch, at which a monotonic time falls
+int64_t clock_to_wall_nsec(const struct timespec *time)
+{
+  int64_t time_nsec = (int64_t)time->tv_sec * 1000000000ll + time->tv_nsec;
+
+  // A replay's wall clock is its recorded start plus the time the replay has run
+  if (clock_replay)
+  {
+    return clock_wall_origin_nsec + (time_nsec - clock_origin_nsec);
+  }
+
+  struct timespec wall;
+  int64_t mono_nsec = clock_real_nsec();
+  clock_gettime(CLOCK_REALTIME, &wall);
+  return (int64_t)wall.tv_sec * 1000000000ll + wall.tv_nsec + (time_nsec - mono_nsec);
+}
+
+// Return the current wall-clock second, which a replay takes from its clock
+time_t clock_wall_now(void)
+{
+  if (!clock_replay)
+  {
+    return time(NULL);
+  }
+  struct timespec now = clock_now();
+  return clock_to_wall(&now);
+}
+
+/*
+ * Return the monotonic time at which a wall-clock time in nanoseconds
+ * falls. Wall-clock times already past map to the current time.
+ */
+struct timespec clock_from_wall_nsec(int64_t wall_nsec)
+{
+  struct timespec now = clock_now();
+
+  int64_t remaining = wall_nsec - clock_to_wall_nsec(&now);
+  if (remaining > 0)
+  {
+    clock_add_usec(&now, (uint64_t)remaining / 1000);
+  }
+  return now;
+}
+
+/*
+ * Parse a duration such as "5", "1.25", "250ms" or "40us" into
+ * microseconds. A bare number is in seconds and may have up to six
+ * decimal places. Returns 1 on success and 0 for malformed input or a
+ * duration over DURATION_MAX_USEC.
+ */
+int parse_duration(const char *text, uint64_t *usec)
+{
+  uint64_t whole = 0;
+  uint64_t fraction = 0;
+  uint64_t scale = USEC_PER_SEC;
+  uint64_t fraction_unit = USEC_PER_SEC / 10;
+  const char *p = text;
+
+  if (!isdigit((unsigned char)*p))
+  {
+    return 0;
+  }
+  while (isdigit((unsigned char)*p))
+  {
+    whole = whole * 10 + (uint64_t)(*p++ - '0');
+    if (whole > DURATION_MAX_USEC)
+    {
+      return 0; // Too long in any unit; reject rather than overflow
+    }
+  }
+  if (*p == '.')
+  {
+    p++;
+    if (!isdigit((unsigned char)*p))
+    {
+      return 0;
+    }
+    while (isdigit((unsigned char)*p))
+    {
+      fraction += (uint64_t)(*p++ - '0') * fraction_unit;
+      fraction_unit /= 10;
+    }
+  }
+
+  // The fraction was accumulated in microseconds of a second; rescale for the unit
+  if (strcmp(p, "ms") == 0)
+  {
+    scale = 1000;
+    fraction /= 1000;
+  }
+  else if (strcmp(p, "us") == 0)
+  {
+    scale = 1;
+    fraction /= USEC_PER_SEC;
+  }
+  else if (strcmp(p, "s") != 0 && *p != '\0')
+  {
+    return 0;
+  }
+
+  if (whole > DURATION_MAX_USEC / scale || whole * scale + fraction > DURATION_MAX_USEC)
+  {
+    return 0;
+  }
+  *usec = whole * scale + fraction;
+  return 1;
+}
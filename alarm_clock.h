@@ -0,0 +1,40 @@
+#ifndef __alarm_clock_h
+#define __alarm_clock_h
+
+#include <stdint.h>
+#include <time.h>
+
+/*
+ * Time helpers for the alarm engine. Deadlines are CLOCK_MONOTONIC
+ * timespecs, so setting the wall clock does not move them; the expiry
+ * wheel counts them in microsecond ticks. Wall-clock time is only used
+ * to print "at HH:MM:SS" in the output.
+ *
+ * A trace replay swaps the clock for one that runs faster than real
+ * time, or for a virtual one that stands still until the event loop
+ * moves it to the next thing due. Everything that reads the time, the
+ * wall-clock time included, goes through these functions, and every
+ * timed wait converts its deadline with clock_real_time.
+ */
+
+#define USEC_PER_SEC 1000000ull
+#define DURATION_MAX_USEC (1000000000000ull * USEC_PER_SEC) // Longest duration, over 30,000 years
+
+void clock_set_speed(double speed, int64_t wall_nsec);
+int clock_is_virtual(void);
+void clock_advance_usec(uint64_t usec);
+uint64_t clock_now_nsec(void);
+uint64_t clock_now_usec(void);
+struct timespec clock_now(void);
+struct timespec clock_after_usec(uint64_t usec);
+void clock_add_usec(struct timespec *time, uint64_t usec);
+uint64_t clock_timespec_to_usec(const struct timespec *time);
+struct timespec clock_usec_to_timespec(uint64_t usec);
+struct timespec clock_real_time(uint64_t usec);
+time_t clock_to_wall(const struct timespec *time);
+int64_t clock_to_wall_nsec(const struct timespec *time);
+time_t clock_wall_now(void);
+struct timespec clock_from_wall_nsec(int64_t wall_nsec);
+int parse_duration(const char *text, uint64_t *usec);
+
+#endif
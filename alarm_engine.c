@@ -0,0 +1,2897 @@
+#include <pthread.h>
+#include <time.h>
+#include "errors.h"
+#include "timing_wheel.h"
+#include "alarm_index.h"
+#include "display_pool.h"
+#include "mpsc_queue.h"
+#include "event_log.h"
+#include "object_pool.h"
+#include "alarm_clock.h"
+#include "latency_stats.h"
+#include "alarm_store.h"
+#include "message_table.h"
+#include "seqcount.h"
+#include "alarm_engine.h"
+#include <semaphore.h>
+#include <sys/eventfd.h>
+#include <sys/timerfd.h>
+#include <stdio.h>
+#include <stdlib.h>
+
+/*
+ * Structure for alarms, two cache lines long. The first line holds
+ * what the monitor reads on every expiry: the wheel entry, which the
+ * wheel also walks while cascading, and the deadline, period and ids
+ * that a periodic re-arm and its log line need. The second holds the
+ * links and references only used when an alarm is removed, changed or
+ * displayed. The message is interned, so an alarm holds a reference
+ * rather than its own 128-byte copy.
+ */
+typedef struct alarm
+{
+  timer_entry_t timer;         // Entry in the expiry wheel, keyed by deadline
+  struct timespec deadline;    // CLOCK_MONOTONIC time at which the alarm expires
+  uint64_t period_usec;        // Period of a recurring alarm, or 0 for an alarm that fires once
+  int id;                      // Unique identifier for the alarm
+  int group_id;                // Group ID to categorize alarms
+  const message_t *message;    // A message associated with the alarm, changed under its display thread's queue_mutex
+  uint64_t duration_usec;      // Duration in microseconds after which the alarm should expire
+  struct alarm_queue_node *queue_node; // Node of the alarm in its display thread's queue, which names the thread
+  index_entry_t index_entry;   // Entry in the alarm id index
+  struct alarm *prev;          // Pointer to the previous alarm in a linked list
+  struct alarm *next;          // Pointer to the next alarm in a linked list
+} __attribute__((aligned(64))) alarm_t;
+
+// Kinds of request applied by the monitor from the change request queue
+typedef enum change_type
+{
+  CHANGE_ALARM, // Change_Alarm
+  CANCEL_ALARM, // Cancel_Alarm, which uses only alarm_id
+  CHANGE_GROUP, // Change_Group: move every alarm of group_id to new_group_id
+  CANCEL_GROUP, // Cancel_Group: cancel every alarm of group_id
+  DELAY_GROUP   // Delay_Group: push every deadline in group_id back by new_duration_usec
+} change_type_t;
+
+// Structure for change requests
+typedef struct change_request
+{
+  change_type_t type;          // What the request asks for
+  int alarm_id;                // ID of the alarm to be changed
+  int group_id;                // Group a group request applies to
+  int new_group_id;            // group ID for the alarm
+  uint64_t new_duration_usec;  // duration in microseconds for the alarm, or the delay of a Delay_Group
+  struct timespec new_deadline; // New CLOCK_MONOTONIC expiry time for the alarm
+  const message_t *new_message; // New message for the alarm, a reference owned by the request
+  mpsc_node_t queue_node;      // Link in the change request queue
+#ifdef ALARM_STATS
+  uint64_t queued_at;          // When the request was queued, for the change latency
+#endif
+} change_request_t;
+
+// Strucutre for alarm nodes in display alarm thread queue
+typedef struct alarm_queue_node
+{
+  alarm_t *alarm;                // Pointer to the alarm
+  struct thread_node *thread;    // Display thread whose queue holds the node
+  int reassigned;                // Indicates if the alarm has been reassigned to a different group
+  int message_changed;           // Indicates if the alarm's message has been changed
+  int release_alarm;             // Indicates that the alarm has expired or been cancelled and is freed once removed
+  const message_t *stopped_message; // Message of an alarm moved away, held until its last line is printed
+  int stopped_alarm_id;          // ID of an alarm moved away, valid with stopped_message
+  int stopped_group_id;          // Group an alarm was moved to, valid with stopped_message
+  struct alarm_queue_node *prev; // Pointer to the previous node in the queue
+  struct alarm_queue_node *next; // Pointer to the next node in the queue
+} alarm_queue_node_t;
+
+/*
+ * Structure for dsipaly alarm thread nodes. A display thread is a
+ * logical thread: it owns up to two alarms of one group and is run on
+ * demand by a worker of display_pool, never by more than one worker
+ * at a time, so its output lines keep their order.
+ */
+typedef struct thread_node
+{
+  unsigned long thread_id;         // ID of the display thread, as shown in the output
+  int group_id;                    // Group ID that this thread is responsible for
+  struct alarm_group *group;       // Group that this thread is responsible for
+  int alarm_count;                 // Count of alarms this thread is managing, protected by the shard's mutex
+  alarm_queue_node_t *alarm_queue; // Queue of alarms that this thread is responsible for
+  pthread_mutex_t queue_mutex;     // Mutex for synchronizing access to the alarm queue and the flags below
+  int scheduled;                   // Set while the thread is queued in or running on the display pool
+  int running;                     // Set while a pool worker is running the thread
+  int signaled;                    // Set when the queue changed during a run, so the thread runs again
+  int print_due;                   // Set by the display cadence when the periodic print is due
+  timer_entry_t cadence_timer;     // Entry in cadence_wheel, keyed by the next periodic print
+  struct thread_node *prev;        // Pointer to the previous thread node in the group's list
+  struct thread_node *next;        // Pointer to the next thread node in the group's list
+  struct thread_node *ready_next;  // Next thread in the event loop's ready list
+#ifdef ALARM_STATS
+  uint64_t printed_at;             // When the last periodic print ran, for the print drift
+#endif
+} thread_node_t;
+
+/*
+ * Structure for alarm groups, the membership index behind the group
+ * commands. A group lists its alarms and its display threads, so a
+ * group command costs time in proportion to the group, not the shard.
+ * Display threads with room for another alarm are kept ahead of full
+ * ones, so handing an alarm to a display thread only ever looks at the
+ * first one. A group record lives while it has alarms or display
+ * threads.
+ */
+typedef struct alarm_group
+{
+  int group_id;                // Group ID of the alarms
+  int alarm_count;             // Number of alarms in the group
+  alarm_t *alarms;             // Head of the linked list of the group's alarms
+  thread_node_t *display_head; // First of the group's display threads, one with room for an alarm if any has
+  thread_node_t *display_tail; // Last of the group's display threads
+  struct alarm_group *next;    // Next group in the shard's group table chain
+} alarm_group_t;
+
+/*
+ * Structure for alarm shards. Alarm state is partitioned by group_id:
+ * each shard has its own lock, group table and expiry wheel, so
+ * commands, changes and expiries for groups in different shards never
+ * contend. Only the id index, which has its own locking, and the
+ * change request queue are shared.
+ *
+ * LOCKING PROTOCOL:
+ *
+ * The shard mutex protects the shard's groups, including their alarm
+ * and display thread lists, and its wheel. Locks are taken in the
+ * order shard mutex, display thread queue_mutex. A change that moves
+ * alarms to a group in another shard holds both shard mutexes, taken
+ * in address order.
+ *
+ * Every change the query commands can see (an alarm's fields, a group
+ * list or the group table, and an alarm leaving the id index) is made
+ * inside a write section of the shard's sequence (see seqcount.h),
+ * opened with shard_write_begin under the mutex around just that
+ * change. The queries then read the shard without the mutex, so they
+ * never hold up its writers, and a pass that changes nothing, or a
+ * long one between its changes, never holds up the queries. Alarms
+ * and groups are pooled and replaced group tables are retired, so what
+ * such a reader follows is always mapped.
+ */
+typedef struct alarm_shard
+{
+  pthread_mutex_t mutex;   // Protects groups, wheel and the alarms and display threads in the shard
+  seqcount_t sequence;     // Changes to the shard seen by lock-free readers, made under mutex
+  int write_depth;         // Write sections open on sequence, so they may nest, protected by mutex
+  alarm_group_t **groups;  // Group table buckets, chained through alarm_group_t.next
+  size_t group_mask;       // Number of group buckets minus one
+  size_t group_count;      // Number of groups in the table
+  struct group_table_retired *retired_groups; // Group tables replaced by a resize
+  timing_wheel_t wheel;    // Expiry index over the shard's alarms
+#ifdef ALARM_STATS
+  lock_stats_t lock_stats; // mutex wait and hold times
+#endif
+} alarm_shard_t;
+
+// Group table replaced by a resize, kept for lock-free readers still walking it
+typedef struct group_table_retired
+{
+  struct group_table_retired *next;
+  alarm_group_t **groups;
+} group_table_retired_t;
+
+// Global variables
+static alarm_shard_t alarm_shards[ALARM_SHARDS_MAX]; // Alarm state, by group
+static int shard_count = 16;                         // Shards in use, set once at startup
+static alarm_index_t alarm_id_index;                 // Id index over every shard's alarms, updated under the owning shard's mutex
+static mpsc_queue_t change_request_queue = MPSC_QUEUE_INITIALIZER; // Change requests waiting for the monitor
+static unsigned long next_display_thread_id = 1;     // ID for the next display thread, updated atomically
+static display_pool_t display_pool;                  // Workers that run the display threads
+
+/*
+ * Set when the single-threaded epoll engine runs in place of the
+ * monitor thread, the display cadence thread and the display pool.
+ * Display threads are then run by the event loop from a ready list.
+ */
+static int event_loop_engine = 0;
+static thread_node_t *display_ready_head = NULL; // Oldest display thread waiting to run in the event loop
+static thread_node_t *display_ready_tail = NULL; // Newest display thread waiting to run in the event loop
+
+// Object pools, so steady-state operation makes no malloc or free calls
+static object_pool_t alarm_pool;          // alarm_t
+static object_pool_t queue_node_pool;     // alarm_queue_node_t
+static object_pool_t change_request_pool; // change_request_t
+static object_pool_t thread_node_pool;    // thread_node_t
+static object_pool_t group_pool;          // alarm_group_t
+
+/*
+ * Monitor workers. The shards are split among them, worker w owning
+ * every shard whose index is w modulo monitor_count, and each worker
+ * sleeps until the earliest deadline in its own shards and expires
+ * them, so a wave of alarms due at once drains on every worker in
+ * parallel. An alarm is only ever expired by the owner of its shard,
+ * under the shard's mutex, so its FIRED and REMOVED events come from
+ * one thread, in order. The lead worker, worker 0, also applies every
+ * change request, in arrival order, and is the only thread that
+ * changes an alarm's group.
+ */
+typedef struct monitor_worker
+{
+  pthread_mutex_t wakeup_mutex; // Mutex for the worker's sleep; never held while working
+  pthread_cond_t cond;          // Condition variable the worker waits on for its next deadline, on CLOCK_MONOTONIC
+  int wakeup;                   // Set to end the worker's sleep, protected by wakeup_mutex
+  int index;                    // Position in monitor_workers, and so which shards the worker owns
+  uint64_t current_deadline;    // Wheel tick the worker is waiting for (0 when idle or scanning), updated atomically
+} __attribute__((aligned(64))) monitor_worker_t;
+
+static monitor_worker_t monitor_workers[ALARM_SHARDS_MAX]; // Every monitor worker, the lead first
+static int monitor_count = 1;                              // Monitor workers in use, 1 to shard_count, set once at startup
+
+static int store_enabled = 0; // Set when the engine was started with a store that every change is logged to
+
+static int engine_timer_fd = -1;        // The event-loop engine's timerfd, armed to the next alarm deadline or cadence print
+static uint64_t engine_timer_armed = 0; // Wheel tick engine_timer_fd is armed for (0 when disarmed)
+
+/*
+ * Events delivered through alarm_engine_event_fd: a ring that doubles
+ * when full, so the writer thread never waits on the program reading
+ * it. event_fd is readable while the ring holds events.
+ */
+typedef struct event_queue
+{
+  pthread_mutex_t mutex;  // Protects everything below
+  alarm_event_t *events;  // Ring storage
+  size_t capacity;        // Slots in the ring (power of two)
+  size_t head;            // Next event to read
+  size_t tail;            // Next free slot
+  int event_fd;           // eventfd, signaled when the ring becomes non-empty
+} event_queue_t;
+
+static event_queue_t event_queue = {PTHREAD_MUTEX_INITIALIZER, NULL, 0, 0, 0, -1};
+
+/*
+ * The display cadence: one wheel holding every display thread's next
+ * periodic print, so a single scheduler wakes only when a print is
+ * due, and only the display threads that are due are run. Prints due
+ * within cadence_slack_usec of each other are coalesced into one
+ * wakeup.
+ *
+ * Locks are taken in the order shard mutex, cadence_mutex, display
+ * thread queue_mutex.
+ */
+#define DISPLAY_PRINT_PERIOD_USEC (5 * USEC_PER_SEC) // Time between the periodic prints of a display thread
+
+static timing_wheel_t cadence_wheel;                               // Next periodic print of every display thread
+static pthread_mutex_t cadence_mutex = PTHREAD_MUTEX_INITIALIZER;  // Protects cadence_wheel and cadence_deadline
+static pthread_cond_t cadence_cond;                                // Signaled when a print is due before cadence_deadline, on CLOCK_MONOTONIC
+static uint64_t cadence_deadline = 0;                              // Wheel tick the cadence thread is waiting for (0 when idle)
+static uint64_t cadence_slack_usec = 20000;                        // Coalescing window, set once at startup from ALARM_CADENCE_SLACK_MS
+
+#ifdef ALARM_STATS
+// Latency histograms, reported by the Stats command
+static latency_histogram_t start_latency;   // Parsed Start_Alarm to alarm_insert
+static latency_histogram_t change_latency;  // Change_Alarm queued to applied by the monitor
+static latency_histogram_t expiry_lateness; // Alarm deadline to removal by the monitor
+static latency_histogram_t print_drift;     // Distance of each display thread's print period from 5 seconds
+#endif
+
+// Function to find the shard that holds a group's alarms and display threads
+static alarm_shard_t *group_shard(int group_id)
+{
+  return &alarm_shards[(unsigned)group_id % (unsigned)shard_count];
+}
+
+// Function to lock one shard, or two in address order
+static void shard_lock_pair(alarm_shard_t *first, alarm_shard_t *second)
+{
+  if (second < first)
+  {
+    alarm_shard_t *swap = first;
+    first = second;
+    second = swap;
+  }
+  STATS_LOCK(&first->mutex, &first->lock_stats);
+  if (second != first)
+  {
+    STATS_LOCK(&second->mutex, &second->lock_stats);
+  }
+}
+
+// Function to unlock what shard_lock_pair locked
+static void shard_unlock_pair(alarm_shard_t *first, alarm_shard_t *second)
+{
+  STATS_UNLOCK(&first->mutex, &first->lock_stats);
+  if (second != first)
+  {
+    STATS_UNLOCK(&second->mutex, &second->lock_stats);
+  }
+}
+
+/*
+ * Function to open a write section on a shard, around a change that
+ * lock-free readers can see. Sections may nest; only the outermost
+ * moves the sequence.
+ *
+ * LOCKING PROTOCOL:
+ *
+ * The caller must hold the shard's mutex until the section is closed.
+ */
+static void shard_write_begin(alarm_shard_t *shard)
+{
+  if (shard->write_depth++ == 0)
+  {
+    seqcount_write_begin(&shard->sequence);
+  }
+}
+
+// Function to close a write section opened with shard_write_begin
+static void shard_write_end(alarm_shard_t *shard)
+{
+  if (--shard->write_depth == 0)
+  {
+    seqcount_write_end(&shard->sequence);
+  }
+}
+
+/*
+ * Function to set an alarm's deadline. Like every field alarm_read
+ * loads, it is stored atomically, since a lock-free reader may be
+ * loading it at the same time and only finds out from the sequence.
+ */
+static void alarm_set_deadline(alarm_t *alarm, struct timespec deadline)
+{
+  __atomic_store_n(&alarm->deadline.tv_sec, deadline.tv_sec, __ATOMIC_RELAXED);
+  __atomic_store_n(&alarm->deadline.tv_nsec, deadline.tv_nsec, __ATOMIC_RELAXED);
+}
+
+/*
+ * Function to find an alarm by id and lock its shard, together with
+ * other if that is not NULL. Returns the alarm, with *shard set to its
+ * shard, or NULL with nothing locked when no alarm has the id.
+ *
+ * LOCKING PROTOCOL:
+ *
+ * The alarm's group, and so its shard, is only known once it is
+ * found, and a monitor worker may expire it meanwhile, so it is looked
+ * up again under the lock and the whole lookup retried if it has moved
+ * to another shard in between. Alarms are pooled, so a stale read of
+ * the group of an alarm freed meanwhile is harmless.
+ */
+static alarm_t *alarm_lookup_locked(int alarm_id, alarm_shard_t *other, alarm_shard_t **shard)
+{
+  while (1)
+  {
+    index_entry_t *entry = alarm_index_lookup(&alarm_id_index, alarm_id);
+    if (entry == NULL)
+    {
+      return NULL;
+    }
+    alarm_shard_t *found = group_shard(__atomic_load_n(&container_of(entry, alarm_t, index_entry)->group_id,
+                                                       __ATOMIC_RELAXED));
+    alarm_shard_t *second = other != NULL ? other : found;
+
+    shard_lock_pair(found, second);
+    entry = alarm_index_lookup(&alarm_id_index, alarm_id);
+    alarm_t *alarm = entry == NULL ? NULL : container_of(entry, alarm_t, index_entry);
+    if (alarm != NULL && group_shard(alarm->group_id) == found)
+    {
+      *shard = found;
+      return alarm;
+    }
+    shard_unlock_pair(found, second);
+    if (alarm == NULL)
+    {
+      return NULL;
+    }
+  }
+}
+
+// Function to find a group's bucket in its shard's group table
+static alarm_group_t **group_bucket(alarm_shard_t *shard, int group_id)
+{
+  // Every group in a shard has the same group_id modulo shard_count, so hash the rest
+  return &shard->groups[((unsigned)group_id / (unsigned)shard_count) & shard->group_mask];
+}
+
+/*
+ * Function to find a group in its shard, or return NULL if it has no
+ * alarms and no display threads.
+ *
+ * LOCKING PROTOCOL:
+ *
+ * The caller must hold the shard's mutex.
+ */
+static alarm_group_t *group_find(alarm_shard_t *shard, int group_id)
+{
+  alarm_group_t *group = *group_bucket(shard, group_id);
+  while (group != NULL && group->group_id != group_id)
+  {
+    group = group->next;
+  }
+  return group;
+}
+
+/*
+ * Function to double a shard's group table. The old table is retired
+ * rather than freed, since a lock-free reader may still be walking it;
+ * tables only double, so the retired ones together are smaller than
+ * the one in use.
+ *
+ * LOCKING PROTOCOL:
+ *
+ * The caller must hold the shard's mutex, in a write section.
+ */
+static void group_table_grow(alarm_shard_t *shard)
+{
+  alarm_group_t **old_groups = shard->groups;
+  size_t old_size = shard->group_mask + 1;
+  size_t new_mask = old_size * 2 - 1;
+  alarm_group_t **new_groups = calloc(old_size * 2, sizeof(alarm_group_t *));
+  group_table_retired_t *retired = malloc(sizeof(group_table_retired_t));
+
+  if (new_groups == NULL || retired == NULL)
+  {
+    errno_abort("Allocate group table");
+  }
+  for (size_t bucket = 0; bucket < old_size; bucket++)
+  {
+    alarm_group_t *group = old_groups[bucket];
+    while (group != NULL)
+    {
+      alarm_group_t *next = group->next;
+      alarm_group_t **head = &new_groups[((unsigned)group->group_id / (unsigned)shard_count) & new_mask];
+      __atomic_store_n(&group->next, *head, __ATOMIC_RELAXED);
+      *head = group; // The new table is not published yet
+      group = next;
+    }
+  }
+
+  // The table before the mask, so a reader that sees the new mask indexes the new table
+  __atomic_store_n(&shard->groups, new_groups, __ATOMIC_RELEASE);
+  __atomic_store_n(&shard->group_mask, new_mask, __ATOMIC_RELEASE);
+  retired->groups = old_groups;
+  retired->next = shard->retired_groups;
+  shard->retired_groups = retired;
+}
+
+/*
+ * Function to find a group in its shard, creating an empty one if
+ * there is none.
+ *
+ * LOCKING PROTOCOL:
+ *
+ * The caller must hold the shard's mutex.
+ */
+static alarm_group_t *group_get(alarm_shard_t *shard, int group_id)
+{
+  alarm_group_t *group = group_find(shard, group_id);
+  if (group != NULL)
+  {
+    return group;
+  }
+
+  shard_write_begin(shard);
+  if (shard->group_count >= 2 * (shard->group_mask + 1))
+  {
+    group_table_grow(shard);
+  }
+  group = (alarm_group_t *)object_pool_alloc(&group_pool);
+  __atomic_store_n(&group->group_id, group_id, __ATOMIC_RELAXED);
+  group->alarm_count = 0;
+  __atomic_store_n(&group->alarms, NULL, __ATOMIC_RELAXED);
+  group->display_head = NULL;
+  group->display_tail = NULL;
+  alarm_group_t **head = group_bucket(shard, group_id);
+  __atomic_store_n(&group->next, *head, __ATOMIC_RELAXED);
+  __atomic_store_n(head, group, __ATOMIC_RELAXED);
+  __atomic_store_n(&shard->group_count, shard->group_count + 1, __ATOMIC_RELAXED);
+  shard_write_end(shard);
+  return group;
+}
+
+/*
+ * Function to free a group once it has neither alarms nor display
+ * threads left.
+ *
+ * LOCKING PROTOCOL:
+ *
+ * The caller must hold the shard's mutex.
+ */
+static void group_release(alarm_shard_t *shard, alarm_group_t *group)
+{
+  if (group->alarms != NULL || group->display_head != NULL)
+  {
+    return;
+  }
+
+  alarm_group_t **last = group_bucket(shard, group->group_id);
+  while (*last != group)
+  {
+    last = &(*last)->next;
+  }
+  shard_write_begin(shard);
+  __atomic_store_n(last, group->next, __ATOMIC_RELAXED);
+  __atomic_store_n(&shard->group_count, shard->group_count - 1, __ATOMIC_RELAXED);
+  shard_write_end(shard);
+  object_pool_free(&group_pool, group);
+}
+
+/*
+ * Function to schedule a new display thread's periodic prints, the
+ * first one period from now, waking the cadence thread if that is
+ * earlier than the print it is waiting for.
+ */
+static void cadence_add(thread_node_t *thread)
+{
+  pthread_mutex_lock(&cadence_mutex);
+  timer_entry_init(&thread->cadence_timer);
+  timing_wheel_add(&cadence_wheel, &thread->cadence_timer, clock_now_usec() + DISPLAY_PRINT_PERIOD_USEC);
+  if (cadence_deadline == 0 || thread->cadence_timer.expires < cadence_deadline)
+  {
+    pthread_cond_signal(&cadence_cond);
+  }
+  pthread_mutex_unlock(&cadence_mutex);
+}
+
+/*
+ * Function to stop a display thread's periodic prints. Once it returns
+ * the cadence can no longer reach the thread, so it may be freed.
+ */
+static void cadence_remove(thread_node_t *thread)
+{
+  pthread_mutex_lock(&cadence_mutex);
+  timing_wheel_remove(&cadence_wheel, &thread->cadence_timer);
+  pthread_mutex_unlock(&cadence_mutex);
+}
+
+/*
+ * Function to unlink a display thread from its group's list in O(1).
+ *
+ * LOCKING PROTOCOL:
+ *
+ * The caller must hold the mutex of the group's shard.
+ */
+static void display_thread_unlink(thread_node_t *thread)
+{
+  alarm_group_t *group = thread->group;
+
+  if (thread->prev == NULL)
+  {
+    group->display_head = thread->next;
+  }
+  else
+  {
+    thread->prev->next = thread->next;
+  }
+  if (thread->next == NULL)
+  {
+    group->display_tail = thread->prev;
+  }
+  else
+  {
+    thread->next->prev = thread->prev;
+  }
+}
+
+/*
+ * Function to put a display thread back in its group's list after its
+ * alarm count changed: at the head if it has room for another alarm,
+ * at the tail if it is full, so threads with room always come first.
+ *
+ * LOCKING PROTOCOL:
+ *
+ * The caller must hold the mutex of the group's shard.
+ */
+static void display_thread_reorder(thread_node_t *thread)
+{
+  alarm_group_t *group = thread->group;
+
+  display_thread_unlink(thread);
+  if (thread->alarm_count < 2)
+  {
+    thread->prev = NULL;
+    thread->next = group->display_head;
+    if (group->display_head == NULL)
+    {
+      group->display_tail = thread;
+    }
+    else
+    {
+      group->display_head->prev = thread;
+    }
+    group->display_head = thread;
+  }
+  else
+  {
+    thread->next = NULL;
+    thread->prev = group->display_tail;
+    if (group->display_tail == NULL)
+    {
+      group->display_head = thread;
+    }
+    else
+    {
+      group->display_tail->next = thread;
+    }
+    group->display_tail = thread;
+  }
+}
+
+// Function to add a thread node at the head of its group's list of display alarm threads
+static thread_node_t *add_thread_node(alarm_group_t *group, unsigned long tid)
+{
+
+  // Allocate memory for a new thread node
+  thread_node_t *new_node = (thread_node_t *)object_pool_alloc(&thread_node_pool);
+
+  // Initialize the new node with provided thread ID and group ID
+  new_node->thread_id = tid;
+  new_node->group_id = group->group_id;
+  new_node->group = group;
+  new_node->alarm_count = 0;                        // Initialize alarm count as zero
+  new_node->alarm_queue = NULL;                     // Initialize the alarm queue as empty
+  pthread_mutex_init(&new_node->queue_mutex, NULL); // Initialize the mutex for the alarm queue
+  new_node->scheduled = 0;                          // Not queued in the display pool yet
+  new_node->running = 0;
+  new_node->signaled = 0;
+  new_node->print_due = 0;
+  new_node->ready_next = NULL;
+  STATS(new_node->printed_at = 0);
+  new_node->prev = NULL;                            // Link the new node at the head of the list
+  new_node->next = group->display_head;
+  if (group->display_head == NULL)
+  {
+    group->display_tail = new_node;
+  }
+  else
+  {
+    group->display_head->prev = new_node;
+  }
+  group->display_head = new_node;
+  cadence_add(new_node);                            // First periodic print one period from now
+
+  return new_node; // Return the newly created node
+}
+
+/*
+ * Function to hand a display thread to whatever runs display threads:
+ * the display pool, or the event loop's ready list.
+ */
+static void display_submit(thread_node_t *thread)
+{
+  if (event_loop_engine)
+  {
+    thread->ready_next = NULL;
+    if (display_ready_tail == NULL)
+    {
+      display_ready_head = thread;
+    }
+    else
+    {
+      display_ready_tail->ready_next = thread;
+    }
+    display_ready_tail = thread;
+  }
+  else
+  {
+    display_pool_submit(&display_pool, thread);
+  }
+}
+
+/*
+ * Function to queue a display thread on the display pool. If a worker
+ * is already running it, the run is repeated once it finishes instead,
+ * so the thread is never in the pool twice.
+ *
+ * LOCKING PROTOCOL:
+ *
+ * The caller must hold the thread's queue_mutex.
+ */
+static void schedule_display_thread(thread_node_t *thread)
+{
+  if (!thread->scheduled)
+  {
+    thread->scheduled = 1;
+    display_submit(thread);
+  }
+  else if (thread->running)
+  {
+    thread->signaled = 1;
+  }
+}
+
+/*
+ * Function to add an alarm to the head of a display thread's queue and
+ * make the new node the alarm's current one, so later signals reach it
+ * without a search.
+ *
+ * LOCKING PROTOCOL:
+ *
+ * The caller must hold the thread's queue_mutex.
+ */
+static void queue_node_push(thread_node_t *thread, alarm_queue_node_t *queue_node)
+{
+  queue_node->prev = NULL;
+  queue_node->next = thread->alarm_queue;
+  if (thread->alarm_queue != NULL)
+  {
+    thread->alarm_queue->prev = queue_node;
+  }
+  thread->alarm_queue = queue_node;
+  thread->alarm_count++;
+  queue_node->thread = thread;
+  queue_node->alarm->queue_node = queue_node;
+}
+
+/*
+ * Function to unlink a node from a display thread's queue in O(1).
+ *
+ * LOCKING PROTOCOL:
+ *
+ * The caller must hold the thread's queue_mutex.
+ */
+static void queue_node_unlink(thread_node_t *thread, alarm_queue_node_t *queue_node)
+{
+  if (queue_node->prev == NULL)
+  {
+    thread->alarm_queue = queue_node->next;
+  }
+  else
+  {
+    queue_node->prev->next = queue_node->next;
+  }
+  if (queue_node->next != NULL)
+  {
+    queue_node->next->prev = queue_node->prev;
+  }
+}
+
+/*
+ * Function to flag an alarm's queue node for the display thread to
+ * stop printing an alarm that is moving to another group. The node
+ * keeps what the last line about the alarm needs, since the alarm
+ * itself may change again, or be freed, before that line is printed.
+ *
+ * LOCKING PROTOCOL:
+ *
+ * The caller must hold the display thread's queue_mutex.
+ */
+static void queue_node_stop(alarm_queue_node_t *queue_node)
+{
+  alarm_t *alarm = queue_node->alarm;
+
+  queue_node->reassigned = -1;
+  queue_node->message_changed = 0;
+  queue_node->stopped_message = message_acquire(alarm->message);
+  queue_node->stopped_alarm_id = alarm->id;
+  queue_node->stopped_group_id = alarm->group_id;
+  alarm->queue_node = NULL;
+  queue_node->thread->alarm_count--;
+}
+
+/*
+ * Function to signal a specific display thread. A reassigned value of
+ * -1 stops the thread printing the alarm, which is moving to another
+ * group, and leaves the alarm without a display thread until it is
+ * assigned one again.
+ *
+ * LOCKING PROTOCOL:
+ *
+ * The caller must hold the mutex of the alarm's shard.
+ */
+static void signal_display_thread(thread_node_t *thread, alarm_t *alarm, int reassigned, int message_changed)
+{
+  pthread_mutex_lock(&thread->queue_mutex); // Lock the mutex before accessing the queue
+  alarm_queue_node_t *queue_node = alarm->queue_node;
+  if (reassigned == -1)
+  {
+    queue_node_stop(queue_node);
+  }
+  else
+  {
+    // Only raise flags, so a pending takeover is not cleared by a later message change
+    if (reassigned != 0)
+    {
+      queue_node->reassigned = reassigned; // Set the reassignment flag
+    }
+    if (message_changed)
+    {
+      queue_node->message_changed = message_changed; // Set the message changed flag
+    }
+  }
+  schedule_display_thread(thread);            // Have a pool worker process the change
+  pthread_mutex_unlock(&thread->queue_mutex); // Unlock the mutex
+
+  if (reassigned == -1)
+  {
+    display_thread_reorder(thread); // The thread has room for another alarm now
+  }
+}
+
+/*
+ * Function to tell the display thread of an expired or cancelled alarm
+ * to stop printing it. The alarm is already out of its group, so the
+ * display thread frees it once it has printed its last message.
+ *
+ * LOCKING PROTOCOL:
+ *
+ * The caller must hold the mutex of the alarm's shard.
+ */
+static void release_display_alarm(alarm_t *alarm)
+{
+  thread_node_t *thread = alarm->queue_node->thread;
+
+  pthread_mutex_lock(&thread->queue_mutex);
+  alarm_queue_node_t *queue_node = alarm->queue_node;
+  alarm->queue_node = NULL;
+  queue_node->reassigned = -1;
+  queue_node->message_changed = 0;
+  queue_node->release_alarm = 1;
+  thread->alarm_count--;
+  schedule_display_thread(thread);
+  pthread_mutex_unlock(&thread->queue_mutex);
+
+  display_thread_reorder(thread); // The thread has room for another alarm now
+}
+
+/*
+ * Function to hand an alarm to a display thread of a group: the first
+ * one, if it has room, since threads with room come first, or else a
+ * new one. A reassigned alarm is flagged so the display thread
+ * announces that it has taken it over. Returns 1 if a new display
+ * thread was created.
+ *
+ * LOCKING PROTOCOL:
+ *
+ * The caller must hold the mutex of the group's shard.
+ */
+static int group_assign_display_thread(alarm_group_t *group, alarm_t *alarm, int reassigned)
+{
+  int created = 0;
+  thread_node_t *thread = group->display_head;
+
+  alarm_queue_node_t *new_queue_node = (alarm_queue_node_t *)object_pool_alloc(&queue_node_pool);
+  new_queue_node->alarm = alarm;
+  new_queue_node->reassigned = reassigned;
+  new_queue_node->message_changed = 0;
+  new_queue_node->release_alarm = 0;
+  new_queue_node->stopped_message = NULL;
+
+  // If no thread can take the alarm, create a new one
+  if (thread == NULL || thread->alarm_count >= 2)
+  {
+    thread = add_thread_node(group, __atomic_fetch_add(&next_display_thread_id, 1, __ATOMIC_RELAXED));
+    created = 1;
+  }
+
+  // Add the alarm to the thread's queue, which also makes it the alarm's display thread
+  pthread_mutex_lock(&thread->queue_mutex);
+  queue_node_push(thread, new_queue_node);
+  if (reassigned)
+  {
+    schedule_display_thread(thread); // Does nothing if the thread is already scheduled
+  }
+  pthread_mutex_unlock(&thread->queue_mutex);
+
+  if (thread->alarm_count == 2)
+  {
+    display_thread_reorder(thread); // Full threads go behind the ones with room
+  }
+  return created;
+}
+
+/*
+ * Function to hand an alarm to a display thread of its group, creating
+ * the group if the alarm is its first. Returns 1 if a new display
+ * thread was created.
+ *
+ * LOCKING PROTOCOL:
+ *
+ * The caller must hold the mutex of the alarm's shard.
+ */
+static int assign_display_thread(alarm_t *alarm, int reassigned)
+{
+  alarm_group_t *group = group_get(group_shard(alarm->group_id), alarm->group_id);
+  return group_assign_display_thread(group, alarm, reassigned);
+}
+
+// Function to find the monitor worker that expires a shard's alarms
+static monitor_worker_t *shard_monitor(alarm_shard_t *shard)
+{
+  return &monitor_workers[(shard - alarm_shards) % monitor_count];
+}
+
+// Function to end a monitor worker's current sleep
+static void monitor_wake(monitor_worker_t *worker)
+{
+  int status;
+
+  // The event loop checks the wheel and the change queue after every event
+  if (event_loop_engine)
+  {
+    return;
+  }
+
+  pthread_mutex_lock(&worker->wakeup_mutex);
+  worker->wakeup = 1;
+  status = pthread_cond_signal(&worker->cond);
+  if (status != 0)
+  {
+    err_abort(status, "Signal cond");
+  }
+  pthread_mutex_unlock(&worker->wakeup_mutex);
+}
+
+// Function to push an alarm at the head of its group's alarm list; the caller holds the group's shard's mutex
+static void group_push_alarm(alarm_group_t *group, alarm_t *alarm)
+{
+  alarm_shard_t *shard = group_shard(group->group_id);
+
+  shard_write_begin(shard);
+  alarm->prev = NULL;
+  __atomic_store_n(&alarm->next, group->alarms, __ATOMIC_RELAXED);
+  if (group->alarms != NULL)
+  {
+    group->alarms->prev = alarm;
+  }
+  __atomic_store_n(&group->alarms, alarm, __ATOMIC_RELAXED);
+  group->alarm_count++;
+  shard_write_end(shard);
+}
+
+/*
+ * Function to add an alarm to the alarm list of its group, creating
+ * the group if the alarm is its first.
+ *
+ * LOCKING PROTOCOL:
+ *
+ * The caller must hold the shard's mutex.
+ */
+static void alarm_push(alarm_shard_t *shard, alarm_t *alarm)
+{
+  group_push_alarm(group_get(shard, alarm->group_id), alarm);
+}
+
+/*
+ * Function to wake the monitor worker of a shard if an alarm armed in
+ * it at the given tick expires before the deadline the worker is
+ * waiting for, or if it is idle or in the middle of a pass
+ * (current_deadline is 0).
+ */
+static void monitor_wake_for(alarm_shard_t *shard, uint64_t expires)
+{
+  monitor_worker_t *worker = shard_monitor(shard);
+  uint64_t deadline = __atomic_load_n(&worker->current_deadline, __ATOMIC_SEQ_CST);
+
+  while (deadline == 0 || expires < deadline)
+  {
+    if (__atomic_compare_exchange_n(&worker->current_deadline, &deadline, expires, 0,
+                                    __ATOMIC_SEQ_CST, __ATOMIC_SEQ_CST))
+    {
+      monitor_wake(worker);
+      return;
+    }
+  }
+}
+
+/*
+ * Function to let the monitor worker of a shard know that the lead
+ * re-armed an alarm in it while applying a change. The lead's own
+ * shards need nothing, since it looks for their next deadline once
+ * its changes are applied.
+ */
+static void monitor_rearmed(alarm_shard_t *shard, uint64_t expires)
+{
+  if (shard_monitor(shard) != &monitor_workers[0])
+  {
+    monitor_wake_for(shard, expires);
+  }
+}
+
+/*
+ * Function to insert a new alarm into its group's shard. Lookups by
+ * id go through alarm_id_index and expiry order is kept by the
+ * shard's wheel, so the list itself is unordered and insertion is O(1).
+ *
+ * LOCKING PROTOCOL:
+ *
+ * The caller must hold the shard's mutex and must already have added
+ * the alarm to alarm_id_index.
+ */
+static void alarm_insert(alarm_t *alarm)
+{
+  alarm_shard_t *shard = group_shard(alarm->group_id);
+
+  // Push the new alarm at the head of the list
+  alarm_push(shard, alarm);
+
+  // Arm the alarm in the expiry wheel
+  timer_entry_init(&alarm->timer);
+  uint64_t expires = clock_timespec_to_usec(&alarm->deadline);
+  timing_wheel_add(&shard->wheel, &alarm->timer, expires);
+
+  monitor_wake_for(shard, expires);
+}
+
+/*
+ * Function to queue a change request for the lead monitor worker. The
+ * queue is lock-free, so the main thread never waits for the monitor,
+ * even while it is applying a batch; only the request that finds the
+ * queue empty wakes the lead.
+ */
+static void insert_change_request(change_request_t *new_request)
+{
+  if (mpsc_queue_push(&change_request_queue, &new_request->queue_node))
+  {
+    monitor_wake(&monitor_workers[0]);
+  }
+}
+
+// Function to describe an alarm's current state as a store record
+static void fill_store_record(wal_record_t *record, wal_record_type_t type, alarm_t *alarm)
+{
+  record->type = type;
+  record->flags = alarm->period_usec != 0 ? WAL_FLAG_PERIODIC : 0;
+  record->alarm_id = alarm->id;
+  record->group_id = alarm->group_id;
+  record->deadline_nsec = clock_to_wall_nsec(&alarm->deadline);
+  record->duration_usec = alarm->duration_usec;
+  strncpy(record->message, alarm->message->text, sizeof(record->message) - 1);
+  record->message[sizeof(record->message) - 1] = '\0';
+}
+
+/*
+ * Function to append an alarm's current state to the write-ahead log,
+ * if there is one.
+ *
+ * LOCKING PROTOCOL:
+ *
+ * The caller must hold the mutex of the alarm's shard, which keeps
+ * the log in the same order as the changes to that alarm.
+ */
+static void store_log_alarm(wal_record_type_t type, alarm_t *alarm)
+{
+  if (store_enabled)
+  {
+    wal_record_t record;
+    fill_store_record(&record, type, alarm);
+    store_append(&record);
+  }
+}
+
+/*
+ * Function to unlink an alarm from its group's alarm list in O(1),
+ * freeing the group if that leaves it with nothing in it.
+ *
+ * LOCKING PROTOCOL:
+ *
+ * The caller must hold the shard's mutex.
+ */
+static void alarm_unlink(alarm_shard_t *shard, alarm_t *alarm)
+{
+  alarm_group_t *group = group_find(shard, alarm->group_id);
+
+  shard_write_begin(shard);
+  if (alarm->prev == NULL)
+  {
+    __atomic_store_n(&group->alarms, alarm->next, __ATOMIC_RELAXED);
+  }
+  else
+  {
+    __atomic_store_n(&alarm->prev->next, alarm->next, __ATOMIC_RELAXED);
+  }
+  if (alarm->next != NULL)
+  {
+    alarm->next->prev = alarm->prev;
+  }
+  alarm->prev = NULL;
+  __atomic_store_n(&alarm->next, NULL, __ATOMIC_RELAXED);
+  group->alarm_count--;
+  group_release(shard, group);
+  shard_write_end(shard);
+}
+
+/*
+ * Function to take an alarm out of its shard in O(1): its group list, its
+ * expiry wheel and the id index all link it intrusively, so none of
+ * them needs a search. Its display thread still refers to it; see
+ * release_display_alarm.
+ *
+ * LOCKING PROTOCOL:
+ *
+ * The caller must hold the shard's mutex.
+ */
+static void alarm_remove(alarm_shard_t *shard, alarm_t *alarm)
+{
+  // One section, so a query that still finds the alarm in the index sees it leave
+  shard_write_begin(shard);
+  alarm_unlink(shard, alarm);
+  timing_wheel_remove(&shard->wheel, &alarm->timer); // Does nothing for an alarm the wheel already expired
+  alarm_index_remove(&alarm_id_index, &alarm->index_entry);
+  shard_write_end(shard);
+}
+
+/*
+ * Remove every alarm of a shard whose expiry time has been reached.
+ *
+ * LOCKING PROTOCOL:
+ *
+ * The caller must hold the shard's mutex.
+ */
+static void monitor_expire_alarms(alarm_shard_t *shard, pthread_t monitor_thread_id, uint64_t now)
+{
+  time_t removed_at = clock_wall_now();
+  STATS(uint64_t removed_ns = clock_now_nsec());
+
+  // Collect only the alarms whose expiry tick has been reached
+  timer_entry_t expired_alarms;
+  timer_list_init(&expired_alarms);
+  timing_wheel_advance(&shard->wheel, now, &expired_alarms);
+
+  while (!timer_list_empty(&expired_alarms))
+  {
+    alarm_t *current = container_of(timer_list_pop(&expired_alarms), alarm_t, timer);
+    STATS(uint64_t deadline_ns = (uint64_t)current->deadline.tv_sec * 1000000000ull + current->deadline.tv_nsec);
+    STATS(latency_histogram_record(&expiry_lateness, removed_ns > deadline_ns ? removed_ns - deadline_ns : 0));
+
+    if (current->period_usec != 0)
+    {
+      log_event(LOG_ALARM_FIRED, (unsigned long)monitor_thread_id, current->id, current->group_id,
+                removed_at, current->message->text);
+
+      // Re-arm the same alarm a period after its previous deadline, not after now, so it
+      // does not drift; periods missed entirely (a stall, a long suspend) are skipped
+      struct timespec deadline = current->deadline;
+      do
+      {
+        clock_add_usec(&deadline, current->period_usec);
+      } while (clock_timespec_to_usec(&deadline) <= now);
+      shard_write_begin(shard);
+      alarm_set_deadline(current, deadline);
+      shard_write_end(shard);
+      timing_wheel_add(&shard->wheel, &current->timer, clock_timespec_to_usec(&current->deadline));
+      continue;
+    }
+
+    // Handle the expired alarm
+    alarm_remove(shard, current);
+
+    log_event(LOG_ALARM_REMOVED, (unsigned long)monitor_thread_id, current->id, current->group_id,
+              removed_at, current->message->text);
+
+    // Signal the display thread to stop displaying this alarm; it frees the alarm
+    store_log_alarm(WAL_EXPIRE, current);
+    release_display_alarm(current);
+  }
+}
+
+/*
+ * Function to carry out a Cancel_Alarm request: take the alarm out of
+ * its shard and tell its display thread to stop printing it, all in
+ * O(1).
+ */
+static void monitor_cancel_alarm(int alarm_id, pthread_t monitor_thread_id)
+{
+  alarm_shard_t *shard;
+  alarm_t *alarm = alarm_lookup_locked(alarm_id, NULL, &shard);
+
+  if (alarm == NULL)
+  {
+    log_event(LOG_CANCEL_REQUEST_INVALID, 0, alarm_id, 0, clock_wall_now(), NULL);
+    return;
+  }
+
+  alarm_remove(shard, alarm);
+  log_event(LOG_ALARM_CANCELLED, (unsigned long)monitor_thread_id, alarm->id, alarm->group_id,
+            clock_wall_now(), alarm->message->text);
+  store_log_alarm(WAL_CANCEL, alarm);
+  release_display_alarm(alarm); // The display thread frees the alarm
+  shard_unlock_pair(shard, shard);
+}
+
+/*
+ * Function to stop every display thread of a group printing the
+ * group's alarms, with one queue lock and one wakeup per display
+ * thread rather than one per alarm. With release set the alarms have
+ * been removed, and each display thread frees its alarms once it has
+ * printed their last line. Otherwise the alarms are moving to
+ * new_group_id, which is set under the display threads' locks since
+ * they read it; each alarm is left without a display thread until it
+ * is assigned one of its new group.
+ *
+ * LOCKING PROTOCOL:
+ *
+ * The caller must hold the mutex of the group's shard.
+ */
+static void group_stop_display(alarm_group_t *group, int release, int new_group_id)
+{
+  for (thread_node_t *thread = group->display_head; thread != NULL; thread = thread->next)
+  {
+    pthread_mutex_lock(&thread->queue_mutex);
+    for (alarm_queue_node_t *queue_node = thread->alarm_queue; queue_node != NULL; queue_node = queue_node->next)
+    {
+      // Nodes already stopped belong to alarms that have left the group
+      if (queue_node->reassigned == -1)
+      {
+        continue;
+      }
+      if (release)
+      {
+        queue_node->alarm->queue_node = NULL;
+        queue_node->reassigned = -1;
+        queue_node->message_changed = 0;
+        queue_node->release_alarm = 1;
+      }
+      else
+      {
+        __atomic_store_n(&queue_node->alarm->group_id, new_group_id, __ATOMIC_RELAXED);
+        queue_node_stop(queue_node);
+      }
+    }
+    thread->alarm_count = 0;
+    schedule_display_thread(thread);
+    pthread_mutex_unlock(&thread->queue_mutex);
+  }
+  // Every thread now has room, so the list's order needs no change
+}
+
+/*
+ * Function to apply a Change_Group, Cancel_Group or Delay_Group
+ * request to every alarm of the group, in time proportional to the
+ * group's size. Each alarm is logged and stored as if it had been
+ * changed or cancelled on its own.
+ *
+ * LOCKING PROTOCOL:
+ *
+ * Takes the mutex of the group's shard, and for Change_Group the
+ * mutex of the new group's shard too.
+ */
+static void monitor_group_request(change_request_t *request, pthread_t monitor_thread_id)
+{
+  static const char *names[] = {[CHANGE_GROUP] = "Change", [CANCEL_GROUP] = "Cancel", [DELAY_GROUP] = "Delay"};
+  alarm_shard_t *shard = group_shard(request->group_id);
+  alarm_shard_t *new_shard = request->type == CHANGE_GROUP ? group_shard(request->new_group_id) : shard;
+
+  shard_lock_pair(shard, new_shard);
+  alarm_group_t *group = group_find(shard, request->group_id);
+  if (group == NULL || group->alarms == NULL)
+  {
+    shard_unlock_pair(shard, new_shard);
+    log_event(LOG_GROUP_REQUEST_INVALID, 0, 0, request->group_id, clock_wall_now(), names[request->type]);
+    return;
+  }
+
+  // Every alarm of the group changes, so the whole request is one write section on each shard
+  shard_write_begin(shard);
+  shard_write_begin(new_shard);
+  alarm_t *alarms = group->alarms;
+  if (request->type != DELAY_GROUP)
+  {
+    __atomic_store_n(&group->alarms, NULL, __ATOMIC_RELAXED); // Every alarm leaves the group
+    group->alarm_count = 0;
+  }
+
+  if (request->type == CANCEL_GROUP)
+  {
+    // Remove every alarm before any display thread may free one
+    for (alarm_t *alarm = alarms; alarm != NULL; alarm = alarm->next)
+    {
+      timing_wheel_remove(&shard->wheel, &alarm->timer);
+      alarm_index_remove(&alarm_id_index, &alarm->index_entry);
+      log_event(LOG_ALARM_CANCELLED, (unsigned long)monitor_thread_id, alarm->id, alarm->group_id,
+                clock_wall_now(), alarm->message->text);
+      store_log_alarm(WAL_CANCEL, alarm);
+    }
+    group_stop_display(group, 1, 0);
+  }
+  else if (request->type == DELAY_GROUP)
+  {
+    for (alarm_t *alarm = alarms; alarm != NULL; alarm = alarm->next)
+    {
+      struct timespec deadline = alarm->deadline;
+      clock_add_usec(&deadline, request->new_duration_usec);
+      alarm_set_deadline(alarm, deadline);
+      timing_wheel_add(&shard->wheel, &alarm->timer, clock_timespec_to_usec(&alarm->deadline));
+      monitor_rearmed(shard, clock_timespec_to_usec(&alarm->deadline));
+      store_log_alarm(WAL_CHANGE, alarm);
+      log_event(LOG_ALARM_CHANGED, (unsigned long)monitor_thread_id, alarm->id, alarm->group_id,
+                clock_to_wall(&alarm->deadline), alarm->message->text);
+    }
+  }
+  else
+  {
+    group_stop_display(group, 0, request->new_group_id);
+
+    // Move the alarms over and hand them to the new group's display threads as one batch
+    alarm_group_t *new_group = group_get(new_shard, request->new_group_id);
+    alarm_t *next;
+    for (alarm_t *alarm = alarms; alarm != NULL; alarm = next)
+    {
+      next = alarm->next;
+      if (new_shard != shard)
+      {
+        timing_wheel_remove(&shard->wheel, &alarm->timer);
+        timing_wheel_add(&new_shard->wheel, &alarm->timer, clock_timespec_to_usec(&alarm->deadline));
+        monitor_rearmed(new_shard, clock_timespec_to_usec(&alarm->deadline));
+      }
+      group_push_alarm(new_group, alarm);
+      group_assign_display_thread(new_group, alarm, 1);
+      store_log_alarm(WAL_CHANGE, alarm);
+      log_event(LOG_ALARM_CHANGED, (unsigned long)monitor_thread_id, alarm->id, alarm->group_id,
+                clock_to_wall(&alarm->deadline), alarm->message->text);
+    }
+  }
+
+  group_release(shard, group);
+  shard_write_end(new_shard);
+  shard_write_end(shard);
+  shard_unlock_pair(shard, new_shard);
+}
+
+/*
+ * Function to apply a Change_Alarm request to the alarm it names.
+ *
+ * LOCKING PROTOCOL:
+ *
+ * The caller must hold the mutex of the alarm's shard and of the
+ * shard of the request's new group.
+ */
+static void monitor_change_alarm(alarm_t *alarm, alarm_shard_t *old_shard, alarm_shard_t *new_shard,
+                                 change_request_t *request, pthread_t monitor_thread_id)
+{
+  // Store the original group ID for comparison
+  int old_group_id = alarm->group_id;
+
+  // The alarm's fields and group lists change together, in one write section on each shard
+  shard_write_begin(old_shard);
+  shard_write_begin(new_shard);
+
+  // Interned messages are equal exactly when they are the same message
+  const message_t *old_message = alarm->message;
+  int message_changed = old_message != request->new_message;
+
+  // An alarm changing group leaves its old group's list first, since the list is found by group_id
+  int moved = old_group_id != request->new_group_id;
+  if (moved)
+  {
+    alarm_unlink(old_shard, alarm);
+  }
+
+  // Update the alarm with the details from the change request, under
+  // its display thread's lock since that thread reads these fields
+  pthread_mutex_lock(&alarm->queue_node->thread->queue_mutex);
+  __atomic_store_n(&alarm->group_id, request->new_group_id, __ATOMIC_RELAXED);
+  __atomic_store_n(&alarm->duration_usec, request->new_duration_usec, __ATOMIC_RELAXED);
+  if (alarm->period_usec != 0)
+  {
+    // A periodic alarm restarts with the new period
+    __atomic_store_n(&alarm->period_usec, alarm->duration_usec, __ATOMIC_RELAXED);
+  }
+  alarm_set_deadline(alarm, request->new_deadline);
+  // The alarm takes over the request's reference
+  __atomic_store_n(&alarm->message, request->new_message, __ATOMIC_RELAXED);
+  pthread_mutex_unlock(&alarm->queue_node->thread->queue_mutex);
+
+  // Once the swap is done no display thread can still be reading the old message
+  message_release(old_message);
+
+  // Move the alarm to its new group, and its new group's shard
+  if (moved)
+  {
+    if (old_shard != new_shard)
+    {
+      timing_wheel_remove(&old_shard->wheel, &alarm->timer);
+    }
+    alarm_push(new_shard, alarm);
+  }
+  shard_write_end(new_shard);
+  shard_write_end(old_shard);
+  uint64_t expires = clock_timespec_to_usec(&alarm->deadline);
+  timing_wheel_add(&new_shard->wheel, &alarm->timer, expires); // Re-arm at the new deadline
+  monitor_rearmed(new_shard, expires);
+
+  // If the group ID of the alarm has changed, handle reassignment
+  if (moved)
+  {
+    // Signal the old display thread to stop printing this alarm
+    signal_display_thread(alarm->queue_node->thread, alarm, -1, 0);
+
+    // Hand the alarm to a display thread of the new group, which announces the takeover
+    assign_display_thread(alarm, 1);
+  }
+
+  // If the message of the alarm has changed, signal the display thread
+  if (message_changed)
+  {
+    signal_display_thread(alarm->queue_node->thread, alarm, 0, message_changed);
+  }
+
+  // Print a message indicating that the alarm has been changed
+  store_log_alarm(WAL_CHANGE, alarm);
+  log_event(LOG_ALARM_CHANGED, (unsigned long)monitor_thread_id, alarm->id, alarm->group_id,
+            clock_to_wall(&alarm->deadline), alarm->message->text);
+}
+
+// Function to report a Change_Alarm request that names no alarm
+static void monitor_change_invalid(change_request_t *request)
+{
+  log_event(LOG_CHANGE_REQUEST_INVALID, 0, request->alarm_id, request->new_group_id,
+            clock_to_wall(&request->new_deadline), request->new_message->text);
+  message_release(request->new_message);
+}
+
+/*
+ * Change_Alarm requests of the batch being applied that are still
+ * pending, at most one per alarm: a later change to an alarm replaces
+ * an earlier one, which is dropped without being applied or reported
+ * (last writer wins). Pending changes concern different alarms, so
+ * they are applied in whatever order takes the fewest locks: sorted by
+ * the alarm's shard and its new group's shard, each run of changes
+ * with the same two shards is applied under one acquisition of their
+ * mutexes. Cancels and group requests may touch any of the alarms, so
+ * the pending changes are applied before each one. Only the lead
+ * monitor worker uses the batch.
+ */
+typedef struct change_entry
+{
+  change_request_t *request; // Latest change to the alarm
+  int order;                 // Position of the alarm's first change in the batch, to keep ties in arrival order
+  int old_shard;             // Shard the alarm was in when the batch was applied, or the new group's if it had none
+  int new_shard;             // Shard of the request's new group
+} change_entry_t;
+
+typedef struct change_batch
+{
+  change_entry_t *entries; // Pending changes
+  size_t count;            // Entries in use
+  size_t capacity;         // Entries allocated
+  int *slots;              // Open-addressed table from alarm id to entry index + 1 (0 for an empty slot)
+  size_t slot_mask;        // Number of slots minus one, at least twice the capacity
+} change_batch_t;
+
+static change_batch_t change_batch = {NULL, 0, 0, NULL, 0};
+
+// Spread sequential ids across slots (Fibonacci hashing)
+static size_t change_batch_hash(int alarm_id)
+{
+  return (size_t)(((uint64_t)(uint32_t)alarm_id * 0x9E3779B97F4A7C15ull) >> 32);
+}
+
+// Function to find the slot of an alarm's pending change, or the empty slot it would take
+static int *change_batch_slot(change_batch_t *batch, int alarm_id)
+{
+  size_t slot = change_batch_hash(alarm_id) & batch->slot_mask;
+  while (batch->slots[slot] != 0 && batch->entries[batch->slots[slot] - 1].request->alarm_id != alarm_id)
+  {
+    slot = (slot + 1) & batch->slot_mask;
+  }
+  return &batch->slots[slot];
+}
+
+// Function to double the batch's capacity, rebuilding its slot table
+static void change_batch_grow(change_batch_t *batch)
+{
+  batch->capacity = batch->capacity == 0 ? 64 : batch->capacity * 2;
+  batch->entries = realloc(batch->entries, batch->capacity * sizeof(change_entry_t));
+  free(batch->slots);
+  batch->slot_mask = batch->capacity * 2 - 1;
+  batch->slots = calloc(batch->slot_mask + 1, sizeof(int));
+  if (batch->entries == NULL || batch->slots == NULL)
+  {
+    errno_abort("Allocate change batch");
+  }
+  for (size_t i = 0; i < batch->count; i++)
+  {
+    *change_batch_slot(batch, batch->entries[i].request->alarm_id) = (int)i + 1;
+  }
+}
+
+// Function to add a Change_Alarm request to the batch, replacing a pending change to the same alarm
+static void change_batch_add(change_batch_t *batch, change_request_t *request)
+{
+  if (batch->count == batch->capacity)
+  {
+    change_batch_grow(batch);
+  }
+
+  int *slot = change_batch_slot(batch, request->alarm_id);
+  if (*slot != 0)
+  {
+    change_entry_t *entry = &batch->entries[*slot - 1];
+    message_release(entry->request->new_message);
+    object_pool_free(&change_request_pool, entry->request);
+    entry->request = request;
+    return;
+  }
+  batch->entries[batch->count].request = request;
+  batch->entries[batch->count].order = (int)batch->count;
+  *slot = (int)++batch->count;
+}
+
+// Order pending changes by the pair of shards they lock, then by arrival
+static int change_entry_compare(const void *a, const void *b)
+{
+  const change_entry_t *first = a, *second = b;
+
+  if (first->old_shard != second->old_shard)
+  {
+    return first->old_shard - second->old_shard;
+  }
+  if (first->new_shard != second->new_shard)
+  {
+    return first->new_shard - second->new_shard;
+  }
+  return first->order - second->order;
+}
+
+/*
+ * Function to apply every pending change of the batch and empty it.
+ *
+ * LOCKING PROTOCOL:
+ *
+ * Each run of changes with the same two shards is applied under one
+ * acquisition of their mutexes. An alarm's shard is read unlocked to
+ * sort the changes, so each alarm is looked up again under the lock;
+ * one that is gone by then (expired, or cancelled through its group)
+ * is reported as invalid, and one found in another shard (its id was
+ * reused meanwhile) is changed on its own with alarm_lookup_locked.
+ */
+static void change_batch_apply(change_batch_t *batch, pthread_t monitor_thread_id)
+{
+  if (batch->count == 0)
+  {
+    return;
+  }
+
+  for (size_t i = 0; i < batch->count; i++)
+  {
+    change_entry_t *entry = &batch->entries[i];
+    index_entry_t *found = alarm_index_lookup(&alarm_id_index, entry->request->alarm_id);
+    int group_id = found == NULL ? entry->request->new_group_id
+                                 : __atomic_load_n(&container_of(found, alarm_t, index_entry)->group_id, __ATOMIC_RELAXED);
+    entry->old_shard = (int)(group_shard(group_id) - alarm_shards);
+    entry->new_shard = (int)(group_shard(entry->request->new_group_id) - alarm_shards);
+  }
+
+  // Empty the slot table in reverse order of insertion, which keeps every probe sequence intact
+  for (size_t i = batch->count; i-- > 0;)
+  {
+    *change_batch_slot(batch, batch->entries[i].request->alarm_id) = 0;
+  }
+  qsort(batch->entries, batch->count, sizeof(change_entry_t), change_entry_compare);
+
+  size_t run_start = 0;
+  while (run_start < batch->count)
+  {
+    alarm_shard_t *old_shard = &alarm_shards[batch->entries[run_start].old_shard];
+    alarm_shard_t *new_shard = &alarm_shards[batch->entries[run_start].new_shard];
+    size_t run_end = run_start;
+
+    shard_lock_pair(old_shard, new_shard);
+    while (run_end < batch->count && &alarm_shards[batch->entries[run_end].old_shard] == old_shard &&
+           &alarm_shards[batch->entries[run_end].new_shard] == new_shard)
+    {
+      change_request_t *request = batch->entries[run_end++].request;
+      index_entry_t *found = alarm_index_lookup(&alarm_id_index, request->alarm_id);
+      alarm_t *alarm = found == NULL ? NULL : container_of(found, alarm_t, index_entry);
+
+      if (alarm == NULL)
+      {
+        monitor_change_invalid(request);
+      }
+      else if (group_shard(alarm->group_id) == old_shard)
+      {
+        monitor_change_alarm(alarm, old_shard, new_shard, request, monitor_thread_id);
+      }
+      else
+      {
+        shard_unlock_pair(old_shard, new_shard);
+        alarm_shard_t *shard;
+        alarm = alarm_lookup_locked(request->alarm_id, new_shard, &shard);
+        if (alarm == NULL)
+        {
+          monitor_change_invalid(request);
+        }
+        else
+        {
+          monitor_change_alarm(alarm, shard, new_shard, request, monitor_thread_id);
+          shard_unlock_pair(shard, new_shard);
+        }
+        shard_lock_pair(old_shard, new_shard);
+      }
+      object_pool_free(&change_request_pool, request);
+    }
+    shard_unlock_pair(old_shard, new_shard);
+    run_start = run_end;
+  }
+  batch->count = 0;
+}
+
+/*
+ * Apply every queued change request. Changes to one alarm are
+ * coalesced and the rest applied in batches (see change_batch_t);
+ * cancels and group requests are applied in arrival order with
+ * respect to every change queued before and after them.
+ *
+ * LOCKING PROTOCOL:
+ *
+ * Each change locks the shard of the alarm's group, and when the group
+ * moves to another shard, that shard too, so the alarm is never
+ * visible in neither list. The queue is drained with a single atomic
+ * exchange, so the main thread can keep queueing requests while this
+ * batch is applied.
+ */
+static void monitor_apply_change_requests(pthread_t monitor_thread_id)
+{
+  // Take the whole pending batch in one step
+  mpsc_node_t *node = mpsc_queue_drain(&change_request_queue);
+
+  // Process each change request in the batch
+  while (node != NULL)
+  {
+    change_request_t *current_request = container_of(node, change_request_t, queue_node);
+    node = node->next;
+    STATS(latency_histogram_record(&change_latency, stats_now() - current_request->queued_at));
+
+    if (current_request->type == CHANGE_ALARM)
+    {
+      change_batch_add(&change_batch, current_request);
+      continue;
+    }
+
+    // Anything else may touch the alarms with pending changes, so those go first
+    change_batch_apply(&change_batch, monitor_thread_id);
+    if (current_request->type == CANCEL_ALARM)
+    {
+      monitor_cancel_alarm(current_request->alarm_id, monitor_thread_id);
+    }
+    else
+    {
+      monitor_group_request(current_request, monitor_thread_id);
+    }
+
+    // Free the memory allocated for the processed change request
+    object_pool_free(&change_request_pool, current_request);
+  }
+  change_batch_apply(&change_batch, monitor_thread_id);
+}
+
+/*
+ * Run one pass of a monitor worker: for the lead, apply queued changes,
+ * then expire the due alarms of the worker's shards, holding one
+ * shard's mutex at a time. Returns the earliest deadline left in those
+ * shards (0 for none), which is also published in the worker's
+ * current_deadline.
+ *
+ * current_deadline is 0 for the whole pass, so an alarm inserted into
+ * a shard the pass has already scanned always wakes the worker for
+ * another pass instead of being missed.
+ */
+static uint64_t monitor_pass(monitor_worker_t *worker, pthread_t monitor_thread_id)
+{
+  uint64_t deadline = 0;
+
+  __atomic_store_n(&worker->current_deadline, 0, __ATOMIC_SEQ_CST);
+
+  // Apply changes first, since they can move an alarm's expiry time
+  if (worker->index == 0 && !mpsc_queue_empty(&change_request_queue))
+  {
+    monitor_apply_change_requests(monitor_thread_id);
+  }
+
+  uint64_t now = clock_now_usec();
+  for (int i = worker->index; i < shard_count; i += monitor_count)
+  {
+    alarm_shard_t *shard = &alarm_shards[i];
+    shard_lock_pair(shard, shard);
+    monitor_expire_alarms(shard, monitor_thread_id, now);
+
+    // Keep the earliest deadline across shards; inserts compare against it
+    uint64_t next_event = timing_wheel_next_event(&shard->wheel);
+    if (next_event != TIMING_WHEEL_NONE && (deadline == 0 || next_event < deadline))
+    {
+      deadline = next_event;
+    }
+    shard_unlock_pair(shard, shard);
+  }
+
+  __atomic_store_n(&worker->current_deadline, deadline, __ATOMIC_SEQ_CST);
+  return deadline;
+}
+
+/*
+ * Sleep until the given wheel tick (0 for no deadline) or until
+ * monitor_wake is called for the worker, whichever comes first.
+ */
+static void monitor_sleep(monitor_worker_t *worker, uint64_t deadline)
+{
+  int status;
+  struct timespec cond_time = clock_real_time(deadline);
+
+  pthread_mutex_lock(&worker->wakeup_mutex);
+  while (!worker->wakeup)
+  {
+    if (deadline == 0)
+    {
+      status = pthread_cond_wait(&worker->cond, &worker->wakeup_mutex);
+    }
+    else
+    {
+      status = pthread_cond_timedwait(&worker->cond, &worker->wakeup_mutex, &cond_time);
+    }
+    if (status == ETIMEDOUT)
+    {
+      break;
+    }
+    if (status != 0)
+    {
+      err_abort(status, "Cond timedwait");
+    }
+  }
+  worker->wakeup = 0;
+  pthread_mutex_unlock(&worker->wakeup_mutex);
+}
+
+/*
+ * The start routine of a monitor worker, passed its monitor_worker_t.
+ * Like alarm_thread in alarm_cond.c, it sleeps in a single
+ * pthread_cond_timedwait on the earliest pending deadline of its
+ * shards, so an alarm is removed as soon as it is due rather than on
+ * the next polling interval. alarm_insert wakes it only when a new
+ * alarm moves that deadline earlier, and insert_change_request wakes
+ * the lead once per batch of change requests. The sleep uses its own
+ * mutex, so nobody who wakes a worker ever waits for it to finish an
+ * expiry or change pass.
+ */
+static void *alarm_monitor_thread_function(void *arg)
+{
+  monitor_worker_t *worker = arg;
+
+  // Retrieve the thread ID of the alarm monitor thread
+  pthread_t monitor_thread_id = pthread_self();
+
+  // Infinite loop to continuously monitor alarms
+  while (1)
+  {
+    monitor_sleep(worker, monitor_pass(worker, monitor_thread_id));
+  }
+  return NULL;
+}
+
+/*
+ * Function to run one pass of a display alarm thread on a pool worker:
+ * announce reassignments and message changes, drop alarms that were
+ * moved away or expired, and print every alarm when the periodic
+ * print is due. A display thread left without alarms exits.
+ */
+static void display_alarm_thread_run(void *arg)
+{
+
+  // Extract thread information from the argument
+  thread_node_t *thread_info = (thread_node_t *)arg;
+
+  // Retrieve the ID of the display alarm thread
+  unsigned long display_thread_id = thread_info->thread_id;
+
+  int status;
+
+  // Lock the mutex to safely access the alarm queue of this thread
+  status = pthread_mutex_lock(&thread_info->queue_mutex);
+  if (status != 0)
+  {
+    err_abort(status, "Lock mutex"); // Abort if mutex lock fails.
+  }
+  thread_info->running = 1;
+  thread_info->signaled = 0;
+  int print_due = thread_info->print_due;
+  thread_info->print_due = 0;
+
+#ifdef ALARM_STATS
+  // Record how far this print is from 5 seconds after the previous one
+  if (print_due)
+  {
+    uint64_t now = clock_now_nsec();
+    if (thread_info->printed_at != 0)
+    {
+      uint64_t period = now - thread_info->printed_at;
+      latency_histogram_record(&print_drift, period > 5000000000ull ? period - 5000000000ull : 5000000000ull - period);
+    }
+    thread_info->printed_at = now;
+  }
+#endif
+
+  // Iterate through the alarm queue of this thread
+  alarm_queue_node_t *queue_node = thread_info->alarm_queue;
+  while (queue_node != NULL)
+  {
+
+    // Get the current alarm from the queue node
+    alarm_t *alarm = queue_node->alarm;
+
+    // Handle different scenarios based on alarm status flags
+    if (queue_node->reassigned == 1)
+    {
+      // Handle the case where this thread has taken over a reassigned alarm
+      log_event(LOG_DISPLAY_TAKEN_OVER, display_thread_id, alarm->id, alarm->group_id, clock_wall_now(), alarm->message->text);
+      queue_node->reassigned = 0; // Reset the flag
+    }
+    else if (queue_node->reassigned == -1)
+    {
+      // Handle the case where this thread stops printing an alarm; one moved
+      // to another group may already have changed again, so use what the node kept
+      if (queue_node->stopped_message != NULL)
+      {
+        log_event(LOG_DISPLAY_STOPPED, display_thread_id, queue_node->stopped_alarm_id, queue_node->stopped_group_id,
+                  clock_wall_now(), queue_node->stopped_message->text);
+        message_release(queue_node->stopped_message);
+      }
+      else
+      {
+        log_event(LOG_DISPLAY_STOPPED, display_thread_id, alarm->id, alarm->group_id, clock_wall_now(), alarm->message->text);
+      }
+
+      // Free an expired or cancelled alarm now that nothing else refers to it
+      if (queue_node->release_alarm)
+      {
+        message_release(alarm->message);
+        object_pool_free(&alarm_pool, alarm);
+      }
+
+      // Remove the alarm from this thread's queue
+      alarm_queue_node_t *next_node = queue_node->next;
+      queue_node_unlink(thread_info, queue_node);
+      object_pool_free(&queue_node_pool, queue_node);
+      queue_node = next_node;
+      continue; // Skip to the next iteration
+    }
+    else if (queue_node->message_changed)
+    {
+      // Handle the case where the alarm message has been changed
+      log_event(LOG_DISPLAY_MESSAGE_CHANGED, display_thread_id, alarm->id, alarm->group_id, clock_wall_now(), alarm->message->text);
+      queue_node->message_changed = 0; // Reset the flag
+    }
+    else if (print_due)
+    {
+      // Regular printing of the alarm information
+      log_event(LOG_DISPLAY_PRINTED, display_thread_id, alarm->id, alarm->group_id, clock_wall_now(), alarm->message->text);
+    }
+
+    // Move to the next queue node
+    queue_node = queue_node->next;
+  }
+
+  // Check if there are no more alarms to display for this thread
+  if (thread_info->alarm_queue == NULL)
+  {
+    // Retake the locks in order; an alarm may be assigned to us meanwhile
+    alarm_shard_t *shard = group_shard(thread_info->group_id);
+    pthread_mutex_unlock(&thread_info->queue_mutex);
+    shard_lock_pair(shard, shard);
+    pthread_mutex_lock(&thread_info->queue_mutex);
+
+    if (thread_info->alarm_queue == NULL)
+    {
+      // Unlink the thread so no one can find or schedule it again, and drop its group if that was the last of it
+      display_thread_unlink(thread_info);
+      group_release(shard, thread_info->group);
+      shard_unlock_pair(shard, shard);
+
+      // Print an exit message and release the thread
+      log_event(LOG_DISPLAY_THREAD_EXITING, display_thread_id, 0, thread_info->group_id, clock_wall_now(), NULL);
+      pthread_mutex_unlock(&thread_info->queue_mutex);
+
+      // The cadence may still mark a print due meanwhile, which only sets signaled while we run
+      cadence_remove(thread_info);
+      pthread_mutex_destroy(&thread_info->queue_mutex);
+      object_pool_free(&thread_node_pool, thread_info);
+      return;
+    }
+    shard_unlock_pair(shard, shard);
+  }
+
+  // Run again if the queue changed while we were running
+  thread_info->running = 0;
+  if (thread_info->signaled)
+  {
+    thread_info->signaled = 0;
+    display_submit(thread_info);
+  }
+  else
+  {
+    thread_info->scheduled = 0;
+  }
+
+  // Unlock the mutex
+  pthread_mutex_unlock(&thread_info->queue_mutex);
+}
+
+/*
+ * Function to run the display threads whose periodic print is due by
+ * now plus the slack window, and schedule each one's next print a
+ * period after the previous one, so the cadence does not drift.
+ * Returns the wheel tick of the next print to wait for (0 for none).
+ *
+ * LOCKING PROTOCOL:
+ *
+ * The caller must hold cadence_mutex.
+ */
+static uint64_t display_cadence_run(uint64_t now)
+{
+  timer_entry_t due_threads;
+  timer_list_init(&due_threads);
+  timing_wheel_advance(&cadence_wheel, now + cadence_slack_usec, &due_threads);
+
+  while (!timer_list_empty(&due_threads))
+  {
+    timer_entry_t *entry = timer_list_pop(&due_threads);
+    thread_node_t *thread = container_of(entry, thread_node_t, cadence_timer);
+
+    pthread_mutex_lock(&thread->queue_mutex);
+    thread->print_due = 1;
+    schedule_display_thread(thread);
+    pthread_mutex_unlock(&thread->queue_mutex);
+
+    // Skip whole periods missed during a stall instead of printing them in a burst
+    uint64_t next_print = entry->expires;
+    do
+    {
+      next_print += DISPLAY_PRINT_PERIOD_USEC;
+    } while (next_print <= now);
+    timing_wheel_add(&cadence_wheel, entry, next_print);
+  }
+
+  uint64_t next_event = timing_wheel_next_event(&cadence_wheel);
+  return next_event == TIMING_WHEEL_NONE ? 0 : next_event;
+}
+
+/*
+ * The display cadence thread's start routine. It sleeps until the
+ * next display thread's print is due, or indefinitely when there are
+ * no display threads, instead of every display thread keeping its own
+ * timer. Deadlines are on CLOCK_MONOTONIC, so the cadence does not
+ * follow clock jumps.
+ */
+static void *display_cadence_thread_function(void *arg)
+{
+  pthread_mutex_lock(&cadence_mutex);
+  while (1)
+  {
+    cadence_deadline = display_cadence_run(clock_now_usec());
+    if (cadence_deadline == 0)
+    {
+      pthread_cond_wait(&cadence_cond, &cadence_mutex);
+    }
+    else
+    {
+      struct timespec wake = clock_real_time(cadence_deadline);
+      int status = pthread_cond_timedwait(&cadence_cond, &cadence_mutex, &wake);
+      if (status != 0 && status != ETIMEDOUT)
+      {
+        err_abort(status, "Cond timedwait");
+      }
+    }
+  }
+  return NULL;
+}
+
+/*
+ * Function to return the wall-clock deadline a recovered alarm should
+ * have now. Firing a periodic alarm is not logged, so its recorded
+ * deadline may be many periods old; it is advanced by whole periods
+ * to the next one still ahead, which keeps its phase.
+ */
+static int64_t periodic_deadline(const wal_record_t *record)
+{
+  struct timespec now = clock_now();
+  int64_t now_nsec = clock_to_wall_nsec(&now);
+  int64_t period_nsec = (int64_t)record->duration_usec * 1000;
+
+  if (!(record->flags & WAL_FLAG_PERIODIC) || period_nsec == 0 || record->deadline_nsec > now_nsec)
+  {
+    return record->deadline_nsec;
+  }
+  return record->deadline_nsec + ((now_nsec - record->deadline_nsec) / period_nsec + 1) * period_nsec;
+}
+
+/*
+ * Function to apply one recovered store record to the alarm table.
+ * It runs before any other thread starts and only builds the alarm
+ * list and the id index; recover_alarms sets up the expiry wheel and
+ * the display threads once every record has been replayed.
+ */
+static void replay_store_record(const wal_record_t *record, void *arg)
+{
+  index_entry_t *entry = alarm_index_lookup(&alarm_id_index, record->alarm_id);
+  alarm_t *alarm = entry == NULL ? NULL : container_of(entry, alarm_t, index_entry);
+
+  if (record->type == WAL_START && alarm == NULL)
+  {
+    alarm = (alarm_t *)object_pool_alloc(&alarm_pool);
+    alarm->id = record->alarm_id;
+    alarm->message = NULL;
+    alarm_index_insert(&alarm_id_index, &alarm->index_entry, alarm->id);
+    alarm->group_id = record->group_id;
+    alarm_push(group_shard(alarm->group_id), alarm);
+  }
+  if (alarm == NULL)
+  {
+    return;
+  }
+
+  if (record->type == WAL_EXPIRE || record->type == WAL_CANCEL)
+  {
+    alarm_unlink(group_shard(alarm->group_id), alarm);
+    alarm_index_remove(&alarm_id_index, &alarm->index_entry);
+    if (alarm->message != NULL)
+    {
+      message_release(alarm->message);
+    }
+    object_pool_free(&alarm_pool, alarm);
+  }
+  else
+  {
+    // A start and a change both carry the alarm's full state
+    if (record->group_id != alarm->group_id)
+    {
+      alarm_unlink(group_shard(alarm->group_id), alarm);
+      alarm->group_id = record->group_id;
+      alarm_push(group_shard(alarm->group_id), alarm);
+    }
+    alarm->duration_usec = record->duration_usec;
+    alarm->period_usec = (record->flags & WAL_FLAG_PERIODIC) ? record->duration_usec : 0;
+    alarm->deadline = clock_from_wall_nsec(periodic_deadline(record));
+    char text[sizeof(record->message)];
+    memcpy(text, record->message, sizeof(text));
+    text[sizeof(text) - 1] = '\0';
+    if (alarm->message != NULL)
+    {
+      message_release(alarm->message);
+    }
+    alarm->message = message_intern(text);
+  }
+}
+
+/*
+ * Function to arm every recovered alarm and hand it to a display
+ * thread. Going through each group's alarms in turn puts them two to a
+ * display thread, as they were before the restart. Alarms whose
+ * deadline passed while the program was down expire as soon as the
+ * monitor starts. Returns the number of alarms.
+ */
+static size_t recover_alarms(void)
+{
+  size_t count = 0;
+
+  for (int i = 0; i < shard_count; i++)
+  {
+    alarm_shard_t *shard = &alarm_shards[i];
+    for (size_t bucket = 0; bucket <= shard->group_mask; bucket++)
+    {
+      for (alarm_group_t *group = shard->groups[bucket]; group != NULL; group = group->next)
+      {
+        for (alarm_t *alarm = group->alarms; alarm != NULL; alarm = alarm->next)
+        {
+          timer_entry_init(&alarm->timer);
+          timing_wheel_add(&shard->wheel, &alarm->timer, clock_timespec_to_usec(&alarm->deadline));
+          group_assign_display_thread(group, alarm, 0);
+          count++;
+        }
+      }
+    }
+  }
+  return count;
+}
+
+/*
+ * Function to write a snapshot of every live alarm. Every shard's
+ * mutex is held, in shard order, while the alarms are copied into the
+ * mapped snapshot, so the snapshot lines up with a WAL segment
+ * boundary; syncing it to disk happens after the locks are released.
+ */
+static void take_snapshot(void)
+{
+  store_snapshot_t snapshot;
+  size_t i = 0;
+
+  for (int shard = 0; shard < shard_count; shard++)
+  {
+    STATS_LOCK(&alarm_shards[shard].mutex, &alarm_shards[shard].lock_stats);
+  }
+  store_snapshot_begin(&snapshot, alarm_index_count(&alarm_id_index));
+  for (int shard = 0; shard < shard_count; shard++)
+  {
+    for (size_t bucket = 0; bucket <= alarm_shards[shard].group_mask; bucket++)
+    {
+      for (alarm_group_t *group = alarm_shards[shard].groups[bucket]; group != NULL; group = group->next)
+      {
+        for (alarm_t *alarm = group->alarms; alarm != NULL && i < snapshot.count; alarm = alarm->next)
+        {
+          fill_store_record(&snapshot.records[i++], WAL_START, alarm);
+        }
+      }
+    }
+  }
+  for (int shard = shard_count - 1; shard >= 0; shard--)
+  {
+    STATS_UNLOCK(&alarm_shards[shard].mutex, &alarm_shards[shard].lock_stats);
+  }
+
+  store_snapshot_commit(&snapshot);
+}
+
+/*
+ * The snapshot thread's start routine. It writes a snapshot every
+ * interval seconds, given by arg, so recovery only replays the WAL
+ * written since.
+ */
+static void *snapshot_thread_function(void *arg)
+{
+  int interval = *(int *)arg;
+  struct timespec next_snapshot;
+  clock_gettime(CLOCK_MONOTONIC, &next_snapshot); // Real time, even in a replay
+
+  while (1)
+  {
+    next_snapshot.tv_sec += interval;
+    while (clock_nanosleep(CLOCK_MONOTONIC, TIMER_ABSTIME, &next_snapshot, NULL) == EINTR)
+    {
+    }
+    take_snapshot();
+  }
+  return NULL;
+}
+
+// Function to log one line of the Stats report
+static void log_stats_line(const char *line)
+{
+  log_event(LOG_STATS, 0, 0, 0, 0, line);
+}
+
+/*
+ * Function to produce the Stats report, one line per histogram, and
+ * pass each line to emit.
+ */
+void alarm_engine_report_stats(void (*emit)(const char *line))
+{
+#ifdef ALARM_STATS
+  char line[128];
+
+  latency_histogram_format(&start_latency, "start to insert", line, sizeof(line));
+  emit(line);
+  latency_histogram_format(&change_latency, "change queue to apply", line, sizeof(line));
+  emit(line);
+  latency_histogram_format(&expiry_lateness, "expiry lateness", line, sizeof(line));
+  emit(line);
+  latency_histogram_format(&print_drift, "print period drift", line, sizeof(line));
+  emit(line);
+
+  // Lock statistics are kept per shard and reported summed over the shards
+  lock_stats_t shard_stats;
+  memset(&shard_stats, 0, sizeof(shard_stats));
+  for (int i = 0; i < shard_count; i++)
+  {
+    latency_histogram_merge(&shard_stats.wait, &alarm_shards[i].lock_stats.wait);
+    latency_histogram_merge(&shard_stats.hold, &alarm_shards[i].lock_stats.hold);
+  }
+  latency_histogram_format(&shard_stats.wait, "shard wait", line, sizeof(line));
+  emit(line);
+  latency_histogram_format(&shard_stats.hold, "shard hold", line, sizeof(line));
+  emit(line);
+#else
+  emit("Statistics are not compiled in; build with -DALARM_STATS");
+#endif
+}
+
+// Function to print the object pool counters to stderr
+void alarm_engine_report_pools(void)
+{
+  object_pool_report(&alarm_pool, stderr);
+  object_pool_report(&queue_node_pool, stderr);
+  object_pool_report(&change_request_pool, stderr);
+  object_pool_report(&thread_node_pool, stderr);
+  object_pool_report(&group_pool, stderr);
+  message_table_report(stderr);
+}
+
+/*
+ * Function to carry out one command. The calling thread is shown as
+ * "Main Thread" in the output. With the engine on threads of its own,
+ * any number of threads may call it at the same time.
+ */
+command_status_t alarm_engine_execute(const command_t *command)
+{
+  pthread_t main_thread_id = pthread_self();
+  int alarm_id = command->alarm_id;
+  int group_id = command->group_id;
+  uint64_t duration_usec = command->duration_usec;
+  STATS(uint64_t execute_start = stats_now());
+
+  switch (command->type)
+  {
+  case COMMAND_STATS:
+    alarm_engine_report_stats(log_stats_line);
+    break;
+  case COMMAND_QUERY_ALARM:
+  case COMMAND_LIST_GROUP:
+  case COMMAND_COUNT:
+    return alarm_engine_answer(command, NULL, NULL);
+  case COMMAND_START_ALARM:
+  case COMMAND_START_PERIODIC_ALARM:
+  {
+    // Create and initialize a new alarm structure
+    alarm_t *new_alarm = (alarm_t *)object_pool_alloc(&alarm_pool);
+
+    // A query may still be reading the pooled memory as the alarm it last held
+    __atomic_store_n(&new_alarm->id, alarm_id, __ATOMIC_RELAXED);
+    __atomic_store_n(&new_alarm->group_id, group_id, __ATOMIC_RELAXED);
+    __atomic_store_n(&new_alarm->duration_usec, duration_usec, __ATOMIC_RELAXED);
+    // The monitor re-arms a periodic alarm in place
+    __atomic_store_n(&new_alarm->period_usec, command->type == COMMAND_START_PERIODIC_ALARM ? duration_usec : 0,
+                     __ATOMIC_RELAXED);
+    alarm_set_deadline(new_alarm, clock_after_usec(duration_usec)); // Set the alarm to expire 'duration' from now
+    __atomic_store_n(&new_alarm->message, message_intern(command->message), __ATOMIC_RELAXED);
+
+    // Check for a duplicate ID and claim the ID in one index operation
+    alarm_shard_t *shard = group_shard(group_id);
+    shard_lock_pair(shard, shard);
+    int duplicate = !alarm_index_insert(&alarm_id_index, &new_alarm->index_entry, alarm_id);
+    if(duplicate){
+      shard_unlock_pair(shard, shard);
+      message_release(new_alarm->message);
+      object_pool_free(&alarm_pool, new_alarm);
+      log_event(LOG_DUPLICATE_ALARM, 0, alarm_id, 0, 0, NULL);
+      return COMMAND_DUPLICATE;
+    }
+    else{
+      // Hand the alarm to a display thread before the monitor can expire it
+      int thread_created = assign_display_thread(new_alarm, 0);
+      if (thread_created)
+      {
+        log_event(LOG_DISPLAY_THREAD_CREATED, new_alarm->queue_node->thread->thread_id, new_alarm->id,
+                  new_alarm->group_id, clock_to_wall(&new_alarm->deadline), new_alarm->message->text);
+      }
+      else
+      {
+        log_event(LOG_DISPLAY_THREAD_ASSIGNED, (unsigned long)main_thread_id, new_alarm->id,
+                  new_alarm->group_id, clock_to_wall(&new_alarm->deadline), new_alarm->message->text);
+      }
+
+      // Insert the new alarm into its group's shard
+      alarm_insert(new_alarm);
+      STATS(latency_histogram_record(&start_latency, stats_now() - execute_start));
+      store_log_alarm(WAL_START, new_alarm);
+      log_event(LOG_ALARM_INSERTED, (unsigned long)main_thread_id, new_alarm->id, new_alarm->group_id,
+                clock_to_wall(&new_alarm->deadline), new_alarm->message->text);
+      shard_unlock_pair(shard, shard); // The alarm may expire and be freed from here on
+    }
+    break;
+  }
+  case COMMAND_CHANGE_ALARM:
+  {
+    change_request_t *new_request = (change_request_t *)object_pool_alloc(&change_request_pool);
+    new_request->type = CHANGE_ALARM;
+    new_request->alarm_id = alarm_id;
+    new_request->new_group_id = group_id;
+    new_request->new_duration_usec = duration_usec; // Duration from now until the alarm should expire
+    // Set the new deadline as the current time plus the specified duration
+    new_request->new_deadline = clock_after_usec(duration_usec);
+    new_request->new_message = message_intern(command->message);
+
+    // Log the request before handing it over, since the monitor frees it once applied
+    log_event(LOG_CHANGE_REQUEST_INSERTED, (unsigned long)main_thread_id, alarm_id, group_id,
+              clock_to_wall(&new_request->new_deadline), command->message);
+
+    STATS(new_request->queued_at = stats_now());
+    insert_change_request(new_request);
+    break;
+  }
+  case COMMAND_CANCEL_ALARM:
+  {
+    // The monitor applies a cancel in order with the changes
+    change_request_t *new_request = (change_request_t *)object_pool_alloc(&change_request_pool);
+    new_request->type = CANCEL_ALARM;
+    new_request->alarm_id = alarm_id;
+
+    log_event(LOG_CANCEL_REQUEST_INSERTED, (unsigned long)main_thread_id, alarm_id, 0, clock_wall_now(), NULL);
+
+    STATS(new_request->queued_at = stats_now());
+    insert_change_request(new_request);
+    break;
+  }
+  case COMMAND_CHANGE_GROUP:
+  {
+    // Move every alarm of a group to another
+    change_request_t *new_request = (change_request_t *)object_pool_alloc(&change_request_pool);
+    new_request->type = CHANGE_GROUP;
+    new_request->group_id = group_id;
+    new_request->new_group_id = command->new_group_id;
+
+    log_event(LOG_CHANGE_GROUP_REQUEST_INSERTED, (unsigned long)main_thread_id, command->new_group_id, group_id,
+              clock_wall_now(), NULL);
+
+    STATS(new_request->queued_at = stats_now());
+    insert_change_request(new_request);
+    break;
+  }
+  case COMMAND_CANCEL_GROUP:
+  {
+    change_request_t *new_request = (change_request_t *)object_pool_alloc(&change_request_pool);
+    new_request->type = CANCEL_GROUP;
+    new_request->group_id = group_id;
+
+    log_event(LOG_CANCEL_GROUP_REQUEST_INSERTED, (unsigned long)main_thread_id, 0, group_id, clock_wall_now(), NULL);
+
+    STATS(new_request->queued_at = stats_now());
+    insert_change_request(new_request);
+    break;
+  }
+  case COMMAND_DELAY_GROUP:
+  {
+    // Push back every deadline in a group
+    change_request_t *new_request = (change_request_t *)object_pool_alloc(&change_request_pool);
+    new_request->type = DELAY_GROUP;
+    new_request->group_id = group_id;
+    new_request->new_duration_usec = duration_usec;
+
+    log_event(LOG_DELAY_GROUP_REQUEST_INSERTED, (unsigned long)main_thread_id, 0, group_id, clock_wall_now(),
+              command->duration);
+
+    STATS(new_request->queued_at = stats_now());
+    insert_change_request(new_request);
+    break;
+  }
+  default:
+    return COMMAND_INVALID; // Subscribe only means something to the command server
+  }
+  return COMMAND_ACCEPTED;
+}
+
+// Function to run every display thread on the event loop's ready list
+static void event_loop_run_displays(void)
+{
+  while (display_ready_head != NULL)
+  {
+    thread_node_t *thread = display_ready_head;
+    display_ready_head = thread->ready_next;
+    if (display_ready_head == NULL)
+    {
+      display_ready_tail = NULL;
+    }
+    display_alarm_thread_run(thread); // May free the thread or put it back on the list
+  }
+}
+
+
+/*
+ * Function to start the engine: create its pools, shards and wheels,
+ * recover the alarms of the store if one is named, and start the
+ * monitor, the display cadence and the display pool unless the engine
+ * is to run on the caller's event loop. Call it once, before any other
+ * alarm_engine_ function; the options are not kept.
+ */
+void alarm_engine_start(const alarm_engine_options_t *options)
+{
+  // Start the output writer before any thread logs an event
+  event_log_init();
+
+  // Create the object pools
+  object_pool_init(&alarm_pool, "alarm", sizeof(alarm_t));
+  object_pool_init(&queue_node_pool, "queue_node", sizeof(alarm_queue_node_t));
+  object_pool_init(&change_request_pool, "change_request", sizeof(change_request_t));
+  object_pool_init(&thread_node_pool, "thread_node", sizeof(thread_node_t));
+  object_pool_init(&group_pool, "group", sizeof(alarm_group_t));
+  message_table_init();
+
+  if (options->shards < 1 || options->shards > ALARM_SHARDS_MAX)
+  {
+    fprintf(stderr, "The engine needs between 1 and %d shards\n", ALARM_SHARDS_MAX);
+    exit(1);
+  }
+  shard_count = options->shards;
+  cadence_slack_usec = options->cadence_slack_usec;
+
+  // A worker without a shard would have nothing to do, and the event loop is one thread
+  if (options->monitor_threads < 1 || options->monitor_threads > shard_count)
+  {
+    fprintf(stderr, "The engine needs between 1 and %d monitor threads\n", shard_count);
+    exit(1);
+  }
+  monitor_count = options->event_loop ? 1 : options->monitor_threads;
+
+  // Start each shard's expiry wheel clock, and the cadence's, at the current time
+  uint64_t now = clock_now_usec();
+  timing_wheel_init(&cadence_wheel, now);
+  for (int i = 0; i < shard_count; i++)
+  {
+    pthread_mutex_init(&alarm_shards[i].mutex, NULL);
+    alarm_shards[i].sequence = 0;
+    alarm_shards[i].write_depth = 0;
+    alarm_shards[i].retired_groups = NULL;
+    alarm_shards[i].groups = calloc(64, sizeof(alarm_group_t *));
+    if (alarm_shards[i].groups == NULL)
+    {
+      errno_abort("Allocate group table");
+    }
+    alarm_shards[i].group_mask = 63;
+    alarm_shards[i].group_count = 0;
+    timing_wheel_init(&alarm_shards[i].wheel, now);
+  }
+
+  // Time the monitor's waits on the same clock as the deadlines
+  pthread_condattr_t cond_attr;
+  pthread_condattr_init(&cond_attr);
+  pthread_condattr_setclock(&cond_attr, CLOCK_MONOTONIC);
+  for (int i = 0; i < monitor_count; i++)
+  {
+    pthread_mutex_init(&monitor_workers[i].wakeup_mutex, NULL);
+    pthread_cond_init(&monitor_workers[i].cond, &cond_attr);
+    monitor_workers[i].wakeup = 0;
+    monitor_workers[i].index = i;
+    monitor_workers[i].current_deadline = 0;
+  }
+  pthread_cond_init(&cadence_cond, &cond_attr);
+  pthread_condattr_destroy(&cond_attr);
+  alarm_index_init(&alarm_id_index, 1024);
+
+  // Recover what the store holds, then log every change to it
+  if (options->store_directory != NULL)
+  {
+    static int snapshot_interval;
+    uint64_t recovery_start = clock_now_usec();
+
+    size_t records = store_open(options->store_directory, options->wal_sync_msec, replay_store_record, NULL);
+    size_t recovered = recover_alarms();
+    fprintf(stderr, "Recovered %zu alarms from %zu records in %.3f seconds\n", recovered, records,
+            (clock_now_usec() - recovery_start) / (double)USEC_PER_SEC);
+    store_enabled = 1;
+
+    snapshot_interval = options->snapshot_interval > 0 ? options->snapshot_interval : 60;
+    pthread_t snapshot_thread;
+    pthread_create(&snapshot_thread, NULL, snapshot_thread_function, &snapshot_interval);
+  }
+
+  // On the caller's event loop, one timerfd stands in for the monitor's and the cadence's waits
+  if (options->event_loop)
+  {
+    event_loop_engine = 1;
+    engine_timer_fd = timerfd_create(CLOCK_MONOTONIC, TFD_NONBLOCK | TFD_CLOEXEC);
+    if (engine_timer_fd < 0)
+    {
+      errno_abort("Create engine timer");
+    }
+    return;
+  }
+
+  // Start the display workers and the thread that paces their periodic prints
+  display_pool_init(&display_pool, display_pool_default_workers(), display_alarm_thread_run);
+  pthread_t display_cadence_thread;
+  pthread_create(&display_cadence_thread, NULL, display_cadence_thread_function, NULL);
+
+  // Create the alarm monitor workers
+  for (int i = 0; i < monitor_count; i++)
+  {
+    pthread_t alarm_monitor_thread;
+    pthread_create(&alarm_monitor_thread, NULL, alarm_monitor_thread_function, &monitor_workers[i]);
+  }
+}
+
+// Function to return the descriptor an event-loop engine needs dispatching on, or -1 on threads
+int alarm_engine_fd(void)
+{
+  return engine_timer_fd;
+}
+
+/*
+ * Function to do the event-loop engine's work on the calling thread:
+ * the monitor's pass (apply queued changes, then expire due alarms),
+ * the cadence's, and every display thread that became ready. The
+ * engine's timerfd is then armed to the next of the alarm deadlines
+ * and cadence prints, which is returned (0 when there is none). A
+ * replay on the virtual clock moves the clock there instead.
+ */
+uint64_t alarm_engine_dispatch(void)
+{
+  uint64_t deadline = monitor_pass(&monitor_workers[0], pthread_self());
+  pthread_mutex_lock(&cadence_mutex);
+  uint64_t next_print = display_cadence_run(clock_now_usec());
+  pthread_mutex_unlock(&cadence_mutex);
+
+  event_loop_run_displays();
+
+  uint64_t next = deadline;
+  if (next_print != 0 && (next == 0 || next_print < next))
+  {
+    next = next_print;
+  }
+
+  // Re-arming also clears an expiry already signaled, so a timer that has gone off is always re-armed
+  if (!clock_is_virtual() && (next != engine_timer_armed || (next != 0 && next <= clock_now_usec())))
+  {
+    struct itimerspec timer = {{0, 0}, {0, 0}};
+    if (next != 0)
+    {
+      timer.it_value = clock_real_time(next);
+    }
+    if (timerfd_settime(engine_timer_fd, TFD_TIMER_ABSTIME, &timer, NULL) < 0)
+    {
+      errno_abort("Arm timer");
+    }
+    engine_timer_armed = next;
+  }
+  return next;
+}
+
+// Function to fill in the text fields of a command built by the calls below
+static void command_set_text(command_t *command, uint64_t duration_usec, const char *message)
+{
+  command->duration_usec = duration_usec;
+  snprintf(command->duration, sizeof(command->duration), "%lluus", (unsigned long long)duration_usec);
+  snprintf(command->message, sizeof(command->message), "%s", message != NULL ? message : "");
+}
+
+/*
+ * Function to start an alarm that expires duration_usec from now, or,
+ * when periodic is set, every duration_usec. A message longer than 127
+ * bytes is cut short.
+ */
+command_status_t alarm_engine_start_alarm(int alarm_id, int group_id, uint64_t duration_usec, int periodic,
+                                          const char *message)
+{
+  command_t command;
+  memset(&command, 0, sizeof(command));
+  command.type = periodic ? COMMAND_START_PERIODIC_ALARM : COMMAND_START_ALARM;
+  command.alarm_id = alarm_id;
+  command.group_id = group_id;
+  command_set_text(&command, duration_usec, message);
+  if (periodic && duration_usec == 0)
+  {
+    return COMMAND_INVALID;
+  }
+  return alarm_engine_execute(&command);
+}
+
+// Function to move an alarm to a group, a new expiry duration_usec from now and a new message
+command_status_t alarm_engine_change_alarm(int alarm_id, int group_id, uint64_t duration_usec, const char *message)
+{
+  command_t command;
+  memset(&command, 0, sizeof(command));
+  command.type = COMMAND_CHANGE_ALARM;
+  command.alarm_id = alarm_id;
+  command.group_id = group_id;
+  command_set_text(&command, duration_usec, message);
+  return alarm_engine_execute(&command);
+}
+
+// Function to cancel an alarm
+command_status_t alarm_engine_cancel_alarm(int alarm_id)
+{
+  command_t command;
+  memset(&command, 0, sizeof(command));
+  command.type = COMMAND_CANCEL_ALARM;
+  command.alarm_id = alarm_id;
+  return alarm_engine_execute(&command);
+}
+
+/*
+ * Function to copy an alarm into info without its shard's mutex. The
+ * alarm may be changing meanwhile, so the copy is only good if the
+ * caller then finds the shard's sequence unchanged; until then it may
+ * be torn, and the message is copied a byte at a time with a bound
+ * instead of trusting its terminator.
+ */
+static void alarm_read(alarm_t *alarm, alarm_info_t *info)
+{
+  info->alarm_id = __atomic_load_n(&alarm->id, __ATOMIC_RELAXED);
+  info->group_id = __atomic_load_n(&alarm->group_id, __ATOMIC_RELAXED);
+  info->duration_usec = __atomic_load_n(&alarm->duration_usec, __ATOMIC_RELAXED);
+  info->period_usec = __atomic_load_n(&alarm->period_usec, __ATOMIC_RELAXED);
+  info->deadline.tv_sec = __atomic_load_n(&alarm->deadline.tv_sec, __ATOMIC_RELAXED);
+  info->deadline.tv_nsec = __atomic_load_n(&alarm->deadline.tv_nsec, __ATOMIC_RELAXED);
+
+  const message_t *message = __atomic_load_n(&alarm->message, __ATOMIC_RELAXED);
+  size_t length = 0;
+  char c;
+  while (message != NULL && length < sizeof(info->message) - 1 &&
+         (c = __atomic_load_n(&message->text[length], __ATOMIC_RELAXED)) != '\0')
+  {
+    info->message[length++] = c;
+  }
+  info->message[length] = '\0';
+}
+
+/*
+ * Function to look up an alarm. Returns 1 and fills in info when an
+ * alarm has the id, 0 otherwise. Changes still waiting for the monitor
+ * are not reflected.
+ *
+ * LOCKING PROTOCOL:
+ *
+ * None: the alarm is found with a lock-free index lookup and copied
+ * inside a read of its shard's sequence, so a query never holds up a
+ * monitor worker or a command. The alarm must still be in the index
+ * once the read has begun, since from then on its removal, or a move
+ * to another shard, changes the sequence; the read is retried if the
+ * sequence changed or the copy names another shard.
+ */
+int alarm_engine_query(int alarm_id, alarm_info_t *info)
+{
+  while (1)
+  {
+    index_entry_t *entry = alarm_index_lookup_lockless(&alarm_id_index, alarm_id);
+    if (entry == NULL)
+    {
+      return 0;
+    }
+    alarm_t *alarm = container_of(entry, alarm_t, index_entry);
+    alarm_shard_t *shard = group_shard(__atomic_load_n(&alarm->group_id, __ATOMIC_RELAXED));
+
+    seqcount_t sequence = seqcount_read_begin(&shard->sequence);
+    if (alarm_index_lookup_lockless(&alarm_id_index, alarm_id) == entry)
+    {
+      alarm_read(alarm, info);
+      if (!seqcount_read_retry(&shard->sequence, sequence) && info->alarm_id == alarm_id &&
+          group_shard(info->group_id) == shard)
+      {
+        return 1;
+      }
+    }
+  }
+}
+
+/*
+ * Function to list the alarms of a group. Fills in up to max entries
+ * of infos and returns the number of alarms in the group, which may be
+ * more than max. Changes still waiting for the monitor are not
+ * reflected.
+ *
+ * LOCKING PROTOCOL:
+ *
+ * None: the group table and the group's alarm list are walked inside
+ * a read of the shard's sequence, and the walk retried if the sequence
+ * changed. A torn walk can loop, so it is cut short after more steps
+ * than an intact one could take.
+ */
+size_t alarm_engine_list_group(int group_id, alarm_info_t *infos, size_t max)
+{
+  alarm_shard_t *shard = group_shard(group_id);
+
+  while (1)
+  {
+    seqcount_t sequence = seqcount_read_begin(&shard->sequence);
+    size_t mask = __atomic_load_n(&shard->group_mask, __ATOMIC_ACQUIRE);
+    alarm_group_t **groups = __atomic_load_n(&shard->groups, __ATOMIC_ACQUIRE);
+    size_t limit = alarm_index_count(&alarm_id_index) + __atomic_load_n(&shard->group_count, __ATOMIC_RELAXED) +
+                   ALARM_INDEX_STRIPES;
+    size_t count = 0;
+
+    alarm_group_t *group = __atomic_load_n(&groups[((unsigned)group_id / (unsigned)shard_count) & mask],
+                                           __ATOMIC_RELAXED);
+    while (group != NULL && __atomic_load_n(&group->group_id, __ATOMIC_RELAXED) != group_id && limit-- > 0)
+    {
+      group = __atomic_load_n(&group->next, __ATOMIC_RELAXED);
+    }
+    if (group != NULL && limit > 0)
+    {
+      alarm_t *alarm = __atomic_load_n(&group->alarms, __ATOMIC_RELAXED);
+      while (alarm != NULL && limit-- > 0)
+      {
+        if (count < max)
+        {
+          alarm_read(alarm, &infos[count]);
+        }
+        count++;
+        alarm = __atomic_load_n(&alarm->next, __ATOMIC_RELAXED);
+      }
+    }
+
+    if (!seqcount_read_retry(&shard->sequence, sequence))
+    {
+      return count;
+    }
+  }
+}
+
+/*
+ * Function to count the alarms, and the groups with alarms or display
+ * threads. Each count is read without a lock and may be a moment old.
+ */
+void alarm_engine_count(size_t *alarms, size_t *groups)
+{
+  *alarms = alarm_index_count(&alarm_id_index);
+  *groups = 0;
+  for (int i = 0; i < shard_count; i++)
+  {
+    *groups += __atomic_load_n(&alarm_shards[i].group_count, __ATOMIC_RELAXED);
+  }
+}
+
+// Function to hand one query answer to answer, or to the event log when it is NULL
+static void answer_event(log_event_type_t type, int alarm_id, int group_id, time_t time, const char *message,
+                         alarm_event_fn answer, void *arg)
+{
+  if (answer == NULL)
+  {
+    log_event(type, 0, alarm_id, group_id, time, message);
+    return;
+  }
+
+  alarm_event_t event;
+  memset(&event, 0, sizeof(event));
+  event.type = type;
+  event.alarm_id = alarm_id;
+  event.group_id = group_id;
+  event.time = time;
+  if (message != NULL)
+  {
+    snprintf(event.message, sizeof(event.message), "%s", message);
+  }
+  answer(&event, arg);
+}
+
+// Function to hand the answer line for one alarm found by a query
+static void answer_alarm(const alarm_info_t *info, alarm_event_fn answer, void *arg)
+{
+  answer_event(info->period_usec != 0 ? LOG_QUERY_PERIODIC_ALARM : LOG_QUERY_ALARM, info->alarm_id, info->group_id,
+               clock_to_wall(&info->deadline), info->message, answer, arg);
+}
+
+/*
+ * Function to carry out a Query_Alarm, List_Group or Count command.
+ * The answers, one event per line as the alarm program prints them,
+ * are handed to answer, with arg, on the calling thread before it
+ * returns; with a NULL answer they go to the event log like any other
+ * event. List_Group answers with a LOG_GROUP_LISTED event and then one
+ * event per alarm.
+ */
+command_status_t alarm_engine_answer(const command_t *command, alarm_event_fn answer, void *arg)
+{
+  switch (command->type)
+  {
+  case COMMAND_QUERY_ALARM:
+  {
+    alarm_info_t info;
+    if (alarm_engine_query(command->alarm_id, &info))
+    {
+      answer_alarm(&info, answer, arg);
+    }
+    else
+    {
+      answer_event(LOG_QUERY_NOT_FOUND, command->alarm_id, 0, clock_wall_now(), NULL, answer, arg);
+    }
+    return COMMAND_ACCEPTED;
+  }
+  case COMMAND_LIST_GROUP:
+  {
+    // Most groups fit on the stack; a larger one is listed again into a buffer of its size
+    alarm_info_t stack_infos[16];
+    alarm_info_t *infos = stack_infos;
+    size_t max = 16;
+    size_t count = alarm_engine_list_group(command->group_id, infos, max);
+    while (count > max)
+    {
+      if (infos != stack_infos)
+      {
+        free(infos);
+      }
+      max = count * 2;
+      infos = malloc(max * sizeof(alarm_info_t));
+      if (infos == NULL)
+      {
+        errno_abort("Allocate group listing");
+      }
+      count = alarm_engine_list_group(command->group_id, infos, max);
+    }
+
+    answer_event(LOG_GROUP_LISTED, (int)count, command->group_id, clock_wall_now(), NULL, answer, arg);
+    for (size_t i = 0; i < count; i++)
+    {
+      answer_alarm(&infos[i], answer, arg);
+    }
+    if (infos != stack_infos)
+    {
+      free(infos);
+    }
+    return COMMAND_ACCEPTED;
+  }
+  case COMMAND_COUNT:
+  {
+    size_t alarms, groups;
+    alarm_engine_count(&alarms, &groups);
+    answer_event(LOG_ALARM_COUNT, (int)alarms, (int)groups, clock_wall_now(), NULL, answer, arg);
+    return COMMAND_ACCEPTED;
+  }
+  default:
+    return COMMAND_INVALID;
+  }
+}
+
+/*
+ * Function to have every event from now on passed to callback, with
+ * arg, instead of printed; a NULL callback prints them again. The
+ * callback runs on the event log's writer thread, one event at a time,
+ * and should return quickly: events wait for it. It may call back into
+ * a threaded engine (see alarm_engine.h). Once this returns, the
+ * previous callback is not called again.
+ */
+void alarm_engine_set_event_callback(alarm_event_fn callback, void *arg)
+{
+  event_log_set_sink(callback, arg);
+}
+
+// Sink that adds every event to event_queue, growing it when it is full
+static void queue_event(const log_record_t *record, void *arg)
+{
+  event_queue_t *queue = arg;
+
+  pthread_mutex_lock(&queue->mutex);
+  if (queue->tail - queue->head == queue->capacity)
+  {
+    size_t capacity = queue->capacity * 2;
+    alarm_event_t *events = malloc(capacity * sizeof(alarm_event_t));
+    if (events == NULL)
+    {
+      errno_abort("Grow event queue");
+    }
+    for (size_t i = queue->head; i != queue->tail; i++)
+    {
+      events[i - queue->head] = queue->events[i & (queue->capacity - 1)];
+    }
+    free(queue->events);
+    queue->events = events;
+    queue->tail -= queue->head;
+    queue->head = 0;
+    queue->capacity = capacity;
+  }
+  queue->events[queue->tail++ & (queue->capacity - 1)] = *record;
+
+  // Only the first event into an empty queue needs to make the eventfd readable
+  if (queue->tail - queue->head == 1)
+  {
+    uint64_t one = 1;
+    write(queue->event_fd, &one, sizeof(one));
+  }
+  pthread_mutex_unlock(&queue->mutex);
+}
+
+/*
+ * Function to have every event from now on queued instead of printed,
+ * for alarm_engine_read_events. Returns an eventfd that is readable
+ * while events are queued, for the caller's poll or epoll set.
+ */
+int alarm_engine_event_fd(void)
+{
+  pthread_mutex_lock(&event_queue.mutex);
+  if (event_queue.event_fd < 0)
+  {
+    event_queue.capacity = 1024;
+    event_queue.events = malloc(event_queue.capacity * sizeof(alarm_event_t));
+    event_queue.event_fd = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC);
+    if (event_queue.events == NULL || event_queue.event_fd < 0)
+    {
+      errno_abort("Create event queue");
+    }
+  }
+  pthread_mutex_unlock(&event_queue.mutex);
+
+  event_log_set_sink(queue_event, &event_queue);
+  return event_queue.event_fd;
+}
+
+/*
+ * Function to take up to max queued events, oldest first. Returns the
+ * number taken; the eventfd stops being readable once none are left.
+ */
+size_t alarm_engine_read_events(alarm_event_t *events, size_t max)
+{
+  size_t count = 0;
+
+  pthread_mutex_lock(&event_queue.mutex);
+  while (count < max && event_queue.head != event_queue.tail)
+  {
+    events[count++] = event_queue.events[event_queue.head++ & (event_queue.capacity - 1)];
+  }
+  if (count > 0 && event_queue.head == event_queue.tail)
+  {
+    uint64_t signaled;
+    read(event_queue.event_fd, &signaled, sizeof(signaled));
+  }
+  pthread_mutex_unlock(&event_queue.mutex);
+  return count;
+}
@@ -0,0 +1,101 @@
+#ifndef __alarm_engine_h
+#define __alarm_engine_h
+
+#include <stddef.h>
+#include <stdint.h>
+#include <time.h>
+#include "command.h"
+#include "event_log.h"
+
+/*
+ * The alarm engine, as a library (make libalarm.a). A program starts
+ * the engine once, then starts, changes, cancels and queries alarms
+ * through the calls below; the alarm program itself is a client that
+ * parses its input into commands and hands them to
+ * alarm_engine_execute. The library exports the calls below and no
+ * other name, so it links into a program whatever names that uses.
+ *
+ * The engine runs either on threads of its own (the monitor workers,
+ * the display cadence and the display pool), in which case any thread
+ * may call it, or on the caller's event loop. In the event-loop mode the
+ * engine owns one timerfd, returned by alarm_engine_fd; whenever it is
+ * readable, and after every batch of calls, the loop calls
+ * alarm_engine_dispatch, and every call into the engine must come from
+ * that one thread.
+ *
+ * alarm_engine_query, alarm_engine_list_group and alarm_engine_count
+ * take no lock the engine's own threads take, so a program may call
+ * them as often as it likes, from any thread of a threaded engine,
+ * without delaying an expiry.
+ *
+ * Everything the engine does is reported as an event, one per line the
+ * alarm program prints (see event_log.h for the kinds). By default the
+ * events are printed on the standard output, as the alarm program
+ * does. A program embedding the engine has them delivered instead,
+ * either to a callback or to a queue it reads when an eventfd becomes
+ * readable, and never pays for formatting them. Events come from the
+ * event log's writer thread, so a slow consumer never holds up the
+ * engine's own threads.
+ *
+ * A callback runs with no engine lock held. With the threaded engine it
+ * may call any function here, to re-arm an alarm when it is removed
+ * for instance, or replace itself with alarm_engine_set_event_callback;
+ * the events those calls report are delivered after it returns. With
+ * the event-loop engine it must not call into the engine, since the
+ * writer thread is not the loop's thread; it hands the work to the
+ * loop instead, as the eventfd delivery does.
+ */
+
+#define ALARM_SHARDS_MAX 64 // Most shards an engine may be split into
+
+// The library's API; libalarm.a is built with everything else hidden and local (see the Makefile)
+#define ALARM_API __attribute__((visibility("default")))
+
+typedef struct alarm_engine_options
+{
+  int event_loop;              // Run on the caller's event loop instead of threads of its own
+  int shards;                  // Shards the alarms are split into by group, 1 to ALARM_SHARDS_MAX
+  uint64_t cadence_slack_usec; // How far apart periodic prints may be and still share a wakeup
+  const char *store_directory; // Directory of the crash-safe store (see alarm_store.h), or NULL for none
+  int wal_sync_msec;           // Group commit interval of the store, or 0 for its default
+  int snapshot_interval;       // Seconds between snapshots of the store
+  int monitor_threads;         // Threads expiring alarms in parallel, each over its own shards, 1 to shards
+} alarm_engine_options_t;
+
+#define ALARM_ENGINE_OPTIONS_INITIALIZER {0, 16, 20000, NULL, 0, 60, 1}
+
+typedef log_record_t alarm_event_t;
+
+// Function every event is delivered to, on the event log's writer thread
+typedef void (*alarm_event_fn)(const alarm_event_t *event, void *arg);
+
+// An alarm, as alarm_engine_query and alarm_engine_list_group find it
+typedef struct alarm_info
+{
+  int alarm_id;            // Unique identifier of the alarm
+  int group_id;            // Group of the alarm
+  uint64_t duration_usec;  // Duration the alarm was last set for
+  uint64_t period_usec;    // Period of a recurring alarm, or 0
+  struct timespec deadline; // Clock time of the next expiry (see alarm_clock.h)
+  char message[128];       // Alarm message
+} alarm_info_t;
+
+ALARM_API void alarm_engine_start(const alarm_engine_options_t *options);
+ALARM_API int alarm_engine_fd(void);
+ALARM_API uint64_t alarm_engine_dispatch(void);
+ALARM_API command_status_t alarm_engine_execute(const command_t *command);
+ALARM_API command_status_t alarm_engine_start_alarm(int alarm_id, int group_id, uint64_t duration_usec, int periodic,
+                                                    const char *message);
+ALARM_API command_status_t alarm_engine_change_alarm(int alarm_id, int group_id, uint64_t duration_usec, const char *message);
+ALARM_API command_status_t alarm_engine_cancel_alarm(int alarm_id);
+ALARM_API int alarm_engine_query(int alarm_id, alarm_info_t *info);
+ALARM_API size_t alarm_engine_list_group(int group_id, alarm_info_t *infos, size_t max);
+ALARM_API void alarm_engine_count(size_t *alarms, size_t *groups);
+ALARM_API command_status_t alarm_engine_answer(const command_t *command, alarm_event_fn answer, void *arg);
+ALARM_API void alarm_engine_set_event_callback(alarm_event_fn callback, void *arg);
+ALARM_API int alarm_engine_event_fd(void);
+ALARM_API size_t alarm_engine_read_events(alarm_event_t *events, size_t max);
+ALARM_API void alarm_engine_report_stats(void (*emit)(const char *line));
+ALARM_API void alarm_engine_report_pools(void);
+
+#endif
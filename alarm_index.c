@@ -0,0 +1,248 @@
+#include <stdint.h>
+#include "errors.h"
+#include "alarm_index.h"
+
+// Spread sequential ids across buckets (Fibonacci hashing)
+static size_t alarm_index_hash(int key)
+{
+  uint64_t hash = (uint64_t)(uint32_t)key * 0x9E3779B97F4A7C15ull;
+  return (size_t)(hash >> 32);
+}
+
+// Link an entry at the head of a bucket chain
+static void alarm_index_link(index_entry_t **head, index_entry_t *entry)
+{
+  __atomic_store_n(&entry->next, *head, __ATOMIC_RELAXED);
+  if (entry->next != NULL)
+  {
+    entry->next->pprev = &entry->next;
+  }
+  entry->pprev = head;
+  __atomic_store_n(head, entry, __ATOMIC_RELAXED);
+}
+
+// Allocate a zeroed bucket array
+static index_entry_t **alarm_index_buckets(size_t count)
+{
+  index_entry_t **buckets = calloc(count, sizeof(index_entry_t *));
+  if (buckets == NULL)
+  {
+    errno_abort("Allocate index buckets");
+  }
+  return buckets;
+}
+
+// Initialize an empty index sized for roughly "capacity" alarms
+void alarm_index_init(alarm_index_t *index, size_t capacity)
+{
+  int status;
+  size_t count = ALARM_INDEX_STRIPES;
+
+  while (count * ALARM_INDEX_MAX_LOAD < capacity)
+  {
+    count <<= 1;
+  }
+
+  status = pthread_rwlock_init(&index->resize_lock, NULL);
+  if (status != 0)
+  {
+    err_abort(status, "Init rwlock");
+  }
+  for (int stripe = 0; stripe < ALARM_INDEX_STRIPES; stripe++)
+  {
+    pthread_mutex_init(&index->stripes[stripe], NULL);
+  }
+  for (int stripe = 0; stripe < ALARM_INDEX_STRIPES; stripe++)
+  {
+    index->sequences[stripe] = 0;
+  }
+  index->resize_sequence = 0;
+  index->buckets = alarm_index_buckets(count);
+  index->mask = count - 1;
+  index->count = 0;
+  index->retired = NULL;
+}
+
+// Double the bucket array once the load factor is exceeded
+static void alarm_index_grow(alarm_index_t *index)
+{
+  pthread_rwlock_wrlock(&index->resize_lock);
+
+  // Another thread may have grown the index while we waited
+  size_t old_count = index->mask + 1;
+  if (__atomic_load_n(&index->count, __ATOMIC_RELAXED) > old_count * ALARM_INDEX_MAX_LOAD)
+  {
+    size_t new_mask = old_count * 2 - 1;
+    index_entry_t **old_buckets = index->buckets;
+    index_entry_t **new_buckets = alarm_index_buckets(new_mask + 1);
+
+    seqcount_write_begin(&index->resize_sequence);
+    for (size_t bucket = 0; bucket < old_count; bucket++)
+    {
+      index_entry_t *entry = old_buckets[bucket];
+      while (entry != NULL)
+      {
+        index_entry_t *next = entry->next;
+        alarm_index_link(&new_buckets[alarm_index_hash(entry->key) & new_mask], entry);
+        entry = next;
+      }
+    }
+
+    // The array before the mask, so a lockless lookup that sees the new mask indexes the new array
+    __atomic_store_n(&index->buckets, new_buckets, __ATOMIC_RELEASE);
+    __atomic_store_n(&index->mask, new_mask, __ATOMIC_RELEASE);
+    seqcount_write_end(&index->resize_sequence);
+
+    index_retired_t *retired = malloc(sizeof(index_retired_t));
+    if (retired == NULL)
+    {
+      errno_abort("Allocate retired buckets");
+    }
+    retired->buckets = old_buckets;
+    retired->next = index->retired;
+    index->retired = retired;
+  }
+  pthread_rwlock_unlock(&index->resize_lock);
+}
+
+/*
+ * Insert an entry under "key" unless the key is already present.
+ * Returns 1 if the entry was inserted and 0 for a duplicate id, so
+ * the duplicate check and the insert are a single atomic step.
+ */
+int alarm_index_insert(alarm_index_t *index, index_entry_t *entry, int key)
+{
+  int inserted = 1;
+  size_t count = 0;
+
+  pthread_rwlock_rdlock(&index->resize_lock);
+  size_t bucket = alarm_index_hash(key) & index->mask;
+  pthread_mutex_t *stripe = &index->stripes[bucket % ALARM_INDEX_STRIPES];
+
+  pthread_mutex_lock(stripe);
+  for (index_entry_t *current = index->buckets[bucket]; current != NULL; current = current->next)
+  {
+    if (current->key == key)
+    {
+      inserted = 0;
+      break;
+    }
+  }
+  if (inserted)
+  {
+    seqcount_write_begin(&index->sequences[bucket % ALARM_INDEX_STRIPES]);
+    __atomic_store_n(&entry->key, key, __ATOMIC_RELAXED);
+    alarm_index_link(&index->buckets[bucket], entry);
+    seqcount_write_end(&index->sequences[bucket % ALARM_INDEX_STRIPES]);
+    count = __atomic_add_fetch(&index->count, 1, __ATOMIC_RELAXED);
+  }
+  pthread_mutex_unlock(stripe);
+
+  int grow = count > (index->mask + 1) * ALARM_INDEX_MAX_LOAD;
+  pthread_rwlock_unlock(&index->resize_lock);
+
+  if (grow)
+  {
+    alarm_index_grow(index);
+  }
+  return inserted;
+}
+
+// Find the entry stored under "key", or NULL if there is none
+index_entry_t *alarm_index_lookup(alarm_index_t *index, int key)
+{
+  index_entry_t *found = NULL;
+
+  pthread_rwlock_rdlock(&index->resize_lock);
+  size_t bucket = alarm_index_hash(key) & index->mask;
+  pthread_mutex_t *stripe = &index->stripes[bucket % ALARM_INDEX_STRIPES];
+
+  pthread_mutex_lock(stripe);
+  for (index_entry_t *current = index->buckets[bucket]; current != NULL; current = current->next)
+  {
+    if (current->key == key)
+    {
+      found = current;
+      break;
+    }
+  }
+  pthread_mutex_unlock(stripe);
+  pthread_rwlock_unlock(&index->resize_lock);
+
+  return found;
+}
+
+/*
+ * Find the entry stored under "key", or NULL if there is none, without
+ * taking any lock. The chain is walked speculatively and the walk
+ * retried if its stripe, or the bucket array, changed meanwhile.
+ * Entries must be type-stable (pooled), since the walk may reach one
+ * that is being removed; a walk longer than the index could be is
+ * only possible through such a change, and is cut short and retried.
+ */
+index_entry_t *alarm_index_lookup_lockless(alarm_index_t *index, int key)
+{
+  while (1)
+  {
+    seqcount_t resize = seqcount_read_begin(&index->resize_sequence);
+    size_t mask = __atomic_load_n(&index->mask, __ATOMIC_ACQUIRE);
+    index_entry_t **buckets = __atomic_load_n(&index->buckets, __ATOMIC_ACQUIRE);
+    size_t bucket = alarm_index_hash(key) & mask;
+    seqcount_t *sequence = &index->sequences[bucket % ALARM_INDEX_STRIPES];
+    seqcount_t stripe = seqcount_read_begin(sequence);
+
+    index_entry_t *found = NULL;
+    size_t limit = __atomic_load_n(&index->count, __ATOMIC_RELAXED) + ALARM_INDEX_STRIPES;
+    index_entry_t *current = __atomic_load_n(&buckets[bucket], __ATOMIC_RELAXED);
+    while (current != NULL && limit-- > 0)
+    {
+      if (__atomic_load_n(&current->key, __ATOMIC_RELAXED) == key)
+      {
+        found = current;
+        break;
+      }
+      current = __atomic_load_n(&current->next, __ATOMIC_RELAXED);
+    }
+
+    if (!seqcount_read_retry(sequence, stripe) && !seqcount_read_retry(&index->resize_sequence, resize))
+    {
+      return found;
+    }
+  }
+}
+
+// Remove an entry in O(1); returns 0 if it was not in the index
+int alarm_index_remove(alarm_index_t *index, index_entry_t *entry)
+{
+  int removed = 0;
+
+  pthread_rwlock_rdlock(&index->resize_lock);
+  size_t bucket = alarm_index_hash(entry->key) & index->mask;
+  pthread_mutex_t *stripe = &index->stripes[bucket % ALARM_INDEX_STRIPES];
+
+  pthread_mutex_lock(stripe);
+  if (entry->pprev != NULL)
+  {
+    seqcount_write_begin(&index->sequences[bucket % ALARM_INDEX_STRIPES]);
+    __atomic_store_n(entry->pprev, entry->next, __ATOMIC_RELAXED);
+    if (entry->next != NULL)
+    {
+      entry->next->pprev = entry->pprev;
+    }
+    __atomic_store_n(&entry->next, NULL, __ATOMIC_RELAXED);
+    entry->pprev = NULL;
+    seqcount_write_end(&index->sequences[bucket % ALARM_INDEX_STRIPES]);
+    __atomic_sub_fetch(&index->count, 1, __ATOMIC_RELAXED);
+    removed = 1;
+  }
+  pthread_mutex_unlock(stripe);
+  pthread_rwlock_unlock(&index->resize_lock);
+
+  return removed;
+}
+
+// Return the number of indexed entries
+size_t alarm_index_count(alarm_index_t *index)
+{
+  return __atomic_load_n(&index->count, __ATOMIC_RELAXED);
+}
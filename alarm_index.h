@@ -0,0 +1,63 @@
+#ifndef __alarm_index_h
+#define __alarm_index_h
+
+#include <pthread.h>
+#include <stddef.h>
+#include "seqcount.h"
+
+/*
+ * Concurrent hash index from alarm id to alarm. Entries are intrusive
+ * (embedded in alarm_t), so the index never allocates per alarm.
+ * Buckets are guarded by a fixed set of striped mutexes, so lookups
+ * and updates of unrelated ids proceed in parallel. The bucket array
+ * doubles when the load factor passes ALARM_INDEX_MAX_LOAD; a resize
+ * takes resize_lock for writing, every other operation holds it for
+ * reading.
+ *
+ * alarm_index_lookup_lockless takes no lock at all, for readers that
+ * must not hold up writers: each stripe's chains, and the bucket array
+ * itself, are covered by a sequence counter (see seqcount.h) that the
+ * lookup checks instead. Replaced bucket arrays are retired rather
+ * than freed, since such a lookup may still be reading one; the array
+ * only doubles, so the retired arrays together take less memory than
+ * the one in use.
+ */
+
+#define ALARM_INDEX_STRIPES 64  // Number of bucket lock stripes (power of two)
+#define ALARM_INDEX_MAX_LOAD 2  // Average chain length that triggers a resize
+
+// Intrusive index entry, embedded in the structure being indexed
+typedef struct index_entry
+{
+  int key;                    // Alarm id
+  struct index_entry *next;   // Next entry in the bucket chain
+  struct index_entry **pprev; // Link that points at this entry, so removal needs no search
+} index_entry_t;
+
+// Bucket array replaced by a resize, kept for lockless lookups still reading it
+typedef struct index_retired
+{
+  struct index_retired *next;
+  index_entry_t **buckets;
+} index_retired_t;
+
+typedef struct alarm_index
+{
+  pthread_rwlock_t resize_lock;                     // Held for writing only while the bucket array is replaced
+  pthread_mutex_t stripes[ALARM_INDEX_STRIPES];     // Locks for bucket i are stripes[i % ALARM_INDEX_STRIPES]
+  seqcount_t sequences[ALARM_INDEX_STRIPES];        // Changes to the chains of each stripe, under its lock
+  seqcount_t resize_sequence;                       // Replacements of the bucket array, under resize_lock
+  index_entry_t **buckets;                          // Bucket chain heads
+  size_t mask;                                      // Number of buckets minus one
+  size_t count;                                     // Number of entries, updated atomically
+  index_retired_t *retired;                         // Bucket arrays replaced by a resize, under resize_lock
+} alarm_index_t;
+
+void alarm_index_init(alarm_index_t *index, size_t capacity);
+int alarm_index_insert(alarm_index_t *index, index_entry_t *entry, int key);
+index_entry_t *alarm_index_lookup(alarm_index_t *index, int key);
+index_entry_t *alarm_index_lookup_lockless(alarm_index_t *index, int key);
+int alarm_index_remove(alarm_index_t *index, index_entry_t *entry);
+size_t alarm_index_count(alarm_index_t *index);
+
+#endif
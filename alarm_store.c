@@ -0,0 +1,474 @@
+#include <pthread.h>
+#include <dirent.h>
+#include <limits.h>
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include "errors.h"
+#include "alarm_store.h"
+
+#define WAL_BUFFER_RECORDS 4096           // Records per group-commit buffer
+#define SNAPSHOT_MAGIC 0x54504e534d52414cull // "LARMSNPT"
+#define SNAPSHOT_VERSION 1
+#define STORE_PATH_MAX (256 + 1 + NAME_MAX + 1) // store_directory, "/" and a directory entry's name
+
+// Header at the start of a snapshot file, followed by its records
+typedef struct snapshot_header
+{
+  uint64_t magic;       // SNAPSHOT_MAGIC
+  uint32_t version;     // SNAPSHOT_VERSION
+  uint32_t record_size; // sizeof(wal_record_t)
+  uint64_t count;       // Number of records
+  uint64_t segment;     // First WAL segment to replay after the snapshot
+} snapshot_header_t;
+
+static char store_directory[256];                              // Directory holding the snapshot and WAL segments
+static int wal_fd = -1;                                        // Current WAL segment
+static uint64_t wal_segment = 0;                               // Number of the current WAL segment
+static wal_record_t *wal_buffers[2];                           // Group-commit buffers
+static int wal_active = 0;                                     // Buffer appends go to
+static size_t wal_used = 0;                                    // Records in the active buffer
+static int wal_flushing = 0;                                   // Set while the flusher writes the other buffer
+static int wal_sync_msec = 10;                                 // Group-commit interval
+static pthread_mutex_t wal_mutex = PTHREAD_MUTEX_INITIALIZER;  // Protects everything above
+static pthread_cond_t wal_cond = PTHREAD_COND_INITIALIZER;     // Signaled when records arrive, space frees up or a flush ends
+
+// FNV-1a checksum of a record, not counting the checksum field itself
+static uint32_t record_checksum(const wal_record_t *record)
+{
+  const unsigned char *byte = (const unsigned char *)record + sizeof(record->checksum);
+  const unsigned char *end = (const unsigned char *)record + sizeof(*record);
+  uint32_t hash = 2166136261u;
+
+  while (byte < end)
+  {
+    hash = (hash ^ *byte++) * 16777619u;
+  }
+  return hash;
+}
+
+// Build the path of a file in the store directory
+static void store_path(char *path, size_t size, const char *name)
+{
+  snprintf(path, size, "%s/%s", store_directory, name);
+}
+
+static void segment_path(char *path, size_t size, uint64_t segment)
+{
+  snprintf(path, size, "%s/wal.%016llu", store_directory, (unsigned long long)segment);
+}
+
+// Make a created, renamed or deleted file's directory entry durable
+static void sync_directory(void)
+{
+  int fd = open(store_directory, O_RDONLY | O_DIRECTORY);
+  if (fd >= 0)
+  {
+    fsync(fd);
+    close(fd);
+  }
+}
+
+// Write a whole buffer, retrying on short writes
+static void write_all(int fd, const void *buffer, size_t size)
+{
+  const char *p = buffer;
+
+  while (size > 0)
+  {
+    ssize_t written = write(fd, p, size);
+    if (written < 0)
+    {
+      if (errno == EINTR)
+      {
+        continue;
+      }
+      errno_abort("Write WAL");
+    }
+    p += written;
+    size -= written;
+  }
+}
+
+// Create the WAL segment with the given number and make it current
+static void wal_open_segment(uint64_t segment)
+{
+  char path[STORE_PATH_MAX];
+
+  segment_path(path, sizeof(path), segment);
+  wal_fd = open(path, O_WRONLY | O_CREAT | O_TRUNC | O_APPEND, 0644);
+  if (wal_fd < 0)
+  {
+    errno_abort("Create WAL segment");
+  }
+  wal_segment = segment;
+  sync_directory();
+}
+
+/*
+ * Write out and sync the active buffer on the caller's thread.
+ *
+ * LOCKING PROTOCOL:
+ *
+ * The caller must hold wal_mutex. Waits for a flush in progress first,
+ * so records reach the file in order.
+ */
+static void wal_write_active(void)
+{
+  while (wal_flushing)
+  {
+    pthread_cond_wait(&wal_cond, &wal_mutex);
+  }
+  if (wal_used > 0)
+  {
+    write_all(wal_fd, wal_buffers[wal_active], wal_used * sizeof(wal_record_t));
+    wal_used = 0;
+    pthread_cond_broadcast(&wal_cond);
+  }
+  fdatasync(wal_fd);
+}
+
+/*
+ * The flusher thread's start routine. Once records arrive it waits
+ * one sync interval for more to collect, then swaps buffers and writes
+ * and syncs the full one without holding wal_mutex, so appends go on
+ * into the other buffer meanwhile.
+ */
+static void *wal_flusher_function(void *arg)
+{
+  pthread_mutex_lock(&wal_mutex);
+  while (1)
+  {
+    while (wal_used == 0)
+    {
+      pthread_cond_wait(&wal_cond, &wal_mutex);
+    }
+    if (wal_used < WAL_BUFFER_RECORDS)
+    {
+      pthread_mutex_unlock(&wal_mutex);
+      usleep(wal_sync_msec * 1000);
+      pthread_mutex_lock(&wal_mutex);
+      if (wal_used == 0)
+      {
+        continue; // A rotation or store_flush wrote them out meanwhile
+      }
+    }
+
+    wal_record_t *buffer = wal_buffers[wal_active];
+    size_t count = wal_used;
+    int fd = wal_fd;
+    wal_active ^= 1;
+    wal_used = 0;
+    wal_flushing = 1;
+    pthread_cond_broadcast(&wal_cond); // Appenders waiting for space can go on
+    pthread_mutex_unlock(&wal_mutex);
+
+    write_all(fd, buffer, count * sizeof(wal_record_t));
+    fdatasync(fd);
+
+    pthread_mutex_lock(&wal_mutex);
+    wal_flushing = 0;
+    pthread_cond_broadcast(&wal_cond);
+  }
+  return NULL;
+}
+
+/*
+ * Replay the valid records of one WAL segment. Returns the number of
+ * records replayed; a missing segment has none.
+ */
+static size_t replay_segment(uint64_t segment, store_replay_fn replay, void *arg)
+{
+  char path[STORE_PATH_MAX];
+  struct stat status;
+  size_t replayed = 0;
+
+  segment_path(path, sizeof(path), segment);
+  int fd = open(path, O_RDONLY);
+  if (fd < 0)
+  {
+    return 0;
+  }
+  if (fstat(fd, &status) == 0 && status.st_size >= (off_t)sizeof(wal_record_t))
+  {
+    void *mapping = mmap(NULL, status.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+    if (mapping == MAP_FAILED)
+    {
+      errno_abort("Map WAL segment");
+    }
+    madvise(mapping, status.st_size, MADV_SEQUENTIAL);
+
+    // A torn or corrupt record marks the end of what was written before a crash
+    const wal_record_t *records = mapping;
+    size_t count = status.st_size / sizeof(wal_record_t);
+    while (replayed < count && records[replayed].checksum == record_checksum(&records[replayed]))
+    {
+      replay(&records[replayed], arg);
+      replayed++;
+    }
+    munmap(mapping, status.st_size);
+  }
+  close(fd);
+  return replayed;
+}
+
+/*
+ * Replay the snapshot, if there is one, through replay. Returns the
+ * first WAL segment to replay after it, or 0 without a snapshot.
+ */
+static uint64_t replay_snapshot(store_replay_fn replay, void *arg, size_t *replayed)
+{
+  char path[STORE_PATH_MAX];
+  struct stat status;
+
+  store_path(path, sizeof(path), "snapshot");
+  int fd = open(path, O_RDONLY);
+  if (fd < 0)
+  {
+    return 0;
+  }
+  if (fstat(fd, &status) < 0 || status.st_size < (off_t)sizeof(snapshot_header_t))
+  {
+    fprintf(stderr, "Snapshot %s is truncated\n", path);
+    exit(1);
+  }
+
+  void *mapping = mmap(NULL, status.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+  if (mapping == MAP_FAILED)
+  {
+    errno_abort("Map snapshot");
+  }
+  madvise(mapping, status.st_size, MADV_SEQUENTIAL);
+  close(fd);
+
+  // The snapshot was synced before it was renamed into place, so any damage is fatal
+  const snapshot_header_t *header = mapping;
+  const wal_record_t *records = (const wal_record_t *)(header + 1);
+  if (header->magic != SNAPSHOT_MAGIC || header->version != SNAPSHOT_VERSION ||
+      header->record_size != sizeof(wal_record_t) ||
+      (off_t)(sizeof(*header) + header->count * sizeof(wal_record_t)) != status.st_size)
+  {
+    fprintf(stderr, "Snapshot %s is not a valid snapshot\n", path);
+    exit(1);
+  }
+  for (uint64_t i = 0; i < header->count; i++)
+  {
+    if (records[i].checksum != record_checksum(&records[i]))
+    {
+      fprintf(stderr, "Snapshot %s is corrupt at record %llu\n", path, (unsigned long long)i);
+      exit(1);
+    }
+    replay(&records[i], arg);
+  }
+  *replayed += header->count;
+
+  uint64_t segment = header->segment;
+  munmap(mapping, status.st_size);
+  return segment;
+}
+
+// Delete the WAL segments before the given one, and a leftover temporary snapshot
+static void delete_old_segments(uint64_t before)
+{
+  DIR *directory = opendir(store_directory);
+  struct dirent *entry;
+  char path[STORE_PATH_MAX];
+
+  if (directory == NULL)
+  {
+    return;
+  }
+  while ((entry = readdir(directory)) != NULL)
+  {
+    unsigned long long segment;
+    if (sscanf(entry->d_name, "wal.%llu", &segment) == 1 && segment < before)
+    {
+      store_path(path, sizeof(path), entry->d_name);
+      unlink(path);
+    }
+  }
+  closedir(directory);
+  sync_directory();
+}
+
+/*
+ * Open the store in the given directory, creating it if needed, and
+ * recover its contents: every snapshot record and then every WAL
+ * record written after the snapshot is passed to replay, in order.
+ * Then start a new WAL segment and the flusher thread. Returns the
+ * number of records replayed.
+ */
+size_t store_open(const char *directory, int sync_msec, store_replay_fn replay, void *arg)
+{
+  size_t replayed = 0;
+  unsigned long long first = 0, last = 0;
+
+  snprintf(store_directory, sizeof(store_directory), "%s", directory);
+  if (mkdir(store_directory, 0755) < 0 && errno != EEXIST)
+  {
+    errno_abort("Create store directory");
+  }
+  if (sync_msec > 0)
+  {
+    wal_sync_msec = sync_msec;
+  }
+
+  // Find the range of WAL segments present
+  DIR *dir = opendir(store_directory);
+  struct dirent *entry;
+  if (dir == NULL)
+  {
+    errno_abort("Open store directory");
+  }
+  while ((entry = readdir(dir)) != NULL)
+  {
+    unsigned long long segment;
+    if (sscanf(entry->d_name, "wal.%llu", &segment) == 1)
+    {
+      if (first == 0 || segment < first)
+      {
+        first = segment;
+      }
+      if (segment > last)
+      {
+        last = segment;
+      }
+    }
+  }
+  closedir(dir);
+
+  // Replay the snapshot, then only the WAL written after it
+  uint64_t segment = replay_snapshot(replay, arg, &replayed);
+  if (segment == 0)
+  {
+    segment = first;
+  }
+  for (; segment != 0 && segment <= last; segment++)
+  {
+    replayed += replay_segment(segment, replay, arg);
+  }
+
+  wal_buffers[0] = malloc(WAL_BUFFER_RECORDS * sizeof(wal_record_t));
+  wal_buffers[1] = malloc(WAL_BUFFER_RECORDS * sizeof(wal_record_t));
+  if (wal_buffers[0] == NULL || wal_buffers[1] == NULL)
+  {
+    errno_abort("Allocate WAL buffers");
+  }
+  wal_open_segment(last + 1);
+
+  pthread_t flusher;
+  int status = pthread_create(&flusher, NULL, wal_flusher_function, NULL);
+  if (status != 0)
+  {
+    err_abort(status, "Create WAL flusher");
+  }
+  pthread_detach(flusher);
+  atexit(store_flush);
+
+  return replayed;
+}
+
+/*
+ * Append a record to the log; fills in its checksum. If both buffers
+ * are full the caller waits for the flusher.
+ */
+void store_append(wal_record_t *record)
+{
+  record->checksum = record_checksum(record);
+
+  pthread_mutex_lock(&wal_mutex);
+  while (wal_used == WAL_BUFFER_RECORDS)
+  {
+    pthread_cond_broadcast(&wal_cond); // Make sure the flusher is not still waiting for records
+    pthread_cond_wait(&wal_cond, &wal_mutex);
+  }
+  wal_buffers[wal_active][wal_used++] = *record;
+  if (wal_used == 1 || wal_used == WAL_BUFFER_RECORDS)
+  {
+    pthread_cond_broadcast(&wal_cond);
+  }
+  pthread_mutex_unlock(&wal_mutex);
+}
+
+/*
+ * Start a snapshot of count records: finish the current WAL segment,
+ * start the next one, and map a temporary snapshot file whose records
+ * the caller fills in before calling store_snapshot_commit. The
+ * caller must hold every lock that orders store_append calls, and
+ * may release them once the records are filled in.
+ */
+void store_snapshot_begin(store_snapshot_t *snapshot, size_t count)
+{
+  char path[STORE_PATH_MAX];
+
+  pthread_mutex_lock(&wal_mutex);
+  wal_write_active();
+  close(wal_fd);
+  wal_open_segment(wal_segment + 1);
+  snapshot->segment = wal_segment;
+  pthread_mutex_unlock(&wal_mutex);
+
+  store_path(path, sizeof(path), "snapshot.tmp");
+  int fd = open(path, O_RDWR | O_CREAT | O_TRUNC, 0644);
+  if (fd < 0)
+  {
+    errno_abort("Create snapshot");
+  }
+  snapshot->count = count;
+  snapshot->size = sizeof(snapshot_header_t) + count * sizeof(wal_record_t);
+  if (ftruncate(fd, snapshot->size) < 0)
+  {
+    errno_abort("Size snapshot");
+  }
+  snapshot->mapping = mmap(NULL, snapshot->size, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+  if (snapshot->mapping == MAP_FAILED)
+  {
+    errno_abort("Map snapshot");
+  }
+  close(fd);
+  snapshot->records = (wal_record_t *)((snapshot_header_t *)snapshot->mapping + 1);
+}
+
+/*
+ * Finish a snapshot: checksum and sync it, rename it into place and
+ * delete the WAL segments it covers.
+ */
+void store_snapshot_commit(store_snapshot_t *snapshot)
+{
+  char path[STORE_PATH_MAX], temporary[STORE_PATH_MAX];
+  snapshot_header_t *header = snapshot->mapping;
+
+  for (size_t i = 0; i < snapshot->count; i++)
+  {
+    snapshot->records[i].type = WAL_START;
+    snapshot->records[i].checksum = record_checksum(&snapshot->records[i]);
+  }
+  header->magic = SNAPSHOT_MAGIC;
+  header->version = SNAPSHOT_VERSION;
+  header->record_size = sizeof(wal_record_t);
+  header->count = snapshot->count;
+  header->segment = snapshot->segment;
+
+  if (msync(snapshot->mapping, snapshot->size, MS_SYNC) < 0)
+  {
+    errno_abort("Sync snapshot");
+  }
+  munmap(snapshot->mapping, snapshot->size);
+
+  store_path(temporary, sizeof(temporary), "snapshot.tmp");
+  store_path(path, sizeof(path), "snapshot");
+  if (rename(temporary, path) < 0)
+  {
+    errno_abort("Install snapshot");
+  }
+  sync_directory();
+  delete_old_segments(snapshot->segment);
+}
+
+// Write out and sync every record appended so far; registered with atexit
+void store_flush(void)
+{
+  pthread_mutex_lock(&wal_mutex);
+  wal_write_active();
+  pthread_mutex_unlock(&wal_mutex);
+}
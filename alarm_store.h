@@ -0,0 +1,79 @@
+#ifndef __alarm_store_h
+#define __alarm_store_h
+
+#include <stddef.h>
+#include <stdint.h>
+
+/*
+ * Crash-safe storage of the alarm table: an append-only write-ahead
+ * log of binary records plus periodic snapshots.
+ *
+ * Records are appended to an in-memory buffer. A flusher thread
+ * writes the buffer out and calls fdatasync at most once per sync
+ * interval (group commit), so a burst of commands costs one sync, not
+ * one per command. A record is durable once the flush that follows
+ * it completes, so a crash loses at most the last sync interval.
+ *
+ * A snapshot is a file of records holding every live alarm, written
+ * through a memory mapping and renamed into place once synced. Taking
+ * one starts a new WAL segment; the snapshot names that segment, and
+ * older segments are deleted once the snapshot is in place. Recovery
+ * maps the snapshot and replays only the segments written after it.
+ * A record that is cut short or fails its checksum ends the replay of
+ * its segment.
+ *
+ * Deadlines are stored as wall-clock times, since monotonic clock
+ * values do not survive a reboot.
+ *
+ * LOCKING PROTOCOL:
+ *
+ * store_append is safe to call from any thread. The caller must
+ * append the records about one alarm under a lock that also orders
+ * the changes to it (the engine uses the mutex of the alarm's shard),
+ * so the log matches the order of those changes. store_snapshot_begin
+ * must be called with every such lock held, so a snapshot lines up
+ * exactly with a WAL segment boundary.
+ */
+
+typedef enum wal_record_type
+{
+  WAL_START = 1, // Alarm started; also the type of every snapshot record
+  WAL_CHANGE,    // Change_Alarm applied to an alarm
+  WAL_EXPIRE,    // Alarm expired and was removed
+  WAL_CANCEL     // Cancel_Alarm removed the alarm
+} wal_record_type_t;
+
+#define WAL_FLAG_PERIODIC 0x1 // The alarm recurs every duration_usec
+
+// One WAL or snapshot record
+typedef struct wal_record
+{
+  uint32_t checksum;      // FNV-1a of the rest of the record
+  uint16_t type;          // wal_record_type_t
+  uint16_t flags;         // WAL_FLAG_* bits
+  int32_t alarm_id;       // Alarm the record is about
+  int32_t group_id;       // Group of the alarm
+  int64_t deadline_nsec;  // Wall-clock deadline, in nanoseconds since the epoch
+  uint64_t duration_usec; // Duration the alarm was set for
+  char message[128];      // Alarm message
+} wal_record_t;
+
+typedef void (*store_replay_fn)(const wal_record_t *record, void *arg);
+
+// A snapshot being written; see store_snapshot_begin
+typedef struct store_snapshot
+{
+  wal_record_t *records; // Space for the records, to be filled by the caller
+  size_t count;          // Number of records to fill
+  void *mapping;         // Mapped file
+  size_t size;           // Size of the mapping
+  uint64_t segment;      // First WAL segment not covered by the snapshot
+} store_snapshot_t;
+
+size_t store_open(const char *directory, int sync_msec, store_replay_fn replay, void *arg);
+void store_append(wal_record_t *record);
+void store_snapshot_begin(store_snapshot_t *snapshot, size_t count);
+void store_snapshot_commit(store_snapshot_t *snapshot);
+void store_flush(void);
+
+#endif
@@ -0,0 +1,382 @@
+/*
+ * embed_bench.c
+ *
+ * Benchmark of the alarm engine embedded in-process through
+ * libalarm.a, with no text parsing, formatting or pipe in between. It
+ * starts the engine with the selected mode and event delivery, starts
+ * a number of one-shot alarms with short durations spread over a
+ * range, and waits for the removal event of every one. It reports:
+ *
+ *   - submit rate: alarm_engine_start_alarm calls per second;
+ *   - events: every event delivered, per second, from the first call
+ *     to the last removal;
+ *   - removal delay: from each alarm's deadline to its removal event
+ *     reaching the program, which includes the engine's expiry
+ *     lateness and the delivery.
+ *
+ * With "-s" every alarm is set to expire at the same instant, the
+ * longest duration after the first call, so the removal delays show
+ * how long the engine takes to drain a wave of simultaneous expiries
+ * on the given number of monitor threads ("-m").
+ *
+ * With "-d callback" events are delivered to a callback on the event
+ * log's writer thread; with "-d eventfd" they are queued and read
+ * whenever the eventfd is readable, by the thread that made the calls.
+ *
+ * With "-q rate" a thread of its own issues that many read-only
+ * queries per second for the whole run, eight alarm_engine_query
+ * calls of random ids to each alarm_engine_list_group and each
+ * alarm_engine_count, and the query rate it achieved is reported.
+ * Queries take no engine lock, so the removal delays should match a
+ * run without them. Only the threads engine may be called from a
+ * second thread.
+ *
+ * With "-a" the callback re-arms every alarm once, for the shortest
+ * duration, as soon as its removal is delivered, and the run waits for
+ * the removal of the re-armed alarms too. The callback then logs
+ * events of its own on the writer thread while the monitor keeps
+ * logging removals. Only the threads engine with callback delivery may
+ * be called from the callback.
+ *
+ * Usage: embed_bench [-e threads|epoll] [-d callback|eventfd] [-n alarms]
+ *                    [-g groups] [-r min_ms:max_ms] [-m monitor_threads] [-s]
+ *                    [-q queries_per_sec] [-a]
+ */
+#include <pthread.h>
+#include <poll.h>
+#include <stdint.h>
+#include <time.h>
+#include "errors.h"
+#include "alarm_engine.h"
+
+// Load description, from the command line
+static int event_loop = 0;
+static int use_eventfd = 0;
+static int alarm_count = 200000;
+static int group_count = 1000;
+static int min_duration_ms = 100;
+static int max_duration_ms = 2000;
+static int monitor_threads = 1;
+static int same_deadline = 0;
+static int query_rate = 0;
+static int rearm = 0;
+static int total_alarms;             // Alarms started, re-armed ones included
+
+static uint64_t *deadlines;          // Clock deadline of each alarm, by id - 1 (a re-armed alarm is id + alarm_count)
+static uint64_t *delays;             // Deadline to removal event, by id - 1
+static uint64_t events_seen = 0;     // Every event delivered, updated atomically
+static uint64_t removals_seen = 0;   // Removal events delivered, updated atomically
+static uint64_t last_removal_at = 0; // When the last removal event arrived
+static int queries_stopped = 0;      // Set to end the query thread, updated atomically
+static uint64_t queries_made = 0;    // Queries issued by the query thread
+static uint64_t queries_found = 0;   // Query_Alarm calls that found their alarm
+
+static uint64_t rng_state = 88172645463325252ull;
+
+#define USEC_PER_SEC 1000000ull
+
+// Monotonic time in microseconds, the clock the engine's deadlines are on
+static uint64_t now_usec(void)
+{
+  struct timespec now;
+  clock_gettime(CLOCK_MONOTONIC, &now);
+  return (uint64_t)now.tv_sec * USEC_PER_SEC + now.tv_nsec / 1000;
+}
+
+// xorshift64 generator, so the benchmark does not measure rand()
+static uint64_t next_random(void)
+{
+  rng_state ^= rng_state << 13;
+  rng_state ^= rng_state >> 7;
+  rng_state ^= rng_state << 17;
+  return rng_state;
+}
+
+// Account for one delivered event
+static void count_event(const alarm_event_t *event)
+{
+  __atomic_add_fetch(&events_seen, 1, __ATOMIC_RELAXED);
+  if (event->type == LOG_ALARM_REMOVED && event->alarm_id >= 1 && event->alarm_id <= total_alarms)
+  {
+    uint64_t now = now_usec();
+    uint64_t deadline = deadlines[event->alarm_id - 1];
+    delays[event->alarm_id - 1] = now > deadline ? now - deadline : 0;
+    last_removal_at = now;
+    __atomic_add_fetch(&removals_seen, 1, __ATOMIC_RELEASE);
+  }
+}
+
+// Event callback, on the event log's writer thread
+static void event_callback(const alarm_event_t *event, void *arg)
+{
+  // Re-arm a first-round alarm before its removal is counted, so the run cannot end first
+  if (rearm && event->type == LOG_ALARM_REMOVED && event->alarm_id >= 1 && event->alarm_id <= alarm_count)
+  {
+    int alarm_id = event->alarm_id + alarm_count;
+    uint64_t duration_usec = (uint64_t)min_duration_ms * 1000;
+    deadlines[alarm_id - 1] = now_usec() + duration_usec;
+    if (alarm_engine_start_alarm(alarm_id, event->group_id, duration_usec, 0, "bench") != COMMAND_ACCEPTED)
+    {
+      fprintf(stderr, "Alarm %d not accepted\n", alarm_id);
+      exit(1);
+    }
+  }
+  count_event(event);
+}
+
+// Read and count every queued event
+static void drain_events(void)
+{
+  alarm_event_t events[256];
+  size_t count;
+
+  while ((count = alarm_engine_read_events(events, 256)) > 0)
+  {
+    for (size_t i = 0; i < count; i++)
+    {
+      count_event(&events[i]);
+    }
+  }
+}
+
+/*
+ * Wait up to timeout_msec for the engine's timer or queued events, and
+ * handle what is ready: dispatch an event-loop engine, read the queue.
+ */
+static void poll_engine(int event_fd, int timeout_msec)
+{
+  struct pollfd fds[2];
+  int count = 0;
+
+  if (event_loop)
+  {
+    fds[count].fd = alarm_engine_fd();
+    fds[count++].events = POLLIN;
+  }
+  if (event_fd >= 0)
+  {
+    fds[count].fd = event_fd;
+    fds[count++].events = POLLIN;
+  }
+  if (count == 0)
+  {
+    struct timespec pause = {0, timeout_msec * 1000000l};
+    nanosleep(&pause, NULL);
+    return;
+  }
+  poll(fds, count, timeout_msec);
+  if (event_loop)
+  {
+    alarm_engine_dispatch();
+  }
+  if (event_fd >= 0)
+  {
+    drain_events();
+  }
+}
+
+/*
+ * Query thread: issue query_rate queries per second, a millisecond's
+ * share at a time, until stopped. It has its own generator, since
+ * next_random is used by the main thread.
+ */
+static void *query_thread(void *arg)
+{
+  uint64_t state = 2463534242ull;
+  alarm_info_t infos[64];
+  uint64_t start = now_usec();
+  uint64_t tick = 0;
+
+  while (!__atomic_load_n(&queries_stopped, __ATOMIC_RELAXED))
+  {
+    tick++;
+    uint64_t due = (uint64_t)query_rate * tick / 1000;
+    while (queries_made < due)
+    {
+      state ^= state << 13;
+      state ^= state >> 7;
+      state ^= state << 17;
+      switch (queries_made++ % 10)
+      {
+      case 8:
+        alarm_engine_list_group((int)(state % group_count) + 1, infos, 64);
+        break;
+      case 9:
+      {
+        size_t alarms, groups;
+        alarm_engine_count(&alarms, &groups);
+        break;
+      }
+      default:
+        queries_found += alarm_engine_query((int)(state % alarm_count) + 1, infos);
+        break;
+      }
+    }
+    uint64_t wake = start + tick * 1000;
+    uint64_t now = now_usec();
+    if (wake > now)
+    {
+      struct timespec pause = {0, (long)(wake - now) * 1000};
+      nanosleep(&pause, NULL);
+    }
+  }
+  return NULL;
+}
+
+static int compare_u64(const void *a, const void *b)
+{
+  uint64_t x = *(const uint64_t *)a, y = *(const uint64_t *)b;
+  return x < y ? -1 : x > y;
+}
+
+static void usage(const char *program)
+{
+  fprintf(stderr, "Usage: %s [-e threads|epoll] [-d callback|eventfd] [-n alarms]\n"
+                  "          [-g groups] [-r min_ms:max_ms] [-m monitor_threads] [-s] [-q queries_per_sec] [-a]\n",
+          program);
+  exit(1);
+}
+
+int main(int argc, char *argv[])
+{
+  int option;
+
+  while ((option = getopt(argc, argv, "e:d:n:g:r:m:sq:a")) != -1)
+  {
+    switch (option)
+    {
+    case 'e': event_loop = strcmp(optarg, "epoll") == 0; break;
+    case 'd': use_eventfd = strcmp(optarg, "eventfd") == 0; break;
+    case 'n': alarm_count = atoi(optarg); break;
+    case 'g': group_count = atoi(optarg); break;
+    case 'r':
+      if (sscanf(optarg, "%d:%d", &min_duration_ms, &max_duration_ms) != 2)
+      {
+        usage(argv[0]);
+      }
+      break;
+    case 'm': monitor_threads = atoi(optarg); break;
+    case 's': same_deadline = 1; break;
+    case 'q': query_rate = atoi(optarg); break;
+    case 'a': rearm = 1; break;
+    default: usage(argv[0]);
+    }
+  }
+  if (alarm_count < 1 || group_count < 1 || min_duration_ms < 1 || max_duration_ms < min_duration_ms ||
+      query_rate < 0 || (query_rate > 0 && event_loop) || (rearm && (event_loop || use_eventfd)))
+  {
+    usage(argv[0]);
+  }
+  total_alarms = rearm ? alarm_count * 2 : alarm_count;
+
+  deadlines = calloc(total_alarms, sizeof(uint64_t));
+  delays = calloc(total_alarms, sizeof(uint64_t));
+  if (deadlines == NULL || delays == NULL)
+  {
+    errno_abort("Allocate alarms");
+  }
+
+  alarm_engine_options_t options = ALARM_ENGINE_OPTIONS_INITIALIZER;
+  options.event_loop = event_loop;
+  options.monitor_threads = monitor_threads;
+  alarm_engine_start(&options);
+  int event_fd = -1;
+  if (use_eventfd)
+  {
+    event_fd = alarm_engine_event_fd();
+  }
+  else
+  {
+    alarm_engine_set_event_callback(event_callback, NULL);
+  }
+
+  pthread_t query_thread_id;
+  if (query_rate > 0)
+  {
+    int status = pthread_create(&query_thread_id, NULL, query_thread, NULL);
+    if (status != 0)
+    {
+      err_abort(status, "Create query thread");
+    }
+  }
+
+  // Start every alarm, handling events between batches as an embedding event loop would
+  uint64_t start = now_usec();
+  uint64_t wave = start + (uint64_t)max_duration_ms * 1000;
+  for (int i = 0; i < alarm_count; i++)
+  {
+    uint64_t now = now_usec();
+    uint64_t duration_usec = (uint64_t)(min_duration_ms + next_random() % (max_duration_ms - min_duration_ms + 1)) * 1000;
+    if (same_deadline)
+    {
+      if (now >= wave)
+      {
+        fprintf(stderr, "Alarm %d could not be started before the wave; raise the duration\n", i + 1);
+        return 1;
+      }
+      duration_usec = wave - now;
+    }
+    deadlines[i] = now + duration_usec;
+    if (alarm_engine_start_alarm(i + 1, (int)(next_random() % group_count) + 1, duration_usec, 0, "bench") !=
+        COMMAND_ACCEPTED)
+    {
+      fprintf(stderr, "Alarm %d not accepted\n", i + 1);
+      return 1;
+    }
+    if (i % 256 == 255)
+    {
+      poll_engine(event_fd, 0);
+    }
+  }
+  uint64_t submitted = now_usec();
+
+  // Wait for every removal, giving up well after the last deadline
+  uint64_t give_up = submitted + (uint64_t)(max_duration_ms + (rearm ? min_duration_ms : 0)) * 1000 + 10 * USEC_PER_SEC;
+  while (__atomic_load_n(&removals_seen, __ATOMIC_ACQUIRE) < (uint64_t)total_alarms && now_usec() < give_up)
+  {
+    poll_engine(event_fd, 10);
+  }
+  uint64_t removals = __atomic_load_n(&removals_seen, __ATOMIC_ACQUIRE);
+  uint64_t finished = now_usec();
+  if (query_rate > 0)
+  {
+    __atomic_store_n(&queries_stopped, 1, __ATOMIC_RELAXED);
+    pthread_join(query_thread_id, NULL);
+  }
+  if (removals < (uint64_t)total_alarms)
+  {
+    fprintf(stderr, "Only %llu of %d removals were delivered\n", (unsigned long long)removals, total_alarms);
+    return 1;
+  }
+
+  qsort(delays, total_alarms, sizeof(uint64_t), compare_u64);
+  if (same_deadline)
+  {
+    printf("%s engine, %d monitor threads, %s delivery, %d alarms over %d groups, all due at %dms\n",
+           event_loop ? "epoll" : "threads", event_loop ? 1 : monitor_threads, use_eventfd ? "eventfd" : "callback",
+           alarm_count, group_count, max_duration_ms);
+  }
+  else
+  {
+    printf("%s engine, %d monitor threads, %s delivery, %d alarms over %d groups, durations %d-%dms\n",
+           event_loop ? "epoll" : "threads", event_loop ? 1 : monitor_threads, use_eventfd ? "eventfd" : "callback",
+           alarm_count, group_count, min_duration_ms, max_duration_ms);
+  }
+  if (rearm)
+  {
+    printf("  every alarm re-armed from the callback for %dms\n", min_duration_ms);
+  }
+  printf("  submit rate      %12.0f calls/sec\n", alarm_count * (double)USEC_PER_SEC / (submitted - start));
+  printf("  events           %12.0f events/sec (%llu events)\n",
+         __atomic_load_n(&events_seen, __ATOMIC_RELAXED) * (double)USEC_PER_SEC / (last_removal_at - start),
+         (unsigned long long)__atomic_load_n(&events_seen, __ATOMIC_RELAXED));
+  printf("  removal delay    p50 %8llu  p99 %8llu  max %8llu us\n", (unsigned long long)delays[total_alarms / 2],
+         (unsigned long long)delays[(size_t)(total_alarms * 0.99)], (unsigned long long)delays[total_alarms - 1]);
+  if (query_rate > 0)
+  {
+    printf("  queries          %12.0f queries/sec (%llu queries, %llu alarms found)\n",
+           queries_made * (double)USEC_PER_SEC / (finished - start), (unsigned long long)queries_made,
+           (unsigned long long)queries_found);
+  }
+  return 0;
+}
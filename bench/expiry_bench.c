@@ -0,0 +1,265 @@
+/*
+ * expiry_bench.c
+ *
+ * Measures the monitor's expiry path for two layouts of the alarm
+ * structure: the wide layout, 256 bytes with the message inline and
+ * the wheel entry straddling a cache line, and the split layout
+ * New_Alarm_Cond.c uses, two cache lines with the wheel entry, ids and
+ * deadline in the first and an interned message. For each
+ * layout the population is armed with deadlines spread over ten
+ * seconds, then the wheel is advanced a millisecond at a time and
+ * every alarm is expired the way monitor_expire_alarms does it: read
+ * its ids and deadline, copy its message as log_event does, and take
+ * it out of the alarm list, the wheel and the id index.
+ *
+ * Usage: expiry_bench [alarms] [distinct_messages]
+ */
+#include <stdint.h>
+#include <time.h>
+#include "errors.h"
+#include "alarm_index.h"
+#include "timing_wheel.h"
+#include "message_table.h"
+
+#define SPAN_USEC 10000000ull // Deadlines are spread over this many ticks
+#define STEP_USEC 1000        // Ticks per wheel advance
+
+// The alarm layout before the hot/cold split
+typedef struct wide_alarm
+{
+  int id;
+  int group_id;
+  uint64_t duration_usec;
+  uint64_t period_usec;
+  struct timespec deadline;
+  char message[128];
+  void *display_thread;
+  void *queue_node;
+  timer_entry_t timer;
+  index_entry_t index_entry;
+  struct wide_alarm *prev;
+  struct wide_alarm *next;
+} wide_alarm_t;
+
+// The alarm layout of New_Alarm_Cond.c
+typedef struct split_alarm
+{
+  timer_entry_t timer;
+  struct timespec deadline;
+  uint64_t period_usec;
+  int id;
+  int group_id;
+  const message_t *message;
+  uint64_t duration_usec;
+  void *queue_node;
+  index_entry_t index_entry;
+  struct split_alarm *prev;
+  struct split_alarm *next;
+} __attribute__((aligned(64))) split_alarm_t;
+
+static uint64_t rng_state = 88172645463325252ull;
+
+// xorshift64 generator, so the benchmark does not measure rand()
+static uint64_t next_random(void)
+{
+  rng_state ^= rng_state << 13;
+  rng_state ^= rng_state >> 7;
+  rng_state ^= rng_state << 17;
+  return rng_state;
+}
+
+static double elapsed_seconds(struct timespec *start, struct timespec *end)
+{
+  return (end->tv_sec - start->tv_sec) + (end->tv_nsec - start->tv_nsec) / 1e9;
+}
+
+static void *allocate(size_t size)
+{
+  void *memory = aligned_alloc(64, (size + 63) & ~(size_t)63);
+  if (memory == NULL)
+  {
+    errno_abort("Allocate alarms");
+  }
+  return memory;
+}
+
+static void report(const char *layout, size_t size, size_t count, double seconds, uint64_t checksum)
+{
+  printf("%-6s layout (%3zu bytes/alarm): %10zu alarms expired in %6.3f s, %6.1f ns/alarm (checksum %llu)\n",
+         layout, size, count, seconds, seconds * 1e9 / count, (unsigned long long)checksum);
+}
+
+static void run_wide(size_t count, int messages)
+{
+  static timing_wheel_t wheel;
+  alarm_index_t index;
+  wide_alarm_t *alarms = allocate(count * sizeof(wide_alarm_t));
+  wide_alarm_t *list = NULL;
+  char line[128];
+  uint64_t checksum = 0;
+  size_t expired = 0;
+  struct timespec start, end;
+
+  timing_wheel_init(&wheel, 0);
+  alarm_index_init(&index, 1024);
+  rng_state = 88172645463325252ull;
+  for (size_t i = 0; i < count; i++)
+  {
+    wide_alarm_t *alarm = &alarms[i];
+    uint64_t expires = 1 + next_random() % SPAN_USEC;
+    alarm->id = (int)i;
+    alarm->group_id = (int)(i % 1000);
+    alarm->period_usec = 0;
+    alarm->deadline.tv_sec = expires / 1000000;
+    alarm->deadline.tv_nsec = expires % 1000000 * 1000;
+    snprintf(alarm->message, sizeof(alarm->message), "message %d", (int)(i % messages));
+    alarm->prev = NULL;
+    alarm->next = list;
+    if (list != NULL)
+    {
+      list->prev = alarm;
+    }
+    list = alarm;
+    timer_entry_init(&alarm->timer);
+    timing_wheel_add(&wheel, &alarm->timer, expires);
+    alarm_index_insert(&index, &alarm->index_entry, alarm->id);
+  }
+
+  clock_gettime(CLOCK_MONOTONIC, &start);
+  for (uint64_t now = STEP_USEC; expired < count; now += STEP_USEC)
+  {
+    timer_entry_t due;
+    timer_list_init(&due);
+    timing_wheel_advance(&wheel, now, &due);
+    while (!timer_list_empty(&due))
+    {
+      wide_alarm_t *alarm = container_of(timer_list_pop(&due), wide_alarm_t, timer);
+      if (alarm->period_usec == 0)
+      {
+        checksum += alarm->id + alarm->group_id + alarm->deadline.tv_nsec;
+        strncpy(line, alarm->message, sizeof(line) - 1);
+        line[sizeof(line) - 1] = '\0';
+        checksum += line[8];
+        if (alarm->prev == NULL)
+        {
+          list = alarm->next;
+        }
+        else
+        {
+          alarm->prev->next = alarm->next;
+        }
+        if (alarm->next != NULL)
+        {
+          alarm->next->prev = alarm->prev;
+        }
+        timing_wheel_remove(&wheel, &alarm->timer);
+        alarm_index_remove(&index, &alarm->index_entry);
+        expired++;
+      }
+    }
+  }
+  clock_gettime(CLOCK_MONOTONIC, &end);
+
+  report("wide", sizeof(wide_alarm_t), count, elapsed_seconds(&start, &end), checksum);
+  free(alarms);
+  free(index.buckets);
+}
+
+static void run_split(size_t count, int messages)
+{
+  static timing_wheel_t wheel;
+  alarm_index_t index;
+  split_alarm_t *alarms = allocate(count * sizeof(split_alarm_t));
+  split_alarm_t *list = NULL;
+  char line[128];
+  uint64_t checksum = 0;
+  size_t expired = 0;
+  struct timespec start, end;
+
+  timing_wheel_init(&wheel, 0);
+  alarm_index_init(&index, 1024);
+  rng_state = 88172645463325252ull;
+  for (size_t i = 0; i < count; i++)
+  {
+    split_alarm_t *alarm = &alarms[i];
+    uint64_t expires = 1 + next_random() % SPAN_USEC;
+    alarm->id = (int)i;
+    alarm->group_id = (int)(i % 1000);
+    alarm->period_usec = 0;
+    alarm->deadline.tv_sec = expires / 1000000;
+    alarm->deadline.tv_nsec = expires % 1000000 * 1000;
+    snprintf(line, sizeof(line), "message %d", (int)(i % messages));
+    alarm->message = message_intern(line);
+    alarm->prev = NULL;
+    alarm->next = list;
+    if (list != NULL)
+    {
+      list->prev = alarm;
+    }
+    list = alarm;
+    timer_entry_init(&alarm->timer);
+    timing_wheel_add(&wheel, &alarm->timer, expires);
+    alarm_index_insert(&index, &alarm->index_entry, alarm->id);
+  }
+
+  clock_gettime(CLOCK_MONOTONIC, &start);
+  for (uint64_t now = STEP_USEC; expired < count; now += STEP_USEC)
+  {
+    timer_entry_t due;
+    timer_list_init(&due);
+    timing_wheel_advance(&wheel, now, &due);
+    while (!timer_list_empty(&due))
+    {
+      split_alarm_t *alarm = container_of(timer_list_pop(&due), split_alarm_t, timer);
+      if (alarm->period_usec == 0)
+      {
+        checksum += alarm->id + alarm->group_id + alarm->deadline.tv_nsec;
+        strncpy(line, alarm->message->text, sizeof(line) - 1);
+        line[sizeof(line) - 1] = '\0';
+        checksum += line[8];
+        if (alarm->prev == NULL)
+        {
+          list = alarm->next;
+        }
+        else
+        {
+          alarm->prev->next = alarm->next;
+        }
+        if (alarm->next != NULL)
+        {
+          alarm->next->prev = alarm->prev;
+        }
+        timing_wheel_remove(&wheel, &alarm->timer);
+        alarm_index_remove(&index, &alarm->index_entry);
+        expired++;
+      }
+    }
+  }
+  clock_gettime(CLOCK_MONOTONIC, &end);
+
+  report("split", sizeof(split_alarm_t), count, elapsed_seconds(&start, &end), checksum);
+
+  // The messages are released outside the timed loop, as display threads do it
+  for (size_t i = 0; i < count; i++)
+  {
+    message_release(alarms[i].message);
+  }
+  free(alarms);
+  free(index.buckets);
+}
+
+int main(int argc, char *argv[])
+{
+  size_t count = argc > 1 ? strtoul(argv[1], NULL, 10) : 10000000;
+  int messages = argc > 2 ? atoi(argv[2]) : 1000;
+
+  if (count == 0 || messages <= 0)
+  {
+    fprintf(stderr, "Usage: %s [alarms] [distinct_messages]\n", argv[0]);
+    return 1;
+  }
+  message_table_init();
+  run_wide(count, messages);
+  run_split(count, messages);
+  return 0;
+}
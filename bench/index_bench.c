@@ -0,0 +1,125 @@
+/*
+ * index_bench.c
+ *
+ * Measures the per-command cost of the id index and expiry wheel as
+ * the number of live alarms grows. For each population size the
+ * table is pre-filled, then a fixed mix of commands is timed:
+ * Start_Alarm (duplicate check + insert + arm), a rejected duplicate
+ * Start_Alarm, Change_Alarm (lookup + re-arm) and expiry (disarm +
+ * remove). With O(1) structures, commands/sec should stay flat.
+ *
+ * Usage: index_bench [max_alarms] [commands_per_size]
+ */
+#include <stdint.h>
+#include <time.h>
+#include "errors.h"
+#include "alarm_index.h"
+#include "timing_wheel.h"
+
+typedef struct bench_alarm
+{
+  int id;
+  timer_entry_t timer;
+  index_entry_t index_entry;
+} bench_alarm_t;
+
+static uint64_t rng_state = 88172645463325252ull;
+
+// xorshift64 generator, so the benchmark does not measure rand()
+static uint64_t next_random(void)
+{
+  rng_state ^= rng_state << 13;
+  rng_state ^= rng_state >> 7;
+  rng_state ^= rng_state << 17;
+  return rng_state;
+}
+
+static double elapsed_seconds(struct timespec *start, struct timespec *end)
+{
+  return (end->tv_sec - start->tv_sec) + (end->tv_nsec - start->tv_nsec) / 1e9;
+}
+
+static void run(size_t live, size_t commands)
+{
+  static timing_wheel_t wheel;
+  alarm_index_t index;
+  uint64_t now = 1000000;
+  bench_alarm_t *alarms = malloc((live + commands) * sizeof(bench_alarm_t));
+  bench_alarm_t **live_set = malloc(live * sizeof(bench_alarm_t *));
+  bench_alarm_t duplicate;
+  struct timespec start, end;
+
+  if (alarms == NULL || live_set == NULL)
+  {
+    errno_abort("Allocate alarms");
+  }
+
+  timing_wheel_init(&wheel, now);
+  alarm_index_init(&index, 1024);
+
+  // Pre-fill the population with alarms spread over the next day
+  for (size_t i = 0; i < live; i++)
+  {
+    bench_alarm_t *alarm = &alarms[i];
+    alarm->id = (int)i;
+    timer_entry_init(&alarm->timer);
+    alarm_index_insert(&index, &alarm->index_entry, alarm->id);
+    timing_wheel_add(&wheel, &alarm->timer, now + 1 + next_random() % 86400);
+    live_set[i] = alarm;
+  }
+
+  size_t next_alarm = live;
+  clock_gettime(CLOCK_MONOTONIC, &start);
+  for (size_t i = 0; i < commands; i++)
+  {
+    size_t victim = next_random() % live;
+    bench_alarm_t *alarm = live_set[victim];
+
+    switch (i & 3)
+    {
+    case 0:
+      // Start_Alarm: a new id replaces an expiring one to keep the population fixed
+      timing_wheel_remove(&wheel, &alarm->timer);
+      alarm_index_remove(&index, &alarm->index_entry);
+      alarm = &alarms[next_alarm];
+      alarm->id = (int)next_alarm++;
+      timer_entry_init(&alarm->timer);
+      if (alarm_index_insert(&index, &alarm->index_entry, alarm->id))
+      {
+        timing_wheel_add(&wheel, &alarm->timer, now + 1 + next_random() % 86400);
+      }
+      live_set[victim] = alarm;
+      break;
+    case 1:
+      // Start_Alarm with an id that is already live
+      alarm_index_insert(&index, &duplicate.index_entry, alarm->id);
+      break;
+    default:
+      // Change_Alarm: find the alarm by id and move its deadline
+      alarm = container_of(alarm_index_lookup(&index, alarm->id), bench_alarm_t, index_entry);
+      timing_wheel_add(&wheel, &alarm->timer, now + 1 + next_random() % 86400);
+      break;
+    }
+  }
+  clock_gettime(CLOCK_MONOTONIC, &end);
+
+  double seconds = elapsed_seconds(&start, &end);
+  printf("%10zu live alarms: %12.0f commands/sec (%6.1f ns/command)\n",
+         live, commands / seconds, seconds * 1e9 / commands);
+
+  free(alarms);
+  free(live_set);
+  free(index.buckets);
+}
+
+int main(int argc, char *argv[])
+{
+  size_t max_alarms = argc > 1 ? strtoul(argv[1], NULL, 10) : 10000000;
+  size_t commands = argc > 2 ? strtoul(argv[2], NULL, 10) : 2000000;
+
+  for (size_t live = 1000; live <= max_alarms; live *= 10)
+  {
+    run(live, commands);
+  }
+  return 0;
+}
@@ -0,0 +1,541 @@
+/*
+ * loadgen.c
+ *
+ * Synthetic load generator and end-to-end benchmark for the alarm
+ * engine. It starts the program with the selected engine
+ * (ALARM_ENGINE), feeds it a generated stream of Start_Alarm,
+ * Change_Alarm and Cancel_Alarm commands through a pipe and reads its
+ * output until every alarm has been removed or cancelled. It reports:
+ *
+ *   - throughput: commands per second, from the first command written
+ *     to the "Inserted" line of the last command;
+ *   - expiry lateness: for each alarm, the time its "Has Removed" line
+ *     appeared minus the time of its last "Inserted" or "Has Changed"
+ *     line plus the duration given there. Every one of those lines
+ *     takes the same path through the event log, so the output latency
+ *     cancels out as long as it stays steady. Samples are kept as
+ *     measured: a negative one, an alarm seen removed before its
+ *     deadline, means the output fell further behind at the insert than
+ *     at the removal, or a line was misattributed, so the percentiles
+ *     include them and their number is reported separately;
+ *   - display-print jitter: how far the interval between two periodic
+ *     prints of the same alarm is from the 5 second cadence;
+ *   - peak RSS (VmHWM) and peak thread count, sampled from /proc.
+ *
+ * Each alarm's message carries its duration in milliseconds, so the
+ * reader learns durations from the output alone.
+ *
+ * Usage: loadgen [-b binary] [-e threads|epoll] [-n alarms] [-r rate]
+ *                [-i sequential|shuffled] [-g groups] [-G uniform|zipf]
+ *                [-d min_ms:max_ms] [-c change_ratio] [-x cancel_ratio]
+ *                [-s seed]
+ */
+#include <pthread.h>
+#include <signal.h>
+#include <stdint.h>
+#include <sys/wait.h>
+#include <time.h>
+#include "errors.h"
+
+#define PRINT_INTERVAL_MS 5000.0 // Display cadence of the program
+
+// Growable array of samples in milliseconds
+typedef struct samples
+{
+  double *values;
+  int count;
+  int capacity;
+} samples_t;
+
+// Load description, from the command line
+static const char *binary = "./a.out";
+static const char *engine = "threads";
+static int alarm_count = 20000;        // Start_Alarm commands, one per alarm id
+static double rate = 0;                // Commands per second; 0 writes as fast as possible
+static int shuffled_ids = 0;           // Start alarms in random id order instead of 1, 2, 3...
+static int group_count = 1000;         // Groups the alarms are spread over
+static int zipf_groups = 0;            // Skew group sizes by Zipf's law instead of evenly
+static int min_duration_ms = 100;      // Shortest alarm duration
+static int max_duration_ms = 12000;    // Longest alarm duration
+static double change_ratio = 0.1;      // Change_Alarm commands per Start_Alarm command
+static double cancel_ratio = 0;        // Cancel_Alarm commands per Start_Alarm command, at most 1
+
+// Results, written by the reader thread
+static uint64_t *based_at;             // When each alarm's current duration started, indexed by id
+static int *duration_ms;               // Current duration of each alarm, indexed by id
+static uint64_t *printed_at;           // When each alarm was last printed, indexed by id
+static samples_t lateness;             // Expiry lateness samples, negative ones included
+static int early_count = 0;            // Lateness samples below zero
+static samples_t jitter;               // Display-print jitter samples
+static int commands_seen = 0;          // Commands the program acknowledged, updated atomically
+static int removed_count = 0;          // "Has Removed" and "Has Cancelled" lines read, updated atomically
+static int cancelled_count = 0;        // "Has Cancelled" lines read
+static uint64_t last_command_at;       // When the last acknowledgement was read
+
+// Process statistics, written by the sampler thread
+static long peak_rss_kb = 0;
+static int peak_threads = 0;
+static int sampling = 1;               // Cleared to stop the sampler, updated atomically
+
+static uint64_t rng_state = 88172645463325252ull;
+
+// xorshift64 generator, so runs are repeatable
+static uint64_t next_random(void)
+{
+  rng_state ^= rng_state << 13;
+  rng_state ^= rng_state >> 7;
+  rng_state ^= rng_state << 17;
+  return rng_state;
+}
+
+static uint64_t now_usec(void)
+{
+  struct timespec now;
+  clock_gettime(CLOCK_MONOTONIC, &now);
+  return (uint64_t)now.tv_sec * 1000000 + now.tv_nsec / 1000;
+}
+
+static void samples_add(samples_t *samples, double value)
+{
+  if (samples->count == samples->capacity)
+  {
+    samples->capacity = samples->capacity == 0 ? 1024 : samples->capacity * 2;
+    samples->values = realloc(samples->values, samples->capacity * sizeof(double));
+    if (samples->values == NULL)
+    {
+      errno_abort("Allocate samples");
+    }
+  }
+  samples->values[samples->count++] = value;
+}
+
+static int compare_double(const void *a, const void *b)
+{
+  double x = *(const double *)a, y = *(const double *)b;
+  return (x > y) - (x < y);
+}
+
+static double percentile(samples_t *sorted, double p)
+{
+  if (sorted->count == 0)
+  {
+    return 0;
+  }
+  return sorted->values[(int)(p * (sorted->count - 1) + 0.5)];
+}
+
+// Find "<prefix><id><suffix>" in an output line; returns the id or -1
+static int find_alarm(const char *line, const char *prefix, const char *suffix)
+{
+  int id, length = -1;
+  char format[64];
+
+  snprintf(format, sizeof(format), "%s%%d%s%%n", prefix, suffix);
+  for (const char *p = strstr(line, prefix); p != NULL; p = strstr(p + 1, prefix))
+  {
+    if (sscanf(p, format, &id, &length) == 1 && length > 0 && id > 0 && id <= alarm_count)
+    {
+      return id;
+    }
+  }
+  return -1;
+}
+
+// The duration in the message "load <ms>" that ends the line
+static int line_duration(const char *line)
+{
+  const char *last = strrchr(line, ' ');
+  return last == NULL ? 0 : atoi(last + 1);
+}
+
+static void command_seen(uint64_t now)
+{
+  last_command_at = now;
+  __atomic_add_fetch(&commands_seen, 1, __ATOMIC_RELEASE);
+}
+
+// Read the program's output and timestamp the lines we measure
+static void *reader_function(void *arg)
+{
+  FILE *output = (FILE *)arg;
+  char *line = NULL;
+  size_t size = 0;
+
+  while (getline(&line, &size, output) > 0)
+  {
+    uint64_t now = now_usec();
+    int id;
+
+    if (strstr(line, "Has Removed") != NULL && (id = find_alarm(line, "Alarm(", ") at")) > 0)
+    {
+      double late = ((double)now - (double)based_at[id]) / 1000.0 - duration_ms[id];
+      samples_add(&lateness, late);
+      if (late < 0)
+      {
+        early_count++;
+      }
+      printed_at[id] = 0;
+      __atomic_add_fetch(&removed_count, 1, __ATOMIC_RELEASE);
+    }
+    else if ((id = find_alarm(line, "Alarm (", ") Printed")) > 0)
+    {
+      if (printed_at[id] != 0)
+      {
+        double interval = ((double)now - (double)printed_at[id]) / 1000.0;
+        samples_add(&jitter, interval > PRINT_INTERVAL_MS ? interval - PRINT_INTERVAL_MS
+                                                          : PRINT_INTERVAL_MS - interval);
+      }
+      printed_at[id] = now;
+    }
+    else if (strstr(line, "Has Cancelled") != NULL && (id = find_alarm(line, "Alarm(", ") at")) > 0)
+    {
+      printed_at[id] = 0;
+      cancelled_count++;
+      __atomic_add_fetch(&removed_count, 1, __ATOMIC_RELEASE);
+    }
+    else if (strstr(line, "Has Changed") != NULL && (id = find_alarm(line, "Alarm(", ") at")) > 0)
+    {
+      based_at[id] = now;
+      duration_ms[id] = line_duration(line);
+    }
+    else if (find_alarm(line, "Change Alarm Request(", ") Inserted") > 0 ||
+             find_alarm(line, "Cancel Alarm Request(", ") Inserted") > 0)
+    {
+      command_seen(now);
+    }
+    else if ((id = find_alarm(line, "Alarm(", ") Inserted")) > 0)
+    {
+      // Lines from different threads may come out of order; a change seen first wins
+      if (based_at[id] == 0)
+      {
+        based_at[id] = now;
+        duration_ms[id] = line_duration(line);
+      }
+      command_seen(now);
+    }
+  }
+  free(line);
+  return NULL;
+}
+
+// Track the program's peak resident set size and thread count
+static void *sampler_function(void *arg)
+{
+  pid_t pid = *(pid_t *)arg;
+  char path[64], line[256];
+
+  snprintf(path, sizeof(path), "/proc/%d/status", (int)pid);
+  while (__atomic_load_n(&sampling, __ATOMIC_ACQUIRE))
+  {
+    FILE *status = fopen(path, "r");
+    if (status == NULL)
+    {
+      break;
+    }
+    while (fgets(line, sizeof(line), status) != NULL)
+    {
+      long value;
+      if (sscanf(line, "VmHWM: %ld", &value) == 1 && value > peak_rss_kb)
+      {
+        peak_rss_kb = value;
+      }
+      else if (sscanf(line, "Threads: %ld", &value) == 1 && value > peak_threads)
+      {
+        peak_threads = (int)value;
+      }
+    }
+    fclose(status);
+    usleep(10000);
+  }
+  return NULL;
+}
+
+// Start the program with its standard input and output connected to pipes
+static pid_t start_program(int *input, int *output)
+{
+  int to_child[2], from_child[2];
+
+  if (pipe(to_child) < 0 || pipe(from_child) < 0)
+  {
+    errno_abort("Create pipes");
+  }
+
+  pid_t pid = fork();
+  if (pid < 0)
+  {
+    errno_abort("Fork");
+  }
+  if (pid == 0)
+  {
+    dup2(to_child[0], STDIN_FILENO);
+    dup2(from_child[1], STDOUT_FILENO);
+    freopen("/dev/null", "w", stderr);
+    close(to_child[0]);
+    close(to_child[1]);
+    close(from_child[0]);
+    close(from_child[1]);
+    setenv("ALARM_ENGINE", engine, 1);
+    execl(binary, binary, (char *)NULL);
+    errno_abort("Exec");
+  }
+
+  close(to_child[0]);
+  close(from_child[1]);
+  *input = to_child[1];
+  *output = from_child[0];
+  return pid;
+}
+
+// Build the group picker: a cumulative distribution over the groups
+static double *group_distribution(void)
+{
+  double *cdf = malloc(group_count * sizeof(double));
+  double total = 0;
+
+  if (cdf == NULL)
+  {
+    errno_abort("Allocate groups");
+  }
+  for (int g = 0; g < group_count; g++)
+  {
+    total += zipf_groups ? 1.0 / (g + 1) : 1.0;
+    cdf[g] = total;
+  }
+  for (int g = 0; g < group_count; g++)
+  {
+    cdf[g] /= total;
+  }
+  return cdf;
+}
+
+static int pick_group(const double *cdf)
+{
+  double u = (next_random() >> 11) * (1.0 / 9007199254740992.0);
+  int low = 0, high = group_count - 1;
+
+  while (low < high)
+  {
+    int middle = (low + high) / 2;
+    if (cdf[middle] < u)
+    {
+      low = middle + 1;
+    }
+    else
+    {
+      high = middle;
+    }
+  }
+  return low + 1;
+}
+
+static int pick_duration(void)
+{
+  return min_duration_ms + (int)(next_random() % (uint64_t)(max_duration_ms - min_duration_ms + 1));
+}
+
+// Buffered command writer; with a rate limit every command is paced and sent on its own
+static char batch[4096];
+static size_t batch_used = 0;
+
+static void flush_commands(int input)
+{
+  if (batch_used > 0 && write(input, batch, batch_used) != (ssize_t)batch_used)
+  {
+    errno_abort("Write commands");
+  }
+  batch_used = 0;
+}
+
+static void send_command(int input, const char *command, long sequence, uint64_t start)
+{
+  size_t length = strlen(command);
+
+  if (rate > 0)
+  {
+    uint64_t due = start + (uint64_t)(sequence * 1e6 / rate);
+    uint64_t now = now_usec();
+    if (due > now)
+    {
+      flush_commands(input);
+      usleep(due - now);
+    }
+  }
+  if (batch_used + length > sizeof(batch))
+  {
+    flush_commands(input);
+  }
+  memcpy(batch + batch_used, command, length);
+  batch_used += length;
+  if (rate > 0)
+  {
+    flush_commands(input);
+  }
+}
+
+static void usage(const char *program)
+{
+  fprintf(stderr, "Usage: %s [-b binary] [-e threads|epoll] [-n alarms] [-r rate]\n"
+                  "          [-i sequential|shuffled] [-g groups] [-G uniform|zipf]\n"
+                  "          [-d min_ms:max_ms] [-c change_ratio] [-x cancel_ratio] [-s seed]\n",
+          program);
+  exit(1);
+}
+
+int main(int argc, char *argv[])
+{
+  int option;
+
+  while ((option = getopt(argc, argv, "b:e:n:r:i:g:G:d:c:x:s:")) != -1)
+  {
+    switch (option)
+    {
+    case 'b': binary = optarg; break;
+    case 'e': engine = optarg; break;
+    case 'n': alarm_count = atoi(optarg); break;
+    case 'r': rate = atof(optarg); break;
+    case 'i': shuffled_ids = strcmp(optarg, "shuffled") == 0; break;
+    case 'g': group_count = atoi(optarg); break;
+    case 'G': zipf_groups = strcmp(optarg, "zipf") == 0; break;
+    case 'd':
+      if (sscanf(optarg, "%d:%d", &min_duration_ms, &max_duration_ms) != 2)
+      {
+        usage(argv[0]);
+      }
+      break;
+    case 'c': change_ratio = atof(optarg); break;
+    case 'x': cancel_ratio = atof(optarg); break;
+    case 's': rng_state = strtoull(optarg, NULL, 0) | 1; break;
+    default: usage(argv[0]);
+    }
+  }
+  if (alarm_count < 1 || group_count < 1 || min_duration_ms < 1 || max_duration_ms < min_duration_ms ||
+      cancel_ratio < 0 || cancel_ratio > 1)
+  {
+    usage(argv[0]);
+  }
+
+  based_at = calloc(alarm_count + 1, sizeof(uint64_t));
+  duration_ms = calloc(alarm_count + 1, sizeof(int));
+  printed_at = calloc(alarm_count + 1, sizeof(uint64_t));
+  int *ids = malloc(alarm_count * sizeof(int));
+  if (based_at == NULL || duration_ms == NULL || printed_at == NULL || ids == NULL)
+  {
+    errno_abort("Allocate results");
+  }
+
+  // Start order of the alarm ids
+  for (int i = 0; i < alarm_count; i++)
+  {
+    ids[i] = i + 1;
+  }
+  if (shuffled_ids)
+  {
+    for (int i = alarm_count - 1; i > 0; i--)
+    {
+      int j = (int)(next_random() % (uint64_t)(i + 1));
+      int id = ids[i];
+      ids[i] = ids[j];
+      ids[j] = id;
+    }
+  }
+  double *groups = group_distribution();
+
+  signal(SIGPIPE, SIG_IGN);
+  int input, output_fd;
+  pid_t pid = start_program(&input, &output_fd);
+  FILE *output = fdopen(output_fd, "r");
+
+  pthread_t reader, sampler;
+  pthread_create(&reader, NULL, reader_function, output);
+  pthread_create(&sampler, NULL, sampler_function, &pid);
+
+  /*
+   * Interleave the changes and cancels with the starts; each targets an
+   * alarm already started and not yet cancelled. Those are kept at the
+   * front of ids, so a cancel swaps its alarm out of that range.
+   */
+  char command[128];
+  long sequence = 0;
+  double changes_due = 0, cancels_due = 0;
+  int active = 0;
+  uint64_t start = now_usec();
+  for (int i = 0; i < alarm_count; i++)
+  {
+    int ms = pick_duration();
+    int id = ids[i];
+    ids[i] = ids[active];
+    ids[active++] = id;
+    snprintf(command, sizeof(command), "Start_Alarm(%d): Group(%d) %dms load %d\n",
+             id, pick_group(groups), ms, ms);
+    send_command(input, command, sequence++, start);
+
+    for (changes_due += change_ratio; changes_due >= 1; changes_due--)
+    {
+      ms = pick_duration();
+      snprintf(command, sizeof(command), "Change_Alarm(%d): Group(%d) %dms load %d\n",
+               ids[next_random() % (uint64_t)active], pick_group(groups), ms, ms);
+      send_command(input, command, sequence++, start);
+    }
+    for (cancels_due += cancel_ratio; cancels_due >= 1 && active > 0; cancels_due--)
+    {
+      int victim = (int)(next_random() % (uint64_t)active);
+      id = ids[victim];
+      ids[victim] = ids[--active];
+      ids[active] = id;
+      snprintf(command, sizeof(command), "Cancel_Alarm(%d)\n", id);
+      send_command(input, command, sequence++, start);
+    }
+  }
+  flush_commands(input);
+
+  // Keep the input open until every alarm is gone, since the program exits at end of input
+  uint64_t give_up = now_usec() + (uint64_t)(max_duration_ms + 30000) * 1000;
+  while (__atomic_load_n(&removed_count, __ATOMIC_ACQUIRE) < alarm_count && now_usec() < give_up)
+  {
+    usleep(10000);
+  }
+  __atomic_store_n(&sampling, 0, __ATOMIC_RELEASE);
+  pthread_join(sampler, NULL);
+  close(input);
+  waitpid(pid, NULL, 0);
+  pthread_join(reader, NULL);
+
+  int acknowledged = __atomic_load_n(&commands_seen, __ATOMIC_ACQUIRE);
+  int removed = __atomic_load_n(&removed_count, __ATOMIC_ACQUIRE);
+  double seconds = (last_command_at - start) / 1e6;
+  qsort(lateness.values, lateness.count, sizeof(double), compare_double);
+  qsort(jitter.values, jitter.count, sizeof(double), compare_double);
+
+  printf("engine %s: %d alarms, %ld commands, groups %d %s, ids %s, durations %d-%d ms\n",
+         engine, alarm_count, sequence, group_count, zipf_groups ? "zipf" : "uniform",
+         shuffled_ids ? "shuffled" : "sequential", min_duration_ms, max_duration_ms);
+  printf("  throughput      %10.0f commands/sec", seconds > 0 ? acknowledged / seconds : 0);
+  if (rate > 0)
+  {
+    printf(" (offered %.0f)", rate);
+  }
+  printf("\n");
+  printf("  expiry lateness p50 %8.2f  p90 %8.2f  p99 %8.2f  p99.9 %8.2f  max %8.2f ms\n",
+         percentile(&lateness, 0.50), percentile(&lateness, 0.90), percentile(&lateness, 0.99),
+         percentile(&lateness, 0.999), percentile(&lateness, 1.0));
+  if (early_count > 0)
+  {
+    printf("  early samples   %10d of %d (min %.2f ms): output latency did not cancel out\n", early_count,
+           lateness.count, percentile(&lateness, 0.0));
+  }
+  printf("  print jitter    p50 %8.2f  p90 %8.2f  p99 %8.2f  max %8.2f ms (%d intervals)\n",
+         percentile(&jitter, 0.50), percentile(&jitter, 0.90), percentile(&jitter, 0.99),
+         percentile(&jitter, 1.0), jitter.count);
+  printf("  peak RSS        %10.1f MB\n", peak_rss_kb / 1024.0);
+  printf("  peak threads    %10d\n", peak_threads);
+  if (cancel_ratio > 0)
+  {
+    printf("  cancelled       %10d alarms\n", cancelled_count);
+  }
+  if (acknowledged < sequence || removed < alarm_count)
+  {
+    printf("  incomplete: %d of %ld commands acknowledged, %d of %d alarms removed\n",
+           acknowledged, sequence, removed, alarm_count);
+  }
+  return 0;
+}
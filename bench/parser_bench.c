@@ -0,0 +1,221 @@
+/*
+ * parser_bench.c
+ *
+ * Measures command parsing: the sscanf chain process_command used to
+ * run on every line (each fgets line copied out and tried against one
+ * format after another), against command_parse run in place on the
+ * lines of one buffer. The input is a generated mix shaped like
+ * loadgen's: mostly Start_Alarm, some Change_Alarm and Cancel_Alarm,
+ * and a few periodic and group commands. Both parsers must agree on
+ * every line before anything is timed.
+ *
+ * Usage: parser_bench [lines] [rounds]
+ */
+#include <stdint.h>
+#include <time.h>
+#include "errors.h"
+#include "alarm_clock.h"
+#include "command.h"
+
+static uint64_t rng_state = 88172645463325252ull;
+
+// xorshift64 generator, so the benchmark does not measure rand()
+static uint64_t next_random(void)
+{
+  rng_state ^= rng_state << 13;
+  rng_state ^= rng_state >> 7;
+  rng_state ^= rng_state << 17;
+  return rng_state;
+}
+
+static double elapsed_seconds(struct timespec *start, struct timespec *end)
+{
+  return (end->tv_sec - start->tv_sec) + (end->tv_nsec - start->tv_nsec) / 1e9;
+}
+
+// The parser process_command used before command_parse, on a terminated line
+static int sscanf_parse(const char *line, command_t *command)
+{
+  int end = 0;
+  int periodic = 0;
+
+  memset(command, 0, sizeof(*command));
+  if (strncmp(line, "Stats", 5) == 0 && (line[5] == '\n' || line[5] == '\0'))
+  {
+    command->type = COMMAND_STATS;
+    return 1;
+  }
+  if ((sscanf(line, "Start_Alarm(%d): Group(%d) %31s %127[^\n]", &command->alarm_id, &command->group_id,
+              command->duration, command->message) == 4 ||
+       (periodic = sscanf(line, "Start_Periodic_Alarm(%d): Group(%d) %31s %127[^\n]", &command->alarm_id,
+                          &command->group_id, command->duration, command->message) == 4)) &&
+      parse_duration(command->duration, &command->duration_usec) && (command->duration_usec > 0 || !periodic))
+  {
+    command->type = periodic ? COMMAND_START_PERIODIC_ALARM : COMMAND_START_ALARM;
+    return 1;
+  }
+  if (sscanf(line, "Change_Alarm(%d): Group(%d) %31s %127[^\n]", &command->alarm_id, &command->group_id,
+             command->duration, command->message) == 4 &&
+      parse_duration(command->duration, &command->duration_usec))
+  {
+    command->type = COMMAND_CHANGE_ALARM;
+    return 1;
+  }
+  if (sscanf(line, "Cancel_Alarm(%d)%n", &command->alarm_id, &end) == 1 && end > 0 &&
+      (line[end] == '\n' || line[end] == '\0'))
+  {
+    command->type = COMMAND_CANCEL_ALARM;
+    return 1;
+  }
+  if (sscanf(line, "Change_Group(%d): NewGroup(%d)%n", &command->group_id, &command->new_group_id, &end) == 2 &&
+      end > 0 && (line[end] == '\n' || line[end] == '\0') && command->new_group_id != command->group_id)
+  {
+    command->type = COMMAND_CHANGE_GROUP;
+    return 1;
+  }
+  if (sscanf(line, "Cancel_Group(%d)%n", &command->group_id, &end) == 1 && end > 0 &&
+      (line[end] == '\n' || line[end] == '\0'))
+  {
+    command->type = COMMAND_CANCEL_GROUP;
+    return 1;
+  }
+  if (sscanf(line, "Delay_Group(%d) +%31s%n", &command->group_id, command->duration, &end) == 2 &&
+      (line[end] == '\n' || line[end] == '\0') && parse_duration(command->duration, &command->duration_usec))
+  {
+    command->type = COMMAND_DELAY_GROUP;
+    return 1;
+  }
+  return 0;
+}
+
+// Append one generated command line to the buffer; returns its length
+static int generate_line(char *buffer, int sequence)
+{
+  uint64_t pick = next_random() % 100;
+  int id = (int)(next_random() % 1000000) + 1;
+  int group = (int)(next_random() % 1000) + 1;
+  int ms = (int)(next_random() % 12000) + 100;
+
+  if (pick < 70)
+  {
+    return sprintf(buffer, "Start_Alarm(%d): Group(%d) %dms load %d\n", sequence, group, ms, ms);
+  }
+  if (pick < 85)
+  {
+    return sprintf(buffer, "Change_Alarm(%d): Group(%d) %dms load %d\n", id, group, ms, ms);
+  }
+  if (pick < 93)
+  {
+    return sprintf(buffer, "Cancel_Alarm(%d)\n", id);
+  }
+  if (pick < 97)
+  {
+    return sprintf(buffer, "Start_Periodic_Alarm(%d): Group(%d) %d.%03d periodic load\n", sequence, group,
+                   ms / 1000, ms % 1000);
+  }
+  if (pick < 98)
+  {
+    return sprintf(buffer, "Change_Group(%d): NewGroup(%d)\n", group, group + 1);
+  }
+  if (pick < 99)
+  {
+    return sprintf(buffer, "Delay_Group(%d) +%dms\n", group, ms);
+  }
+  return sprintf(buffer, "Cancel_Group(%d)\n", group);
+}
+
+// Compare the fields a command type uses
+static int same_command(const command_t *a, const command_t *b)
+{
+  return a->type == b->type && a->alarm_id == b->alarm_id && a->group_id == b->group_id &&
+         a->new_group_id == b->new_group_id && a->duration_usec == b->duration_usec &&
+         strcmp(a->duration, b->duration) == 0 && strcmp(a->message, b->message) == 0;
+}
+
+int main(int argc, char *argv[])
+{
+  int lines = argc > 1 ? atoi(argv[1]) : 1000000;
+  int rounds = argc > 2 ? atoi(argv[2]) : 5;
+  struct timespec start, end;
+  command_t command, expected;
+  command_error_t error;
+  uint64_t checksum_sscanf = 0, checksum_parse = 0;
+
+  if (lines <= 0 || rounds <= 0)
+  {
+    fprintf(stderr, "Usage: %s [lines] [rounds]\n", argv[0]);
+    return 1;
+  }
+
+  // One buffer of lines, as a large read would leave them
+  char *buffer = malloc((size_t)lines * 96);
+  if (buffer == NULL)
+  {
+    errno_abort("Allocate lines");
+  }
+  size_t size = 0;
+  for (int i = 0; i < lines; i++)
+  {
+    size += generate_line(buffer + size, i + 1);
+  }
+
+  // Check that both parsers read every line the same way
+  for (char *line = buffer, *newline; line < buffer + size; line = newline + 1)
+  {
+    char copy[128];
+    newline = memchr(line, '\n', buffer + size - line);
+    memcpy(copy, line, newline - line + 1);
+    copy[newline - line + 1] = '\0';
+    if (!sscanf_parse(copy, &expected) || !command_parse(line, newline - line, &command, &error))
+    {
+      fprintf(stderr, "Rejected: %s", copy);
+      return 1;
+    }
+    if (!same_command(&command, &expected))
+    {
+      fprintf(stderr, "Parsers disagree on: %s", copy);
+      return 1;
+    }
+  }
+
+  // The old path: copy each line out as fgets did, then try the formats in turn
+  clock_gettime(CLOCK_MONOTONIC, &start);
+  for (int round = 0; round < rounds; round++)
+  {
+    for (char *line = buffer, *newline; line < buffer + size; line = newline + 1)
+    {
+      char copy[128];
+      newline = memchr(line, '\n', buffer + size - line);
+      memcpy(copy, line, newline - line + 1);
+      copy[newline - line + 1] = '\0';
+      sscanf_parse(copy, &command);
+      checksum_sscanf += command.type + command.alarm_id + command.duration_usec;
+    }
+  }
+  clock_gettime(CLOCK_MONOTONIC, &end);
+  double sscanf_seconds = elapsed_seconds(&start, &end);
+
+  // The new path: parse each line where it lies in the buffer
+  clock_gettime(CLOCK_MONOTONIC, &start);
+  for (int round = 0; round < rounds; round++)
+  {
+    for (char *line = buffer, *newline; line < buffer + size; line = newline + 1)
+    {
+      newline = memchr(line, '\n', buffer + size - line);
+      command_parse(line, newline - line, &command, &error);
+      checksum_parse += command.type + command.alarm_id + command.duration_usec;
+    }
+  }
+  clock_gettime(CLOCK_MONOTONIC, &end);
+  double parse_seconds = elapsed_seconds(&start, &end);
+
+  double total = (double)lines * rounds;
+  printf("%d lines x %d rounds, %.1f bytes/line\n", lines, rounds, (double)size / lines);
+  printf("  sscanf chain   %12.0f lines/sec %8.1f ns/line (checksum %llu)\n", total / sscanf_seconds,
+         sscanf_seconds * 1e9 / total, (unsigned long long)checksum_sscanf);
+  printf("  command_parse  %12.0f lines/sec %8.1f ns/line (checksum %llu)\n", total / parse_seconds,
+         parse_seconds * 1e9 / total, (unsigned long long)checksum_parse);
+  printf("  speedup        %12.1fx\n", sscanf_seconds / parse_seconds);
+  free(buffer);
+  return 0;
+}
@@ -0,0 +1,252 @@
+/*
+ * replay_bench.c
+ *
+ * Accelerated replay benchmark. It writes a synthetic command trace
+ * covering a long stretch of simulated time (a day by default):
+ * Start_Alarm and Start_Periodic_Alarm commands arriving at random at
+ * a steady average rate, with some Change_Alarm, Cancel_Alarm and
+ * group commands mixed in. It then replays the trace through the
+ * program with ALARM_TRACE_REPLAY, on the virtual clock unless a speed
+ * is given, and reports:
+ *
+ *   - how long the replay took, and how many simulated seconds that
+ *     is per second;
+ *   - how many lines the program printed, and a checksum of them with
+ *     the pthread IDs left out, which are the only thing that differs
+ *     from one run of the same binary to the next.
+ *
+ * Each replay is run the given number of times; on the virtual clock
+ * the checksums must agree, and comparing them across builds shows
+ * whether a change altered the program's behaviour on the trace.
+ *
+ * Usage: replay_bench [-b binary] [-t simulated_seconds] [-r commands_per_second]
+ *                     [-g groups] [-d min_s:max_s] [-x speed] [-n runs]
+ */
+#include <stdint.h>
+#include <sys/wait.h>
+#include <time.h>
+#include "errors.h"
+
+// Trace description, from the command line
+static const char *binary = "./bench/alarm";
+static int simulated_seconds = 86400;
+static double command_rate = 1;    // Commands per simulated second
+static int group_count = 100;
+static int min_duration = 1;       // Alarm durations, in seconds
+static int max_duration = 600;
+static const char *speed = "max";  // ALARM_REPLAY_SPEED
+static int run_count = 2;
+
+static char trace_path[64];
+
+static uint64_t rng_state = 88172645463325252ull;
+
+// xorshift64 generator, so every run of the benchmark writes the same trace
+static uint64_t next_random(void)
+{
+  rng_state ^= rng_state << 13;
+  rng_state ^= rng_state >> 7;
+  rng_state ^= rng_state << 17;
+  return rng_state;
+}
+
+static uint64_t now_usec(void)
+{
+  struct timespec now;
+  clock_gettime(CLOCK_MONOTONIC, &now);
+  return (uint64_t)now.tv_sec * 1000000ull + (uint64_t)now.tv_nsec / 1000;
+}
+
+// Write the trace; returns the number of commands in it
+static int write_trace(void)
+{
+  FILE *trace = fopen(trace_path, "w");
+  if (trace == NULL)
+  {
+    errno_abort("Create trace");
+  }
+
+  uint64_t end = (uint64_t)simulated_seconds * 1000000ull;
+  uint64_t mean_gap = (uint64_t)(1000000.0 / command_rate);
+  uint64_t time = 0;
+  int commands = 0;
+  int next_id = 1;
+
+  fprintf(trace, "start %lld\n", 1700000000000000000ll);
+  while (1)
+  {
+    // Uniform gaps around the mean, for a steady rate without long quiet spells
+    time += next_random() % (2 * mean_gap + 1);
+    if (time >= end)
+    {
+      break;
+    }
+
+    uint64_t pick = next_random() % 100;
+    int group = (int)(next_random() % group_count) + 1;
+    int duration = min_duration + (int)(next_random() % (max_duration - min_duration + 1));
+    int id = next_id > 1 ? (int)(next_random() % (next_id - 1)) + 1 : 1;
+
+    if (pick < 70 || next_id == 1)
+    {
+      fprintf(trace, "%llu Start_Alarm(%d): Group(%d) %d alarm %d\n", (unsigned long long)time, next_id, group,
+              duration, next_id);
+      next_id++;
+    }
+    else if (pick < 75)
+    {
+      fprintf(trace, "%llu Start_Periodic_Alarm(%d): Group(%d) %d periodic %d\n", (unsigned long long)time, next_id,
+              group, duration, next_id);
+      next_id++;
+    }
+    else if (pick < 88)
+    {
+      fprintf(trace, "%llu Change_Alarm(%d): Group(%d) %d changed %d\n", (unsigned long long)time, id, group,
+              duration, id);
+    }
+    else if (pick < 96)
+    {
+      fprintf(trace, "%llu Cancel_Alarm(%d)\n", (unsigned long long)time, id);
+    }
+    else if (pick < 98)
+    {
+      fprintf(trace, "%llu Delay_Group(%d) +%d\n", (unsigned long long)time, group, duration);
+    }
+    else if (pick < 99)
+    {
+      fprintf(trace, "%llu Change_Group(%d): NewGroup(%d)\n", (unsigned long long)time, group,
+              group % group_count + 1);
+    }
+    else
+    {
+      fprintf(trace, "%llu Cancel_Group(%d)\n", (unsigned long long)time, group);
+    }
+    commands++;
+  }
+  fprintf(trace, "%llu end\n", (unsigned long long)end);
+  fclose(trace);
+  return commands;
+}
+
+// FNV-1a of a line, leaving out the pthread ID after "Thread " (display thread numbers are kept)
+static uint64_t hash_line(uint64_t hash, const char *line)
+{
+  for (const char *p = line; *p != '\0'; p++)
+  {
+    if (strncmp(p, "Thread ", 7) == 0 && strspn(p + 7, "0123456789") > 6)
+    {
+      p += 7 + strspn(p + 7, "0123456789") - 1;
+      continue;
+    }
+    hash = (hash ^ (unsigned char)*p) * 1099511628211ull;
+  }
+  return hash;
+}
+
+// Replay the trace once; fills in the output's line count and checksum
+static void replay(uint64_t *lines, uint64_t *checksum)
+{
+  int output[2];
+  if (pipe(output) < 0)
+  {
+    errno_abort("Create pipe");
+  }
+
+  pid_t pid = fork();
+  if (pid < 0)
+  {
+    errno_abort("Fork");
+  }
+  if (pid == 0)
+  {
+    freopen("/dev/null", "r", stdin);
+    dup2(output[1], STDOUT_FILENO);
+    dup2(output[1], STDERR_FILENO);
+    close(output[0]);
+    close(output[1]);
+    setenv("ALARM_TRACE_REPLAY", trace_path, 1);
+    setenv("ALARM_REPLAY_SPEED", speed, 1);
+    execl(binary, binary, (char *)NULL);
+    errno_abort("Exec");
+  }
+  close(output[1]);
+
+  FILE *program = fdopen(output[0], "r");
+  char line[512];
+  *lines = 0;
+  *checksum = 14695981039346656037ull;
+  while (fgets(line, sizeof(line), program) != NULL)
+  {
+    (*lines)++;
+    *checksum = hash_line(*checksum, line);
+  }
+  fclose(program);
+  waitpid(pid, NULL, 0);
+}
+
+static void usage(const char *program)
+{
+  fprintf(stderr, "Usage: %s [-b binary] [-t simulated_seconds] [-r commands_per_second]\n"
+                  "          [-g groups] [-d min_s:max_s] [-x speed] [-n runs]\n",
+          program);
+  exit(1);
+}
+
+int main(int argc, char *argv[])
+{
+  int option;
+
+  while ((option = getopt(argc, argv, "b:t:r:g:d:x:n:")) != -1)
+  {
+    switch (option)
+    {
+    case 'b': binary = optarg; break;
+    case 't': simulated_seconds = atoi(optarg); break;
+    case 'r': command_rate = atof(optarg); break;
+    case 'g': group_count = atoi(optarg); break;
+    case 'd':
+      if (sscanf(optarg, "%d:%d", &min_duration, &max_duration) != 2)
+      {
+        usage(argv[0]);
+      }
+      break;
+    case 'x': speed = optarg; break;
+    case 'n': run_count = atoi(optarg); break;
+    default: usage(argv[0]);
+    }
+  }
+  if (simulated_seconds < 1 || command_rate <= 0 || group_count < 1 || min_duration < 1 ||
+      max_duration < min_duration || run_count < 1)
+  {
+    usage(argv[0]);
+  }
+
+  snprintf(trace_path, sizeof(trace_path), "/tmp/replay_bench.%d.trace", (int)getpid());
+  int commands = write_trace();
+  printf("%d commands over %d simulated seconds, %d groups, durations %d-%ds, speed %s\n", commands,
+         simulated_seconds, group_count, min_duration, max_duration, speed);
+
+  uint64_t first_checksum = 0;
+  int agree = 1;
+  for (int run = 0; run < run_count; run++)
+  {
+    uint64_t lines, checksum;
+    uint64_t start = now_usec();
+    replay(&lines, &checksum);
+    double seconds = (now_usec() - start) / 1e6;
+
+    printf("  run %d: %8.3f s, %10.0f simulated s/s, %llu lines, checksum %016llx\n", run + 1, seconds,
+           simulated_seconds / seconds, (unsigned long long)lines, (unsigned long long)checksum);
+    if (run == 0)
+    {
+      first_checksum = checksum;
+    }
+    agree &= checksum == first_checksum;
+  }
+  if (run_count > 1)
+  {
+    printf("  output %s across runs\n", agree ? "identical" : "DIFFERS");
+  }
+  unlink(trace_path);
+  return strcmp(speed, "max") == 0 && !agree;
+}
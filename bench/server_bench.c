@@ -0,0 +1,455 @@
+/*
+ * server_bench.c
+ *
+ * Multi-client throughput benchmark for the command server. It starts
+ * the program with the selected engine and ALARM_SOCKET, connects a
+ * number of clients and has each send its own range of Start_Alarm
+ * commands, a window at a time: the window is written in one send and
+ * its replies are awaited before the next is sent, so a window of 1 is
+ * a client waiting on every command and a larger one pipelines. It
+ * reports:
+ *
+ *   - throughput: replies per second over every client, from the
+ *     first command sent to the last reply read;
+ *   - window round trip: from sending a window to reading its last
+ *     reply, over every window of every client;
+ *   - with subscribers, event delivery: how long after the last reply
+ *     each subscriber had seen the "Has Removed" event of every alarm.
+ *
+ * Alarm durations are short and spread out, so alarms keep expiring
+ * while commands arrive and the subscribers see a steady event stream.
+ *
+ * Usage: server_bench [-b binary] [-e threads|epoll] [-p text|binary]
+ *                     [-c clients] [-n commands_per_client] [-w window]
+ *                     [-s subscribers] [-g groups] [-d min_ms:max_ms]
+ */
+#include <pthread.h>
+#include <signal.h>
+#include <stdint.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+#include <sys/wait.h>
+#include <time.h>
+#include "errors.h"
+#include "command.h"
+#include "event_log.h"
+
+// Load description, from the command line
+static const char *binary = "./bench/alarm";
+static const char *engine = "threads";
+static int binary_protocol = 0;        // Speak the binary protocol instead of text
+static int client_count = 8;           // Connections sending commands
+static int commands_per_client = 20000; // Start_Alarm commands sent by each client
+static int window = 64;                // Commands sent before waiting for their replies
+static int subscriber_count = 0;       // Connections counting expiry events
+static int group_count = 1000;         // Groups the alarms are spread over
+static int min_duration_ms = 100;      // Shortest alarm duration
+static int max_duration_ms = 2000;     // Longest alarm duration
+
+static char socket_path[108];          // Where the program listens
+static uint64_t started_at;            // When the clients started sending
+static uint64_t last_reply_at;         // When the last reply was read, updated atomically
+static int rejected = 0;               // Replies other than OK, updated atomically
+
+// Results of one client
+typedef struct client
+{
+  int index;              // Position among the clients, which picks its alarm ids
+  double *round_trips;    // Round trip of each window, in microseconds
+  int windows;            // Windows sent
+} client_t;
+
+// Results of one subscriber
+typedef struct subscriber
+{
+  int fd;                 // Connection, subscribed before any command is sent
+  int removed;            // "Has Removed" events seen
+  uint64_t complete_at;   // When the last expected event arrived
+} subscriber_t;
+
+static uint64_t now_usec(void)
+{
+  struct timespec now;
+  clock_gettime(CLOCK_MONOTONIC, &now);
+  return (uint64_t)now.tv_sec * 1000000 + now.tv_nsec / 1000;
+}
+
+static int compare_double(const void *a, const void *b)
+{
+  double x = *(const double *)a, y = *(const double *)b;
+  return (x > y) - (x < y);
+}
+
+// Connect to the program, retrying while it starts up
+static int connect_program(void)
+{
+  struct sockaddr_un address;
+
+  memset(&address, 0, sizeof(address));
+  address.sun_family = AF_UNIX;
+  strcpy(address.sun_path, socket_path);
+  for (int attempt = 0; attempt < 500; attempt++)
+  {
+    int fd = socket(AF_UNIX, SOCK_STREAM, 0);
+    if (fd < 0)
+    {
+      errno_abort("Create socket");
+    }
+    if (connect(fd, (struct sockaddr *)&address, sizeof(address)) == 0)
+    {
+      if (binary_protocol && write(fd, COMMAND_BINARY_MAGIC, 4) != 4)
+      {
+        errno_abort("Write magic");
+      }
+      return fd;
+    }
+    close(fd);
+    usleep(10000);
+  }
+  fprintf(stderr, "Cannot connect to %s\n", socket_path);
+  exit(1);
+}
+
+static void send_all(int fd, const char *data, size_t size)
+{
+  while (size > 0)
+  {
+    ssize_t sent = send(fd, data, size, MSG_NOSIGNAL);
+    if (sent < 0)
+    {
+      errno_abort("Send commands");
+    }
+    data += sent;
+    size -= sent;
+  }
+}
+
+/*
+ * Read until count replies have arrived. Text replies are lines;
+ * binary replies are fixed-size frames.
+ */
+static void read_replies(int fd, int count)
+{
+  char buffer[8192];
+  size_t held = 0;
+
+  while (count > 0)
+  {
+    ssize_t got = read(fd, buffer + held, sizeof(buffer) - held);
+    if (got <= 0)
+    {
+      fprintf(stderr, "Connection closed with %d replies outstanding\n", count);
+      exit(1);
+    }
+    held += got;
+
+    size_t used = 0;
+    if (binary_protocol)
+    {
+      command_reply_frame_t reply;
+      while (held - used >= sizeof(reply))
+      {
+        memcpy(&reply, buffer + used, sizeof(reply));
+        if (reply.status != COMMAND_ACCEPTED)
+        {
+          __atomic_add_fetch(&rejected, 1, __ATOMIC_RELAXED);
+        }
+        used += sizeof(reply);
+        count--;
+      }
+    }
+    else
+    {
+      char *newline;
+      while ((newline = memchr(buffer + used, '\n', held - used)) != NULL)
+      {
+        if (strncmp(buffer + used, "OK\n", 3) != 0)
+        {
+          __atomic_add_fetch(&rejected, 1, __ATOMIC_RELAXED);
+        }
+        used = newline - buffer + 1;
+        count--;
+      }
+    }
+    held -= used;
+    memmove(buffer, buffer + used, held);
+  }
+}
+
+static void *client_function(void *arg)
+{
+  client_t *client = (client_t *)arg;
+  int fd = connect_program();
+  char *batch = malloc((size_t)window * COMMAND_FRAME_MAX);
+  uint64_t seed = 88172645463325252ull ^ (uint64_t)(client->index + 1) * 0x9E3779B97F4A7C15ull;
+  command_t command;
+
+  if (batch == NULL)
+  {
+    errno_abort("Allocate batch");
+  }
+  client->round_trips = malloc((commands_per_client / window + 1) * sizeof(double));
+  if (client->round_trips == NULL)
+  {
+    errno_abort("Allocate round trips");
+  }
+
+  memset(&command, 0, sizeof(command));
+  command.type = COMMAND_START_ALARM;
+  for (int sent = 0; sent < commands_per_client;)
+  {
+    size_t used = 0;
+    int count = 0;
+    while (count < window && sent < commands_per_client)
+    {
+      seed ^= seed << 13;
+      seed ^= seed >> 7;
+      seed ^= seed << 17;
+      int ms = min_duration_ms + (int)(seed % (uint64_t)(max_duration_ms - min_duration_ms + 1));
+      int id = client->index * commands_per_client + sent + 1;
+      int group = (int)(seed >> 32) % group_count + 1;
+
+      if (binary_protocol)
+      {
+        command.alarm_id = id;
+        command.group_id = group;
+        command.duration_usec = (uint64_t)ms * 1000;
+        snprintf(command.message, sizeof(command.message), "bench %d", ms);
+        used += command_encode(&command, batch + used);
+      }
+      else
+      {
+        used += sprintf(batch + used, "Start_Alarm(%d): Group(%d) %dms bench %d\n", id, group, ms, ms);
+      }
+      count++;
+      sent++;
+    }
+
+    uint64_t window_start = now_usec();
+    send_all(fd, batch, used);
+    read_replies(fd, count);
+    uint64_t window_end = now_usec();
+    client->round_trips[client->windows++] = (double)(window_end - window_start);
+    if (window_end > __atomic_load_n(&last_reply_at, __ATOMIC_RELAXED))
+    {
+      __atomic_store_n(&last_reply_at, window_end, __ATOMIC_RELAXED);
+    }
+  }
+  close(fd);
+  free(batch);
+  return NULL;
+}
+
+// Count the "Has Removed" events a subscriber is sent until it has seen every alarm's
+static void *subscriber_function(void *arg)
+{
+  subscriber_t *subscriber = (subscriber_t *)arg;
+  int expected = client_count * commands_per_client;
+  char buffer[65536];
+  size_t held = 0;
+
+  while (subscriber->removed < expected)
+  {
+    ssize_t got = read(subscriber->fd, buffer + held, sizeof(buffer) - held);
+    if (got <= 0)
+    {
+      fprintf(stderr, "Subscriber disconnected after %d events\n", subscriber->removed);
+      return NULL;
+    }
+    held += got;
+
+    size_t used = 0;
+    if (binary_protocol)
+    {
+      uint32_t length;
+      while (held - used >= sizeof(length))
+      {
+        memcpy(&length, buffer + used, sizeof(length));
+        if (held - used < sizeof(length) + length)
+        {
+          break;
+        }
+        command_event_frame_t event;
+        if (length + sizeof(length) >= sizeof(event))
+        {
+          memcpy(&event, buffer + used, sizeof(event));
+          if (event.kind == COMMAND_EVENT && event.type == LOG_ALARM_REMOVED)
+          {
+            subscriber->removed++;
+          }
+        }
+        used += sizeof(length) + length;
+      }
+    }
+    else
+    {
+      char *newline;
+      while ((newline = memchr(buffer + used, '\n', held - used)) != NULL)
+      {
+        *newline = '\0';
+        if (strncmp(buffer + used, "EVENT ", 6) == 0 && strstr(buffer + used, "Has Removed") != NULL)
+        {
+          subscriber->removed++;
+        }
+        used = newline - buffer + 1;
+      }
+    }
+    held -= used;
+    memmove(buffer, buffer + used, held);
+  }
+  subscriber->complete_at = now_usec();
+  return NULL;
+}
+
+// Start the program listening on socket_path, with no input and its output discarded
+static pid_t start_program(void)
+{
+  pid_t pid = fork();
+  if (pid < 0)
+  {
+    errno_abort("Fork");
+  }
+  if (pid == 0)
+  {
+    freopen("/dev/null", "r", stdin);
+    freopen("/dev/null", "w", stdout);
+    freopen("/dev/null", "w", stderr);
+    setenv("ALARM_ENGINE", engine, 1);
+    setenv("ALARM_SOCKET", socket_path, 1);
+    execl(binary, binary, (char *)NULL);
+    errno_abort("Exec");
+  }
+  return pid;
+}
+
+static void usage(const char *program)
+{
+  fprintf(stderr, "Usage: %s [-b binary] [-e threads|epoll] [-p text|binary]\n"
+                  "          [-c clients] [-n commands_per_client] [-w window]\n"
+                  "          [-s subscribers] [-g groups] [-d min_ms:max_ms]\n",
+          program);
+  exit(1);
+}
+
+int main(int argc, char *argv[])
+{
+  int option;
+
+  while ((option = getopt(argc, argv, "b:e:p:c:n:w:s:g:d:")) != -1)
+  {
+    switch (option)
+    {
+    case 'b': binary = optarg; break;
+    case 'e': engine = optarg; break;
+    case 'p': binary_protocol = strcmp(optarg, "binary") == 0; break;
+    case 'c': client_count = atoi(optarg); break;
+    case 'n': commands_per_client = atoi(optarg); break;
+    case 'w': window = atoi(optarg); break;
+    case 's': subscriber_count = atoi(optarg); break;
+    case 'g': group_count = atoi(optarg); break;
+    case 'd':
+      if (sscanf(optarg, "%d:%d", &min_duration_ms, &max_duration_ms) != 2)
+      {
+        usage(argv[0]);
+      }
+      break;
+    default: usage(argv[0]);
+    }
+  }
+  if (client_count < 1 || commands_per_client < 1 || window < 1 || subscriber_count < 0 || group_count < 1 ||
+      min_duration_ms < 1 || max_duration_ms < min_duration_ms)
+  {
+    usage(argv[0]);
+  }
+
+  snprintf(socket_path, sizeof(socket_path), "/tmp/server_bench.%d.sock", (int)getpid());
+  signal(SIGPIPE, SIG_IGN);
+  pid_t pid = start_program();
+
+  // Subscribe before any command is sent, so every expiry is seen
+  subscriber_t *subscribers = calloc(subscriber_count + 1, sizeof(subscriber_t));
+  pthread_t *subscriber_threads = malloc((subscriber_count + 1) * sizeof(pthread_t));
+  client_t *clients = calloc(client_count, sizeof(client_t));
+  pthread_t *client_threads = malloc(client_count * sizeof(pthread_t));
+  if (subscribers == NULL || subscriber_threads == NULL || clients == NULL || client_threads == NULL)
+  {
+    errno_abort("Allocate connections");
+  }
+  for (int i = 0; i < subscriber_count; i++)
+  {
+    command_t command;
+    char frame[COMMAND_FRAME_MAX];
+
+    subscribers[i].fd = connect_program();
+    memset(&command, 0, sizeof(command));
+    command.type = COMMAND_SUBSCRIBE;
+    if (binary_protocol)
+    {
+      send_all(subscribers[i].fd, frame, command_encode(&command, frame));
+    }
+    else
+    {
+      send_all(subscribers[i].fd, "Subscribe\n", 10);
+    }
+    read_replies(subscribers[i].fd, 1);
+  }
+
+  started_at = now_usec();
+  for (int i = 0; i < subscriber_count; i++)
+  {
+    pthread_create(&subscriber_threads[i], NULL, subscriber_function, &subscribers[i]);
+  }
+  for (int i = 0; i < client_count; i++)
+  {
+    clients[i].index = i;
+    pthread_create(&client_threads[i], NULL, client_function, &clients[i]);
+  }
+
+  // Gather every window's round trip
+  int windows = 0;
+  double *round_trips = malloc((size_t)client_count * (commands_per_client / window + 1) * sizeof(double));
+  if (round_trips == NULL)
+  {
+    errno_abort("Allocate round trips");
+  }
+  for (int i = 0; i < client_count; i++)
+  {
+    pthread_join(client_threads[i], NULL);
+    memcpy(round_trips + windows, clients[i].round_trips, clients[i].windows * sizeof(double));
+    windows += clients[i].windows;
+  }
+  for (int i = 0; i < subscriber_count; i++)
+  {
+    pthread_join(subscriber_threads[i], NULL);
+  }
+  kill(pid, SIGTERM);
+  waitpid(pid, NULL, 0);
+  unlink(socket_path);
+
+  long total = (long)client_count * commands_per_client;
+  double seconds = (last_reply_at - started_at) / 1e6;
+  qsort(round_trips, windows, sizeof(double), compare_double);
+
+  printf("engine %s, %s protocol: %d clients x %d commands, window %d, %d subscribers\n", engine,
+         binary_protocol ? "binary" : "text", client_count, commands_per_client, window, subscriber_count);
+  printf("  throughput      %10.0f commands/sec\n", seconds > 0 ? total / seconds : 0);
+  printf("  window round trip p50 %8.1f  p99 %8.1f  max %8.1f us\n", round_trips[(int)(0.50 * (windows - 1))],
+         round_trips[(int)(0.99 * (windows - 1))], round_trips[windows - 1]);
+  for (int i = 0; i < subscriber_count; i++)
+  {
+    if (subscribers[i].complete_at == 0)
+    {
+      printf("  subscriber %d    incomplete: %d of %ld events\n", i, subscribers[i].removed, total);
+    }
+    else
+    {
+      printf("  subscriber %d    %d events, last %.1f ms after the last reply\n", i, subscribers[i].removed,
+             (subscribers[i].complete_at - last_reply_at) / 1000.0);
+    }
+  }
+  if (rejected > 0)
+  {
+    printf("  rejected        %10d commands\n", rejected);
+  }
+  return 0;
+}
@@ -0,0 +1,529 @@
+#include <stdio.h>
+#include <string.h>
+#include <unistd.h>
+#include <errno.h>
+#include "alarm_clock.h"
+#include "command.h"
+
+// Position of the parser within a line
+typedef struct parser
+{
+  const char *line;       // Start of the line, for error columns
+  const char *next;       // Next character to look at
+  const char *end;        // One past the last character of the line
+  command_error_t *error; // Where a failure is reported
+} parser_t;
+
+// Command names, the command each starts and what follows the name
+typedef enum command_syntax
+{
+  SYNTAX_BARE,    // Nothing: Stats, Subscribe, Count
+  SYNTAX_ALARM,   // (id): Group(g) duration message
+  SYNTAX_ID,      // (id)
+  SYNTAX_REGROUP, // (g): NewGroup(h)
+  SYNTAX_GROUP,   // (g)
+  SYNTAX_DELAY    // (g) +duration
+} command_syntax_t;
+
+static const struct
+{
+  const char *name;
+  size_t length;
+  command_type_t type;
+  command_syntax_t syntax;
+} command_names[] = {
+  {"Start_Alarm", 11, COMMAND_START_ALARM, SYNTAX_ALARM},
+  {"Change_Alarm", 12, COMMAND_CHANGE_ALARM, SYNTAX_ALARM},
+  {"Cancel_Alarm", 12, COMMAND_CANCEL_ALARM, SYNTAX_ID},
+  {"Start_Periodic_Alarm", 20, COMMAND_START_PERIODIC_ALARM, SYNTAX_ALARM},
+  {"Change_Group", 12, COMMAND_CHANGE_GROUP, SYNTAX_REGROUP},
+  {"Cancel_Group", 12, COMMAND_CANCEL_GROUP, SYNTAX_GROUP},
+  {"Delay_Group", 11, COMMAND_DELAY_GROUP, SYNTAX_DELAY},
+  {"Stats", 5, COMMAND_STATS, SYNTAX_BARE},
+  {"Subscribe", 9, COMMAND_SUBSCRIBE, SYNTAX_BARE},
+  {"Query_Alarm", 11, COMMAND_QUERY_ALARM, SYNTAX_ID},
+  {"List_Group", 10, COMMAND_LIST_GROUP, SYNTAX_GROUP},
+  {"Count", 5, COMMAND_COUNT, SYNTAX_BARE},
+};
+
+// Explanations of the error codes
+static const char *error_texts[COMMAND_ERRORS] = {
+  "no error",
+  "unknown command",
+  "expected '('",
+  "expected a number",
+  "number out of range",
+  "expected ')'",
+  "expected ':'",
+  "expected 'Group('",
+  "expected 'NewGroup('",
+  "expected '+'",
+  "expected a duration",
+  "malformed duration",
+  "period must be greater than zero",
+  "expected a message",
+  "unexpected text after the command",
+  "new group must differ from the group",
+  "malformed frame",
+  "control character in the message",
+};
+
+// Return the explanation of an error code
+const char *command_error_text(command_error_code_t code)
+{
+  return code < COMMAND_ERRORS ? error_texts[code] : "unknown error";
+}
+
+// Record an error at the parser's position; returns 0 for the caller to pass on
+static int parser_fail(parser_t *parser, command_error_code_t code)
+{
+  parser->error->code = code;
+  parser->error->column = parser->next - parser->line;
+  return 0;
+}
+
+static int is_space(char c)
+{
+  return c == ' ' || c == '\t' || c == '\r' || c == '\v' || c == '\f';
+}
+
+static void parser_skip_space(parser_t *parser)
+{
+  while (parser->next < parser->end && is_space(*parser->next))
+  {
+    parser->next++;
+  }
+}
+
+// Match literal text exactly at the parser's position
+static int parser_expect(parser_t *parser, const char *text, size_t length, command_error_code_t code)
+{
+  if ((size_t)(parser->end - parser->next) < length || memcmp(parser->next, text, length) != 0)
+  {
+    return parser_fail(parser, code);
+  }
+  parser->next += length;
+  return 1;
+}
+
+// Parse a decimal int, after optional whitespace and sign
+static int parser_int(parser_t *parser, int *value)
+{
+  int negative = 0;
+  int64_t number = 0;
+
+  parser_skip_space(parser);
+  const char *start = parser->next;
+  if (parser->next < parser->end && (*parser->next == '-' || *parser->next == '+'))
+  {
+    negative = *parser->next++ == '-';
+  }
+  if (parser->next == parser->end || *parser->next < '0' || *parser->next > '9')
+  {
+    parser->next = start;
+    return parser_fail(parser, COMMAND_ERROR_EXPECTED_NUMBER);
+  }
+  while (parser->next < parser->end && *parser->next >= '0' && *parser->next <= '9')
+  {
+    number = number * 10 + (*parser->next++ - '0');
+    if (number > (int64_t)INT32_MAX + 1)
+    {
+      parser->next = start;
+      return parser_fail(parser, COMMAND_ERROR_NUMBER_RANGE);
+    }
+  }
+  if (!negative && number > INT32_MAX)
+  {
+    parser->next = start;
+    return parser_fail(parser, COMMAND_ERROR_NUMBER_RANGE);
+  }
+  *value = (int)(negative ? -number : number);
+  return 1;
+}
+
+// Parse "(number)" right after a name
+static int parser_argument(parser_t *parser, int *value)
+{
+  return parser_expect(parser, "(", 1, COMMAND_ERROR_EXPECTED_OPEN) && parser_int(parser, value) &&
+         parser_expect(parser, ")", 1, COMMAND_ERROR_EXPECTED_CLOSE);
+}
+
+// Parse a duration word, after optional whitespace, keeping its text
+static int parser_duration(parser_t *parser, command_t *command)
+{
+  parser_skip_space(parser);
+  const char *start = parser->next;
+  while (parser->next < parser->end && !is_space(*parser->next))
+  {
+    parser->next++;
+  }
+  size_t length = parser->next - start;
+  parser->next = start;
+  if (length == 0)
+  {
+    return parser_fail(parser, COMMAND_ERROR_EXPECTED_DURATION);
+  }
+  if (length >= sizeof(command->duration))
+  {
+    return parser_fail(parser, COMMAND_ERROR_BAD_DURATION);
+  }
+  memcpy(command->duration, start, length);
+  command->duration[length] = '\0';
+  if (!parse_duration(command->duration, &command->duration_usec))
+  {
+    return parser_fail(parser, COMMAND_ERROR_BAD_DURATION);
+  }
+  parser->next = start + length;
+  return 1;
+}
+
+// Take the rest of the line, after optional whitespace, as the message
+static int parser_message(parser_t *parser, command_t *command)
+{
+  parser_skip_space(parser);
+  size_t length = parser->end - parser->next;
+  if (length == 0)
+  {
+    return parser_fail(parser, COMMAND_ERROR_EXPECTED_MESSAGE);
+  }
+  if (length > sizeof(command->message) - 1)
+  {
+    length = sizeof(command->message) - 1;
+  }
+  memcpy(command->message, parser->next, length);
+  command->message[length] = '\0';
+  parser->next = parser->end;
+  return 1;
+}
+
+// Allow only whitespace after a complete command
+static int parser_end(parser_t *parser)
+{
+  parser_skip_space(parser);
+  return parser->next == parser->end || parser_fail(parser, COMMAND_ERROR_TRAILING_TEXT);
+}
+
+/*
+ * Parse one command line of the given length, without its newline.
+ * Returns 1 and fills in the command when the line is a well-formed
+ * command; otherwise returns 0 and fills in the error.
+ */
+int command_parse(const char *line, size_t length, command_t *command, command_error_t *error)
+{
+  parser_t parser = {line, line, line + length, error};
+  int index;
+
+  command->alarm_id = command->group_id = command->new_group_id = 0;
+  command->duration[0] = '\0';
+  command->message[0] = '\0';
+  command->duration_usec = 0;
+  error->code = COMMAND_ERROR_NONE;
+  error->column = 0;
+
+  // The name runs up to the first character that cannot be in one
+  const char *name = line;
+  while (parser.next < parser.end && (*parser.next == '_' || (*parser.next >= 'A' && *parser.next <= 'Z') ||
+                                      (*parser.next >= 'a' && *parser.next <= 'z')))
+  {
+    parser.next++;
+  }
+  size_t name_length = parser.next - name;
+  for (index = 0; index < (int)(sizeof(command_names) / sizeof(command_names[0])); index++)
+  {
+    if (command_names[index].length == name_length && memcmp(command_names[index].name, name, name_length) == 0)
+    {
+      break;
+    }
+  }
+  if (index == sizeof(command_names) / sizeof(command_names[0]))
+  {
+    parser.next = line;
+    return parser_fail(&parser, COMMAND_ERROR_UNKNOWN);
+  }
+  command->type = command_names[index].type;
+
+  switch (command_names[index].syntax)
+  {
+  case SYNTAX_BARE:
+    return parser_end(&parser);
+  case SYNTAX_ALARM:
+    if (!parser_argument(&parser, &command->alarm_id) || !parser_expect(&parser, ":", 1, COMMAND_ERROR_EXPECTED_COLON))
+    {
+      return 0;
+    }
+    parser_skip_space(&parser);
+    if (!parser_expect(&parser, "Group(", 6, COMMAND_ERROR_EXPECTED_GROUP) || !parser_int(&parser, &command->group_id) ||
+        !parser_expect(&parser, ")", 1, COMMAND_ERROR_EXPECTED_CLOSE))
+    {
+      return 0;
+    }
+    const char *duration = parser.next;
+    if (!parser_duration(&parser, command))
+    {
+      return 0;
+    }
+    if (command->type == COMMAND_START_PERIODIC_ALARM && command->duration_usec == 0)
+    {
+      parser.next = duration;
+      parser_skip_space(&parser);
+      return parser_fail(&parser, COMMAND_ERROR_ZERO_PERIOD);
+    }
+    return parser_message(&parser, command);
+  case SYNTAX_ID:
+    return parser_argument(&parser, &command->alarm_id) && parser_end(&parser);
+  case SYNTAX_REGROUP:
+    if (!parser_argument(&parser, &command->group_id) || !parser_expect(&parser, ":", 1, COMMAND_ERROR_EXPECTED_COLON))
+    {
+      return 0;
+    }
+    parser_skip_space(&parser);
+    const char *new_group = parser.next;
+    if (!parser_expect(&parser, "NewGroup(", 9, COMMAND_ERROR_EXPECTED_NEW_GROUP) ||
+        !parser_int(&parser, &command->new_group_id) || !parser_expect(&parser, ")", 1, COMMAND_ERROR_EXPECTED_CLOSE) ||
+        !parser_end(&parser))
+    {
+      return 0;
+    }
+    if (command->new_group_id == command->group_id)
+    {
+      parser.next = new_group;
+      return parser_fail(&parser, COMMAND_ERROR_SAME_GROUP);
+    }
+    return 1;
+  case SYNTAX_GROUP:
+    return parser_argument(&parser, &command->group_id) && parser_end(&parser);
+  case SYNTAX_DELAY:
+    if (!parser_argument(&parser, &command->group_id))
+    {
+      return 0;
+    }
+    parser_skip_space(&parser);
+    return parser_expect(&parser, "+", 1, COMMAND_ERROR_EXPECTED_PLUS) && parser_duration(&parser, command) &&
+           parser_end(&parser);
+  }
+  return 0;
+}
+
+/*
+ * Decode one binary request frame of the given size, header included.
+ * Returns 1 and fills in the command when the frame is a well-formed
+ * command, with the same limits command_parse applies, 0 otherwise. A
+ * message may not hold a NUL or a control byte, such as a newline,
+ * which would cut it short or forge a line of the output.
+ */
+int command_decode(const void *frame, size_t size, command_t *command, command_error_t *error)
+{
+  command_frame_t header;
+
+  error->code = COMMAND_ERROR_BAD_FRAME;
+  error->column = 0;
+  if (size < sizeof(header) || size > COMMAND_FRAME_MAX)
+  {
+    return 0;
+  }
+  memcpy(&header, frame, sizeof(header));
+  size_t message_length = size - sizeof(header);
+
+  memset(command, 0, sizeof(*command));
+  command->type = (command_type_t)header.type;
+  command->alarm_id = header.alarm_id;
+  command->group_id = header.group_id;
+  command->new_group_id = header.new_group_id;
+  command->duration_usec = header.duration_usec;
+  memcpy(command->message, (const char *)frame + sizeof(header), message_length);
+  command->message[message_length] = '\0';
+  for (size_t i = 0; i < message_length; i++)
+  {
+    unsigned char c = command->message[i];
+    if (c < ' ' || c == 0x7f)
+    {
+      error->code = COMMAND_ERROR_BAD_MESSAGE;
+      return 0;
+    }
+  }
+  snprintf(command->duration, sizeof(command->duration), "%lluus", (unsigned long long)header.duration_usec);
+
+  switch (command->type)
+  {
+  case COMMAND_START_PERIODIC_ALARM:
+    if (command->duration_usec == 0)
+    {
+      error->code = COMMAND_ERROR_ZERO_PERIOD;
+      return 0;
+    }
+    // Fall through
+  case COMMAND_START_ALARM:
+  case COMMAND_CHANGE_ALARM:
+    // Deadlines are only computed without wrapping for the durations parse_duration accepts
+    error->code = command->duration_usec > DURATION_MAX_USEC ? COMMAND_ERROR_BAD_DURATION
+                  : message_length > 0                      ? COMMAND_ERROR_NONE
+                                                            : COMMAND_ERROR_EXPECTED_MESSAGE;
+    break;
+  case COMMAND_CHANGE_GROUP:
+    error->code = command->new_group_id != command->group_id ? COMMAND_ERROR_NONE : COMMAND_ERROR_SAME_GROUP;
+    break;
+  case COMMAND_STATS:
+  case COMMAND_SUBSCRIBE:
+  case COMMAND_QUERY_ALARM:
+  case COMMAND_LIST_GROUP:
+  case COMMAND_COUNT:
+  case COMMAND_CANCEL_ALARM:
+  case COMMAND_CANCEL_GROUP:
+    error->code = COMMAND_ERROR_NONE;
+    break;
+  case COMMAND_DELAY_GROUP:
+    error->code = command->duration_usec > DURATION_MAX_USEC ? COMMAND_ERROR_BAD_DURATION : COMMAND_ERROR_NONE;
+    break;
+  default:
+    break;
+  }
+  return error->code == COMMAND_ERROR_NONE;
+}
+
+/*
+ * Encode a command as a binary request frame, which must have room for
+ * COMMAND_FRAME_MAX bytes. Returns the frame size.
+ */
+size_t command_encode(const command_t *command, void *frame)
+{
+  command_frame_t header;
+  size_t message_length = strnlen(command->message, sizeof(command->message) - 1);
+
+  memset(&header, 0, sizeof(header));
+  header.length = sizeof(header) - sizeof(header.length) + message_length;
+  header.type = command->type;
+  header.alarm_id = command->alarm_id;
+  header.group_id = command->group_id;
+  header.new_group_id = command->new_group_id;
+  header.duration_usec = command->duration_usec;
+  memcpy(frame, &header, sizeof(header));
+  memcpy((char *)frame + sizeof(header), command->message, message_length);
+  return sizeof(header) + message_length;
+}
+
+/*
+ * Write a command as a text line in the syntax command_parse reads,
+ * without a newline, so a command that came in as a binary frame can
+ * be logged and read back. A newline in a message would end the line
+ * early, so it is written as a space. Returns the length of the line,
+ * which is cut short when it does not fit in size bytes.
+ */
+size_t command_format(const command_t *command, char *line, size_t size)
+{
+  int length = 0;
+
+  switch (command->type)
+  {
+  case COMMAND_STATS:
+    length = snprintf(line, size, "Stats");
+    break;
+  case COMMAND_START_ALARM:
+  case COMMAND_START_PERIODIC_ALARM:
+  case COMMAND_CHANGE_ALARM:
+    length = snprintf(line, size, "%s(%d): Group(%d) %s %s",
+                      command->type == COMMAND_START_ALARM    ? "Start_Alarm"
+                      : command->type == COMMAND_CHANGE_ALARM ? "Change_Alarm"
+                                                              : "Start_Periodic_Alarm",
+                      command->alarm_id, command->group_id, command->duration, command->message);
+    break;
+  case COMMAND_CANCEL_ALARM:
+    length = snprintf(line, size, "Cancel_Alarm(%d)", command->alarm_id);
+    break;
+  case COMMAND_CHANGE_GROUP:
+    length = snprintf(line, size, "Change_Group(%d): NewGroup(%d)", command->group_id, command->new_group_id);
+    break;
+  case COMMAND_CANCEL_GROUP:
+    length = snprintf(line, size, "Cancel_Group(%d)", command->group_id);
+    break;
+  case COMMAND_DELAY_GROUP:
+    length = snprintf(line, size, "Delay_Group(%d) +%s", command->group_id, command->duration);
+    break;
+  case COMMAND_QUERY_ALARM:
+    length = snprintf(line, size, "Query_Alarm(%d)", command->alarm_id);
+    break;
+  case COMMAND_LIST_GROUP:
+    length = snprintf(line, size, "List_Group(%d)", command->group_id);
+    break;
+  case COMMAND_COUNT:
+    length = snprintf(line, size, "Count");
+    break;
+  default:
+    length = snprintf(line, size, "Subscribe");
+    break;
+  }
+
+  if (length < 0)
+  {
+    length = 0;
+  }
+  if ((size_t)length >= size)
+  {
+    length = size > 0 ? (int)size - 1 : 0;
+  }
+  for (char *newline = memchr(line, '\n', length); newline != NULL; newline = memchr(newline, '\n', line + length - newline))
+  {
+    *newline = ' ';
+  }
+  return (size_t)length;
+}
+
+// Start reading lines from a descriptor
+void command_input_init(command_input_t *input, int fd)
+{
+  input->fd = fd;
+  input->start = 0;
+  input->used = 0;
+  input->ended = 0;
+}
+
+/*
+ * Read at most limit more bytes (fewer if that is what is available),
+ * first moving the unreturned input to the front of the buffer.
+ * Returns 0 once the input has ended.
+ */
+int command_input_fill(command_input_t *input, size_t limit)
+{
+  input->used -= input->start;
+  memmove(input->buffer, input->buffer + input->start, input->used);
+  input->start = 0;
+
+  size_t room = sizeof(input->buffer) - input->used;
+  ssize_t count = read(input->fd, input->buffer + input->used, limit < room ? limit : room);
+  if (count < 0)
+  {
+    return errno == EINTR || errno == EAGAIN;
+  }
+  if (count == 0)
+  {
+    input->ended = 1;
+    return 0;
+  }
+  input->used += count;
+  return 1;
+}
+
+/*
+ * Return the next line in the buffer, without its newline, and its
+ * length, or NULL when no complete line is buffered. Once the input
+ * has ended, a last line without a newline is returned as well.
+ */
+const char *command_input_line(command_input_t *input, size_t *length)
+{
+  char *start = input->buffer + input->start;
+  size_t available = input->used - input->start;
+  char *newline = memchr(start, '\n', available);
+
+  if (newline != NULL)
+  {
+    *length = newline - start;
+    input->start += *length + 1;
+    return start;
+  }
+  if (available > 0 && (input->ended || available == sizeof(input->buffer)))
+  {
+    *length = available;
+    input->start = input->used;
+    return start;
+  }
+  return NULL;
+}
@@ -0,0 +1,172 @@
+#ifndef __command_h
+#define __command_h
+
+#include <stddef.h>
+#include <stdint.h>
+
+/*
+ * Parsed commands. Every input path turns its requests into a
+ * command_t: the standard input and text clients of the command server
+ * through command_parse, binary clients through command_decode, which
+ * reads fixed fields instead of scanning text.
+ *
+ * command_parse is a single pass over the line, which need not be
+ * terminated, so lines are parsed where they lie in a read buffer. As
+ * with the scanf formats it replaces, whitespace may appear before
+ * numbers and around the parts of a command, and a message longer than
+ * 127 bytes is cut short. A malformed line is reported with what was
+ * wrong and the column where the parser found it.
+ *
+ * The binary protocol is for local clients only, so integers are in
+ * the host's byte order. A binary client opens its connection with
+ * COMMAND_BINARY_MAGIC, then sends request frames, each a
+ * command_frame_t header followed by the message bytes (no
+ * terminator, and no NUL or control bytes), with a duration of at most
+ * DURATION_MAX_USEC, as a text command has. The server answers every request, in order, with a
+ * command_reply_frame_t, and sends a command_event_frame_t followed by
+ * the message bytes for every event delivered to a subscriber. The
+ * answers to a query come first, as COMMAND_ANSWER event frames, then
+ * its reply.
+ */
+
+// Kinds of command
+typedef enum command_type
+{
+  COMMAND_STATS,                // Stats
+  COMMAND_START_ALARM,          // Start_Alarm(id): Group(g) duration message
+  COMMAND_START_PERIODIC_ALARM, // Start_Periodic_Alarm(id): Group(g) period message
+  COMMAND_CHANGE_ALARM,         // Change_Alarm(id): Group(g) duration message
+  COMMAND_CANCEL_ALARM,         // Cancel_Alarm(id)
+  COMMAND_CHANGE_GROUP,         // Change_Group(g): NewGroup(h)
+  COMMAND_CANCEL_GROUP,         // Cancel_Group(g)
+  COMMAND_DELAY_GROUP,          // Delay_Group(g) +duration
+  COMMAND_SUBSCRIBE,            // Subscribe, only accepted by the command server
+  COMMAND_QUERY_ALARM,          // Query_Alarm(id)
+  COMMAND_LIST_GROUP,           // List_Group(g)
+  COMMAND_COUNT,                // Count
+  COMMAND_TYPES                 // Number of command types
+} command_type_t;
+
+// Outcome of a command, as replied to a command server client
+typedef enum command_status
+{
+  COMMAND_ACCEPTED,  // Carried out, or queued for the monitor
+  COMMAND_DUPLICATE, // Start_Alarm for an ID already in use
+  COMMAND_INVALID    // Malformed command
+} command_status_t;
+
+// What was wrong with a malformed command
+typedef enum command_error_code
+{
+  COMMAND_ERROR_NONE,
+  COMMAND_ERROR_UNKNOWN,          // Not a command name
+  COMMAND_ERROR_EXPECTED_OPEN,    // Missing "("
+  COMMAND_ERROR_EXPECTED_NUMBER,  // Missing ID or group number
+  COMMAND_ERROR_NUMBER_RANGE,     // ID or group number does not fit an int
+  COMMAND_ERROR_EXPECTED_CLOSE,   // Missing ")"
+  COMMAND_ERROR_EXPECTED_COLON,   // Missing ":"
+  COMMAND_ERROR_EXPECTED_GROUP,   // Missing "Group("
+  COMMAND_ERROR_EXPECTED_NEW_GROUP, // Missing "NewGroup("
+  COMMAND_ERROR_EXPECTED_PLUS,    // Missing "+" before a delay
+  COMMAND_ERROR_EXPECTED_DURATION, // Missing duration
+  COMMAND_ERROR_BAD_DURATION,     // Duration parse_duration does not accept
+  COMMAND_ERROR_ZERO_PERIOD,      // Start_Periodic_Alarm with a zero period
+  COMMAND_ERROR_EXPECTED_MESSAGE, // Missing message
+  COMMAND_ERROR_TRAILING_TEXT,    // Text after a complete command
+  COMMAND_ERROR_SAME_GROUP,       // Change_Group to the group itself
+  COMMAND_ERROR_BAD_FRAME,        // Binary frame of an unknown type or size
+  COMMAND_ERROR_BAD_MESSAGE,      // Binary message with a NUL or control byte
+  COMMAND_ERRORS                  // Number of error codes
+} command_error_code_t;
+
+// Where and why a command was rejected
+typedef struct command_error
+{
+  command_error_code_t code; // What was wrong
+  size_t column;             // Offset into the line where it was found
+} command_error_t;
+
+typedef struct command
+{
+  command_type_t type;    // What the command asks for
+  int alarm_id;           // Alarm the command names
+  int group_id;           // Group of the alarm, or the group a group command applies to
+  int new_group_id;       // Target group of Change_Group
+  uint64_t duration_usec; // Duration, period or delay
+  char duration[32];      // Duration as given, for the log
+  char message[128];      // Alarm message
+} command_t;
+
+#define COMMAND_BINARY_MAGIC "\0ALM" // First four bytes of a binary connection
+
+// Header of a binary request frame
+typedef struct command_frame
+{
+  uint32_t length;        // Bytes after this field, message included
+  uint8_t type;           // command_type_t
+  uint8_t reserved[3];
+  int32_t alarm_id;
+  int32_t group_id;
+  int32_t new_group_id;
+  uint64_t duration_usec;
+} __attribute__((packed)) command_frame_t;
+
+// Kinds of frame sent by the command server
+typedef enum command_reply_kind
+{
+  COMMAND_REPLY = 1, // Answer to a request
+  COMMAND_EVENT = 2, // Event delivered to a subscriber
+  COMMAND_ANSWER = 3 // Answer to a query, sent before the request's reply
+} command_reply_kind_t;
+
+// Binary reply frame
+typedef struct command_reply_frame
+{
+  uint32_t length;        // Bytes after this field
+  uint8_t kind;           // COMMAND_REPLY
+  uint8_t status;         // command_status_t
+  uint8_t error;          // command_error_code_t of an invalid command
+  uint8_t reserved;
+} __attribute__((packed)) command_reply_frame_t;
+
+// Header of a binary event frame
+typedef struct command_event_frame
+{
+  uint32_t length;        // Bytes after this field, message included
+  uint8_t kind;           // COMMAND_EVENT or COMMAND_ANSWER
+  uint8_t type;           // log_event_type_t
+  uint8_t reserved[2];
+  int32_t alarm_id;
+  int32_t group_id;
+  uint64_t thread_id;
+  int64_t time;           // Wall-clock time of the event, in seconds
+} __attribute__((packed)) command_event_frame_t;
+
+#define COMMAND_FRAME_MAX (sizeof(command_frame_t) + 127) // Largest valid request frame
+
+#define COMMAND_INPUT_SIZE 65536 // Bytes buffered by a command_input_t
+
+/*
+ * Buffered reader that splits an input stream into lines, so a burst
+ * of commands costs one read instead of one per line. A line longer
+ * than the buffer is passed on in buffer-sized pieces.
+ */
+typedef struct command_input
+{
+  int fd;                          // Descriptor read from
+  char buffer[COMMAND_INPUT_SIZE]; // Input not yet split into lines
+  size_t start;                    // Offset of the first byte not yet returned
+  size_t used;                     // Offset one past the last byte read
+  int ended;                       // Set once a read has returned end of input
+} command_input_t;
+
+int command_parse(const char *line, size_t length, command_t *command, command_error_t *error);
+const char *command_error_text(command_error_code_t code);
+int command_decode(const void *frame, size_t size, command_t *command, command_error_t *error);
+size_t command_encode(const command_t *command, void *frame);
+size_t command_format(const command_t *command, char *line, size_t size);
+void command_input_init(command_input_t *input, int fd);
+int command_input_fill(command_input_t *input, size_t limit);
+const char *command_input_line(command_input_t *input, size_t *length);
+
+#endif
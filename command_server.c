@@ -0,0 +1,683 @@
+#include <pthread.h>
+#include <fcntl.h>
+#include <sys/epoll.h>
+#include <sys/eventfd.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+#include "errors.h"
+#include "event_log.h"
+#include "command_server.h"
+
+// Protocols a connection may speak
+typedef enum connection_protocol
+{
+  PROTOCOL_UNKNOWN, // Nothing read yet
+  PROTOCOL_TEXT,    // Command lines
+  PROTOCOL_BINARY   // Frames, after COMMAND_BINARY_MAGIC
+} connection_protocol_t;
+
+/*
+ * Structure for client connections. The input is only touched by the
+ * server thread. The output is also appended to by the event log
+ * writer for a subscriber, so it is protected by output_mutex.
+ *
+ * LOCKING PROTOCOL:
+ *
+ * Locks are taken in the order server_mutex, output_mutex. A
+ * connection is only freed after it has been taken off the subscriber
+ * list under server_mutex.
+ */
+typedef struct connection
+{
+  int fd;                                   // Client socket
+  connection_protocol_t protocol;           // Protocol picked by the first bytes
+  int subscribed;                           // Set once the client has sent Subscribe
+  int dropped;                              // Set when a subscriber fell too far behind, protected by output_mutex
+  uint32_t events;                          // Events the socket is polled for
+  char input[COMMAND_SERVER_INPUT_SIZE];    // Requests not yet carried out
+  size_t input_used;                        // Bytes held in input
+  pthread_mutex_t output_mutex;             // Protects the output buffer and dropped
+  char *output;                             // Replies and events not yet sent
+  size_t output_start;                      // Offset of the first unsent byte
+  size_t output_used;                       // Offset one past the last unsent byte
+  size_t output_capacity;                   // Size of output
+  struct connection *prev;                  // Previous subscriber
+  struct connection *next;                  // Next subscriber
+} connection_t;
+
+static int server_epoll = -1;              // Polls the listening socket, the wakeup eventfd and the clients
+static int listen_fd = -1;                 // Listening socket
+static int wake_fd = -1;                   // Signaled when events are queued for subscribers
+static int wake_pending = 0;               // Set while wake_fd is signaled, updated atomically
+static command_handler_fn command_handler; // Carries out commands
+static char listener_tag, wake_tag;        // Epoll data of the listening socket and of wake_fd
+static pthread_mutex_t server_mutex = PTHREAD_MUTEX_INITIALIZER; // Protects the subscriber list
+static connection_t *subscribers = NULL;   // Connections that sent Subscribe
+static connection_t *closed = NULL;        // Connections closed during this poll, freed at its end
+
+// Text replies, by command_status_t
+static const char *text_replies[] = {"OK\n", "DUPLICATE\n", "INVALID\n"};
+
+// Append bytes to a connection's output; the caller holds output_mutex
+static void connection_append(connection_t *connection, const void *data, size_t size)
+{
+  if (connection->output_used + size > connection->output_capacity)
+  {
+    // Move the unsent bytes to the front before growing
+    size_t unsent = connection->output_used - connection->output_start;
+    memmove(connection->output, connection->output + connection->output_start, unsent);
+    connection->output_start = 0;
+    connection->output_used = unsent;
+    while (connection->output_used + size > connection->output_capacity)
+    {
+      connection->output_capacity *= 2;
+    }
+    connection->output = realloc(connection->output, connection->output_capacity);
+    if (connection->output == NULL)
+    {
+      errno_abort("Grow connection output");
+    }
+  }
+  memcpy(connection->output + connection->output_used, data, size);
+  connection->output_used += size;
+}
+
+// Return the number of unsent bytes of a connection
+static size_t connection_backlog(connection_t *connection)
+{
+  pthread_mutex_lock(&connection->output_mutex);
+  size_t backlog = connection->output_used - connection->output_start;
+  pthread_mutex_unlock(&connection->output_mutex);
+  return backlog;
+}
+
+/*
+ * Append the reply to one command. A text reply to a malformed command
+ * also says what was wrong and where.
+ */
+static void connection_reply(connection_t *connection, command_status_t status, const command_error_t *error)
+{
+  pthread_mutex_lock(&connection->output_mutex);
+  if (connection->protocol == PROTOCOL_TEXT && error != NULL)
+  {
+    char reply[96];
+    int length = snprintf(reply, sizeof(reply), "INVALID column %zu: %s\n", error->column + 1,
+                          command_error_text(error->code));
+    connection_append(connection, reply, length);
+  }
+  else if (connection->protocol == PROTOCOL_TEXT)
+  {
+    connection_append(connection, text_replies[status], strlen(text_replies[status]));
+  }
+  else
+  {
+    command_reply_frame_t reply = {sizeof(reply) - sizeof(reply.length), COMMAND_REPLY, status,
+                                   error != NULL ? error->code : COMMAND_ERROR_NONE, 0};
+    connection_append(connection, &reply, sizeof(reply));
+  }
+  pthread_mutex_unlock(&connection->output_mutex);
+}
+
+// Fill in the binary frame header of an event or answer record
+static size_t event_frame(const log_record_t *record, command_reply_kind_t kind, command_event_frame_t *frame)
+{
+  size_t message_length = strnlen(record->message, sizeof(record->message));
+
+  memset(frame, 0, sizeof(*frame));
+  frame->length = sizeof(*frame) - sizeof(frame->length) + message_length;
+  frame->kind = kind;
+  frame->type = record->type;
+  frame->alarm_id = record->alarm_id;
+  frame->group_id = record->group_id;
+  frame->thread_id = record->thread_id;
+  frame->time = record->time;
+  return message_length;
+}
+
+// Append the line of one printed event, without its blank line, after a tag
+static void connection_append_line(connection_t *connection, const char *tag, const char *line, int length)
+{
+  while (length > 0 && line[length - 1] == '\n')
+  {
+    length--;
+  }
+  connection_append(connection, tag, strlen(tag));
+  connection_append(connection, line, length);
+  connection_append(connection, "\n", 1);
+}
+
+// Queue one answer to a query, ahead of the query's reply; arg is the connection
+static void connection_answer(const log_record_t *answer, void *arg)
+{
+  connection_t *connection = arg;
+
+  pthread_mutex_lock(&connection->output_mutex);
+  if (connection->protocol == PROTOCOL_TEXT)
+  {
+    char line[EVENT_LOG_LINE_MAX];
+    connection_append_line(connection, "ANSWER ", line, event_log_format(answer, line));
+  }
+  else
+  {
+    command_event_frame_t frame;
+    size_t message_length = event_frame(answer, COMMAND_ANSWER, &frame);
+    connection_append(connection, &frame, sizeof(frame));
+    connection_append(connection, answer->message, message_length);
+  }
+  pthread_mutex_unlock(&connection->output_mutex);
+}
+
+// Carry out one command for a connection and queue its reply
+static void connection_execute(connection_t *connection, const command_t *command)
+{
+  command_status_t status = COMMAND_ACCEPTED;
+
+  if (command->type == COMMAND_SUBSCRIBE)
+  {
+    pthread_mutex_lock(&server_mutex);
+    if (!connection->subscribed)
+    {
+      connection->subscribed = 1;
+      connection->prev = NULL;
+      connection->next = subscribers;
+      if (subscribers != NULL)
+      {
+        subscribers->prev = connection;
+      }
+      subscribers = connection;
+    }
+    pthread_mutex_unlock(&server_mutex);
+  }
+  else
+  {
+    status = command_handler(command, connection_answer, connection);
+  }
+  connection_reply(connection, status, NULL);
+}
+
+/*
+ * Carry out the complete requests in a connection's input, stopping
+ * while its unsent output is over COMMAND_SERVER_BACKLOG_HIGH. Returns
+ * 0 if the client broke the protocol and must be disconnected.
+ */
+static int connection_process(connection_t *connection)
+{
+  size_t offset = 0;
+  command_t command;
+  command_error_t error;
+
+  if (connection->protocol == PROTOCOL_UNKNOWN && connection->input_used > 0)
+  {
+    if (connection->input[0] != COMMAND_BINARY_MAGIC[0])
+    {
+      connection->protocol = PROTOCOL_TEXT;
+    }
+    else if (connection->input_used >= 4)
+    {
+      if (memcmp(connection->input, COMMAND_BINARY_MAGIC, 4) != 0)
+      {
+        return 0;
+      }
+      connection->protocol = PROTOCOL_BINARY;
+      offset = 4;
+    }
+  }
+
+  while (connection_backlog(connection) < COMMAND_SERVER_BACKLOG_HIGH)
+  {
+    char *start = connection->input + offset;
+    size_t available = connection->input_used - offset;
+
+    if (connection->protocol == PROTOCOL_TEXT)
+    {
+      char *newline = memchr(start, '\n', available);
+      if (newline == NULL)
+      {
+        // A line longer than the whole buffer can never complete
+        if (available == sizeof(connection->input))
+        {
+          return 0;
+        }
+        break;
+      }
+      offset += newline - start + 1;
+      if (newline > start)
+      {
+        if (command_parse(start, newline - start, &command, &error))
+        {
+          connection_execute(connection, &command);
+        }
+        else
+        {
+          connection_reply(connection, COMMAND_INVALID, &error);
+        }
+      }
+    }
+    else if (connection->protocol == PROTOCOL_BINARY)
+    {
+      uint32_t length;
+      if (available < sizeof(length))
+      {
+        break;
+      }
+      memcpy(&length, start, sizeof(length));
+      if (length > COMMAND_FRAME_MAX - sizeof(length))
+      {
+        return 0; // A frame this long is not a command, and the stream cannot be resynchronized
+      }
+      if (available < sizeof(length) + length)
+      {
+        break;
+      }
+      offset += sizeof(length) + length;
+      if (command_decode(start, sizeof(length) + length, &command, &error))
+      {
+        connection_execute(connection, &command);
+      }
+      else
+      {
+        connection_reply(connection, COMMAND_INVALID, &error);
+      }
+    }
+    else
+    {
+      break;
+    }
+  }
+
+  connection->input_used -= offset;
+  memmove(connection->input, connection->input + offset, connection->input_used);
+  return 1;
+}
+
+/*
+ * Send as much of a connection's output as the socket takes. Returns 0
+ * if the connection is gone or was dropped.
+ */
+static int connection_flush(connection_t *connection)
+{
+  int alive = 1;
+
+  pthread_mutex_lock(&connection->output_mutex);
+  while (connection->output_start < connection->output_used && !connection->dropped)
+  {
+    ssize_t sent = send(connection->fd, connection->output + connection->output_start,
+                        connection->output_used - connection->output_start, MSG_NOSIGNAL);
+    if (sent < 0)
+    {
+      if (errno == EINTR)
+      {
+        continue;
+      }
+      alive = errno == EAGAIN;
+      break;
+    }
+    connection->output_start += sent;
+  }
+  if (connection->output_start == connection->output_used)
+  {
+    connection->output_start = connection->output_used = 0;
+  }
+  alive = alive && !connection->dropped;
+  pthread_mutex_unlock(&connection->output_mutex);
+
+  return alive;
+}
+
+/*
+ * Take a connection off the subscriber list and stop polling it. It is
+ * freed at the end of the poll, since events already collected may
+ * still name it.
+ */
+static void connection_close(connection_t *connection)
+{
+  pthread_mutex_lock(&server_mutex);
+  if (connection->subscribed)
+  {
+    if (connection->prev == NULL)
+    {
+      subscribers = connection->next;
+    }
+    else
+    {
+      connection->prev->next = connection->next;
+    }
+    if (connection->next != NULL)
+    {
+      connection->next->prev = connection->prev;
+    }
+  }
+  pthread_mutex_unlock(&server_mutex);
+
+  epoll_ctl(server_epoll, EPOLL_CTL_DEL, connection->fd, NULL);
+  close(connection->fd);
+  connection->fd = -1;
+  connection->next = closed;
+  closed = connection;
+}
+
+/*
+ * Carry out the requests in a connection's input and send the replies,
+ * for as long as that makes progress: requests held back by the backlog
+ * limit are carried out as soon as sending has made room for them.
+ * Returns 0 if the connection must be closed.
+ */
+static int connection_run(connection_t *connection)
+{
+  while (1)
+  {
+    size_t input_used = connection->input_used;
+    if (!connection_process(connection))
+    {
+      return 0;
+    }
+    size_t backlog = connection_backlog(connection);
+    if (!connection_flush(connection))
+    {
+      return 0;
+    }
+
+    // Stop once nothing was carried out or sent, or the client must take more first
+    size_t remaining = connection_backlog(connection);
+    if (connection->input_used == 0 || remaining >= COMMAND_SERVER_BACKLOG_HIGH ||
+        (connection->input_used == input_used && remaining == backlog))
+    {
+      return 1;
+    }
+  }
+}
+
+/*
+ * Carry out what a connection has sent, send what it is owed, and poll
+ * it for what it can take next: requests while its backlog is low and
+ * its input has room, room to send while it has a backlog.
+ */
+static void connection_service(connection_t *connection)
+{
+  if (!connection_run(connection))
+  {
+    connection_close(connection);
+    return;
+  }
+
+  size_t backlog = connection_backlog(connection);
+  int readable = backlog < COMMAND_SERVER_BACKLOG_HIGH && connection->input_used < sizeof(connection->input);
+  uint32_t events = (readable ? EPOLLIN : 0) | (backlog > 0 ? EPOLLOUT : 0);
+  if (events != connection->events)
+  {
+    struct epoll_event event;
+    event.events = events;
+    event.data.ptr = connection;
+    epoll_ctl(server_epoll, EPOLL_CTL_MOD, connection->fd, &event);
+    connection->events = events;
+  }
+}
+
+// Read what a client has sent and serve it
+static void connection_read(connection_t *connection)
+{
+  // A full input is served first; reading into no room would look like the client hanging up
+  if (connection->input_used == sizeof(connection->input))
+  {
+    connection_service(connection);
+    return;
+  }
+
+  ssize_t count = read(connection->fd, connection->input + connection->input_used,
+                       sizeof(connection->input) - connection->input_used);
+  if (count < 0 && (errno == EINTR || errno == EAGAIN))
+  {
+    return;
+  }
+  if (count == 0)
+  {
+    // The client is done sending; answer what it sent before hanging up
+    connection_run(connection);
+  }
+  if (count <= 0)
+  {
+    connection_close(connection);
+    return;
+  }
+  connection->input_used += count;
+  connection_service(connection);
+}
+
+// Accept every pending client
+static void server_accept(void)
+{
+  while (1)
+  {
+    int fd = accept(listen_fd, NULL, NULL);
+    if (fd < 0)
+    {
+      if (errno == EINTR)
+      {
+        continue;
+      }
+      return; // EAGAIN, or a client that went away before it was accepted
+    }
+    fcntl(fd, F_SETFL, O_NONBLOCK);
+    fcntl(fd, F_SETFD, FD_CLOEXEC);
+
+    connection_t *connection = calloc(1, sizeof(connection_t));
+    if (connection == NULL)
+    {
+      errno_abort("Allocate connection");
+    }
+    connection->fd = fd;
+    connection->protocol = PROTOCOL_UNKNOWN;
+    connection->events = EPOLLIN;
+    connection->output_capacity = 4096;
+    connection->output = malloc(connection->output_capacity);
+    if (connection->output == NULL)
+    {
+      errno_abort("Allocate connection output");
+    }
+    pthread_mutex_init(&connection->output_mutex, NULL);
+
+    struct epoll_event event;
+    event.events = EPOLLIN;
+    event.data.ptr = connection;
+    if (epoll_ctl(server_epoll, EPOLL_CTL_ADD, fd, &event) < 0)
+    {
+      errno_abort("Poll connection");
+    }
+  }
+}
+
+// Send the events queued for every subscriber, and disconnect the ones that were dropped
+static void server_deliver_events(void)
+{
+  uint64_t value;
+
+  read(wake_fd, &value, sizeof(value));
+  __atomic_store_n(&wake_pending, 0, __ATOMIC_SEQ_CST);
+
+  // Collect the subscribers first, since serving one may free it
+  pthread_mutex_lock(&server_mutex);
+  size_t count = 0;
+  for (connection_t *connection = subscribers; connection != NULL; connection = connection->next)
+  {
+    count++;
+  }
+  connection_t **pending = malloc((count + 1) * sizeof(connection_t *));
+  if (pending == NULL)
+  {
+    errno_abort("Allocate subscriber list");
+  }
+  count = 0;
+  for (connection_t *connection = subscribers; connection != NULL; connection = connection->next)
+  {
+    pending[count++] = connection;
+  }
+  pthread_mutex_unlock(&server_mutex);
+
+  // Only this thread closes connections, and frees them at the end of the poll
+  for (size_t i = 0; i < count; i++)
+  {
+    if (pending[i]->fd >= 0)
+    {
+      connection_service(pending[i]);
+    }
+  }
+  free(pending);
+}
+
+// Return whether an event is delivered to subscribers
+static int event_is_published(log_event_type_t type)
+{
+  switch (type)
+  {
+  case LOG_ALARM_REMOVED:
+  case LOG_ALARM_FIRED:
+  case LOG_ALARM_CANCELLED:
+  case LOG_DISPLAY_TAKEN_OVER:
+  case LOG_DISPLAY_STOPPED:
+  case LOG_DISPLAY_MESSAGE_CHANGED:
+  case LOG_DISPLAY_PRINTED:
+  case LOG_DISPLAY_THREAD_EXITING:
+    return 1;
+  default:
+    return 0;
+  }
+}
+
+/*
+ * Event log tap: queue an event for every subscriber and wake the
+ * server to send it. Runs on the event log writer thread.
+ */
+static void server_publish(const log_record_t *record, const char *line, int length)
+{
+  if (!event_is_published(record->type))
+  {
+    return;
+  }
+
+  command_event_frame_t frame;
+  size_t message_length = event_frame(record, COMMAND_EVENT, &frame);
+
+  pthread_mutex_lock(&server_mutex);
+  if (subscribers == NULL)
+  {
+    pthread_mutex_unlock(&server_mutex);
+    return;
+  }
+  for (connection_t *connection = subscribers; connection != NULL; connection = connection->next)
+  {
+    pthread_mutex_lock(&connection->output_mutex);
+    if (connection->output_used - connection->output_start > COMMAND_SERVER_BACKLOG_MAX)
+    {
+      connection->dropped = 1;
+    }
+    if (!connection->dropped && connection->protocol == PROTOCOL_TEXT)
+    {
+      connection_append_line(connection, "EVENT ", line, length);
+    }
+    else if (!connection->dropped)
+    {
+      connection_append(connection, &frame, sizeof(frame));
+      connection_append(connection, record->message, message_length);
+    }
+    pthread_mutex_unlock(&connection->output_mutex);
+  }
+  pthread_mutex_unlock(&server_mutex);
+
+  if (!__atomic_exchange_n(&wake_pending, 1, __ATOMIC_SEQ_CST))
+  {
+    uint64_t value = 1;
+    write(wake_fd, &value, sizeof(value));
+  }
+}
+
+/*
+ * Listen on a Unix domain socket at path, replacing a stale socket
+ * file, and carry out clients' commands with handler. Returns a file
+ * descriptor that is readable whenever command_server_poll has work.
+ */
+int command_server_open(const char *path, command_handler_fn handler)
+{
+  struct sockaddr_un address;
+  struct epoll_event event;
+
+  if (strlen(path) >= sizeof(address.sun_path))
+  {
+    fprintf(stderr, "Socket path %s is too long\n", path);
+    exit(1);
+  }
+  memset(&address, 0, sizeof(address));
+  address.sun_family = AF_UNIX;
+  strcpy(address.sun_path, path);
+
+  listen_fd = socket(AF_UNIX, SOCK_STREAM | SOCK_NONBLOCK | SOCK_CLOEXEC, 0);
+  if (listen_fd < 0)
+  {
+    errno_abort("Create socket");
+  }
+  unlink(path);
+  if (bind(listen_fd, (struct sockaddr *)&address, sizeof(address)) < 0 || listen(listen_fd, SOMAXCONN) < 0)
+  {
+    errno_abort("Listen on socket");
+  }
+
+  server_epoll = epoll_create1(EPOLL_CLOEXEC);
+  wake_fd = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC);
+  if (server_epoll < 0 || wake_fd < 0)
+  {
+    errno_abort("Create command server");
+  }
+  event.events = EPOLLIN;
+  event.data.ptr = &listener_tag;
+  epoll_ctl(server_epoll, EPOLL_CTL_ADD, listen_fd, &event);
+  event.data.ptr = &wake_tag;
+  epoll_ctl(server_epoll, EPOLL_CTL_ADD, wake_fd, &event);
+
+  command_handler = handler;
+  event_log_set_tap(server_publish);
+  return server_epoll;
+}
+
+// Wait up to timeout_msec (-1 for no limit) for clients and serve them
+void command_server_poll(int timeout_msec)
+{
+  struct epoll_event events[64];
+
+  int count = epoll_wait(server_epoll, events, 64, timeout_msec);
+  if (count < 0 && errno != EINTR)
+  {
+    errno_abort("Wait for clients");
+  }
+  for (int i = 0; i < count; i++)
+  {
+    connection_t *connection = events[i].data.ptr;
+    if (events[i].data.ptr == &listener_tag)
+    {
+      server_accept();
+    }
+    else if (events[i].data.ptr == &wake_tag)
+    {
+      server_deliver_events();
+    }
+    else if (connection->fd < 0)
+    {
+      continue; // Closed earlier in this poll
+    }
+    else if (events[i].events & (EPOLLIN | EPOLLHUP | EPOLLERR))
+    {
+      connection_read(connection);
+    }
+    else
+    {
+      connection_service(connection);
+    }
+  }
+
+  while (closed != NULL)
+  {
+    connection_t *connection = closed;
+    closed = connection->next;
+    pthread_mutex_destroy(&connection->output_mutex);
+    free(connection->output);
+    free(connection);
+  }
+}
@@ -0,0 +1,48 @@
+#ifndef __command_server_h
+#define __command_server_h
+
+#include "command.h"
+#include "event_log.h"
+
+/*
+ * Local command server. Clients connect to a Unix domain stream socket
+ * and send commands either as text lines, in the syntax read from the
+ * standard input, or as binary frames (see command.h); a connection's
+ * first bytes pick its protocol. A client may send any number of
+ * commands without waiting: every command is answered, in order, and
+ * the replies to everything read in one pass are written back in one
+ * send. A text reply is a line "OK", "DUPLICATE" or "INVALID", which
+ * for a malformed line goes on to give the column and what was wrong
+ * there; empty lines are skipped without a reply.
+ *
+ * The answers to a query command (Query_Alarm, List_Group, Count) are
+ * sent ahead of its reply, one line "ANSWER <printed line>" or one
+ * binary frame of kind COMMAND_ANSWER per line the program would
+ * print for it, and are not printed.
+ *
+ * A client that sends Subscribe is also sent every expiry (removed,
+ * fired and cancelled alarm) and display event the program prints, as
+ * a line "EVENT <printed line>" or a binary event frame. Events are
+ * taken from the event log's tap, so they cost the engine nothing. A
+ * subscriber that falls more than COMMAND_SERVER_BACKLOG_MAX bytes
+ * behind is disconnected rather than slowing the log writer; a client
+ * that does not read its replies is simply not read from until it
+ * does.
+ *
+ * The server runs on whichever thread calls command_server_poll, and
+ * the handler is called on that thread.
+ */
+
+#define COMMAND_SERVER_INPUT_SIZE 16384            // Bytes of requests buffered per connection
+#define COMMAND_SERVER_BACKLOG_HIGH 65536          // Unsent bytes above which a connection is not read
+#define COMMAND_SERVER_BACKLOG_MAX (4 << 20)       // Unsent bytes above which a subscriber is dropped
+
+// Function a handler passes each answer to a query to, with the arg it was given
+typedef void (*command_answer_fn)(const log_record_t *answer, void *arg);
+
+typedef command_status_t (*command_handler_fn)(const command_t *command, command_answer_fn answer, void *arg);
+
+int command_server_open(const char *path, command_handler_fn handler);
+void command_server_poll(int timeout_msec);
+
+#endif
@@ -0,0 +1,198 @@
+#include "errors.h"
+#include "display_pool.h"
+
+// Arguments handed to each worker thread
+typedef struct display_worker_arg
+{
+  display_pool_t *pool;
+  int index;
+} display_worker_arg_t;
+
+// Index of the worker running on this thread, or -1 outside the pool
+static __thread int current_worker = -1;
+
+// Return the default pool size: one worker per online core
+int display_pool_default_workers(void)
+{
+  long cores = sysconf(_SC_NPROCESSORS_ONLN);
+  return cores > 0 ? (int)cores : 1;
+}
+
+// Initialize an empty deque
+static void display_deque_init(display_deque_t *deque)
+{
+  pthread_mutex_init(&deque->mutex, NULL);
+  deque->capacity = 64;
+  deque->head = deque->tail = 0;
+  deque->tasks = malloc(deque->capacity * sizeof(void *));
+  if (deque->tasks == NULL)
+  {
+    errno_abort("Allocate deque");
+  }
+}
+
+// Append a task at the tail, doubling the ring buffer when it is full
+static void display_deque_push(display_deque_t *deque, void *task)
+{
+  pthread_mutex_lock(&deque->mutex);
+  if (deque->tail - deque->head == deque->capacity)
+  {
+    void **tasks = malloc(deque->capacity * 2 * sizeof(void *));
+    if (tasks == NULL)
+    {
+      errno_abort("Grow deque");
+    }
+    for (unsigned i = 0; i < deque->capacity; i++)
+    {
+      tasks[i] = deque->tasks[(deque->head + i) & (deque->capacity - 1)];
+    }
+    free(deque->tasks);
+    deque->tasks = tasks;
+    deque->head = 0;
+    deque->tail = deque->capacity;
+    deque->capacity *= 2;
+  }
+  deque->tasks[deque->tail++ & (deque->capacity - 1)] = task;
+  pthread_mutex_unlock(&deque->mutex);
+}
+
+// Take the oldest task (owner side), or NULL if the deque is empty
+static void *display_deque_take(display_deque_t *deque)
+{
+  void *task = NULL;
+
+  pthread_mutex_lock(&deque->mutex);
+  if (deque->head != deque->tail)
+  {
+    task = deque->tasks[deque->head++ & (deque->capacity - 1)];
+  }
+  pthread_mutex_unlock(&deque->mutex);
+  return task;
+}
+
+// Take the newest task (thief side), or NULL if the deque is empty
+static void *display_deque_steal(display_deque_t *deque)
+{
+  void *task = NULL;
+
+  pthread_mutex_lock(&deque->mutex);
+  if (deque->head != deque->tail)
+  {
+    task = deque->tasks[--deque->tail & (deque->capacity - 1)];
+  }
+  pthread_mutex_unlock(&deque->mutex);
+  return task;
+}
+
+// Find work for a worker: its own deque first, then the other workers' deques
+static void *display_pool_find_task(display_pool_t *pool, int index)
+{
+  void *task = display_deque_take(&pool->deques[index]);
+
+  for (int i = 1; task == NULL && i < pool->worker_count; i++)
+  {
+    task = display_deque_steal(&pool->deques[(index + i) % pool->worker_count]);
+  }
+  if (task != NULL)
+  {
+    __atomic_sub_fetch(&pool->pending, 1, __ATOMIC_SEQ_CST);
+  }
+  return task;
+}
+
+// Start routine of a pool worker
+static void *display_worker_function(void *arg)
+{
+  display_worker_arg_t *worker = (display_worker_arg_t *)arg;
+  display_pool_t *pool = worker->pool;
+  int index = worker->index;
+
+  free(worker);
+  current_worker = index;
+
+  while (1)
+  {
+    void *task = display_pool_find_task(pool, index);
+    if (task != NULL)
+    {
+      pool->run(task);
+      continue;
+    }
+
+    /*
+     * Publish that we are idle before re-checking for work, so a
+     * submitter either sees the pending task count we are about to
+     * read, or sees us idle and signals.
+     */
+    pthread_mutex_lock(&pool->idle_mutex);
+    __atomic_add_fetch(&pool->idle, 1, __ATOMIC_SEQ_CST);
+    while (__atomic_load_n(&pool->pending, __ATOMIC_SEQ_CST) == 0)
+    {
+      pthread_cond_wait(&pool->idle_cond, &pool->idle_mutex);
+    }
+    __atomic_sub_fetch(&pool->idle, 1, __ATOMIC_SEQ_CST);
+    pthread_mutex_unlock(&pool->idle_mutex);
+  }
+  return NULL;
+}
+
+// Create the workers of a pool
+void display_pool_init(display_pool_t *pool, int worker_count, display_task_fn run)
+{
+  int status;
+
+  pool->worker_count = worker_count;
+  pool->run = run;
+  pool->next_victim = 0;
+  pool->pending = 0;
+  pool->idle = 0;
+  pthread_mutex_init(&pool->idle_mutex, NULL);
+  pthread_cond_init(&pool->idle_cond, NULL);
+  pool->deques = malloc(worker_count * sizeof(display_deque_t));
+  pool->workers = malloc(worker_count * sizeof(pthread_t));
+  if (pool->deques == NULL || pool->workers == NULL)
+  {
+    errno_abort("Allocate display pool");
+  }
+
+  for (int i = 0; i < worker_count; i++)
+  {
+    display_deque_init(&pool->deques[i]);
+  }
+  for (int i = 0; i < worker_count; i++)
+  {
+    display_worker_arg_t *worker = malloc(sizeof(display_worker_arg_t));
+    if (worker == NULL)
+    {
+      errno_abort("Allocate display worker");
+    }
+    worker->pool = pool;
+    worker->index = i;
+    status = pthread_create(&pool->workers[i], NULL, display_worker_function, worker);
+    if (status != 0)
+    {
+      err_abort(status, "Create display worker");
+    }
+  }
+}
+
+// Queue a task for execution by one of the workers
+void display_pool_submit(display_pool_t *pool, void *task)
+{
+  int index = current_worker;
+
+  if (index < 0)
+  {
+    index = (int)(__atomic_fetch_add(&pool->next_victim, 1, __ATOMIC_RELAXED) % pool->worker_count);
+  }
+  display_deque_push(&pool->deques[index], task);
+  __atomic_add_fetch(&pool->pending, 1, __ATOMIC_SEQ_CST);
+
+  // Wake a worker only if one may be blocked waiting for work
+  if (__atomic_load_n(&pool->idle, __ATOMIC_SEQ_CST) > 0)
+  {
+    pthread_mutex_lock(&pool->idle_mutex);
+    pthread_cond_signal(&pool->idle_cond);
+    pthread_mutex_unlock(&pool->idle_mutex);
+  }
+}
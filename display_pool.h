@@ -0,0 +1,47 @@
+#ifndef __display_pool_h
+#define __display_pool_h
+
+#include <pthread.h>
+
+/*
+ * Fixed-size worker pool that runs display tasks. Each worker owns a
+ * deque of tasks: it takes work from the head of its own deque and,
+ * when that is empty, steals from the tail of another worker's deque.
+ * Tasks submitted from a worker go to that worker's deque; tasks
+ * submitted from any other thread are spread round-robin.
+ *
+ * The pool does not order tasks. A caller that needs ordering (the
+ * display units do) must keep each of its tasks in at most one deque
+ * at a time and resubmit it only after its run has finished.
+ */
+
+typedef void (*display_task_fn)(void *task);
+
+// Per-worker double-ended task queue, stored as a growable ring buffer
+typedef struct display_deque
+{
+  pthread_mutex_t mutex; // Protects the ring buffer
+  void **tasks;          // Ring buffer of task pointers
+  unsigned capacity;     // Size of the ring buffer (power of two)
+  unsigned head;         // Index of the oldest task
+  unsigned tail;         // Index one past the newest task
+} display_deque_t;
+
+typedef struct display_pool
+{
+  int worker_count;          // Number of worker threads
+  display_task_fn run;       // Function applied to every task
+  display_deque_t *deques;   // One deque per worker
+  pthread_t *workers;        // Worker thread IDs
+  unsigned next_victim;      // Round-robin target for external submits
+  int pending;               // Tasks submitted but not yet taken, updated atomically
+  int idle;                  // Workers blocked in idle_cond, updated atomically
+  pthread_mutex_t idle_mutex; // Mutex for idle_cond
+  pthread_cond_t idle_cond;  // Signaled when work arrives for idle workers
+} display_pool_t;
+
+void display_pool_init(display_pool_t *pool, int worker_count, display_task_fn run);
+void display_pool_submit(display_pool_t *pool, void *task);
+int display_pool_default_workers(void);
+
+#endif
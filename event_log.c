@@ -0,0 +1,586 @@
+#include <pthread.h>
+#include <limits.h>
+#include <sched.h>
+#include <sys/uio.h>
+#include "errors.h"
+#include "event_log.h"
+
+/*
+ * Single-producer/single-consumer ring of records. The owning thread
+ * advances tail; the writer advances head while holding drain_mutex.
+ * The owning thread may grow the ring, under drain_mutex, while a sink
+ * is running (see log_event).
+ */
+typedef struct log_ring
+{
+  log_record_t *records; // Ring storage, size records
+  unsigned size;         // Records the ring holds (power of two)
+  unsigned head;         // Next record to write out, updated atomically
+  unsigned tail;         // Next free slot, updated atomically
+  int retired;           // Set once the owning thread has exited, updated atomically
+  struct log_ring *next; // Next ring in the writer's list
+} log_ring_t;
+
+#define LOG_BATCH 64     // Lines formatted per writev call
+
+static log_ring_t *log_rings = NULL;                            // Every registered ring, newest first
+static pthread_mutex_t ring_list_mutex = PTHREAD_MUTEX_INITIALIZER; // Protects log_rings updates
+static pthread_mutex_t drain_mutex = PTHREAD_MUTEX_INITIALIZER; // Serializes consumers of the rings
+static pthread_cond_t drain_cond = PTHREAD_COND_INITIALIZER;    // Signaled when a consumer finishes delivering
+static int draining = 0;                                        // Set while a consumer delivers a batch, under drain_mutex
+static __thread int thread_draining = 0;                        // Set while this thread delivers a batch
+static int sink_running = 0;                                    // Set while a sink is called, updated atomically
+static pthread_mutex_t writer_mutex = PTHREAD_MUTEX_INITIALIZER; // Mutex for writer_cond
+static pthread_cond_t writer_cond = PTHREAD_COND_INITIALIZER;  // Signaled when records arrive for a sleeping writer
+static int writer_sleeping = 0;                                 // Set while the writer waits, updated atomically
+static __thread log_ring_t *thread_ring = NULL;                 // This thread's ring
+static pthread_key_t ring_key;                                  // Retires a thread's ring when the thread exits
+static pthread_once_t ring_key_once = PTHREAD_ONCE_INIT;        // Creates ring_key
+static int retired_rings = 0;                                   // Retired rings not yet freed, updated atomically
+static event_log_tap_fn log_tap = NULL;                         // Function shown every record, set atomically
+static event_log_sink_fn log_sink = NULL;                       // Function handed every record instead of printing, set while no batch is delivered
+static void *log_sink_arg = NULL;                               // Argument of log_sink
+static uint64_t log_sequence = 0;                               // Sequence number of the next record logged, updated atomically
+static uint64_t drained_sequence = 0;                           // Sequence number of the next record to write out, under drain_mutex
+
+// Key destructor: retire the ring of an exiting thread, for the writer to free once it is drained
+static void log_retire_ring(void *arg)
+{
+  log_ring_t *ring = arg;
+
+  thread_ring = NULL;
+  __atomic_store_n(&ring->retired, 1, __ATOMIC_RELEASE);
+  __atomic_add_fetch(&retired_rings, 1, __ATOMIC_RELAXED);
+}
+
+static void log_create_ring_key(void)
+{
+  int status = pthread_key_create(&ring_key, log_retire_ring);
+  if (status != 0)
+  {
+    err_abort(status, "Create log ring key");
+  }
+}
+
+// Return this thread's ring, registering a new one on first use
+static log_ring_t *log_thread_ring(void)
+{
+  if (thread_ring == NULL)
+  {
+    log_ring_t *ring = calloc(1, sizeof(log_ring_t));
+    if (ring != NULL)
+    {
+      ring->size = EVENT_LOG_RING_SIZE;
+      ring->records = malloc(ring->size * sizeof(log_record_t));
+    }
+    if (ring == NULL || ring->records == NULL)
+    {
+      errno_abort("Allocate log ring");
+    }
+    pthread_mutex_lock(&ring_list_mutex);
+    ring->next = log_rings;
+    __atomic_store_n(&log_rings, ring, __ATOMIC_RELEASE);
+    pthread_mutex_unlock(&ring_list_mutex);
+    thread_ring = ring;
+    pthread_once(&ring_key_once, log_create_ring_key);
+    pthread_setspecific(ring_key, ring);
+  }
+  return thread_ring;
+}
+
+// Wake the writer if it is waiting for records
+static void log_wake_writer(void)
+{
+  if (__atomic_load_n(&writer_sleeping, __ATOMIC_SEQ_CST))
+  {
+    // Clearing the flag under the mutex stops a writer that has not reached its wait yet
+    pthread_mutex_lock(&writer_mutex);
+    __atomic_store_n(&writer_sleeping, 0, __ATOMIC_SEQ_CST);
+    pthread_cond_signal(&writer_cond);
+    pthread_mutex_unlock(&writer_mutex);
+  }
+}
+
+// Format the "at" time of a record
+static void log_format_time(time_t time, char *buffer, size_t size)
+{
+  struct tm tm;
+  localtime_r(&time, &tm);
+  strftime(buffer, size, "%H:%M:%S", &tm);
+}
+
+// Turn a record into its output line, of up to EVENT_LOG_LINE_MAX bytes; returns the line length
+int event_log_format(const log_record_t *record, char *line)
+{
+  char time_str[30];
+  int length = 0;
+
+  log_format_time(record->time, time_str, sizeof(time_str));
+
+  switch (record->type)
+  {
+  case LOG_PROMPT:
+    length = snprintf(line, EVENT_LOG_LINE_MAX, "Alarm> ");
+    break;
+  case LOG_DUPLICATE_ALARM:
+    length = snprintf(line, EVENT_LOG_LINE_MAX, "Alarm with ID %d already exists. Ignoring command.\n",
+                      record->alarm_id);
+    break;
+  case LOG_DISPLAY_THREAD_CREATED:
+    length = snprintf(line, EVENT_LOG_LINE_MAX, "Main Thread Created New Display Alarm Thread %lu For Alarm(%d) at %s: Group(%d) %s\n\n",
+                      record->thread_id, record->alarm_id, time_str, record->group_id, record->message);
+    break;
+  case LOG_DISPLAY_THREAD_ASSIGNED:
+    length = snprintf(line, EVENT_LOG_LINE_MAX, "Main Thread %lu Assigned to Display Alarm(%d) at %s: Group(%d) %s\n",
+                      record->thread_id, record->alarm_id, time_str, record->group_id, record->message);
+    break;
+  case LOG_ALARM_INSERTED:
+    length = snprintf(line, EVENT_LOG_LINE_MAX, "Alarm(%d) Inserted by Main Thread %lu Into Alarm List at %s: Group(%d) %s\n\n",
+                      record->alarm_id, record->thread_id, time_str, record->group_id, record->message);
+    break;
+  case LOG_CHANGE_REQUEST_INSERTED:
+    length = snprintf(line, EVENT_LOG_LINE_MAX, "Change Alarm Request(%d) Inserted by Main Thread %lu Into Alarm List at %s: Group(%d) %s\n",
+                      record->alarm_id, record->thread_id, time_str, record->group_id, record->message);
+    break;
+  case LOG_ALARM_CHANGED:
+    length = snprintf(line, EVENT_LOG_LINE_MAX, "Alarm Monitor Thread %lu Has Changed Alarm(%d) at %s: Group(%d) %s\n",
+                      record->thread_id, record->alarm_id, time_str, record->group_id, record->message);
+    break;
+  case LOG_CHANGE_REQUEST_INVALID:
+    length = snprintf(line, EVENT_LOG_LINE_MAX, "Invalid Change Alarm Request(%d) at %s: Group(%d) %s\n",
+                      record->alarm_id, time_str, record->group_id, record->message);
+    break;
+  case LOG_CANCEL_REQUEST_INSERTED:
+    length = snprintf(line, EVENT_LOG_LINE_MAX, "Cancel Alarm Request(%d) Inserted by Main Thread %lu Into Alarm List at %s\n",
+                      record->alarm_id, record->thread_id, time_str);
+    break;
+  case LOG_ALARM_CANCELLED:
+    length = snprintf(line, EVENT_LOG_LINE_MAX, "Alarm Monitor Thread %lu Has Cancelled Alarm(%d) at %s: Group(%d) %s\n",
+                      record->thread_id, record->alarm_id, time_str, record->group_id, record->message);
+    break;
+  case LOG_CANCEL_REQUEST_INVALID:
+    length = snprintf(line, EVENT_LOG_LINE_MAX, "Invalid Cancel Alarm Request(%d) at %s\n",
+                      record->alarm_id, time_str);
+    break;
+  case LOG_CHANGE_GROUP_REQUEST_INSERTED:
+    length = snprintf(line, EVENT_LOG_LINE_MAX, "Change Group Request(%d) Inserted by Main Thread %lu Into Alarm List at %s: NewGroup(%d)\n",
+                      record->group_id, record->thread_id, time_str, record->alarm_id);
+    break;
+  case LOG_CANCEL_GROUP_REQUEST_INSERTED:
+    length = snprintf(line, EVENT_LOG_LINE_MAX, "Cancel Group Request(%d) Inserted by Main Thread %lu Into Alarm List at %s\n",
+                      record->group_id, record->thread_id, time_str);
+    break;
+  case LOG_DELAY_GROUP_REQUEST_INSERTED:
+    length = snprintf(line, EVENT_LOG_LINE_MAX, "Delay Group Request(%d) Inserted by Main Thread %lu Into Alarm List at %s: +%s\n",
+                      record->group_id, record->thread_id, time_str, record->message);
+    break;
+  case LOG_GROUP_REQUEST_INVALID:
+    length = snprintf(line, EVENT_LOG_LINE_MAX, "Invalid %s Group Request(%d) at %s\n",
+                      record->message, record->group_id, time_str);
+    break;
+  case LOG_ALARM_REMOVED:
+    length = snprintf(line, EVENT_LOG_LINE_MAX, "Alarm Monitor Thread %lu Has Removed Alarm(%d) at %s: Group(%d) %s\n",
+                      record->thread_id, record->alarm_id, time_str, record->group_id, record->message);
+    break;
+  case LOG_ALARM_FIRED:
+    length = snprintf(line, EVENT_LOG_LINE_MAX, "Alarm Monitor Thread %lu Has Fired Periodic Alarm(%d) at %s: Group(%d) %s\n",
+                      record->thread_id, record->alarm_id, time_str, record->group_id, record->message);
+    break;
+  case LOG_DISPLAY_TAKEN_OVER:
+    length = snprintf(line, EVENT_LOG_LINE_MAX, "Display Thread %lu Has Taken Over Printing Message of Alarm(%d) at %s: Changed Group(%d) %s\n",
+                      record->thread_id, record->alarm_id, time_str, record->group_id, record->message);
+    break;
+  case LOG_DISPLAY_STOPPED:
+    length = snprintf(line, EVENT_LOG_LINE_MAX, "Display Thread %lu Has Stopped Printing Message of Alarm(%d) at %s: Changed Group(%d) %s\n",
+                      record->thread_id, record->alarm_id, time_str, record->group_id, record->message);
+    break;
+  case LOG_DISPLAY_MESSAGE_CHANGED:
+    length = snprintf(line, EVENT_LOG_LINE_MAX, "Display Thread %lu Starts to Print Changed Message Alarm(%d) at %s: Group(%d) %s\n",
+                      record->thread_id, record->alarm_id, time_str, record->group_id, record->message);
+    break;
+  case LOG_DISPLAY_PRINTED:
+    length = snprintf(line, EVENT_LOG_LINE_MAX, "Alarm (%d) Printed by Alarm Display Thread %lu at %s: Group(%d) %s\n",
+                      record->alarm_id, record->thread_id, time_str, record->group_id, record->message);
+    break;
+  case LOG_DISPLAY_THREAD_EXITING:
+    length = snprintf(line, EVENT_LOG_LINE_MAX, "No More Alarms in Group(%d): Display Thread %lu exiting at %s\n",
+                      record->group_id, record->thread_id, time_str);
+    break;
+  case LOG_STATS:
+    length = snprintf(line, EVENT_LOG_LINE_MAX, "%s\n", record->message);
+    break;
+  case LOG_QUERY_ALARM:
+    length = snprintf(line, EVENT_LOG_LINE_MAX, "Alarm(%d) Queried: Group(%d) Expires at %s: %s\n",
+                      record->alarm_id, record->group_id, time_str, record->message);
+    break;
+  case LOG_QUERY_PERIODIC_ALARM:
+    length = snprintf(line, EVENT_LOG_LINE_MAX, "Periodic Alarm(%d) Queried: Group(%d) Fires Next at %s: %s\n",
+                      record->alarm_id, record->group_id, time_str, record->message);
+    break;
+  case LOG_QUERY_NOT_FOUND:
+    length = snprintf(line, EVENT_LOG_LINE_MAX, "Alarm(%d) Not Found at %s\n", record->alarm_id, time_str);
+    break;
+  case LOG_GROUP_LISTED:
+    length = snprintf(line, EVENT_LOG_LINE_MAX, "Group(%d) Has %d Alarms at %s\n",
+                      record->group_id, record->alarm_id, time_str);
+    break;
+  case LOG_ALARM_COUNT:
+    length = snprintf(line, EVENT_LOG_LINE_MAX, "%d Alarms in %d Groups at %s\n",
+                      record->alarm_id, record->group_id, time_str);
+    break;
+  }
+
+  // snprintf reports the untruncated length
+  return length < EVENT_LOG_LINE_MAX ? length : EVENT_LOG_LINE_MAX - 1;
+}
+
+// Write a batch of lines, retrying on short writes
+static void log_write(struct iovec *iov, int count)
+{
+  while (count > 0)
+  {
+    ssize_t written = writev(STDOUT_FILENO, iov, count);
+    if (written < 0)
+    {
+      if (errno == EINTR)
+      {
+        continue;
+      }
+      return; // Standard output is gone; drop the batch
+    }
+
+    // Skip the fully written lines and trim a partially written one
+    while (count > 0 && (size_t)written >= iov->iov_len)
+    {
+      written -= iov->iov_len;
+      iov++;
+      count--;
+    }
+    if (count > 0)
+    {
+      iov->iov_base = (char *)iov->iov_base + written;
+      iov->iov_len -= written;
+    }
+  }
+}
+
+/*
+ * Return the ring whose oldest record has the lowest sequence number,
+ * or NULL if every ring is empty. The caller holds drain_mutex.
+ */
+static log_ring_t *log_next_ring(void)
+{
+  log_ring_t *next = NULL;
+  uint64_t next_sequence = 0;
+
+  for (log_ring_t *ring = __atomic_load_n(&log_rings, __ATOMIC_ACQUIRE); ring != NULL; ring = ring->next)
+  {
+    unsigned head = ring->head;
+    if (head != __atomic_load_n(&ring->tail, __ATOMIC_ACQUIRE))
+    {
+      uint64_t sequence = ring->records[head & (ring->size - 1)].sequence;
+      if (next == NULL || sequence < next_sequence)
+      {
+        next = ring;
+        next_sequence = sequence;
+      }
+    }
+  }
+  return next;
+}
+
+/*
+ * Unlink and free every retired ring that has been drained, so threads
+ * that come and go leave nothing behind for the writer to scan. The
+ * caller holds drain_mutex, which every reader of the list holds.
+ */
+static void log_free_retired_rings(void)
+{
+  pthread_mutex_lock(&ring_list_mutex);
+  log_ring_t **link = &log_rings;
+  while (*link != NULL)
+  {
+    log_ring_t *ring = *link;
+    if (__atomic_load_n(&ring->retired, __ATOMIC_ACQUIRE) &&
+        ring->head == __atomic_load_n(&ring->tail, __ATOMIC_ACQUIRE))
+    {
+      __atomic_store_n(link, ring->next, __ATOMIC_RELEASE);
+      __atomic_sub_fetch(&retired_rings, 1, __ATOMIC_RELAXED);
+      free(ring->records);
+      free(ring);
+      continue;
+    }
+    link = &ring->next;
+  }
+  pthread_mutex_unlock(&ring_list_mutex);
+}
+
+/*
+ * Copy up to LOG_BATCH records, merging the rings by sequence number,
+ * into batch. Returns the number copied. The caller holds drain_mutex.
+ *
+ * A record whose thread has taken its sequence number but not yet
+ * published it holds back every later one, so a line is never written
+ * ahead of one logged before it; the writer yields until it appears,
+ * which takes no longer than filling in one record.
+ */
+static int log_take_batch(log_record_t *batch)
+{
+  int count = 0;
+  log_ring_t *ring;
+
+  while (count < LOG_BATCH && (ring = log_next_ring()) != NULL)
+  {
+    unsigned head = ring->head;
+    log_record_t *record = &ring->records[head & (ring->size - 1)];
+    if (record->sequence != drained_sequence)
+    {
+      sched_yield(); // An earlier record is still being filled in
+      continue;
+    }
+    drained_sequence++;
+
+    // Records are copied out of the ring, so the slot can be reused right away
+    batch[count++] = *record;
+    __atomic_store_n(&ring->head, head + 1, __ATOMIC_RELEASE);
+  }
+  return count;
+}
+
+// Hand a batch of records to the sink, or format and write them out
+static void log_deliver(const log_record_t *batch, int count)
+{
+  static char lines[LOG_BATCH][EVENT_LOG_LINE_MAX]; // Only used by the thread delivering a batch
+  struct iovec iov[LOG_BATCH];
+  int lines_count = 0;
+  event_log_tap_fn tap = __atomic_load_n(&log_tap, __ATOMIC_ACQUIRE);
+
+  for (int i = 0; i < count; i++)
+  {
+    const log_record_t *record = &batch[i];
+
+    // A sink takes the records as they are; nothing is printed. It may be changed by the sink itself
+    if (log_sink != NULL)
+    {
+      if (lines_count > 0)
+      {
+        log_write(iov, lines_count);
+        lines_count = 0;
+      }
+      if (tap != NULL)
+      {
+        tap(record, lines[0], event_log_format(record, lines[0]));
+      }
+      __atomic_store_n(&sink_running, 1, __ATOMIC_SEQ_CST);
+      log_sink(record, log_sink_arg);
+      __atomic_store_n(&sink_running, 0, __ATOMIC_SEQ_CST);
+      continue;
+    }
+
+    iov[lines_count].iov_base = lines[lines_count];
+    iov[lines_count].iov_len = event_log_format(record, lines[lines_count]);
+    if (tap != NULL)
+    {
+      tap(record, lines[lines_count], iov[lines_count].iov_len);
+    }
+    lines_count++;
+  }
+  if (lines_count > 0)
+  {
+    log_write(iov, lines_count);
+  }
+}
+
+/*
+ * Deliver everything queued in every ring, in the order it was logged.
+ * Returns the number of records delivered.
+ *
+ * LOCKING PROTOCOL:
+ *
+ * Records are taken from the rings a batch at a time under drain_mutex,
+ * and delivered with it released, so a sink may call back into the
+ * engine, which logs records of its own and may set another sink. Only
+ * one thread delivers at a time, which keeps the batches in order;
+ * another waits on drain_cond for it. Called by the delivering thread
+ * itself, from a sink, it returns at once: the records are delivered
+ * once the sink returns.
+ */
+static int log_drain(void)
+{
+  static log_record_t batch[LOG_BATCH]; // Only used by the thread delivering a batch
+  int count;
+  int total = 0;
+
+  if (thread_draining)
+  {
+    return 0;
+  }
+  pthread_mutex_lock(&drain_mutex);
+  while (draining)
+  {
+    pthread_cond_wait(&drain_cond, &drain_mutex);
+  }
+  while ((count = log_take_batch(batch)) > 0)
+  {
+    draining = 1;
+    thread_draining = 1;
+    pthread_mutex_unlock(&drain_mutex);
+    log_deliver(batch, count);
+    total += count;
+    pthread_mutex_lock(&drain_mutex);
+    thread_draining = 0;
+    draining = 0;
+  }
+  if (__atomic_load_n(&retired_rings, __ATOMIC_RELAXED) > 0)
+  {
+    log_free_retired_rings();
+  }
+  pthread_cond_broadcast(&drain_cond);
+  pthread_mutex_unlock(&drain_mutex);
+
+  return total;
+}
+
+// The writer thread's start routine
+static void *event_log_writer_function(void *arg)
+{
+  while (1)
+  {
+    if (log_drain() > 0)
+    {
+      continue;
+    }
+
+    /*
+     * Publish that we are about to sleep, then drain once more: a
+     * producer either sees the flag and signals, or its record is
+     * picked up by this drain.
+     */
+    pthread_mutex_lock(&writer_mutex);
+    __atomic_store_n(&writer_sleeping, 1, __ATOMIC_SEQ_CST);
+    pthread_mutex_unlock(&writer_mutex);
+    if (log_drain() == 0)
+    {
+      pthread_mutex_lock(&writer_mutex);
+      if (__atomic_load_n(&writer_sleeping, __ATOMIC_SEQ_CST))
+      {
+        pthread_cond_wait(&writer_cond, &writer_mutex);
+      }
+      pthread_mutex_unlock(&writer_mutex);
+    }
+    __atomic_store_n(&writer_sleeping, 0, __ATOMIC_SEQ_CST);
+  }
+  return NULL;
+}
+
+// Start the writer thread and arrange for a final flush on exit
+void event_log_init(void)
+{
+  int status;
+  pthread_t writer;
+
+  status = pthread_create(&writer, NULL, event_log_writer_function, NULL);
+  if (status != 0)
+  {
+    err_abort(status, "Create log writer");
+  }
+  pthread_detach(writer);
+  atexit(event_log_flush);
+}
+
+// Double the capacity of this thread's ring, keeping its records in order
+static void log_grow_ring(log_ring_t *ring)
+{
+  unsigned size = ring->size * 2;
+  log_record_t *records = malloc(size * sizeof(log_record_t));
+  if (records == NULL)
+  {
+    errno_abort("Grow log ring");
+  }
+
+  // Consumers only read the records under drain_mutex
+  pthread_mutex_lock(&drain_mutex);
+  for (unsigned i = ring->head; i != ring->tail; i++)
+  {
+    records[i & (size - 1)] = ring->records[i & (ring->size - 1)];
+  }
+  free(ring->records);
+  ring->records = records;
+  ring->size = size;
+  pthread_mutex_unlock(&drain_mutex);
+}
+
+/*
+ * Append a record to this thread's ring. If the ring is full the
+ * caller waits for the writer to make room, so nothing is dropped.
+ * While a sink is running the ring grows instead: the sink may be
+ * running on this very thread, or waiting for a lock this thread holds.
+ */
+void log_event(log_event_type_t type, unsigned long thread_id, int alarm_id, int group_id,
+               time_t time, const char *message)
+{
+  log_ring_t *ring = log_thread_ring();
+  unsigned tail = ring->tail;
+
+  while (tail - __atomic_load_n(&ring->head, __ATOMIC_ACQUIRE) == ring->size)
+  {
+    if (__atomic_load_n(&sink_running, __ATOMIC_SEQ_CST))
+    {
+      log_grow_ring(ring);
+      break;
+    }
+    log_wake_writer();
+    sched_yield();
+  }
+
+  log_record_t *record = &ring->records[tail & (ring->size - 1)];
+  record->sequence = __atomic_fetch_add(&log_sequence, 1, __ATOMIC_RELAXED);
+  record->type = type;
+  record->thread_id = thread_id;
+  record->alarm_id = alarm_id;
+  record->group_id = group_id;
+  record->time = time;
+  if (message != NULL)
+  {
+    strncpy(record->message, message, sizeof(record->message) - 1);
+    record->message[sizeof(record->message) - 1] = '\0';
+  }
+  else
+  {
+    record->message[0] = '\0';
+  }
+
+  __atomic_store_n(&ring->tail, tail + 1, __ATOMIC_SEQ_CST);
+  log_wake_writer();
+}
+
+// Write out every queued record; registered with atexit
+void event_log_flush(void)
+{
+  log_drain();
+}
+
+// Set the function shown every record from now on, or NULL for none
+void event_log_set_tap(event_log_tap_fn tap)
+{
+  __atomic_store_n(&log_tap, tap, __ATOMIC_RELEASE);
+}
+
+/*
+ * Hand every record from now on to sink, called with arg, instead of
+ * printing it, or print again when sink is NULL. Records already
+ * queued go to whichever is set when the writer gets to them. Once it
+ * returns, the previous sink is not called again, unless it is called
+ * from that sink itself, which then takes effect from the next record.
+ */
+void event_log_set_sink(event_log_sink_fn sink, void *arg)
+{
+  pthread_mutex_lock(&drain_mutex);
+  while (draining && !thread_draining)
+  {
+    pthread_cond_wait(&drain_cond, &drain_mutex);
+  }
+  log_sink = sink;
+  log_sink_arg = arg;
+  pthread_mutex_unlock(&drain_mutex);
+}
@@ -0,0 +1,89 @@
+#ifndef __event_log_h
+#define __event_log_h
+
+#include <stdint.h>
+#include <time.h>
+
+/*
+ * Asynchronous event log. Threads append fixed-size binary records to
+ * a ring buffer of their own, which costs a copy and no locking. A
+ * dedicated writer thread formats the records (including the
+ * localtime/strftime work) and flushes them to standard output with
+ * writev. Every record is stamped with a sequence number as it is
+ * logged, and the writer merges the rings by it, so records are
+ * written out in the order they were logged, across every thread: a
+ * line caused by another, such as a monitor's reply to a command,
+ * never comes out ahead of it. Records still queued when the process
+ * calls exit() are flushed by an atexit handler. The ring of a thread
+ * that exits is freed once the writer has written out its records. A
+ * tap, if one is set, is shown every record and its line as the
+ * writer writes them out, on the writer thread. A sink, if one is
+ * set, is handed every record on the writer thread in place of the
+ * standard output, and records are then only formatted for a tap. The
+ * sink is called with no lock of the log held, so it may log records
+ * of its own and set another sink.
+ */
+
+// Every line the program prints, one per event
+typedef enum log_event_type
+{
+  LOG_PROMPT,                  // "Alarm> "
+  LOG_DUPLICATE_ALARM,         // Start_Alarm rejected for a duplicate ID
+  LOG_DISPLAY_THREAD_CREATED,  // Main thread created a display thread for a new alarm
+  LOG_DISPLAY_THREAD_ASSIGNED, // Main thread assigned a new alarm to an existing display thread
+  LOG_ALARM_INSERTED,          // Main thread inserted a new alarm
+  LOG_CHANGE_REQUEST_INSERTED, // Main thread queued a change request
+  LOG_ALARM_CHANGED,           // Monitor applied a change request
+  LOG_CHANGE_REQUEST_INVALID,  // Monitor found no alarm for a change request
+  LOG_CANCEL_REQUEST_INSERTED, // Main thread queued a cancel request
+  LOG_ALARM_CANCELLED,         // Monitor cancelled an alarm
+  LOG_CANCEL_REQUEST_INVALID,  // Monitor found no alarm for a cancel request
+  LOG_CHANGE_GROUP_REQUEST_INSERTED, // Main thread queued a Change_Group request
+  LOG_CANCEL_GROUP_REQUEST_INSERTED, // Main thread queued a Cancel_Group request
+  LOG_DELAY_GROUP_REQUEST_INSERTED,  // Main thread queued a Delay_Group request
+  LOG_GROUP_REQUEST_INVALID,   // Monitor found no alarm in the group of a group request
+  LOG_ALARM_REMOVED,           // Monitor removed an expired alarm
+  LOG_ALARM_FIRED,             // Monitor fired a periodic alarm and re-armed it
+  LOG_DISPLAY_TAKEN_OVER,      // Display thread took over a reassigned alarm
+  LOG_DISPLAY_STOPPED,         // Display thread stopped printing an alarm
+  LOG_DISPLAY_MESSAGE_CHANGED, // Display thread prints a changed message
+  LOG_DISPLAY_PRINTED,         // Periodic print of an alarm
+  LOG_DISPLAY_THREAD_EXITING,  // Display thread has no more alarms
+  LOG_STATS,                   // One line of the Stats report, in the message
+  LOG_QUERY_ALARM,             // Query_Alarm or List_Group found a one-shot alarm
+  LOG_QUERY_PERIODIC_ALARM,    // Query_Alarm or List_Group found a periodic alarm
+  LOG_QUERY_NOT_FOUND,         // Query_Alarm found no alarm with the ID
+  LOG_GROUP_LISTED,            // List_Group, with the group's alarm count as alarm_id, before its alarms
+  LOG_ALARM_COUNT              // Count, with the alarm count as alarm_id and the group count as group_id
+} log_event_type_t;
+
+// Binary log record; the writer thread turns it into one output line
+typedef struct log_record
+{
+  uint64_t sequence;        // Order the record was logged in, across every thread
+  log_event_type_t type;    // Which line to print
+  unsigned long thread_id;  // Thread named in the line
+  int alarm_id;             // Alarm named in the line
+  int group_id;             // Group named in the line
+  time_t time;              // Time shown after "at"
+  char message[128];        // Alarm message
+} log_record_t;
+
+#define EVENT_LOG_RING_SIZE 1024 // Records per thread ring buffer (power of two)
+#define EVENT_LOG_LINE_MAX 320   // Longest formatted line, message included
+
+// Function shown every record written out, with its formatted line
+typedef void (*event_log_tap_fn)(const log_record_t *record, const char *line, int length);
+
+// Function handed every record in place of printing it
+typedef void (*event_log_sink_fn)(const log_record_t *record, void *arg);
+
+void event_log_init(void);
+void log_event(log_event_type_t type, unsigned long thread_id, int alarm_id, int group_id,
+               time_t time, const char *message);
+void event_log_flush(void);
+int event_log_format(const log_record_t *record, char *line);
+void event_log_set_tap(event_log_tap_fn tap);
+void event_log_set_sink(event_log_sink_fn sink, void *arg);
+
+#endif
@@ -0,0 +1,134 @@
+#include <time.h>
+#include "errors.h"
+#include "latency_stats.h"
+
+#ifdef ALARM_STATS
+
+// Return the monotonic clock in nanoseconds
+uint64_t stats_now(void)
+{
+  struct timespec now;
+  clock_gettime(CLOCK_MONOTONIC, &now);
+  return (uint64_t)now.tv_sec * 1000000000ull + (uint64_t)now.tv_nsec;
+}
+
+// Map a value to its bucket
+static int latency_bucket(uint64_t value)
+{
+  if (value < LATENCY_SUB_BUCKETS)
+  {
+    return (int)value;
+  }
+  int shift = 63 - __builtin_clzll(value) - LATENCY_SUB_BITS;
+  return (shift + 1) * LATENCY_SUB_BUCKETS + (int)((value >> shift) - LATENCY_SUB_BUCKETS);
+}
+
+// Return the largest value that maps to a bucket
+static uint64_t latency_bucket_limit(int bucket)
+{
+  if (bucket < LATENCY_SUB_BUCKETS)
+  {
+    return (uint64_t)bucket;
+  }
+  int shift = bucket / LATENCY_SUB_BUCKETS - 1;
+  uint64_t mantissa = (uint64_t)(bucket % LATENCY_SUB_BUCKETS) + LATENCY_SUB_BUCKETS;
+  return ((mantissa + 1) << shift) - 1;
+}
+
+// Record one value in nanoseconds
+void latency_histogram_record(latency_histogram_t *histogram, uint64_t nsec)
+{
+  __atomic_add_fetch(&histogram->counts[latency_bucket(nsec)], 1, __ATOMIC_RELAXED);
+  __atomic_add_fetch(&histogram->count, 1, __ATOMIC_RELAXED);
+  __atomic_add_fetch(&histogram->total, nsec, __ATOMIC_RELAXED);
+
+  uint64_t max = __atomic_load_n(&histogram->max, __ATOMIC_RELAXED);
+  while (nsec > max &&
+         !__atomic_compare_exchange_n(&histogram->max, &max, nsec, 1, __ATOMIC_RELAXED, __ATOMIC_RELAXED))
+  {
+  }
+}
+
+// Add every value recorded in one histogram to another
+void latency_histogram_merge(latency_histogram_t *into, latency_histogram_t *from)
+{
+  for (int bucket = 0; bucket < LATENCY_BUCKETS; bucket++)
+  {
+    into->counts[bucket] += __atomic_load_n(&from->counts[bucket], __ATOMIC_RELAXED);
+  }
+  into->count += __atomic_load_n(&from->count, __ATOMIC_RELAXED);
+  into->total += __atomic_load_n(&from->total, __ATOMIC_RELAXED);
+
+  uint64_t max = __atomic_load_n(&from->max, __ATOMIC_RELAXED);
+  if (max > into->max)
+  {
+    into->max = max;
+  }
+}
+
+// Return the value below which the given fraction of the recorded values lie
+static uint64_t latency_histogram_percentile(latency_histogram_t *histogram, uint64_t count, double fraction)
+{
+  uint64_t rank = (uint64_t)(fraction * count + 0.5);
+  uint64_t max = __atomic_load_n(&histogram->max, __ATOMIC_RELAXED);
+  uint64_t seen = 0;
+
+  if (rank == 0)
+  {
+    rank = 1;
+  }
+  for (int bucket = 0; bucket < LATENCY_BUCKETS; bucket++)
+  {
+    seen += __atomic_load_n(&histogram->counts[bucket], __ATOMIC_RELAXED);
+    if (seen >= rank)
+    {
+      // The bucket's limit can lie past every value actually recorded
+      uint64_t limit = latency_bucket_limit(bucket);
+      return limit < max ? limit : max;
+    }
+  }
+  return max;
+}
+
+/*
+ * Format a one-line summary of a histogram, in microseconds. Values
+ * recorded while formatting may or may not be counted.
+ */
+int latency_histogram_format(latency_histogram_t *histogram, const char *name, char *buffer, size_t size)
+{
+  uint64_t count = __atomic_load_n(&histogram->count, __ATOMIC_RELAXED);
+  uint64_t total = __atomic_load_n(&histogram->total, __ATOMIC_RELAXED);
+
+  if (count == 0)
+  {
+    return snprintf(buffer, size, "%-20s n=0", name);
+  }
+  return snprintf(buffer, size, "%-20s n=%llu mean=%.1f p50=%.1f p99=%.1f p99.9=%.1f max=%.1f us",
+                  name, (unsigned long long)count, total / 1000.0 / count,
+                  latency_histogram_percentile(histogram, count, 0.50) / 1000.0,
+                  latency_histogram_percentile(histogram, count, 0.99) / 1000.0,
+                  latency_histogram_percentile(histogram, count, 0.999) / 1000.0,
+                  __atomic_load_n(&histogram->max, __ATOMIC_RELAXED) / 1000.0);
+}
+
+// Lock a mutex, recording how long we waited for it
+void lock_stats_lock(pthread_mutex_t *mutex, lock_stats_t *stats)
+{
+  uint64_t start = stats_now();
+  int status = pthread_mutex_lock(mutex);
+  if (status != 0)
+  {
+    err_abort(status, "Lock mutex");
+  }
+  stats->acquired_at = stats_now();
+  latency_histogram_record(&stats->wait, stats->acquired_at - start);
+}
+
+// Unlock a mutex, recording how long it was held
+void lock_stats_unlock(pthread_mutex_t *mutex, lock_stats_t *stats)
+{
+  latency_histogram_record(&stats->hold, stats_now() - stats->acquired_at);
+  pthread_mutex_unlock(mutex);
+}
+
+#endif
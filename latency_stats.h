@@ -0,0 +1,59 @@
+#ifndef __latency_stats_h
+#define __latency_stats_h
+
+#include <pthread.h>
+#include <stddef.h>
+#include <stdint.h>
+
+/*
+ * Latency histograms for the engine's hot paths, in the style of HDR
+ * histograms: buckets are exact below 32 ns and above that split each
+ * power of two into 32 sub-buckets, so every recorded value is kept
+ * to within about 3% over the whole 64-bit range of nanoseconds.
+ * Recording is a few relaxed atomic adds and never takes a lock.
+ *
+ * Everything here is compiled in only when ALARM_STATS is defined.
+ * Without it, STATS(...) expands to nothing and STATS_LOCK and
+ * STATS_UNLOCK are plain pthread_mutex_lock and pthread_mutex_unlock,
+ * so the statistics cost nothing.
+ */
+
+#ifdef ALARM_STATS
+
+#define LATENCY_SUB_BITS 5                                   // log2 of the sub-buckets per power of two
+#define LATENCY_SUB_BUCKETS (1 << LATENCY_SUB_BITS)          // Sub-buckets per power of two
+#define LATENCY_BUCKETS ((64 - LATENCY_SUB_BITS + 1) * LATENCY_SUB_BUCKETS) // Buckets covering every uint64_t
+
+typedef struct latency_histogram
+{
+  uint64_t counts[LATENCY_BUCKETS]; // Values recorded per bucket, updated atomically
+  uint64_t count;                   // Values recorded, updated atomically
+  uint64_t total;                   // Sum of the values, updated atomically
+  uint64_t max;                     // Largest value, updated atomically
+} latency_histogram_t;
+
+// Wait and hold times of one mutex
+typedef struct lock_stats
+{
+  latency_histogram_t wait; // Time from asking for the mutex to getting it
+  latency_histogram_t hold; // Time from getting the mutex to releasing it
+  uint64_t acquired_at;     // When the current holder got the mutex; only the holder touches it
+} lock_stats_t;
+
+uint64_t stats_now(void);
+void latency_histogram_record(latency_histogram_t *histogram, uint64_t nsec);
+void latency_histogram_merge(latency_histogram_t *into, latency_histogram_t *from);
+int latency_histogram_format(latency_histogram_t *histogram, const char *name, char *buffer, size_t size);
+void lock_stats_lock(pthread_mutex_t *mutex, lock_stats_t *stats);
+void lock_stats_unlock(pthread_mutex_t *mutex, lock_stats_t *stats);
+
+# define STATS(statement) statement
+# define STATS_LOCK(mutex, stats) lock_stats_lock(mutex, stats)
+# define STATS_UNLOCK(mutex, stats) lock_stats_unlock(mutex, stats)
+#else
+# define STATS(statement)
+# define STATS_LOCK(mutex, stats) pthread_mutex_lock(mutex)
+# define STATS_UNLOCK(mutex, stats) pthread_mutex_unlock(mutex)
+#endif
+
+#endif
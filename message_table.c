@@ -0,0 +1,215 @@
+#include <pthread.h>
+#include "errors.h"
+#include "object_pool.h"
+#include "message_table.h"
+
+#define MESSAGE_TABLE_MAX_LOAD 2 // Average chain length that triggers a resize
+#define MESSAGE_CLASSES 3        // Size classes of message storage
+
+// Total object size of each class; the largest holds MESSAGE_TEXT_MAX bytes of text
+static const size_t class_sizes[MESSAGE_CLASSES] = {32, 64, sizeof(message_t) + MESSAGE_TEXT_MAX};
+static object_pool_t class_pools[MESSAGE_CLASSES];
+
+static pthread_rwlock_t resize_lock = PTHREAD_RWLOCK_INITIALIZER; // Held for writing only while the buckets are replaced
+static pthread_mutex_t stripes[MESSAGE_TABLE_STRIPES];           // Locks for bucket i are stripes[i % MESSAGE_TABLE_STRIPES]
+static message_t **buckets;                                      // Bucket chain heads
+static size_t mask;                                              // Number of buckets minus one
+static size_t count;                                             // Number of distinct messages, updated atomically
+
+// FNV-1a hash of a terminated text
+static uint32_t message_hash(const char *text)
+{
+  uint32_t hash = 2166136261u;
+
+  while (*text != '\0')
+  {
+    hash = (hash ^ (unsigned char)*text++) * 16777619u;
+  }
+  return hash;
+}
+
+// Return the size class that holds a text of the given length
+static int message_class(size_t length)
+{
+  int class = 0;
+
+  while (class < MESSAGE_CLASSES - 1 && sizeof(message_t) + length + 1 > class_sizes[class])
+  {
+    class++;
+  }
+  return class;
+}
+
+// Allocate a zeroed bucket array
+static message_t **message_buckets(size_t size)
+{
+  message_t **array = calloc(size, sizeof(message_t *));
+  if (array == NULL)
+  {
+    errno_abort("Allocate message buckets");
+  }
+  return array;
+}
+
+// Set up the size class pools and an empty table
+void message_table_init(void)
+{
+  static const char *names[MESSAGE_CLASSES] = {"message_32", "message_64", "message_144"};
+
+  for (int class = 0; class < MESSAGE_CLASSES; class++)
+  {
+    object_pool_init(&class_pools[class], names[class], class_sizes[class]);
+  }
+  for (int stripe = 0; stripe < MESSAGE_TABLE_STRIPES; stripe++)
+  {
+    pthread_mutex_init(&stripes[stripe], NULL);
+  }
+  buckets = message_buckets(1024);
+  mask = 1023;
+  count = 0;
+}
+
+// Double the bucket array once the load factor is exceeded
+static void message_table_grow(void)
+{
+  pthread_rwlock_wrlock(&resize_lock);
+
+  // Another thread may have grown the table while we waited
+  size_t old_size = mask + 1;
+  if (__atomic_load_n(&count, __ATOMIC_RELAXED) > old_size * MESSAGE_TABLE_MAX_LOAD)
+  {
+    size_t new_mask = old_size * 2 - 1;
+    message_t **new_buckets = message_buckets(new_mask + 1);
+
+    for (size_t bucket = 0; bucket < old_size; bucket++)
+    {
+      message_t *message = buckets[bucket];
+      while (message != NULL)
+      {
+        message_t *next = message->next;
+        message->next = new_buckets[message->hash & new_mask];
+        new_buckets[message->hash & new_mask] = message;
+        message = next;
+      }
+    }
+    free(buckets);
+    buckets = new_buckets;
+    mask = new_mask;
+  }
+  pthread_rwlock_unlock(&resize_lock);
+}
+
+/*
+ * Return the shared copy of a text, taking a reference to it. Text
+ * longer than MESSAGE_TEXT_MAX - 1 bytes is cut short.
+ */
+const message_t *message_intern(const char *text)
+{
+  size_t length = strnlen(text, MESSAGE_TEXT_MAX - 1);
+  char copy[MESSAGE_TEXT_MAX];
+  size_t total = 0;
+
+  // Hash the text as stored, so an over-long text matches its cut copy
+  memcpy(copy, text, length);
+  copy[length] = '\0';
+  uint32_t hash = message_hash(copy);
+
+  pthread_rwlock_rdlock(&resize_lock);
+  size_t bucket = hash & mask;
+  pthread_mutex_t *stripe = &stripes[bucket % MESSAGE_TABLE_STRIPES];
+
+  pthread_mutex_lock(stripe);
+  message_t *message = buckets[bucket];
+  while (message != NULL && (message->hash != hash || strcmp(message->text, copy) != 0))
+  {
+    message = message->next;
+  }
+  if (message != NULL)
+  {
+    message->references++;
+  }
+  else
+  {
+    message = (message_t *)object_pool_alloc(&class_pools[message_class(length)]);
+    message->hash = hash;
+    message->references = 1;
+    // A stale query may still be reading the recycled text byte by byte
+    for (size_t index = 0; index <= length; index++)
+    {
+      __atomic_store_n(&message->text[index], copy[index], __ATOMIC_RELAXED);
+    }
+    message->next = buckets[bucket];
+    buckets[bucket] = message;
+    total = __atomic_add_fetch(&count, 1, __ATOMIC_RELAXED);
+  }
+  pthread_mutex_unlock(stripe);
+
+  int grow = total > (mask + 1) * MESSAGE_TABLE_MAX_LOAD;
+  pthread_rwlock_unlock(&resize_lock);
+
+  if (grow)
+  {
+    message_table_grow();
+  }
+  return message;
+}
+
+// Take another reference to a message already held
+const message_t *message_acquire(const message_t *message)
+{
+  pthread_rwlock_rdlock(&resize_lock);
+  pthread_mutex_t *stripe = &stripes[(message->hash & mask) % MESSAGE_TABLE_STRIPES];
+  pthread_mutex_lock(stripe);
+  ((message_t *)message)->references++;
+  pthread_mutex_unlock(stripe);
+  pthread_rwlock_unlock(&resize_lock);
+  return message;
+}
+
+// Drop a reference; the last one frees the message
+void message_release(const message_t *message)
+{
+  message_t *released = (message_t *)message;
+
+  pthread_rwlock_rdlock(&resize_lock);
+  size_t bucket = released->hash & mask;
+  pthread_mutex_t *stripe = &stripes[bucket % MESSAGE_TABLE_STRIPES];
+
+  pthread_mutex_lock(stripe);
+  if (--released->references == 0)
+  {
+    message_t **last = &buckets[bucket];
+    while (*last != released)
+    {
+      last = &(*last)->next;
+    }
+    *last = released->next;
+    __atomic_sub_fetch(&count, 1, __ATOMIC_RELAXED);
+  }
+  else
+  {
+    released = NULL;
+  }
+  pthread_mutex_unlock(stripe);
+  pthread_rwlock_unlock(&resize_lock);
+
+  if (released != NULL)
+  {
+    object_pool_free(&class_pools[message_class(strlen(released->text))], released);
+  }
+}
+
+// Return the number of distinct messages held
+size_t message_table_count(void)
+{
+  return __atomic_load_n(&count, __ATOMIC_RELAXED);
+}
+
+// Print the allocation counters of every size class
+void message_table_report(FILE *stream)
+{
+  for (int class = 0; class < MESSAGE_CLASSES; class++)
+  {
+    object_pool_report(&class_pools[class], stream);
+  }
+}
@@ -0,0 +1,39 @@
+#ifndef __message_table_h
+#define __message_table_h
+
+#include <stddef.h>
+#include <stdint.h>
+#include <stdio.h>
+
+/*
+ * Interned alarm messages. Every distinct message text is stored once,
+ * in a pool sized to its length, and shared by reference count among
+ * the alarms and change requests that use it. Equal messages are the
+ * same pointer, so "has the message changed" is a pointer comparison,
+ * and an alarm carries a pointer instead of a 128-byte buffer.
+ *
+ * The table is a hash table guarded by striped mutexes, grown like
+ * alarm_index. A message's reference count is only changed under its
+ * stripe, so a message found by message_intern can never be freed
+ * under it.
+ */
+
+#define MESSAGE_TABLE_STRIPES 64 // Number of bucket lock stripes (power of two)
+#define MESSAGE_TEXT_MAX 128     // Longest text, terminator included
+
+typedef struct message
+{
+  struct message *next; // Next message in the hash chain
+  uint32_t hash;        // Hash of text
+  uint32_t references;  // Holders of the message, protected by its stripe
+  char text[];          // Terminated text, allocated to its size class
+} message_t;
+
+void message_table_init(void);
+const message_t *message_intern(const char *text);
+const message_t *message_acquire(const message_t *message);
+void message_release(const message_t *message);
+size_t message_table_count(void);
+void message_table_report(FILE *stream);
+
+#endif
@@ -0,0 +1,68 @@
+#ifndef __mpsc_queue_h
+#define __mpsc_queue_h
+
+#include <stddef.h>
+
+/*
+ * Lock-free multi-producer/single-consumer queue. Producers push with
+ * a single compare-and-swap on the head and never wait for the
+ * consumer. The consumer takes everything queued so far with one
+ * atomic exchange and gets it back as a FIFO batch, so requests from
+ * any one producer keep their order.
+ *
+ * Nodes are intrusive: embed an mpsc_node_t in the queued structure.
+ */
+
+typedef struct mpsc_node
+{
+  struct mpsc_node *next; // Next node in the queue or in a drained batch
+} mpsc_node_t;
+
+typedef struct mpsc_queue
+{
+  mpsc_node_t *head; // Most recently pushed node, updated atomically
+} mpsc_queue_t;
+
+#define MPSC_QUEUE_INITIALIZER { NULL }
+
+/*
+ * Push a node. Returns 1 if the queue was empty, meaning the consumer
+ * may be asleep and the caller is responsible for waking it; pushes
+ * onto a non-empty queue are already covered by that first wakeup.
+ */
+static inline int mpsc_queue_push(mpsc_queue_t *queue, mpsc_node_t *node)
+{
+  mpsc_node_t *head = __atomic_load_n(&queue->head, __ATOMIC_RELAXED);
+
+  do
+  {
+    node->next = head;
+  } while (!__atomic_compare_exchange_n(&queue->head, &head, node, 1,
+                                        __ATOMIC_RELEASE, __ATOMIC_RELAXED));
+  return head == NULL;
+}
+
+// Take every queued node, oldest first; returns NULL if the queue is empty
+static inline mpsc_node_t *mpsc_queue_drain(mpsc_queue_t *queue)
+{
+  mpsc_node_t *node = __atomic_exchange_n(&queue->head, NULL, __ATOMIC_ACQUIRE);
+  mpsc_node_t *batch = NULL;
+
+  // The stack holds the newest node first; reverse it into arrival order
+  while (node != NULL)
+  {
+    mpsc_node_t *next = node->next;
+    node->next = batch;
+    batch = node;
+    node = next;
+  }
+  return batch;
+}
+
+// Test whether anything is queued
+static inline int mpsc_queue_empty(mpsc_queue_t *queue)
+{
+  return __atomic_load_n(&queue->head, __ATOMIC_ACQUIRE) == NULL;
+}
+
+#endif
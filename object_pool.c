@@ -0,0 +1,224 @@
+#include "errors.h"
+#include "object_pool.h"
+
+/*
+ * A free object holds the link to the next free object in its first
+ * word. The first object of a batch in the depot also holds the link
+ * to the next batch in its second word. A lock-free reader may still
+ * be loading a freed object's fields, so these links are stored with
+ * relaxed atomics.
+ */
+typedef struct free_object
+{
+  struct free_object *next;       // Next free object in the list or batch
+  struct free_object *next_batch; // Next batch in the depot (batch heads only)
+} free_object_t;
+
+// A thread's private free list for one pool
+typedef struct pool_cache
+{
+  free_object_t *free_list; // Free objects owned by this thread
+  int count;                // Number of objects in free_list
+} pool_cache_t;
+
+static int pool_count = 0;                                 // Number of pools created, updated atomically
+static object_pool_t *pools[OBJECT_POOL_MAX];              // Every pool created, by pool_id
+static __thread pool_cache_t thread_caches[OBJECT_POOL_MAX]; // This thread's free lists, indexed by pool_id
+static __thread int thread_registered = 0;                 // Set once this thread's lists are returned on exit
+static pthread_key_t cache_key;                            // Returns a thread's lists to the depots when it exits
+static pthread_once_t cache_key_once = PTHREAD_ONCE_INIT;  // Creates cache_key
+
+// Store a link inside a free object
+static inline void free_object_link(free_object_t **link, free_object_t *target)
+{
+  __atomic_store_n(link, target, __ATOMIC_RELAXED);
+}
+
+// Hand a list of free objects to the pool's depot, in full batches; the caller holds depot_mutex
+static void object_pool_give_back(object_pool_t *pool, free_object_t *list)
+{
+  while (list != NULL)
+  {
+    free_object_t *object = list;
+    list = object->next;
+    free_object_link(&object->next, (free_object_t *)pool->leftovers);
+    pool->leftovers = object;
+    if (++pool->leftover_count == OBJECT_POOL_BATCH)
+    {
+      free_object_link(&object->next_batch, (free_object_t *)pool->depot);
+      pool->depot = object;
+      pool->leftovers = NULL;
+      pool->leftover_count = 0;
+      __atomic_add_fetch(&pool->depot_transfers, 1, __ATOMIC_RELAXED);
+    }
+  }
+}
+
+// Key destructor: return an exiting thread's free lists to the depots
+static void object_pool_release_caches(void *arg)
+{
+  int count = __atomic_load_n(&pool_count, __ATOMIC_ACQUIRE);
+
+  for (int i = 0; i < count && i < OBJECT_POOL_MAX; i++)
+  {
+    pool_cache_t *cache = &thread_caches[i];
+    if (cache->free_list != NULL)
+    {
+      pthread_mutex_lock(&pools[i]->depot_mutex);
+      object_pool_give_back(pools[i], cache->free_list);
+      pthread_mutex_unlock(&pools[i]->depot_mutex);
+      cache->free_list = NULL;
+      cache->count = 0;
+    }
+  }
+  thread_registered = 0;
+}
+
+static void object_pool_create_key(void)
+{
+  int status = pthread_key_create(&cache_key, object_pool_release_caches);
+  if (status != 0)
+  {
+    err_abort(status, "Create object pool key");
+  }
+}
+
+// Arrange for this thread's free lists to be returned when it exits
+static void object_pool_register_thread(void)
+{
+  pthread_once(&cache_key_once, object_pool_create_key);
+  pthread_setspecific(cache_key, thread_caches);
+  thread_registered = 1;
+}
+
+// Initialize an empty pool for objects of the given size
+void object_pool_init(object_pool_t *pool, const char *name, size_t object_size)
+{
+  pool->pool_id = __atomic_fetch_add(&pool_count, 1, __ATOMIC_RELAXED);
+  if (pool->pool_id >= OBJECT_POOL_MAX)
+  {
+    fprintf(stderr, "Too many object pools at \"%s\":%d\n", __FILE__, __LINE__);
+    abort();
+  }
+  pools[pool->pool_id] = pool;
+
+  // Round up so every object can hold its free list links and stays aligned
+  if (object_size < sizeof(free_object_t))
+  {
+    object_size = sizeof(free_object_t);
+  }
+  pool->object_size = (object_size + 15) & ~(size_t)15;
+  pool->name = name;
+  pthread_mutex_init(&pool->depot_mutex, NULL);
+  pool->depot = NULL;
+  pool->leftovers = NULL;
+  pool->leftover_count = 0;
+  pool->allocations = 0;
+  pool->releases = 0;
+  pool->slab_allocations = 0;
+  pool->depot_transfers = 0;
+}
+
+// Refill an empty thread cache from the depot, or from a new slab if the depot is empty
+static void object_pool_refill(object_pool_t *pool, pool_cache_t *cache)
+{
+  pthread_mutex_lock(&pool->depot_mutex);
+  free_object_t *batch = (free_object_t *)pool->depot;
+  if (batch != NULL)
+  {
+    pool->depot = batch->next_batch;
+  }
+  pthread_mutex_unlock(&pool->depot_mutex);
+
+  if (!thread_registered)
+  {
+    object_pool_register_thread();
+  }
+  if (batch != NULL)
+  {
+    __atomic_add_fetch(&pool->depot_transfers, 1, __ATOMIC_RELAXED);
+    cache->free_list = batch;
+    cache->count = OBJECT_POOL_BATCH;
+    return;
+  }
+
+  // Cache-line aligned, so objects whose size is a multiple of a line never straddle one
+  char *slab = aligned_alloc(64, pool->object_size * OBJECT_POOL_SLAB);
+  if (slab == NULL)
+  {
+    errno_abort("Allocate slab");
+  }
+  __atomic_add_fetch(&pool->slab_allocations, 1, __ATOMIC_RELAXED);
+
+  for (int i = OBJECT_POOL_SLAB - 1; i >= 0; i--)
+  {
+    free_object_t *object = (free_object_t *)(slab + i * pool->object_size);
+    object->next = cache->free_list;
+    cache->free_list = object;
+  }
+  cache->count = OBJECT_POOL_SLAB;
+}
+
+// Take an object from the pool; its contents are undefined
+void *object_pool_alloc(object_pool_t *pool)
+{
+  pool_cache_t *cache = &thread_caches[pool->pool_id];
+
+  if (cache->free_list == NULL)
+  {
+    object_pool_refill(pool, cache);
+  }
+
+  free_object_t *object = cache->free_list;
+  cache->free_list = object->next;
+  cache->count--;
+  __atomic_add_fetch(&pool->allocations, 1, __ATOMIC_RELAXED);
+  return object;
+}
+
+// Give an object back to the pool; any thread may free any object
+void object_pool_free(object_pool_t *pool, void *pointer)
+{
+  pool_cache_t *cache = &thread_caches[pool->pool_id];
+  free_object_t *object = (free_object_t *)pointer;
+
+  free_object_link(&object->next, cache->free_list);
+  cache->free_list = object;
+  if (++cache->count == 1 && !thread_registered)
+  {
+    object_pool_register_thread(); // A thread that only frees objects still holds them
+  }
+  __atomic_add_fetch(&pool->releases, 1, __ATOMIC_RELAXED);
+
+  // Hand one batch to the depot once this thread holds more than two
+  if (cache->count > 2 * OBJECT_POOL_BATCH)
+  {
+    free_object_t *batch = cache->free_list;
+    free_object_t *last = batch;
+    for (int i = 1; i < OBJECT_POOL_BATCH; i++)
+    {
+      last = last->next;
+    }
+    cache->free_list = last->next;
+    cache->count -= OBJECT_POOL_BATCH;
+    free_object_link(&last->next, NULL);
+
+    pthread_mutex_lock(&pool->depot_mutex);
+    free_object_link(&batch->next_batch, (free_object_t *)pool->depot);
+    pool->depot = batch;
+    pthread_mutex_unlock(&pool->depot_mutex);
+    __atomic_add_fetch(&pool->depot_transfers, 1, __ATOMIC_RELAXED);
+  }
+}
+
+// Print the pool's allocation counters
+void object_pool_report(object_pool_t *pool, FILE *stream)
+{
+  size_t allocations = __atomic_load_n(&pool->allocations, __ATOMIC_RELAXED);
+  size_t releases = __atomic_load_n(&pool->releases, __ATOMIC_RELAXED);
+
+  fprintf(stream, "Pool %-14s allocs %zu frees %zu live %zu mallocs %zu depot batches %zu\n",
+          pool->name, allocations, releases, allocations - releases,
+          __atomic_load_n(&pool->slab_allocations, __ATOMIC_RELAXED),
+          __atomic_load_n(&pool->depot_transfers, __ATOMIC_RELAXED));
+}
@@ -0,0 +1,49 @@
+#ifndef __object_pool_h
+#define __object_pool_h
+
+#include <pthread.h>
+#include <stddef.h>
+#include <stdio.h>
+
+/*
+ * Per-type object pool. Each thread keeps a private free list per
+ * pool, so allocating and freeing are a pointer push or pop with no
+ * locking. Objects freed on a thread other than the one that
+ * allocated them simply join the freeing thread's list; once a list
+ * grows past two batches, one batch of OBJECT_POOL_BATCH objects is
+ * handed to the shared depot under a single lock acquisition, where
+ * any thread that runs dry picks it up. New memory is only requested
+ * from malloc, a slab at a time, when both the thread's list and the
+ * depot are empty, so a workload whose live object count has levelled
+ * off makes no malloc or free calls at all. When a thread exits, the
+ * objects on its lists go back to the depot, so threads that come and
+ * go strand none.
+ *
+ * Objects are never returned to the system.
+ */
+
+#define OBJECT_POOL_MAX 8      // Number of pools a program may create
+#define OBJECT_POOL_BATCH 64   // Objects moved between a thread and the depot at once
+#define OBJECT_POOL_SLAB 256   // Objects carved out of each malloc
+
+typedef struct object_pool
+{
+  const char *name;            // Name used in reports
+  size_t object_size;          // Size of each object, rounded up to hold the free list links
+  int pool_id;                 // Index of this pool's free list in each thread's cache
+  pthread_mutex_t depot_mutex; // Protects depot
+  void *depot;                 // Stack of full batches of free objects
+  void *leftovers;             // Fewer than a batch of free objects from exited threads, protected by depot_mutex
+  int leftover_count;          // Number of objects in leftovers, protected by depot_mutex
+  size_t allocations;          // Objects handed out, updated atomically
+  size_t releases;             // Objects given back, updated atomically
+  size_t slab_allocations;     // Calls to malloc, updated atomically
+  size_t depot_transfers;      // Batches moved through the depot, updated atomically
+} object_pool_t;
+
+void object_pool_init(object_pool_t *pool, const char *name, size_t object_size);
+void *object_pool_alloc(object_pool_t *pool);
+void object_pool_free(object_pool_t *pool, void *object);
+void object_pool_report(object_pool_t *pool, FILE *stream);
+
+#endif
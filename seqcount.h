@@ -0,0 +1,54 @@
+#ifndef __seqcount_h
+#define __seqcount_h
+
+#include <sched.h>
+
+/*
+ * Sequence counter, for readers that must never take the lock writers
+ * hold. A writer, already serialized by its own lock, makes the count
+ * odd before changing the data and even again after. A reader notes
+ * the count, reads the data, and uses what it read only if the count
+ * is unchanged; otherwise it reads again. Readers never write shared
+ * memory, so any number of them cost writers nothing.
+ *
+ * What a reader reaches through pointers must stay mapped while it
+ * reads, since it may follow a pointer a writer is replacing: here,
+ * objects from object pools, which are never returned to the system,
+ * and tables that are retired rather than freed when they grow.
+ */
+
+typedef unsigned seqcount_t;
+
+// Start a change; the caller holds the writers' lock
+static inline void seqcount_write_begin(seqcount_t *sequence)
+{
+  __atomic_store_n(sequence, *sequence + 1, __ATOMIC_RELAXED);
+  __atomic_thread_fence(__ATOMIC_RELEASE);
+}
+
+// End a change begun with seqcount_write_begin
+static inline void seqcount_write_end(seqcount_t *sequence)
+{
+  __atomic_store_n(sequence, *sequence + 1, __ATOMIC_RELEASE);
+}
+
+// Start a read, waiting out a change in progress; returns the count to check against
+static inline seqcount_t seqcount_read_begin(const seqcount_t *sequence)
+{
+  seqcount_t value;
+
+  while ((value = __atomic_load_n(sequence, __ATOMIC_ACQUIRE)) & 1)
+  {
+    sched_yield(); // The writer may need this CPU to finish
+  }
+  return value;
+}
+
+// Return nonzero if a change overlapped the read begun at value, which must then be retried
+static inline int seqcount_read_retry(const seqcount_t *sequence, seqcount_t value)
+{
+  __atomic_thread_fence(__ATOMIC_ACQUIRE);
+  return __atomic_load_n(sequence, __ATOMIC_RELAXED) != value;
+}
+
+#endif
@@ -0,0 +1,211 @@
+#include "timing_wheel.h"
+
+// Number of tick bits below the slots of a level
+#define LEVEL_SHIFT(level) (TIMING_WHEEL_BITS * (level))
+
+// Initialize an empty wheel whose clock starts at the given tick
+void timing_wheel_init(timing_wheel_t *wheel, uint64_t now)
+{
+  wheel->current = now;
+  wheel->count = 0;
+  for (int level = 0; level < TIMING_WHEEL_LEVELS; level++)
+  {
+    wheel->occupied[level] = 0;
+  }
+  for (int bucket = 0; bucket < TIMING_WHEEL_LEVELS * TIMING_WHEEL_SLOTS; bucket++)
+  {
+    timer_list_init(&wheel->slots[bucket]);
+  }
+  timer_list_init(&wheel->due);
+}
+
+// Initialize an entry as not being held by any wheel
+void timer_entry_init(timer_entry_t *entry)
+{
+  entry->expires = 0;
+  entry->bucket = TIMER_ENTRY_UNARMED;
+  entry->prev = entry->next = NULL;
+}
+
+// Append an entry to the tail of a circular list
+static void timer_list_append(timer_entry_t *head, timer_entry_t *entry)
+{
+  entry->prev = head->prev;
+  entry->next = head;
+  head->prev->next = entry;
+  head->prev = entry;
+}
+
+// Pick the lowest level whose slots share all higher tick bits with the wheel clock
+static int timing_wheel_level(uint64_t current, uint64_t expires)
+{
+  for (int level = 0; level < TIMING_WHEEL_LEVELS - 1; level++)
+  {
+    if ((expires >> LEVEL_SHIFT(level + 1)) == (current >> LEVEL_SHIFT(level + 1)))
+    {
+      return level;
+    }
+  }
+  return TIMING_WHEEL_LEVELS - 1; // The top level covers all remaining bits
+}
+
+// Link an entry into its slot, or onto the due list if it has already expired
+static void timing_wheel_place(timing_wheel_t *wheel, timer_entry_t *entry)
+{
+  if (entry->expires <= wheel->current)
+  {
+    entry->bucket = TIMER_ENTRY_DUE;
+    timer_list_append(&wheel->due, entry);
+    return;
+  }
+
+  int level = timing_wheel_level(wheel->current, entry->expires);
+  int slot = (int)((entry->expires >> LEVEL_SHIFT(level)) & (TIMING_WHEEL_SLOTS - 1));
+
+  entry->bucket = level * TIMING_WHEEL_SLOTS + slot;
+  timer_list_append(&wheel->slots[entry->bucket], entry);
+  wheel->occupied[level] |= (uint64_t)1 << slot;
+}
+
+// Arm an entry to expire at the given tick, re-arming it if it is already held
+void timing_wheel_add(timing_wheel_t *wheel, timer_entry_t *entry, uint64_t expires)
+{
+  timing_wheel_remove(wheel, entry);
+  entry->expires = expires;
+  timing_wheel_place(wheel, entry);
+  wheel->count++;
+}
+
+// Disarm an entry; does nothing if the entry is not held by the wheel
+void timing_wheel_remove(timing_wheel_t *wheel, timer_entry_t *entry)
+{
+  int bucket = entry->bucket;
+
+  if (bucket == TIMER_ENTRY_UNARMED)
+  {
+    return;
+  }
+
+  entry->prev->next = entry->next;
+  entry->next->prev = entry->prev;
+  entry->prev = entry->next = NULL;
+  entry->bucket = TIMER_ENTRY_UNARMED;
+  wheel->count--;
+
+  // Clear the occupancy bit once the slot has drained
+  if (bucket >= 0 && timer_list_empty(&wheel->slots[bucket]))
+  {
+    wheel->occupied[bucket / TIMING_WHEEL_SLOTS] &= ~((uint64_t)1 << (bucket % TIMING_WHEEL_SLOTS));
+  }
+}
+
+// Return the next tick at which a slot must be expired or cascaded
+static uint64_t timing_wheel_next_slot(const timing_wheel_t *wheel)
+{
+  uint64_t next = TIMING_WHEEL_NONE;
+
+  for (int level = 0; level < TIMING_WHEEL_LEVELS; level++)
+  {
+    if (wheel->occupied[level] == 0)
+    {
+      continue;
+    }
+
+    // Occupied slots always lie ahead of the clock within the current rotation
+    uint64_t base = 0;
+    if (level < TIMING_WHEEL_LEVELS - 1)
+    {
+      base = (wheel->current >> LEVEL_SHIFT(level + 1)) << LEVEL_SHIFT(level + 1);
+    }
+    uint64_t slot = (uint64_t)__builtin_ctzll(wheel->occupied[level]);
+    uint64_t tick = base | (slot << LEVEL_SHIFT(level));
+
+    if (tick < next)
+    {
+      next = tick;
+    }
+  }
+  return next;
+}
+
+/*
+ * Return a lower bound on the earliest pending expiry: either the
+ * exact tick of the next level 0 slot, or the tick at which a higher
+ * level slot must be cascaded. Returns the wheel clock if entries are
+ * already due, and TIMING_WHEEL_NONE if the wheel is empty.
+ */
+uint64_t timing_wheel_next_event(const timing_wheel_t *wheel)
+{
+  if (!timer_list_empty(&wheel->due))
+  {
+    return wheel->current;
+  }
+  return timing_wheel_next_slot(wheel);
+}
+
+// Move every entry of a slot list to the expired list
+static void timing_wheel_collect(timing_wheel_t *wheel, timer_entry_t *head, timer_entry_t *expired)
+{
+  while (!timer_list_empty(head))
+  {
+    timer_entry_t *entry = timer_list_pop(head);
+    timer_list_append(expired, entry);
+    wheel->count--;
+  }
+}
+
+/*
+ * Advance the wheel clock to "now", moving every entry whose expiry
+ * tick is at or before "now" onto the caller's "expired" list (a list
+ * head initialized with timer_list_init). Entries on the expired list
+ * are already disarmed; drain it with timer_list_pop. Only ticks that
+ * hold work are visited, so the cost is proportional to the number of
+ * slots expired or cascaded rather than to the elapsed time.
+ */
+void timing_wheel_advance(timing_wheel_t *wheel, uint64_t now, timer_entry_t *expired)
+{
+  timing_wheel_collect(wheel, &wheel->due, expired);
+
+  while (1)
+  {
+    uint64_t tick = timing_wheel_next_slot(wheel);
+    if (tick == TIMING_WHEEL_NONE || tick > now)
+    {
+      break;
+    }
+    wheel->current = tick;
+
+    // Cascade higher levels first so their entries can fall through to level 0
+    for (int level = TIMING_WHEEL_LEVELS - 1; level >= 1; level--)
+    {
+      if ((tick & (((uint64_t)1 << LEVEL_SHIFT(level)) - 1)) != 0)
+      {
+        continue;
+      }
+
+      int slot = (int)((tick >> LEVEL_SHIFT(level)) & (TIMING_WHEEL_SLOTS - 1));
+      if ((wheel->occupied[level] & ((uint64_t)1 << slot)) == 0)
+      {
+        continue;
+      }
+
+      timer_entry_t *head = &wheel->slots[level * TIMING_WHEEL_SLOTS + slot];
+      wheel->occupied[level] &= ~((uint64_t)1 << slot);
+      while (!timer_list_empty(head))
+      {
+        timing_wheel_place(wheel, timer_list_pop(head));
+      }
+    }
+
+    // Expire the level 0 slot for this tick, plus anything the cascade made due
+    int slot = (int)(tick & (TIMING_WHEEL_SLOTS - 1));
+    wheel->occupied[0] &= ~((uint64_t)1 << slot);
+    timing_wheel_collect(wheel, &wheel->slots[slot], expired);
+    timing_wheel_collect(wheel, &wheel->due, expired);
+  }
+
+  if (now > wheel->current)
+  {
+    wheel->current = now;
+  }
+}
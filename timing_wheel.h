@@ -0,0 +1,89 @@
+#ifndef __timing_wheel_h
+#define __timing_wheel_h
+
+#include <stddef.h>
+#include <stdint.h>
+
+/*
+ * Hierarchical timing wheel used as the expiry index of the alarm
+ * monitor. Each level has 64 slots; a slot at level L covers 64^L
+ * ticks. Entries are intrusive, so inserting, removing and expiring
+ * an entry never allocates and costs O(1). Expiring only touches the
+ * slots that actually hold entries: a per-level occupancy bitmap lets
+ * timing_wheel_advance jump straight to the next tick that has work.
+ *
+ * LOCKING PROTOCOL:
+ *
+ * The wheel has no lock of its own; the owner serializes access.
+ */
+
+#define TIMING_WHEEL_BITS 6                             // log2 of the slots per level
+#define TIMING_WHEEL_SLOTS (1 << TIMING_WHEEL_BITS)     // Slots per level
+#define TIMING_WHEEL_LEVELS 11                          // 11 * 6 bits covers every 64-bit tick
+#define TIMING_WHEEL_NONE UINT64_MAX                    // "No pending entry" tick value
+
+#define TIMER_ENTRY_UNARMED -1 // Entry is not in the wheel
+#define TIMER_ENTRY_DUE -2     // Entry is on the due list, waiting for the next advance
+
+// Intrusive wheel entry, embedded in the structure being timed
+typedef struct timer_entry
+{
+  uint64_t expires;          // Absolute tick at which the entry expires
+  int bucket;                // level * TIMING_WHEEL_SLOTS + slot, or TIMER_ENTRY_*
+  struct timer_entry *prev;  // Previous entry in the slot list
+  struct timer_entry *next;  // Next entry in the slot list
+} timer_entry_t;
+
+// The wheel itself
+typedef struct timing_wheel
+{
+  uint64_t current;                                               // Last tick processed by timing_wheel_advance
+  uint64_t occupied[TIMING_WHEEL_LEVELS];                         // Bitmap of non-empty slots per level
+  timer_entry_t slots[TIMING_WHEEL_LEVELS * TIMING_WHEEL_SLOTS];  // Circular list heads, one per slot
+  timer_entry_t due;                                              // Entries added at or before current
+  size_t count;                                                   // Number of armed entries
+} timing_wheel_t;
+
+// Get a pointer to the structure containing an intrusive member
+#define container_of(ptr, type, member) \
+  ((type *)((char *)(ptr) - offsetof(type, member)))
+
+void timing_wheel_init(timing_wheel_t *wheel, uint64_t now);
+void timer_entry_init(timer_entry_t *entry);
+void timing_wheel_add(timing_wheel_t *wheel, timer_entry_t *entry, uint64_t expires);
+void timing_wheel_remove(timing_wheel_t *wheel, timer_entry_t *entry);
+uint64_t timing_wheel_next_event(const timing_wheel_t *wheel);
+void timing_wheel_advance(timing_wheel_t *wheel, uint64_t now, timer_entry_t *expired);
+
+// Test whether an entry is currently held by a wheel
+static inline int timer_entry_armed(const timer_entry_t *entry)
+{
+  return entry->bucket != TIMER_ENTRY_UNARMED;
+}
+
+// Initialize an empty circular list head
+static inline void timer_list_init(timer_entry_t *head)
+{
+  head->prev = head;
+  head->next = head;
+  head->bucket = TIMER_ENTRY_UNARMED;
+}
+
+// Test whether a circular list is empty
+static inline int timer_list_empty(const timer_entry_t *head)
+{
+  return head->next == head;
+}
+
+// Unlink and return the first entry of a non-empty circular list
+static inline timer_entry_t *timer_list_pop(timer_entry_t *head)
+{
+  timer_entry_t *entry = head->next;
+  head->next = entry->next;
+  entry->next->prev = head;
+  entry->prev = entry->next = NULL;
+  entry->bucket = TIMER_ENTRY_UNARMED;
+  return entry;
+}
+
+#endif
@@ -0,0 +1,188 @@
+#include <pthread.h>
+#include <fcntl.h>
+#include <ctype.h>
+#include "errors.h"
+#include "alarm_clock.h"
+#include "trace.h"
+
+static FILE *trace_file = NULL;                                // Trace being recorded
+static uint64_t trace_origin;                                  // Clock time the recording started, in microseconds
+static pthread_mutex_t trace_mutex = PTHREAD_MUTEX_INITIALIZER; // Keeps the lines whole and in time order
+
+/*
+ * Start recording the commands carried out to a new trace file at
+ * path, replacing any file there.
+ */
+void trace_record_open(const char *path)
+{
+  trace_file = fopen(path, "w");
+  if (trace_file == NULL)
+  {
+    errno_abort("Open trace");
+  }
+
+  // Line buffered, so a recording cut short by a signal keeps every command it showed
+  setvbuf(trace_file, NULL, _IOLBF, 0);
+
+  struct timespec now = clock_now();
+  trace_origin = clock_timespec_to_usec(&now);
+  fprintf(trace_file, "start %lld\n", (long long)clock_to_wall_nsec(&now));
+}
+
+/*
+ * Add a command to the trace, stamped with the current time. Once the
+ * trace is closed, which happens at exit while the command server may
+ * still be carrying out commands, the command is left out.
+ */
+void trace_record(const command_t *command)
+{
+  char line[256];
+  size_t length = command_format(command, line, sizeof(line));
+
+  pthread_mutex_lock(&trace_mutex);
+  if (trace_file != NULL)
+  {
+    uint64_t now = clock_now_usec();
+    fprintf(trace_file, "%llu %.*s\n", (unsigned long long)(now > trace_origin ? now - trace_origin : 0),
+            (int)length, line);
+  }
+  pthread_mutex_unlock(&trace_mutex);
+}
+
+// End the trace with the time the input ended
+void trace_record_close(void)
+{
+  pthread_mutex_lock(&trace_mutex);
+  if (trace_file != NULL)
+  {
+    uint64_t now = clock_now_usec();
+    fprintf(trace_file, "%llu end\n", (unsigned long long)(now > trace_origin ? now - trace_origin : 0));
+    fclose(trace_file);
+    trace_file = NULL;
+  }
+  pthread_mutex_unlock(&trace_mutex);
+}
+
+// Report a malformed trace and give up; a replay that skipped lines would not be one
+static void trace_reader_fail(trace_reader_t *reader, const char *problem)
+{
+  fprintf(stderr, "Trace line %zu: %s\n", reader->line_number, problem);
+  exit(1);
+}
+
+// Return the next line of the trace file that is not a comment, or NULL at its end
+static const char *trace_reader_line(trace_reader_t *reader, size_t *length)
+{
+  const char *line;
+
+  while (1)
+  {
+    while ((line = command_input_line(&reader->input, length)) == NULL)
+    {
+      if (reader->input.ended || !command_input_fill(&reader->input, sizeof(reader->input.buffer)))
+      {
+        if ((line = command_input_line(&reader->input, length)) == NULL)
+        {
+          return NULL;
+        }
+        break;
+      }
+    }
+    reader->line_number++;
+    if (*length > 0 && line[0] != '#')
+    {
+      return line;
+    }
+  }
+}
+
+/*
+ * Open a trace for replay and read its start line. Returns the
+ * wall-clock time, in nanoseconds since the epoch, the recording
+ * began, which the replay shows as its own start.
+ */
+int64_t trace_reader_open(trace_reader_t *reader, const char *path)
+{
+  int fd = open(path, O_RDONLY | O_CLOEXEC);
+  if (fd < 0)
+  {
+    errno_abort("Open trace");
+  }
+  command_input_init(&reader->input, fd);
+  reader->line_number = 0;
+  reader->origin = 0;
+  reader->time = 0;
+  reader->line = NULL;
+  reader->length = 0;
+  reader->ended = 0;
+
+  size_t length;
+  const char *line = trace_reader_line(reader, &length);
+  long long wall_nsec;
+  char start[32];
+  if (line == NULL || length >= sizeof(start))
+  {
+    trace_reader_fail(reader, "expected \"start <ns>\"");
+  }
+  memcpy(start, line, length);
+  start[length] = '\0';
+  if (sscanf(start, "start %lld", &wall_nsec) != 1)
+  {
+    trace_reader_fail(reader, "expected \"start <ns>\"");
+  }
+  return (int64_t)wall_nsec;
+}
+
+// Start the replay at the current time and read the first entry, as trace_reader_next does
+int trace_reader_start(trace_reader_t *reader)
+{
+  reader->origin = clock_now_usec();
+  reader->time = reader->origin;
+  return trace_reader_next(reader);
+}
+
+/*
+ * Move to the next entry. Returns 1 when it is a command, due at
+ * reader->time, and 0 when it is the end of the input, at
+ * reader->time; a trace with no end line ends at its last command.
+ */
+int trace_reader_next(trace_reader_t *reader)
+{
+  size_t length;
+  const char *line = reader->ended ? NULL : trace_reader_line(reader, &length);
+
+  if (line == NULL)
+  {
+    reader->ended = 1;
+    reader->line = NULL;
+    reader->length = 0;
+    return 0;
+  }
+
+  uint64_t offset = 0;
+  size_t i = 0;
+  while (i < length && isdigit((unsigned char)line[i]))
+  {
+    offset = offset * 10 + (uint64_t)(line[i++] - '0');
+  }
+  if (i == 0 || i == length || line[i] != ' ')
+  {
+    trace_reader_fail(reader, "expected \"<us> <command>\"");
+  }
+  if (reader->origin + offset < reader->time)
+  {
+    trace_reader_fail(reader, "time goes backwards");
+  }
+  reader->time = reader->origin + offset;
+  reader->line = line + i + 1;
+  reader->length = length - i - 1;
+
+  if (reader->length == 3 && memcmp(reader->line, "end", 3) == 0)
+  {
+    reader->ended = 1;
+    reader->line = NULL;
+    reader->length = 0;
+    return 0;
+  }
+  return 1;
+}
@@ -0,0 +1,47 @@
+#ifndef __trace_h
+#define __trace_h
+
+#include <stddef.h>
+#include <stdint.h>
+#include "command.h"
+
+/*
+ * Command traces, for replaying a run's input at another speed. A
+ * trace is a text file: a first line "start <ns>" giving the wall-clock
+ * time the recording began, in nanoseconds since the epoch, then one
+ * line "<us> <command>" per command carried out, <us> microseconds
+ * after the start, and a last line "<us> end" when the input ended.
+ * Lines starting with "#" are ignored.
+ *
+ * The recorder writes every command the engine carries out, whether
+ * read from the standard input or from a command server client, in the
+ * text syntax (see command_format), so a trace can also be written or
+ * edited by hand. Lines are written as they happen, so a recording
+ * killed mid-run is still readable; it just has no end line, and a
+ * replay of it ends with its last command.
+ *
+ * LOCKING PROTOCOL:
+ *
+ * trace_record is safe to call from any thread. A trace_reader_t
+ * belongs to the one thread replaying it.
+ */
+
+typedef struct trace_reader
+{
+  command_input_t input; // Trace file not yet read
+  size_t line_number;    // Line of the file last read, for errors
+  uint64_t origin;       // Clock time the replay started, in microseconds
+  uint64_t time;         // Clock time the current entry is due
+  const char *line;      // Command of the current entry, valid until the next call
+  size_t length;         // Length of the command
+  int ended;             // Set once the current entry is the end of the input
+} trace_reader_t;
+
+void trace_record_open(const char *path);
+void trace_record(const command_t *command);
+void trace_record_close(void);
+int64_t trace_reader_open(trace_reader_t *reader, const char *path);
+int trace_reader_start(trace_reader_t *reader);
+int trace_reader_next(trace_reader_t *reader);
+
+#endif